@@ -0,0 +1,340 @@
+/*
+ * unix-arena.c
+ *
+ * This file contains the allocator that owns the memory of a simulated
+ * Unix filesystem. Containers, names and the tables built on them are
+ * allocated here so that removing a container recycles its memory and
+ * removing the filesystem frees a handful of slabs instead of every
+ * container.
+ */
+
+
+#include <stdlib.h>
+#include "unix-arena.h"
+
+/* Bytes requested from malloc for each slab */
+#define SLAB_SIZE (64 * 1024)
+
+/* Every block handed out is aligned to this many bytes, which is also
+   the smallest size class */
+#define ARENA_ALIGN 16
+
+/* Blocks of one size class a cache holds at most. Filling or emptying
+   it leaves half that many. */
+#define CACHE_BLOCKS 32
+
+/* Sits in front of a slab or of a block bigger than any size class,
+   padded so what follows stays aligned */
+typedef union chunk_header {
+  struct {
+    union chunk_header * next;
+    union chunk_header * prev;
+  } links;
+  char align[ARENA_ALIGN];
+} Header;
+
+static int size_class(unsigned long size);
+
+
+/*
+ * Initializes arena to own no memory
+ */
+void arena_init(Arena *arena) {
+
+  int i;
+
+  arena->slabs = NULL;
+  arena->bump = NULL;
+  arena->bump_left = 0;
+  arena->large = NULL;
+  arena->in_use = 0;
+  arena->reserved = 0;
+
+  for (i = 0; i < ARENA_CLASSES; i++)
+    arena->free_list[i] = NULL;
+}
+
+
+/*
+ * Allocates a block of at least size bytes from arena. The block is
+ * reused from the free list of its size class when possible and carved
+ * out of the newest slab otherwise.
+ *
+ * Returns a pointer to the block, or NULL if memory couldn't be
+ * allocated
+ */
+void *arena_alloc(Arena *arena, unsigned long size) {
+
+  Header *header;
+  void *block;
+  int class = size_class(size);
+
+  /* Blocks too big for a size class get their own allocation */
+  if (class == ARENA_CLASSES) {
+
+    header = malloc(sizeof(*header) + size);
+
+    if (header == NULL)
+      return NULL;
+
+    arena->in_use += size;
+    arena->reserved += sizeof(*header) + size;
+
+    header->links.prev = NULL;
+    header->links.next = arena->large;
+    if (arena->large != NULL)
+      ((Header *) arena->large)->links.prev = header;
+    arena->large = header;
+
+    return header + 1;
+  }
+
+  size = (unsigned long) ARENA_ALIGN << class;
+  arena->in_use += size;
+
+  /* Reuse a released block of the same size class */
+  if (arena->free_list[class] != NULL) {
+    block = arena->free_list[class];
+    arena->free_list[class] = *(void **) block;
+    return block;
+  }
+
+  /* Start a new slab when the newest one is used up, the leftover
+     space in the old one is never handed out */
+  if (arena->bump_left < size) {
+
+    header = malloc(SLAB_SIZE);
+
+    if (header == NULL) {
+      arena->in_use -= size;
+      return NULL;
+    }
+
+    arena->reserved += SLAB_SIZE;
+
+    header->links.next = arena->slabs;
+    arena->slabs = header;
+    arena->bump = (char *) (header + 1);
+    arena->bump_left = SLAB_SIZE - sizeof(*header);
+  }
+
+  block = arena->bump;
+  arena->bump += size;
+  arena->bump_left -= size;
+
+  return block;
+}
+
+
+/*
+ * Gives a block allocated from arena back to it. size must be the size
+ * the block was allocated with.
+ */
+void arena_free(Arena *arena, void *block, unsigned long size) {
+
+  Header *header;
+  int class;
+
+  if (block == NULL)
+    return;
+
+  class = size_class(size);
+
+  /* Blocks of a size class go on its free list for reuse */
+  if (class < ARENA_CLASSES) {
+    arena->in_use -= (unsigned long) ARENA_ALIGN << class;
+    *(void **) block = arena->free_list[class];
+    arena->free_list[class] = block;
+    return;
+  }
+
+  /* Unchain a block that had its own allocation */
+  header = (Header *) block - 1;
+  arena->in_use -= size;
+  arena->reserved -= sizeof(*header) + size;
+
+  if (header->links.prev != NULL)
+    header->links.prev->links.next = header->links.next;
+  else
+    arena->large = header->links.next;
+
+  if (header->links.next != NULL)
+    header->links.next->links.prev = header->links.prev;
+
+  free(header);
+}
+
+
+/*
+ * Returns the bytes a block of size bytes really takes up: the size of
+ * its class, or size itself for a block bigger than every class. Two
+ * sizes with the same result can be freed as one another.
+ */
+unsigned long arena_block_size(unsigned long size) {
+
+  int class = size_class(size);
+
+  if (class < ARENA_CLASSES)
+    return (unsigned long) ARENA_ALIGN << class;
+
+  return size;
+}
+
+
+/*
+ * Frees every block allocated from arena at once and leaves it owning
+ * no memory
+ */
+void arena_release(Arena *arena) {
+
+  Header *curr, *next;
+
+  for (curr = arena->slabs; curr != NULL; curr = next) {
+    next = curr->links.next;
+    free(curr);
+  }
+
+  for (curr = arena->large; curr != NULL; curr = next) {
+    next = curr->links.next;
+    free(curr);
+  }
+
+  arena_init(arena);
+}
+
+
+/*
+ * Initializes cache to hold no blocks
+ */
+void cache_init(Cache *cache) {
+
+  int i;
+
+  for (i = 0; i < ARENA_CLASSES; i++) {
+    cache->free_list[i] = NULL;
+    cache->count[i] = 0;
+  }
+}
+
+
+/*
+ * Takes a block of at least size bytes out of cache, without touching
+ * the arena it came from
+ *
+ * Returns a pointer to the block, or NULL if the cache has none of its
+ * size class, or size is bigger than every class
+ */
+void *cache_alloc(Cache *cache, unsigned long size) {
+
+  void *block;
+  int class = size_class(size);
+
+  if (class == ARENA_CLASSES || cache->free_list[class] == NULL)
+    return NULL;
+
+  block = cache->free_list[class];
+  cache->free_list[class] = *(void **) block;
+  cache->count[class]--;
+
+  return block;
+}
+
+
+/*
+ * Keeps block, of size bytes and allocated from an arena, in cache for
+ * cache_alloc(), unless the cache of its size class is full
+ *
+ * Returns 1 if the block was kept, 0 if it has to go back to the arena
+ */
+int cache_free(Cache *cache, void *block, unsigned long size) {
+
+  int class = size_class(size);
+
+  if (class == ARENA_CLASSES || cache->count[class] >= CACHE_BLOCKS)
+    return 0;
+
+  *(void **) block = cache->free_list[class];
+  cache->free_list[class] = block;
+  cache->count[class]++;
+
+  return 1;
+}
+
+
+/*
+ * Fills cache with blocks of the size class of size bytes from arena,
+ * up to half of what it holds at most. A size bigger than every class
+ * isn't cached.
+ */
+void cache_fill(Cache *cache, Arena *arena, unsigned long size) {
+
+  void *block;
+  int class = size_class(size);
+
+  if (class == ARENA_CLASSES)
+    return;
+
+  while (cache->count[class] < CACHE_BLOCKS / 2
+	 && (block = arena_alloc(arena, size)) != NULL) {
+    *(void **) block = cache->free_list[class];
+    cache->free_list[class] = block;
+    cache->count[class]++;
+  }
+}
+
+
+/*
+ * Gives the blocks cache holds of the size class of size bytes back to
+ * arena, down to half of what it holds at most
+ */
+void cache_drain(Cache *cache, Arena *arena, unsigned long size) {
+
+  int class = size_class(size);
+
+  if (class == ARENA_CLASSES)
+    return;
+
+  while (cache->count[class] > CACHE_BLOCKS / 2)
+    arena_free(arena, cache_alloc(cache, size), size);
+}
+
+
+/*
+ * Gives every block cache holds back to arena
+ */
+void cache_empty(Cache *cache, Arena *arena) {
+
+  unsigned long size;
+  int class;
+
+  for (class = 0; class < ARENA_CLASSES; class++) {
+
+    size = (unsigned long) ARENA_ALIGN << class;
+
+    while (cache->free_list[class] != NULL)
+      arena_free(arena, cache_alloc(cache, size), size);
+  }
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Returns the size class a block of size bytes is allocated from, or
+ * ARENA_CLASSES if it is bigger than every class
+ */
+static int size_class(unsigned long size) {
+
+  unsigned long class_size = ARENA_ALIGN;
+  int class = 0;
+
+  while (class < ARENA_CLASSES && class_size < size) {
+    class_size *= 2;
+    class++;
+  }
+
+  return class;
+}
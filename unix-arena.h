@@ -0,0 +1,20 @@
+/*
+ * unix-arena.h
+ *
+ * Header file for the allocator that owns the memory of a Unix
+ * filesystem
+ */
+
+#include "unix-datastructure.h"
+
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, unsigned long size);
+void arena_free(Arena *arena, void *block, unsigned long size);
+unsigned long arena_block_size(unsigned long size);
+void arena_release(Arena *arena);
+void cache_init(Cache *cache);
+void *cache_alloc(Cache *cache, unsigned long size);
+int cache_free(Cache *cache, void *block, unsigned long size);
+void cache_fill(Cache *cache, Arena *arena, unsigned long size);
+void cache_drain(Cache *cache, Arena *arena, unsigned long size);
+void cache_empty(Cache *cache, Arena *arena);
@@ -0,0 +1,850 @@
+/*
+ * unix-bench.c
+ *
+ * Benchmarks for the simulated Unix filesystem. Each workload builds a
+ * synthetic tree through the functions in unix.h and times every call,
+ * then reports ops/sec, ns/op percentiles and the peak resident set
+ * size as JSON on the standard output. The threads workload runs the
+ * same mix of commands from 1 up to THREADS_MAX threads at once and
+ * reports the ops/sec of all of them together, the recursive one
+ * runs find, print_tree and rm over a whole tree with 1 up to
+ * WORKERS_MAX workers, and the snapshot one times the first change
+ * after a snapshot below directories of two sizes.
+ *
+ * Build and run it with the rest of the sources:
+ *
+ *   make bench
+ *   ./unix-bench [divisor]
+ *
+ * The tree sizes (1M siblings, 100k levels, ...) are divided by the
+ * optional divisor for quicker runs. Every workload runs in a child
+ * process so its peak RSS isn't inflated by the ones before it.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "unix.h"
+
+/* Tree sizes before dividing them */
+#define WIDE_ENTRIES 1000000
+#define DEEP_LEVELS 100000
+#define BALANCED_FANOUT 10
+#define BALANCED_DEPTH 5
+#define MIX_OPS 1000000
+#define THREAD_FANOUT 10
+#define THREAD_DEPTH 3
+#define THREAD_OPS 1000000
+
+/* Most threads the threads workload runs at once, doubling from one */
+#define THREADS_MAX 64
+
+/* Most workers the recursive workload gives the filesystem, doubling
+   from one, and the files of the wide directory it adds to its tree */
+#define WORKERS_MAX 8
+#define RECURSIVE_ENTRIES 100000
+
+/* Most entries of each directory on the way down to the change the
+   snapshot workload makes, which also tries a hundredth as many, and
+   the snapshots it takes of each */
+#define SNAPSHOT_ENTRIES 100000
+#define SNAPSHOTS 3
+
+/* Image the balanced tree is saved to and loaded from */
+#define IMAGE_FILE "unix-bench.img"
+
+/* Latencies of the calls of one operation in one workload */
+typedef struct phase {
+  const char * op;
+  unsigned long count;
+  unsigned long size;
+  unsigned long long * ns;
+  unsigned long long wall;	/* time taken by calls made in parallel */
+  int threads;			/* threads making the calls, 0 for one */
+  unsigned long entries;	/* of the directories the calls went
+				   through, 0 when it doesn't matter */
+} Phase;
+
+/* One thread of the threads workload */
+typedef struct worker {
+  Unix * filesystem;		/* tree the thread starts a session on */
+  unsigned long nodes;		/* directories in the tree */
+  unsigned long ops;		/* calls to make */
+  unsigned long seed;		/* state of its random numbers */
+  int id;
+  Phase phase;
+  pthread_t thread;
+} Worker;
+
+static unsigned long divisor = 1;
+static unsigned long seed = 88172645463325252UL;
+static int first_result = 1;
+
+static void run(const char workload[], void (*body)(Unix *, const char *));
+static void wide(Unix *filesystem, const char workload[]);
+static void deep(Unix *filesystem, const char workload[]);
+static void balanced(Unix *filesystem, const char workload[]);
+static void mix(Unix *filesystem, const char workload[]);
+static void threads(Unix *filesystem, const char workload[]);
+static void recursive(Unix *filesystem, const char workload[]);
+static void snapshot_write(Unix *filesystem, const char workload[]);
+static unsigned long copied(Unix *filesystem);
+static void *thread_mix(void *arg);
+static void node_path(unsigned long node, unsigned long fanout, char path[]);
+static void phase_init(Phase *phase, const char op[], unsigned long size);
+static unsigned long long now(void);
+static void record(Phase *phase, unsigned long long start);
+static void report(const char workload[], Phase *phase);
+static int compare_ns(const void *a, const void *b);
+static unsigned long next_random(void);
+static unsigned long random_from(unsigned long *state);
+
+/* Times one call into the filesystem and records it in phase */
+#define TIMED(phase, call)                              \
+  do {                                                  \
+    unsigned long long start_ = now();                  \
+    call;                                               \
+    record(phase, start_);                              \
+  } while (0)
+
+
+int main(int argc, char *argv[]) {
+
+  if (argc > 1 && atol(argv[1]) > 0)
+    divisor = atol(argv[1]);
+
+  printf("{\n  \"benchmark\": \"unix-shell\",\n");
+  printf("  \"divisor\": %lu,\n  \"results\": [", divisor);
+  fflush(stdout);
+
+  run("wide", wide);
+  run("deep", deep);
+  run("balanced", balanced);
+  run("mix", mix);
+  run("threads", threads);
+  run("recursive", recursive);
+  run("snapshot", snapshot_write);
+
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
+
+
+/*
+ * Runs one workload on a fresh filesystem in a child process, whose
+ * output is kept in memory and discarded after every call
+ */
+static void run(const char workload[], void (*body)(Unix *, const char *)) {
+
+  Unix filesystem;
+  pid_t child;
+  int status;
+
+  fflush(stdout);
+  child = fork();
+
+  if (child == 0) {
+    mkfs(&filesystem);
+    set_output(&filesystem, -1);
+    body(&filesystem, workload);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  if (child < 0 || waitpid(child, &status, 0) < 0
+      || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "unix-bench: workload %s failed\n", workload);
+    exit(1);
+  }
+
+  /* The child printed at least one result */
+  first_result = 0;
+}
+
+
+/*
+ * One directory with WIDE_ENTRIES files created in random order, each
+ * looked up and half of them removed again
+ */
+static void wide(Unix *filesystem, const char workload[]) {
+
+  unsigned long entries = WIDE_ENTRIES / divisor, i, j, swap;
+  unsigned long *order = malloc(entries * sizeof(*order));
+  Phase phase;
+  char name[32];
+
+  for (i = 0; i < entries; i++)
+    order[i] = i;
+
+  for (i = entries; i > 1; i--) {
+    j = next_random() % i;
+    swap = order[i - 1];
+    order[i - 1] = order[j];
+    order[j] = swap;
+  }
+
+  phase_init(&phase, "touch", entries);
+  for (i = 0; i < entries; i++) {
+    sprintf(name, "f%07lu", order[i]);
+    TIMED(&phase, touch(filesystem, name));
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "ls_file", entries);
+  for (i = 0; i < entries; i++) {
+    sprintf(name, "f%07lu", next_random() % entries);
+    TIMED(&phase, ls(filesystem, name));
+    clear_output(filesystem);
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "ls_dir", 1);
+  TIMED(&phase, ls(filesystem, ""));
+  clear_output(filesystem);
+  report(workload, &phase);
+
+  phase_init(&phase, "rm", entries / 2);
+  for (i = 0; i < entries / 2; i++) {
+    sprintf(name, "f%07lu", order[i]);
+    TIMED(&phase, rm(filesystem, name));
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "rmfs", 1);
+  TIMED(&phase, rmfs(filesystem));
+  report(workload, &phase);
+
+  free(order);
+}
+
+
+/*
+ * A chain of DEEP_LEVELS directories, walked down one level at a time,
+ * in one absolute path and back up, then removed from the top
+ */
+static void deep(Unix *filesystem, const char workload[]) {
+
+  unsigned long levels = DEEP_LEVELS / divisor, i;
+  char *path = malloc(2 * levels + 1);
+  Phase phase, cds;
+
+  phase_init(&phase, "mkdir", levels);
+  phase_init(&cds, "cd", levels);
+  for (i = 0; i < levels; i++) {
+    TIMED(&phase, mkdir(filesystem, "d"));
+    TIMED(&cds, cd(filesystem, "d"));
+  }
+  report(workload, &phase);
+  report(workload, &cds);
+
+  phase_init(&phase, "pwd", 1000);
+  for (i = 0; i < 1000; i++) {
+    TIMED(&phase, pwd(filesystem));
+    clear_output(filesystem);
+  }
+  report(workload, &phase);
+
+  for (i = 0; i < levels; i++) {
+    path[2 * i] = '/';
+    path[2 * i + 1] = 'd';
+  }
+  path[2 * levels] = '\0';
+
+  phase_init(&phase, "cd_path", 2);
+  TIMED(&phase, cd(filesystem, "/"));
+  TIMED(&phase, cd(filesystem, path));
+  report(workload, &phase);
+
+  phase_init(&phase, "cd_parent", levels);
+  for (i = 0; i < levels; i++)
+    TIMED(&phase, cd(filesystem, ".."));
+  report(workload, &phase);
+
+  phase_init(&phase, "rm_tree", 1);
+  TIMED(&phase, rm(filesystem, "/d"));
+  report(workload, &phase);
+
+  phase_init(&phase, "rmfs", 1);
+  TIMED(&phase, rmfs(filesystem));
+  report(workload, &phase);
+
+  free(path);
+}
+
+
+/*
+ * A tree with BALANCED_FANOUT directories in every directory down to
+ * BALANCED_DEPTH levels, built and visited through absolute paths,
+ * then saved to an image, mapped and listed in place, and loaded back
+ */
+static void balanced(Unix *filesystem, const char workload[]) {
+
+  unsigned long fanout = BALANCED_FANOUT, nodes = 0, count, i;
+  int depth;
+  char path[128];
+  Phase phase;
+
+  for (count = 1, depth = 0; depth < BALANCED_DEPTH; depth++) {
+    count *= fanout;
+    nodes += count;
+  }
+  nodes /= divisor;
+
+  /* Creating node i needs all of its ancestors, so go breadth first */
+  phase_init(&phase, "mkdir", nodes);
+  for (i = 0; i < nodes; i++) {
+    node_path(i, fanout, path);
+    TIMED(&phase, mkdir(filesystem, path));
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "cd_path", nodes);
+  for (i = 0; i < nodes; i++) {
+    node_path(next_random() % nodes, fanout, path);
+    TIMED(&phase, cd(filesystem, path));
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "ls_dir", nodes);
+  for (i = 0; i < nodes; i++) {
+    TIMED(&phase, ls(filesystem, i % 2 ? "/n1" : ".."));
+    clear_output(filesystem);
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "save", 1);
+  TIMED(&phase, save(filesystem, IMAGE_FILE));
+  report(workload, &phase);
+
+  phase_init(&phase, "map", 1);
+  TIMED(&phase, map_image(filesystem, IMAGE_FILE));
+  report(workload, &phase);
+
+  phase_init(&phase, "ls_mapped", nodes);
+  for (i = 0; i < nodes; i++) {
+    node_path(next_random() % nodes, fanout, path);
+    TIMED(&phase, ls(filesystem, path));
+    clear_output(filesystem);
+  }
+  report(workload, &phase);
+
+  phase_init(&phase, "load", 1);
+  TIMED(&phase, load(filesystem, IMAGE_FILE));
+  report(workload, &phase);
+  remove(IMAGE_FILE);
+
+  phase_init(&phase, "rm_tree", fanout);
+  cd(filesystem, "/");
+  for (i = 0; i < fanout; i++) {
+    sprintf(path, "n%lu", i);
+    TIMED(&phase, rm(filesystem, path));
+  }
+  report(workload, &phase);
+
+  rmfs(filesystem);
+}
+
+
+/*
+ * A mix of commands on random paths of a small tree, weighted towards
+ * lookups the way interactive use is
+ */
+static void mix(Unix *filesystem, const char workload[]) {
+
+  unsigned long ops = MIX_OPS / divisor, i;
+  Phase phase;
+  char path[64];
+
+  phase_init(&phase, "mix", ops);
+  for (i = 0; i < ops; i++) {
+
+    sprintf(path, "/d%lu/e%lu/f%lu", next_random() % 50,
+	    next_random() % 50, next_random() % 20);
+
+    /* Drop the last one or two components now and then */
+    if (next_random() % 3 == 0)
+      *strrchr(path, '/') = '\0';
+    if (next_random() % 5 == 0)
+      *strrchr(path, '/') = '\0';
+
+    switch (next_random() % 10) {
+    case 0:
+    case 1:
+    case 2:
+      TIMED(&phase, ls(filesystem, path));
+      break;
+    case 3:
+    case 4:
+      TIMED(&phase, cd(filesystem, path));
+      break;
+    case 5:
+      TIMED(&phase, touch(filesystem, path));
+      break;
+    case 6:
+    case 7:
+      TIMED(&phase, mkdir(filesystem, path));
+      break;
+    case 8:
+      TIMED(&phase, rm(filesystem, path));
+      break;
+    default:
+      TIMED(&phase, pwd(filesystem));
+    }
+
+    clear_output(filesystem);
+  }
+  report(workload, &phase);
+
+  rmfs(filesystem);
+}
+
+
+/*
+ * A tree of THREAD_FANOUT directories in every directory down to
+ * THREAD_DEPTH levels, with 1, 2, 4, ... THREADS_MAX threads running the
+ * same number of commands on it between them, each through a session
+ * of its own
+ */
+static void threads(Unix *filesystem, const char workload[]) {
+
+  Worker *workers = malloc(THREADS_MAX * sizeof(*workers));
+  unsigned long nodes = 0, count, ops = THREAD_OPS / divisor, i;
+  unsigned long long start;
+  int depth, count_threads, t;
+  char path[128];
+  Phase phase;
+
+  for (count = 1, depth = 0; depth < THREAD_DEPTH; depth++) {
+    count *= THREAD_FANOUT;
+    nodes += count;
+  }
+
+  for (i = 0; i < nodes; i++) {
+    node_path(i, THREAD_FANOUT, path);
+    mkdir(filesystem, path);
+  }
+
+  if (workers == NULL || !enable_threads(filesystem, 1)) {
+    fprintf(stderr, "unix-bench: not enough memory\n");
+    exit(1);
+  }
+
+  for (count_threads = 1; count_threads <= THREADS_MAX; count_threads *= 2) {
+
+    for (t = 0; t < count_threads; t++) {
+      workers[t].filesystem = filesystem;
+      workers[t].nodes = nodes;
+      workers[t].ops = ops / count_threads;
+      workers[t].seed = next_random();
+      workers[t].id = t;
+      phase_init(&workers[t].phase, "mix", workers[t].ops);
+    }
+
+    start = now();
+
+    for (t = 0; t < count_threads; t++)
+      pthread_create(&workers[t].thread, NULL, thread_mix, &workers[t]);
+
+    for (t = 0; t < count_threads; t++)
+      pthread_join(workers[t].thread, NULL);
+
+    /* Report the calls of every thread as one phase */
+    phase_init(&phase, "mix", ops);
+    phase.wall = now() - start;
+    phase.threads = count_threads;
+
+    for (t = 0; t < count_threads; t++) {
+      memcpy(phase.ns + phase.count, workers[t].phase.ns,
+	     workers[t].phase.count * sizeof(*phase.ns));
+      phase.count += workers[t].phase.count;
+      free(workers[t].phase.ns);
+    }
+
+    report(workload, &phase);
+  }
+
+  enable_threads(filesystem, 0);
+  rmfs(filesystem);
+  free(workers);
+}
+
+
+/*
+ * The balanced tree next to a directory of RECURSIVE_ENTRIES files,
+ * walked whole by find and print_tree and then removed, with 1, 2, 4,
+ * ... WORKERS_MAX workers. du is timed too, as du_totals: it reads the
+ * totals every directory keeps and walks nothing, so it is no measure
+ * of the walks.
+ */
+static void recursive(Unix *filesystem, const char workload[]) {
+
+  unsigned long fanout = BALANCED_FANOUT, nodes = 0, count, i;
+  unsigned long entries = RECURSIVE_ENTRIES / divisor;
+  int depth, workers;
+  char path[128];
+  Phase phase;
+
+  for (count = 1, depth = 0; depth < BALANCED_DEPTH; depth++) {
+    count *= fanout;
+    nodes += count;
+  }
+  nodes /= divisor;
+
+  for (workers = 1; workers <= WORKERS_MAX; workers *= 2) {
+
+    for (i = 0; i < nodes; i++) {
+      node_path(i, fanout, path);
+      mkdir(filesystem, path);
+    }
+
+    mkdir(filesystem, "/w");
+    for (i = 0; i < entries; i++) {
+      sprintf(path, "/w/f%07lu", i);
+      touch(filesystem, path);
+    }
+
+    if (!set_workers(filesystem, workers)) {
+      fprintf(stderr, "unix-bench: not enough memory\n");
+      exit(1);
+    }
+
+    phase_init(&phase, "du_totals", 3);
+    phase.threads = workers;
+    for (i = 0; i < 3; i++) {
+      TIMED(&phase, du(filesystem, "/"));
+      clear_output(filesystem);
+    }
+    report(workload, &phase);
+
+    phase_init(&phase, "find", 3);
+    phase.threads = workers;
+    for (i = 0; i < 3; i++) {
+      TIMED(&phase, find(filesystem, "/", "n3"));
+      clear_output(filesystem);
+    }
+    report(workload, &phase);
+
+    phase_init(&phase, "tree", 3);
+    phase.threads = workers;
+    for (i = 0; i < 3; i++) {
+      TIMED(&phase, print_tree(filesystem, "/"));
+      clear_output(filesystem);
+    }
+    report(workload, &phase);
+
+    /* Every top directory goes in one call */
+    phase_init(&phase, "rm_tree", fanout + 1);
+    phase.threads = workers;
+    for (i = 0; i < fanout; i++) {
+      sprintf(path, "/n%lu", i);
+      TIMED(&phase, rm(filesystem, path));
+    }
+    TIMED(&phase, rm(filesystem, "/w"));
+    report(workload, &phase);
+  }
+
+  rmfs(filesystem);
+}
+
+
+/*
+ * A file two directories down, /s/d/f, below directories of a
+ * hundredth of SNAPSHOT_ENTRIES entries each and then of as many,
+ * snapshotted SNAPSHOTS times, each time followed by the first change
+ * below it and by a second one. A snapshot shares every directory, so
+ * the first change copies only the entries on its way down, /s and
+ * /s/d, whatever the size of the directories, and the second copies
+ * nothing; both are checked against the entries the filesystem counts
+ * as copied.
+ */
+static void snapshot_write(Unix *filesystem, const char workload[]) {
+
+  unsigned long entries = SNAPSHOT_ENTRIES / divisor, before, expected, i;
+  Phase snapshots, first, second;
+  char path[32];
+  int size, n;
+
+  enable_stats(filesystem, 1);
+
+  for (size = 0; size < 2; size++) {
+
+    if (size == 0)
+      entries = entries / 100 > 0 ? entries / 100 : 1;
+    else
+      entries *= 100;
+
+    mkdir(filesystem, "/s");
+    mkdir(filesystem, "/s/d");
+    for (i = 1; i < entries; i++) {
+      sprintf(path, "/s/f%07lu", i);
+      touch(filesystem, path);
+    }
+    for (i = 0; i < entries; i++) {
+      sprintf(path, "/s/d/f%07lu", i);
+      touch(filesystem, path);
+    }
+
+    phase_init(&snapshots, "snapshot", SNAPSHOTS);
+    phase_init(&first, "first_write", SNAPSHOTS);
+    phase_init(&second, "second_write", SNAPSHOTS);
+    snapshots.entries = first.entries = second.entries = entries;
+
+    /* Replacing a snapshot would free what the one before copied */
+    for (n = 0; n < SNAPSHOTS; n++) {
+
+      sprintf(path, "before%d_%d", size, n);
+      TIMED(&snapshots, snapshot(filesystem, path));
+
+      /* The entries on the way down, /s and /s/d, however many
+	 entries the directories they are in hold */
+      expected = 2;
+
+      before = copied(filesystem);
+      sprintf(path, "/s/d/a%d", n);
+      TIMED(&first, touch(filesystem, path));
+
+      if (copied(filesystem) - before != expected) {
+	fprintf(stderr, "unix-bench: first write copied %lu entries, "
+		"not %lu\n", copied(filesystem) - before, expected);
+	exit(1);
+      }
+
+      before = copied(filesystem);
+      sprintf(path, "/s/d/b%d", n);
+      TIMED(&second, touch(filesystem, path));
+
+      if (copied(filesystem) != before) {
+	fprintf(stderr, "unix-bench: second write copied %lu entries\n",
+		copied(filesystem) - before);
+	exit(1);
+      }
+    }
+
+    report(workload, &snapshots);
+    report(workload, &first);
+    report(workload, &second);
+
+    rm(filesystem, "/s");
+  }
+
+  rmfs(filesystem);
+}
+
+
+/*
+ * Returns the entries copies were given in the filesystem so far
+ */
+static unsigned long copied(Unix *filesystem) {
+  return get_stats(filesystem)->copied;
+}
+
+
+/*
+ * Runs the commands of one thread of the threads workload: mostly ls,
+ * cd and pwd on random directories, with a file of its own touched in
+ * and removed from one now and then
+ */
+static void *thread_mix(void *arg) {
+
+  Worker *worker = arg;
+  Unix session;
+  unsigned long i;
+  char path[128];
+
+  mksession(&session, worker->filesystem);
+  set_output(&session, -1);
+
+  for (i = 0; i < worker->ops; i++) {
+
+    node_path(random_from(&worker->seed) % worker->nodes, THREAD_FANOUT,
+	      path);
+
+    switch (random_from(&worker->seed) % 20) {
+    case 0:
+      sprintf(path + strlen(path), "/w%d", worker->id);
+      TIMED(&worker->phase, touch(&session, path));
+      break;
+    case 1:
+      sprintf(path + strlen(path), "/w%d", worker->id);
+      TIMED(&worker->phase, rm(&session, path));
+      break;
+    case 2:
+    case 3:
+      TIMED(&worker->phase, pwd(&session));
+      break;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+    case 8:
+    case 9:
+      TIMED(&worker->phase, cd(&session, path));
+      break;
+    default:
+      TIMED(&worker->phase, ls(&session, path));
+    }
+
+    clear_output(&session);
+  }
+
+  rmfs(&session);
+
+  return NULL;
+}
+
+
+/*
+ * Writes the absolute path of a node of the balanced tree to path.
+ * Nodes are numbered breadth first, so the parent of node n is node
+ * n / fanout - 1 and comes before it.
+ */
+static void node_path(unsigned long node, unsigned long fanout, char path[]) {
+
+  unsigned long ancestors[BALANCED_DEPTH];
+  int depth = 0;
+
+  for (;;) {
+    ancestors[depth++] = node % fanout;
+    if (node < fanout)
+      break;
+    node = node / fanout - 1;
+  }
+
+  path[0] = '\0';
+  while (depth > 0)
+    sprintf(path + strlen(path), "/n%lu", ancestors[--depth]);
+}
+
+
+/*
+ * Starts recording the latencies of up to size calls of op
+ */
+static void phase_init(Phase *phase, const char op[], unsigned long size) {
+
+  phase->op = op;
+  phase->count = 0;
+  phase->size = size;
+  phase->ns = malloc((size > 0 ? size : 1) * sizeof(*phase->ns));
+  phase->wall = 0;
+  phase->threads = 0;
+  phase->entries = 0;
+
+  if (phase->ns == NULL) {
+    fprintf(stderr, "unix-bench: not enough memory\n");
+    exit(1);
+  }
+}
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds
+ */
+static unsigned long long now(void) {
+
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (unsigned long long) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+
+/*
+ * Records the latency of a call that started at start
+ */
+static void record(Phase *phase, unsigned long long start) {
+
+  unsigned long long end = now();
+
+  if (phase->count < phase->size)
+    phase->ns[phase->count++] = end - start;
+}
+
+
+/*
+ * Prints the results of a phase as a JSON object and frees its
+ * latencies. Calls made in parallel are counted against the time they
+ * took together rather than the sum of their latencies.
+ */
+static void report(const char workload[], Phase *phase) {
+
+  struct rusage usage;
+  unsigned long long total = 0;
+  unsigned long i, n = phase->count;
+
+  for (i = 0; i < n; i++)
+    total += phase->ns[i];
+
+  if (phase->wall > 0)
+    total = phase->wall;
+
+  qsort(phase->ns, n, sizeof(*phase->ns), compare_ns);
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%s\n    {\"workload\": \"%s\", \"op\": \"%s\", ",
+	 first_result ? "" : ",", workload, phase->op);
+
+  if (phase->threads > 0)
+    printf("\"threads\": %d, ", phase->threads);
+
+  if (phase->entries > 0)
+    printf("\"entries\": %lu, ", phase->entries);
+
+  printf("\"count\": %lu, "
+	 "\"ops_per_sec\": %.1f, \"ns_per_op\": {\"p50\": %llu, "
+	 "\"p90\": %llu, \"p99\": %llu, \"max\": %llu}, "
+	 "\"peak_rss_kb\": %ld}",
+	 n,
+	 total > 0 ? n * 1e9 / total : 0.0,
+	 n > 0 ? phase->ns[n / 2] : 0,
+	 n > 0 ? phase->ns[n * 9 / 10] : 0,
+	 n > 0 ? phase->ns[n * 99 / 100] : 0,
+	 n > 0 ? phase->ns[n - 1] : 0,
+	 usage.ru_maxrss);
+
+  first_result = 0;
+  free(phase->ns);
+}
+
+
+/*
+ * Orders latencies for qsort()
+ */
+static int compare_ns(const void *a, const void *b) {
+
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+
+/*
+ * Returns the next number of a xorshift sequence, so every run
+ * benchmarks the same trees
+ */
+static unsigned long next_random(void) {
+  return random_from(&seed);
+}
+
+
+/*
+ * Returns the next number of the xorshift sequence whose state is
+ * state, for threads that each keep their own
+ */
+static unsigned long random_from(unsigned long *state) {
+
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+
+  return *state;
+}
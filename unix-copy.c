@@ -0,0 +1,996 @@
+/*
+ * unix-copy.c
+ *
+ * This file contains cp, which copies a file or a whole directory of a
+ * simulated Unix filesystem without copying what is below it, the
+ * snapshot, restore and snapshots commands, which copy the whole tree
+ * the same way, and the copying that is left for later: freezing an
+ * entry into the layers above it before it changes, and giving a copy
+ * an entry of its own on the way down to a change.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unix.h"
+#include "unix-copy.h"
+#include "unix-image.h"
+#include "unix-journal.h"
+#include "unix-lock.h"
+#include "unix-order.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+
+static int copy_path(Unix *filesystem, const char arg[], const char dest[]);
+static int take_snapshot(Unix *filesystem, const char name[]);
+static int restore_snapshot(Unix *filesystem, const char name[]);
+static int is_name(const char name[]);
+static int needs_freeze(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len);
+static int freeze(Unix *filesystem, Container *dir, const char name[],
+		  unsigned long len);
+static Container *copy_into(Unix *filesystem, Container *dir,
+			    Container *source);
+static int layer_for(Unix *filesystem, Container *source, Container **layer);
+static void copy_entry(Unix *filesystem, Container *copy, Container *source,
+		       Container *layer);
+static void release(Unix *filesystem, Container *origin);
+static void drop_layer(Unix *filesystem, Container *layer);
+static void orphan(Unix *filesystem, Container *container);
+static Share *new_share(Unix *filesystem, int is_layer);
+static Share *share_of(Container *container);
+static int compare_entries(Container *first, Container *second);
+
+
+/*
+ * Copies the file or directory at the path arg of the unix variable
+ * sent in to the path dest, or into the directory at dest under its own
+ * name if there is one. Nothing below a directory is copied until
+ * either side changes, so this takes the same time however much the
+ * directory holds. A directory can't be copied into itself.
+ *
+ * It holds the tree lock, for the moment it takes, so no command is
+ * half way through changing what the copy is made of.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int cp(Unix *filesystem, const char arg[], const char dest[]) {
+
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || arg == NULL || dest == NULL
+      || (int)strlen(arg) == 0 || (int)strlen(dest) == 0)
+    return 0;
+
+  lock_tree(filesystem);
+  enter_tree(filesystem);
+
+  /* A mapped image is built in memory first */
+  result = filesystem->tree->image == NULL || image_materialize(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  result = result && copy_path(filesystem, arg, dest);
+  result = STATS_END(filesystem, C_CP, start, result);
+
+  if (journal_full(filesystem))
+    checkpoint(filesystem);
+
+  /* Records the checkpoint couldn't save are lost */
+  if (journal_failed(filesystem))
+    result = 0;
+
+  leave_tree(filesystem);
+  unlock_tree(filesystem);
+
+  /* Synced once the tree is let go, so other commands go on meanwhile */
+  result = journal_commit(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Takes a snapshot called name of the tree of the unix variable sent
+ * in, replacing the one with that name if there is one. It is a copy of
+ * the root, kept apart from the tree, so it costs the same however big
+ * the tree is. A later change copies one entry for each directory on
+ * the way down to it, and nothing else.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int snapshot(Unix *filesystem, const char name[]) {
+
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || name == NULL || !is_name(name))
+    return 0;
+
+  lock_tree(filesystem);
+  enter_tree(filesystem);
+
+  /* A mapped image is built in memory first */
+  result = filesystem->tree->image == NULL || image_materialize(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  result = result && take_snapshot(filesystem, name);
+  result = STATS_END(filesystem, C_SNAPSHOT, start, result);
+
+  if (journal_full(filesystem))
+    checkpoint(filesystem);
+
+  /* Records the checkpoint couldn't save are lost */
+  if (journal_failed(filesystem))
+    result = 0;
+
+  leave_tree(filesystem);
+  unlock_tree(filesystem);
+
+  /* Synced once the tree is let go, so other commands go on meanwhile */
+  result = journal_commit(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Makes the tree of the unix variable sent in what it was when the
+ * snapshot called name was taken, with the root as the current
+ * directory of every session. The snapshot is kept, and the restored
+ * tree is a copy of it like any other, so restoring takes the same
+ * time however big it is.
+ *
+ * Returns 1 if successful, 0 if there is no such snapshot
+ */
+int restore(Unix *filesystem, const char name[]) {
+
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || name == NULL || !is_name(name))
+    return 0;
+
+  lock_tree(filesystem);
+  enter_tree(filesystem);
+
+  result = filesystem->tree->image == NULL || image_materialize(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  result = result && restore_snapshot(filesystem, name);
+  result = STATS_END(filesystem, C_RESTORE, start, result);
+
+  if (journal_full(filesystem))
+    checkpoint(filesystem);
+
+  /* Records the checkpoint couldn't save are lost */
+  if (journal_failed(filesystem))
+    result = 0;
+
+  leave_tree(filesystem);
+  unlock_tree(filesystem);
+
+  /* Synced once the tree is let go, so other commands go on meanwhile */
+  result = journal_commit(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Prints the names of the snapshots of the tree of the unix variable
+ * sent in, in sorted order, one per line
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int snapshots(Unix *filesystem) {
+
+  Container *curr = NULL;
+  unsigned long long start;
+  unsigned long visited = 0;
+  int result;
+
+  if (filesystem == NULL)
+    return 0;
+
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (result && filesystem->tree->snapshots != NULL)
+    curr = LINK(filesystem->tree->snapshots->sub_dir);
+
+  for (; curr != NULL; curr = LINK(curr->next)) {
+    sink_write(&filesystem->out, curr->name, curr->name_len);
+    sink_write(&filesystem->out, "\n", 1);
+    visited++;
+  }
+
+  sink_flush(&filesystem->out);
+  STATS_ADD(filesystem, visited, visited);
+
+  result = STATS_END(filesystem, C_SNAPSHOTS, start, result);
+  end_change(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Opens view on what dir shows, in sorted order, starting at the first
+ * entry that doesn't sort before prefix, of length len: the entries of
+ * dir and of each layer below it, which view_next() merges. A directory
+ * that isn't a copy is read straight from its own entries. Nothing is
+ * printed, as the workers of a walk open views too, so the caller says
+ * if memory runs out.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+int view_open(Unix *filesystem, View *view, Container *dir,
+	      const char prefix[], unsigned long len) {
+
+  Container *curr, **grown;
+  int size = VIEW_CHAIN;
+
+  view->more = NULL;
+  view->count = 0;
+
+  /* Each origin is loaded once, so a layer put in between meanwhile,
+     which shows the same, is either read in full or not at all */
+  for (curr = dir; curr != NULL; curr = LINK(curr->directory->origin)) {
+
+    if (view->count == size) {
+
+      grown = realloc(view->more, 2 * size * sizeof(Container *));
+
+      if (grown == NULL) {
+	view_close(view);
+	return 0;
+      }
+
+      if (view->more == NULL)
+	memcpy(grown, view->at, size * sizeof(Container *));
+      view->more = grown;
+      size *= 2;
+    }
+
+    VIEW_HEADS(view)[view->count++] = len > 0
+      ? skip_seek(filesystem, curr, prefix, len) : LINK(curr->sub_dir);
+  }
+
+  return 1;
+}
+
+
+/*
+ * Returns the next entry view shows, or NULL once there are none left.
+ * Of the entries with the same name, the one nearest the directory the
+ * view was opened on is shown, or none if that one hides the name.
+ */
+Container *view_next(View *view) {
+
+  Container **heads = VIEW_HEADS(view), *entry;
+  int i, first;
+
+  for (;;) {
+
+    first = -1;
+    for (i = 0; i < view->count; i++)
+      if (heads[i] != NULL
+	  && (first < 0 || compare_entries(heads[i], heads[first]) < 0))
+	first = i;
+
+    if (first < 0)
+      return NULL;
+
+    /* The levels before first are all past the name already */
+    entry = heads[first];
+    for (i = first; i < view->count; i++)
+      while (heads[i] != NULL && compare_entries(heads[i], entry) == 0)
+	heads[i] = LINK(heads[i]->next);
+
+    if (entry->type != U_HIDDEN)
+      return entry;
+  }
+}
+
+
+/*
+ * Frees what view_open() allocated for view
+ */
+void view_close(View *view) {
+
+  free(view->more);
+  view->more = NULL;
+  view->count = 0;
+}
+
+
+/*
+ * Looks up the entry called name, of length len, among what dir shows,
+ * going down its layers until one of them has an entry with the name
+ *
+ * Returns the entry, or NULL if there is none or the name is hidden
+ */
+Container *view_lookup(Unix *filesystem, Container *dir, const char name[],
+		       unsigned long len) {
+
+  Container *entry;
+
+  for (; dir != NULL; dir = LINK(dir->directory->origin)) {
+
+    entry = index_lookup(filesystem, dir, name, len);
+
+    if (entry != NULL)
+      return entry->type != U_HIDDEN ? entry : NULL;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Checks if dir may show entries: it has entries of its own or is a
+ * copy, which shows those of its layers
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+int has_entries(Container *dir) {
+  return dir->directory != NULL
+    && (LINK(dir->sub_dir) != NULL || LINK(dir->directory->origin) != NULL);
+}
+
+
+/*
+ * Gives dir, a copy in the tree of the unix variable sent in, an entry
+ * of its own called name, of length len, in place of the one it shows
+ * through its origin, for a command about to change something at or
+ * below it. It is a copy of that entry, so nothing else is copied, and
+ * what dir shows stays the same.
+ *
+ * Returns the entry of dir called name, or NULL if it shows none or
+ * memory couldn't be allocated
+ */
+Container *own_entry(Unix *filesystem, Container *dir, const char name[],
+		     unsigned long len) {
+
+  Tree *tree = filesystem->tree;
+  Container *entry, *source;
+
+  LOCK(filesystem, clones);
+  atomic_fetch_add(&tree->freezes, 1);
+  lock_dir(filesystem, dir);
+
+  /* Looked up again, since what the origin has is only frozen into
+     its layers under the lock on copies */
+  entry = index_lookup(filesystem, dir, name, len);
+
+  if (entry == NULL) {
+    source = view_lookup(filesystem, LINK(dir->directory->origin), name, len);
+    entry = source != NULL ? copy_into(filesystem, dir, source) : NULL;
+  } else if (entry->type == U_HIDDEN)
+    entry = NULL;
+
+  unlock_dir(filesystem, dir);
+  atomic_fetch_add(&tree->freezes, 1);
+  UNLOCK(filesystem, clones);
+
+  return entry;
+}
+
+
+/*
+ * Makes sure that every copy of dir or of a directory above it in the
+ * tree of the unix variable sent in keeps what it shows, before the
+ * entry of dir called name, of length len, is added, removed or changes
+ * in any other way. Going down from the root, the entry on the way is
+ * frozen into the layer of each directory that has one, and name into
+ * that of dir. Each directory freezes one entry, however many it
+ * holds, and nothing at all once it has frozen that one.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+int unshare(Unix *filesystem, Container *dir, const char name[],
+	    unsigned long len) {
+
+  Tree *tree = filesystem->tree;
+  Container **path = NULL, **grown, *curr;
+  unsigned long freezes, depth = 0, size = 0;
+  int result = 1;
+
+  if (atomic_load(&tree->layers) == 0)
+    return 1;
+
+  /* Nothing left to freeze on the way up is enough, as long as nothing
+     was being frozen meanwhile, which is how layers are made */
+  freezes = atomic_load(&tree->freezes);
+
+  if (freezes % 2 == 0 && !needs_freeze(filesystem, dir, name, len)
+      && atomic_load(&tree->freezes) == freezes)
+    return 1;
+
+  LOCK(filesystem, clones);
+  atomic_fetch_add(&tree->freezes, 1);
+
+  for (curr = dir; result; curr = curr->parent) {
+
+    if (depth == size) {
+
+      size = size > 0 ? 2 * size : 64;
+      grown = realloc(path, size * sizeof(Container *));
+
+      if (grown == NULL) {
+	print_error(filesystem, NO_MEMORY);
+	result = 0;
+	break;
+      }
+
+      path = grown;
+    }
+
+    path[depth++] = curr;
+
+    if (curr->type == U_ROOT)
+      break;
+  }
+
+  while (result && depth > 1) {
+    depth--;
+    result = freeze(filesystem, path[depth], path[depth - 1]->name,
+		    path[depth - 1]->name_len);
+  }
+
+  if (result)
+    result = freeze(filesystem, dir, name, len);
+
+  atomic_fetch_add(&tree->freezes, 1);
+  UNLOCK(filesystem, clones);
+
+  free(path);
+
+  return result;
+}
+
+
+/*
+ * Lets go of what container, which rm removed from the tree of the unix
+ * variable sent in, shares before it is deleted. A copy or layer lets
+ * go of its origin, which may leave that to be deleted as well. A
+ * directory that layers are still made of is kept for them instead,
+ * and a layer of it that no copy reads goes on the list of containers
+ * to delete.
+ *
+ * Returns 1 if container can be deleted, 0 if it is kept
+ */
+int let_go(Unix *filesystem, Container *container) {
+
+  Tree *tree = filesystem->tree;
+  Share *share;
+  Container *origin, *layer;
+  int keep = 0;
+
+  if (container->directory == NULL
+      || (LINK(container->directory->share) == NULL
+	  && LINK(container->directory->origin) == NULL))
+    return 1;
+
+  share = share_of(container);
+
+  LOCK(filesystem, clones);
+
+  origin = LINK(container->directory->origin);
+
+  if (share != NULL && share->refs > 0) {
+
+    layer = LINK(share->layer);
+
+    /* Nothing reads the newest layer, which was kept for the copies
+       made next */
+    if (layer != NULL && share_of(layer)->refs == 0) {
+      SET_LINK(share->layer, NULL);
+      orphan(filesystem, layer);
+    }
+
+    keep = share->orphan = 1;
+
+  } else {
+
+    if (share != NULL && share->is_layer)
+      atomic_fetch_sub(&tree->layers, 1);
+
+    if (origin != NULL)
+      release(filesystem, origin);
+  }
+
+  UNLOCK(filesystem, clones);
+
+  return !keep;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Copies the container at the path arg of the unix variable sent in to
+ * the path dest, for cp
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int copy_path(Unix *filesystem, const char arg[], const char dest[]) {
+
+  Container *parent, *source, *dir, *target, *copy, *layer;
+  const char *name, *arg_name;
+  unsigned long len, arg_len;
+
+  target = resolve_change(filesystem, dest, &dir, &name, &len);
+
+  /* Resolved after dest, so a source above it is found in the tree
+     itself and not in a layer that dest was given an entry of */
+  source = resolve_path(filesystem, arg, &parent, &arg_name, &arg_len);
+
+  if (source == NULL || source->type == U_ROOT)
+    return 0;
+
+  /* Into a directory that is there already, under its own name */
+  if (target != NULL) {
+
+    if (target->type == U_FILE)
+      return 0;
+
+    dir = target;
+    name = source->name;
+    len = source->name_len;
+  }
+
+  if (dir == NULL
+      || (source->type == U_DIR && is_ancestor(filesystem, source, dir))
+      || view_lookup(filesystem, dir, name, len) != NULL
+      || !unshare(filesystem, dir, name, len))
+    return 0;
+
+  if (!layer_for(filesystem, source, &layer)
+      || (copy = new_entry(filesystem, name, len, source->type)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  if (!make_room(filesystem, dir, copy->level)) {
+    print_error(filesystem, NO_MEMORY);
+    free_container(filesystem, copy);
+    return 0;
+  }
+
+  copy_entry(filesystem, copy, source, layer);
+  add_entry(filesystem, dir, copy);
+
+  JOURNAL_PATHS(filesystem, C_CP, arg, dest);
+
+  return 1;
+}
+
+
+/*
+ * Takes the snapshot called name of the tree of the unix variable sent
+ * in, for snapshot(). The snapshots are the entries of a root of their
+ * own, which no path leads to.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int take_snapshot(Unix *filesystem, const char name[]) {
+
+  Tree *tree = filesystem->tree;
+  Container *old, *copy, *layer;
+  unsigned long len = strlen(name);
+
+  if (tree->snapshots == NULL && (tree->snapshots = new_root(filesystem))
+      == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  /* Removed first, so a layer only it read isn't kept for the copy */
+  old = index_lookup(filesystem, tree->snapshots, name, len);
+
+  if (old != NULL) {
+    unlink_entry(filesystem, tree->snapshots, old);
+    remove_container(filesystem, old);
+  }
+
+  if (!layer_for(filesystem, tree->root, &layer)
+      || (copy = new_entry(filesystem, name, len, U_DIR)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  if (!make_room(filesystem, tree->snapshots, copy->level)) {
+    print_error(filesystem, NO_MEMORY);
+    free_container(filesystem, copy);
+    return 0;
+  }
+
+  copy_entry(filesystem, copy, tree->root, layer);
+  add_entry(filesystem, tree->snapshots, copy);
+
+  JOURNAL_NAME(filesystem, C_SNAPSHOT, name);
+
+  return 1;
+}
+
+
+/*
+ * Makes a new root that is a copy of the snapshot called name the root
+ * of the tree of the unix variable sent in, for restore(). The old root
+ * is deleted, or kept for the layers of it that snapshots still read.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int restore_snapshot(Unix *filesystem, const char name[]) {
+
+  Tree *tree = filesystem->tree;
+  Container *source, *root, *layer;
+
+  if (tree->snapshots == NULL)
+    return 0;
+
+  source = index_lookup(filesystem, tree->snapshots, name, strlen(name));
+
+  if (source == NULL)
+    return 0;
+
+  if (!layer_for(filesystem, source, &layer)
+      || (root = new_root(filesystem)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  copy_entry(filesystem, root, source, layer);
+  replace_root(filesystem, root);
+
+  JOURNAL_NAME(filesystem, C_RESTORE, name);
+
+  return 1;
+}
+
+
+/*
+ * Checks if name can be the name of a snapshot: it isn't empty, has no
+ * "/" and isn't "." or ".."
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+static int is_name(const char name[]) {
+  return name[0] != '\0' && strchr(name, '/') == NULL
+    && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+
+/*
+ * Checks, without locks, if the entry of dir called name, of length len,
+ * or one of the directories above it on the way down to it, still has
+ * to be frozen into the newest layer of the directory it is in
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+static int needs_freeze(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len) {
+
+  Share *share;
+  Container *layer;
+
+  for (;;) {
+
+    share = share_of(dir);
+    layer = share != NULL ? LINK(share->layer) : NULL;
+
+    if (layer != NULL && index_lookup(filesystem, layer, name, len) == NULL)
+      return 1;
+
+    if (dir->type == U_ROOT)
+      return 0;
+
+    name = dir->name;
+    len = dir->name_len;
+    dir = dir->parent;
+  }
+}
+
+
+/*
+ * Freezes the entry of dir called name, of length len, into the newest
+ * layer of dir, if it has one the entry isn't frozen into yet: the
+ * layer is given a copy of the entry, or an entry that hides the name
+ * if dir shows none. The caller holds the lock on copies.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int freeze(Unix *filesystem, Container *dir, const char name[],
+		  unsigned long len) {
+
+  Share *share = share_of(dir);
+  Container *layer = share != NULL ? LINK(share->layer) : NULL, *source;
+  Container *hidden;
+
+  if (layer == NULL || index_lookup(filesystem, layer, name, len) != NULL)
+    return 1;
+
+  source = view_lookup(filesystem, dir, name, len);
+
+  if (source != NULL)
+    return copy_into(filesystem, layer, source) != NULL;
+
+  hidden = new_entry(filesystem, name, len, U_HIDDEN);
+
+  if (hidden == NULL || !make_room(filesystem, layer, hidden->level)) {
+    print_error(filesystem, NO_MEMORY);
+    if (hidden != NULL)
+      free_container(filesystem, hidden);
+    return 0;
+  }
+
+  place_entry(filesystem, layer, hidden);
+
+  return 1;
+}
+
+
+/*
+ * Links a copy of source into dir, a copy or layer that shows source
+ * through its origin, without changing what dir shows or its totals.
+ * The caller holds the lock on copies, and the lock of dir if it is in
+ * the tree.
+ *
+ * Returns the copy, or NULL if memory couldn't be allocated
+ */
+static Container *copy_into(Unix *filesystem, Container *dir,
+			    Container *source) {
+
+  Container *copy, *layer;
+
+  if (!layer_for(filesystem, source, &layer)
+      || (copy = new_entry(filesystem, source->name, source->name_len,
+			   source->type)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
+  }
+
+  if (!make_room(filesystem, dir, copy->level)) {
+    print_error(filesystem, NO_MEMORY);
+    free_container(filesystem, copy);
+    return NULL;
+  }
+
+  copy_entry(filesystem, copy, source, layer);
+  place_entry(filesystem, dir, copy);
+
+  STATS_ADD(filesystem, copied, 1);
+
+  return copy;
+}
+
+
+/*
+ * Finds the layer a copy of source in the tree of the unix variable
+ * sent in is to have as its origin, into layer: the newest layer of
+ * source while nothing is frozen into it, and a new one otherwise,
+ * which the one before it then has as its origin, so it goes on showing
+ * the same. A layer no copy reads is retired instead. A file, or a
+ * directory that shows nothing, needs none, and layer is NULL.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int layer_for(Unix *filesystem, Container *source, Container **layer) {
+
+  Share *share = share_of(source), *layer_share;
+  Container *newest, *made;
+
+  *layer = NULL;
+
+  if (source->directory == NULL || source->directory->shown == 0)
+    return 1;
+
+  if (share == NULL) {
+
+    share = new_share(filesystem, 0);
+
+    if (share == NULL)
+      return 0;
+
+    SET_LINK(source->directory->share, share);
+  }
+
+  newest = LINK(share->layer);
+
+  if (newest != NULL && LINK(newest->sub_dir) == NULL) {
+    *layer = newest;
+    return 1;
+  }
+
+  layer_share = new_share(filesystem, 1);
+  made = layer_share != NULL ? new_root(filesystem) : NULL;
+
+  if (made == NULL) {
+    if (layer_share != NULL)
+      tree_free(filesystem, layer_share, sizeof(Share));
+    return 0;
+  }
+
+  SET_LINK(made->directory->share, layer_share);
+  SET_LINK(made->directory->origin, source);
+  share->refs++;
+  atomic_fetch_add(&filesystem->tree->layers, 1);
+
+  if (newest != NULL && share_of(newest)->refs == 0)
+    drop_layer(filesystem, newest);
+  else if (newest != NULL) {
+    SET_LINK(newest->directory->origin, made);
+    layer_share->refs++;
+    share->refs--;
+  }
+
+  SET_LINK(share->layer, made);
+  *layer = made;
+
+  return 1;
+}
+
+
+/*
+ * Makes copy, a container about to be linked into the tree of the unix
+ * variable sent in, a copy of source. It takes the totals of source and
+ * shares its contents, and with layer, from layer_for(), shows what
+ * source does.
+ */
+static void copy_entry(Unix *filesystem, Container *copy, Container *source,
+		       Container *layer) {
+
+  (void) filesystem;
+
+  if (source->directory != NULL) {
+    copy->directory->files = source->directory->files;
+    copy->directory->dirs = source->directory->dirs;
+    copy->directory->shown = source->directory->shown;
+  }
+  copy->bytes = source->bytes;
+
+  if (source->contents != NULL) {
+    atomic_fetch_add(&source->contents->refs, 1);
+    copy->contents = source->contents;
+  }
+
+  if (layer == NULL)
+    return;
+
+  SET_LINK(copy->directory->origin, layer);
+  share_of(layer)->refs++;
+}
+
+
+/*
+ * Lets go of origin, which a copy or layer being deleted from the tree
+ * of the unix variable sent in had as its origin. A layer nothing reads
+ * any more is deleted, unless it is the newest of a directory still in
+ * the tree, which may make copies again, and a directory rm removed that
+ * nothing is made of any more is deleted too. The caller holds the lock
+ * on copies.
+ */
+static void release(Unix *filesystem, Container *origin) {
+
+  Share *share = share_of(origin), *source_share;
+  Container *source;
+
+  if (--share->refs > 0)
+    return;
+
+  if (!share->is_layer) {
+    if (share->orphan)
+      orphan(filesystem, origin);
+    return;
+  }
+
+  source = LINK(origin->directory->origin);
+  source_share = source != NULL ? share_of(source) : NULL;
+
+  /* Commands may still be looking the newest layer up */
+  if (source_share != NULL && LINK(source_share->layer) == origin
+      && !source_share->orphan) {
+    drop_layer(filesystem, origin);
+    return;
+  }
+
+  if (source_share != NULL && LINK(source_share->layer) == origin)
+    SET_LINK(source_share->layer, NULL);
+
+  orphan(filesystem, origin);
+}
+
+
+/*
+ * Takes layer, which no copy reads, off the directory it was made of,
+ * which then has no layer, and retires it. It lets go of that directory
+ * at once, since the directory may move to another block before the
+ * layer is deleted. The caller holds the lock on copies.
+ */
+static void drop_layer(Unix *filesystem, Container *layer) {
+
+  Container *source = LINK(layer->directory->origin);
+  Share *share = share_of(source);
+
+  SET_LINK(share->layer, NULL);
+  SET_LINK(layer->directory->origin, NULL);
+  share->refs--;
+
+  remove_container(filesystem, layer);
+}
+
+
+/*
+ * Puts container, which nothing reads any more, on the list of the
+ * containers of the tree of the unix variable sent in that delete()
+ * deletes next. The caller holds the lock on copies.
+ */
+static void orphan(Unix *filesystem, Container *container) {
+
+  container->prev = filesystem->tree->orphans;
+  filesystem->tree->orphans = container;
+}
+
+
+/*
+ * Allocates a record of copies from the arena of the unix variable sent
+ * in, for a layer if is_layer is non-zero, with nothing made of it
+ *
+ * Returns the record, or NULL if memory couldn't be allocated
+ */
+static Share *new_share(Unix *filesystem, int is_layer) {
+
+  Share *share = tree_alloc(filesystem, sizeof(Share));
+
+  if (share == NULL)
+    return NULL;
+
+  atomic_init(&share->layer, NULL);
+  share->refs = 0;
+  share->is_layer = is_layer;
+  share->orphan = 0;
+
+  return share;
+}
+
+
+/*
+ * Returns the record of the copies of container, or NULL if it has
+ * none, which a file never has
+ */
+static Share *share_of(Container *container) {
+  return container->directory != NULL
+    ? LINK(container->directory->share) : NULL;
+}
+
+
+/*
+ * Compares the names of two entries in the same order as strcmp()
+ *
+ * Returns a negative value, zero or a positive value if the name of
+ * first sorts before, equal to or after that of second
+ */
+static int compare_entries(Container *first, Container *second) {
+
+  unsigned long shorter = first->name_len < second->name_len
+    ? first->name_len : second->name_len;
+  int result = memcmp(first->name, second->name, shorter);
+
+  if (result != 0 || first->name_len == second->name_len)
+    return result;
+
+  return first->name_len < second->name_len ? -1 : 1;
+}
@@ -0,0 +1,73 @@
+/*
+ * unix-copy.h
+ *
+ * Header file for the copies cp makes in a Unix filesystem.
+ *
+ * Copying a directory copies nothing below it. The copy gets a layer
+ * of the directory it was copied from: a directory outside the tree
+ * whose origin is that directory, and which starts out empty. What a
+ * directory shows is its own entries followed by what its origin shows,
+ * an own entry hiding the one of the origin with the same name, so the
+ * copy shows what the directory it was copied from does. Its totals are
+ * those of that directory, so du and count need nothing more.
+ *
+ * Before a directory with a layer changes an entry, the entry is frozen
+ * into the layer: the layer is given a copy of it as it is, or an entry
+ * that hides the name when it doesn't exist yet. A change below a
+ * directory freezes the entry on the way down to it in the layer of
+ * every directory above it that has one. Layers only get the entries
+ * that change, so however many entries those directories hold, a
+ * change below a snapshot copies one entry for each directory on its
+ * way down, and later changes on the same way down copy nothing.
+ *
+ * A command changes a copy through entries of its own: each directory
+ * on the way down to the change is given a copy of the entry it only
+ * shows through its origin, and nothing else. An rm in a directory
+ * that shows entries of its origin leaves an entry that hides the name.
+ * A copied file shares the contents of its origin until either of them
+ * is written to.
+ *
+ * Once a layer has had entries frozen into it, a later copy gets a new
+ * layer, which the one before it now has as its origin, so every copy
+ * keeps seeing what it was copied from. A layer no copy reads anymore
+ * is deleted, and a directory rm removes while layers are still made of
+ * it is kept for them and deleted with the last of them.
+ */
+
+#include "unix-datastructure.h"
+
+/* Levels of layers a view keeps the place in before it allocates
+   room for more */
+#define VIEW_CHAIN 8
+
+typedef struct share {
+  Link layer;			/* newest layer made of it, or NULL */
+  unsigned long refs;		/* directories whose origin it is */
+  int is_layer;			/* it is a layer itself */
+  int orphan;			/* removed, and kept for its layers */
+} Share;
+
+/* What a directory shows, read in sorted order: the next entry of the
+   directory and of each layer below it. More levels than fit at are
+   kept in more */
+typedef struct view {
+  Container * at[VIEW_CHAIN];
+  Container ** more;
+  int count;			/* levels of the view */
+} View;
+
+/* The next entries of the levels of a view, wherever they are kept */
+#define VIEW_HEADS(view) ((view)->more != NULL ? (view)->more : (view)->at)
+
+int view_open(Unix *filesystem, View *view, Container *dir,
+	      const char prefix[], unsigned long len);
+Container *view_next(View *view);
+void view_close(View *view);
+Container *view_lookup(Unix *filesystem, Container *dir, const char name[],
+		       unsigned long len);
+int has_entries(Container *dir);
+Container *own_entry(Unix *filesystem, Container *dir, const char name[],
+		     unsigned long len);
+int unshare(Unix *filesystem, Container *dir, const char name[],
+	    unsigned long len);
+int let_go(Unix *filesystem, Container *container);
@@ -7,23 +7,300 @@
  * (c) Ernest Essuah Mensah
  */
 
+#ifndef UNIX_DATASTRUCTURE_H
+#define UNIX_DATASTRUCTURE_H
+
+#include <stdatomic.h>
+
 struct Container;
 
-enum Type {U_ROOT, U_FILE, U_DIR};
+/* U_HIDDEN is an entry of a copy or layer that hides the name from
+   what its origin shows, and holds nothing */
+enum Type {U_ROOT, U_FILE, U_DIR, U_HIDDEN};
 
 /* A container is the "superclass" of what an element
  * of the Unix filesystem can contain.
+ *
+ * The entries of a directory (or the root) are kept in a sorted doubly
+ * linked list starting at sub_dir, and are also hashed by name into an
+ * open-addressing table so lookups don't have to walk the list.
+ *
+ * The sorted list is the bottom level of a skip list: an entry linked on
+ * more than one level keeps its upper links in forward, and the directory
+ * keeps the first entry of each upper level in skip_head, so a sorted
+ * position is found in O(log n) expected steps.
+ *
+ * A container is a single allocation: the upper skip-list links are
+ * stored inline at the end, followed by the name. The hash and length
+ * of the name are kept next to the links so most mismatches are
+ * rejected without reading the name. A rename to a name that doesn't
+ * fit there gives the name a block of its own instead of moving the
+ * container, so its address, which its entries keep as their parent,
+ * never changes. What only a directory needs, its index and
+ * skip-list heads among it, is a second allocation the directory points
+ * to, so a file with a short name fits a 128-byte block.
+ *
+ * Lookups, listings and walks follow the links and the index without
+ * locks while threads run, so those are atomic: a container is fully built
+ * before the store that links it in.
  */
+typedef _Atomic(struct container *) Link;
+
+/* A piece of the contents of a file. The chunks of a file hold its
+   bytes in order, each up to the size it was allocated with. Contents
+   copied from others share the chunks they haven't written to, which
+   sit at the same place in all of them */
+typedef struct chunk {
+  _Atomic unsigned long refs;	/* contents sharing it */
+  unsigned long start;		/* offset of its first byte in the file */
+  unsigned long len;		/* bytes of data in use */
+  unsigned long size;		/* bytes data can hold */
+  char data[];
+} Chunk;
+
+/* The contents of a file, which only a file that has been written to
+   has. They are guarded by the lock of its directory. Copies of a file
+   share them until one of the files is written to, and so does a cat
+   printing them. */
+typedef struct contents {
+  Chunk * first;		/* the chunk while there is one */
+  Chunk ** table;		/* the chunks in order, searched for an
+				   offset, or NULL while there is one */
+  unsigned long table_size;	/* chunks the table has room for */
+  unsigned long len;		/* bytes in all of the chunks */
+  unsigned long chunks;
+  _Atomic unsigned long refs;	/* files sharing them */
+} Contents;
+
+/* What a directory copied by cp keeps about its layers, defined in
+   unix-copy.h */
+struct share;
+
+/* A place in the order of the directories of a tree, described in
+   unix-order.h: a node of the balanced tree the order is kept in. A
+   directory has one where it starts and one where it ends */
+typedef struct mark {
+  struct mark * parent;		/* in the balanced tree, or NULL */
+  struct mark * left;		/* the marks before it below it */
+  struct mark * right;		/* the marks after it below it */
+  unsigned long size;		/* marks below it and itself, or 0 while
+				   it isn't in the order */
+} Mark;
+
+/* The hash index of a directory. It is replaced whole when it grows,
+   so a lookup always sees a size that matches its slots */
+typedef struct index {
+  unsigned long size;		/* number of slots, always a power of two */
+  Link slots[];
+} Index;
+
+/* What only a directory has: its entries and what is kept about them,
+   its copies and its place in the order of the directories. It is
+   allocated apart from the container, so a file, which has none, is
+   that much smaller. */
+typedef struct directory {
+  _Atomic(Index *) index;	/* hash table of the entries, or NULL */
+  unsigned long index_used;	/* live entries plus deleted markers */
+  unsigned long entries;	/* entries of its own */
+  unsigned long shown;		/* entries it shows: those of its own
+				   and of its origin that aren't hidden */
+  _Atomic unsigned long files;	/* files anywhere below */
+  _Atomic unsigned long dirs;	/* directories anywhere below */
+  Link origin;			/* layer a copy shows the entries of
+				   besides its own, or NULL */
+  _Atomic(struct share *) share; /* its layers, or NULL */
+  _Atomic(Link *) skip_head;	/* first entry of each upper level */
+  int skip_levels;		/* skip-list levels used by the entries */
+  int unlinked;			/* its rm is in the journal */
+  Mark marks[2];		/* its start and end in the order of the
+				   directories */
+  _Atomic unsigned long lock;	/* held to change its entries, and
+				   shared to read what changes with them */
+} Directory;
+
 typedef struct container {
-  char * name;
+  unsigned long id;		/* never reused by another container */
   struct container * parent;
-  struct container * next;
+  struct container * prev;
+  Link next;
   enum Type type;
-  struct container * sub_dir;
+  _Atomic int removed;		/* set once rm takes it out of the tree */
+  Link sub_dir;
+  _Atomic unsigned long bytes;	/* bytes of the contents of the files
+				   below, or of its own for a file */
+  Contents * contents;		/* of a file, or NULL */
+  Directory * directory;	/* of a directory, or NULL for a file */
+  int level;			/* skip-list levels this entry is on */
+  _Atomic int adding;		/* commands adding to its totals */
+  unsigned long hash;		/* hash of the name */
+  unsigned long name_len;	/* length of the name */
+  char * name;			/* the name, after the links unless a
+				   rename gave it a block of its own */
+  Link forward[];		/* links above the sorted list */
 } Container;
 
-/* Definition for a Unix filesystem variable */
-typedef struct unix {
+/* Number of entries in the lookup cache of a filesystem */
+#define DCACHE_SIZE 4096
+
+/* Number of words the name of an entry of the lookup cache fills */
+#define DCACHE_WORDS 5
+
+/* Longest name the lookup cache holds */
+#define DCACHE_NAME_MAX (DCACHE_WORDS * sizeof(unsigned long))
+
+/* An entry of the lookup cache: the result of looking up name in the
+ * directory with the given id. A NULL container records that the name
+ * doesn't exist there. Threads read an entry without locks and check
+ * seq before and after, which is odd while the entry is being changed
+ * and grows each time it is.
+ */
+typedef struct dentry {
+  _Atomic unsigned long seq;	/* changes of the entry, times two */
+  _Atomic unsigned long dir_id;	/* 0 for an unused entry */
+  _Atomic unsigned long hash;	/* hash of the name */
+  Link container;		/* what the name resolves to, or NULL */
+  _Atomic unsigned long len;	/* length of the name */
+  _Atomic unsigned long name[DCACHE_WORDS]; /* the name, zero padded */
+} Dentry;
+
+/* Number of block sizes the arena hands out from its slabs: 16, 32,
+   64, ... up to 2048 bytes */
+#define ARENA_CLASSES 8
+
+/* An arena owns all the memory of a filesystem. Small blocks are carved
+ * out of large slabs and go back on a free list for their size class
+ * when released, bigger blocks are allocated on their own and chained
+ * together, so the whole filesystem can be dropped by releasing the
+ * slabs and that chain.
+ */
+typedef struct arena {
+  void * slabs;			/* chain of slabs, newest first */
+  char * bump;			/* start of the unused part of the newest slab */
+  unsigned long bump_left;	/* bytes left in the newest slab */
+  void * free_list[ARENA_CLASSES]; /* released blocks of each size class */
+  void * large;			/* chain of blocks bigger than any class */
+  unsigned long in_use;		/* bytes of the blocks handed out */
+  unsigned long reserved;	/* bytes obtained from malloc */
+} Arena;
+
+/* Free blocks of each size class of the arena that a session keeps for
+   its own commands, so threads allocating at the same time only take
+   the lock on the arena to fill or empty it. They count as in use by
+   the arena. */
+typedef struct cache {
+  void * free_list[ARENA_CLASSES];
+  unsigned int count[ARENA_CLASSES];
+} Cache;
+
+/* Commands whose calls and latencies are counted */
+enum Command {C_TOUCH, C_MKDIR, C_CD, C_LS, C_RM, C_PWD, C_DU, C_FIND,
+	      C_TREE, C_COUNT, C_COMPLETE, C_WRITE, C_APPEND, C_CAT, C_CP,
+	      C_SNAPSHOT, C_RESTORE, C_SNAPSHOTS, C_MV, C_COMMANDS};
+
+/* Number of latency buckets kept per command. Bucket i counts the
+   calls that took less than 2^(i + 1) nanoseconds */
+#define STATS_BUCKETS 32
+
+/* Counters of the work done by a filesystem, kept while enabled.
+   Threads add to them without locks, so a read of one while threads
+   run may be a little behind. */
+typedef struct stats {
+  _Atomic unsigned long calls[C_COMMANDS];
+  _Atomic unsigned long latency[C_COMMANDS][STATS_BUCKETS];
+  _Atomic unsigned long comparisons; /* names compared during lookups */
+  _Atomic unsigned long visited; /* containers and index slots looked
+				    at */
+  _Atomic unsigned long copied;	/* entries copied into layers and
+				   copies */
+} Stats;
+
+/* Where the output of the commands goes. It collects in buffer and is
+ * written to fd in large writes; with an fd of -1 it is kept in memory
+ * instead, with the buffer growing to hold all of it.
+ */
+typedef struct sink {
+  int fd;			/* file descriptor written to, or -1 */
+  int failed;			/* a write failed since the last flush */
+  char * buffer;
+  unsigned long used;		/* bytes waiting in the buffer */
+  unsigned long size;		/* bytes the buffer can hold */
+} Sink;
+
+/* A journal logs the commands that changed a filesystem since its image
+ * was last saved, so the tree can be rebuilt after a crash by loading
+ * the image and running them again. Records collect in memory in batch
+ * and are handed over to out to be written and synced to disk a batch
+ * at a time. The records are counted as they are added, so a command
+ * knows once the sync of its own has been done.
+ */
+typedef struct journal {
+  Sink batch;			/* records waiting to be synced */
+  Sink out;			/* the batch being written to the file */
+  char * image;			/* file the tree is checkpointed to */
+  unsigned long long generation; /* checkpoints taken of the tree */
+  unsigned long long appended;	/* records added to it */
+  unsigned long long synced;	/* of those, the ones on disk */
+  unsigned long records;	/* records since the last checkpoint */
+  int failed;			/* records were lost since the last
+				   checkpoint */
+  unsigned long removal;	/* epoch the last directory rm was
+				   recorded in */
+} Journal;
+
+/* The locks of a tree, defined in unix-lock.h */
+struct locks;
+
+/* The workers of a tree, defined in unix-pool.h */
+struct pool;
+
+/* The tree of a filesystem and everything kept about it, shared by
+ * every session working on it
+ */
+typedef struct tree {
   struct container * root;
-  struct container * curr_dir;
+  unsigned long seed;		/* seed of the next session's levels */
+  Arena arena;			/* memory of every container and name */
+  _Atomic unsigned long next_id; /* id of the next container created */
+  Dentry * dcache;		/* recent lookups by directory and name */
+  Stats * stats;		/* counters, or NULL when disabled */
+  const char * image;		/* image mapped in place of the tree, or NULL */
+  unsigned long image_size;	/* bytes of the mapped image */
+  Journal * journal;		/* log of the changes, or NULL */
+  struct unix * sessions;	/* every session on the tree */
+  struct locks * locks;		/* locks for threads, or NULL */
+  struct pool * pool;		/* workers for recursive commands, or NULL */
+  _Atomic unsigned long layers;	/* layers of directories copies were
+				   made of */
+  _Atomic unsigned long freezes; /* odd while entries are frozen into
+				   layers */
+  struct container * orphans;	/* removed containers to delete next */
+  struct container * snapshots;	/* root the snapshots are entries of,
+				   or NULL */
+  Mark * order;			/* top of the order of the directories,
+				   or NULL */
+} Tree;
+
+/* Definition for a Unix filesystem variable. Each one is a session on
+ * a tree, with a current directory and output of its own, so several
+ * can work on the same tree, each from a thread of its own once
+ * enable_threads() has been called.
+ */
+typedef struct unix {
+  Tree * tree;
+  struct container * curr_dir;	/* as the running command found it */
+  _Atomic(struct container *) shared_dir; /* curr_dir as rm moves it */
+  _Atomic unsigned long epoch;	/* epoch the running command entered, or 0 */
+  Sink out;			/* output of the commands */
+  char * path;			/* absolute path of curr_dir, when valid */
+  unsigned long path_len;	/* length of the path */
+  unsigned long path_size;	/* bytes allocated for the path */
+  int path_valid;		/* zero when the path has to be rebuilt */
+  unsigned long image_dir;	/* node of the current directory in an image */
+  unsigned long seed;		/* state for picking skip-list levels */
+  unsigned long long journaled;	/* records the journal had after the last
+				   change of the running command, or 0 */
+  Cache cache;			/* blocks of the arena kept for its commands */
+  struct unix * next_session;	/* next session on the same tree */
 } Unix;
+
+#endif
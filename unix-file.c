@@ -0,0 +1,623 @@
+/*
+ * unix-file.c
+ *
+ * This file contains the commands that write and print the contents of
+ * the files of a simulated Unix filesystem: write_file, append_file
+ * and cat. They aren't called write and append so they stay clear of
+ * the write() of the C library.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unix.h"
+#include "unix-copy.h"
+#include "unix-file.h"
+#include "unix-image.h"
+#include "unix-journal.h"
+#include "unix-lock.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+
+/* Bytes the smallest and the biggest chunk are allocated with. Chunks
+   past the biggest size class of the arena have blocks of their own,
+   and a write to a file sharing its chunks copies a chunk at most */
+#define CHUNK_MIN_BLOCK 64
+#define CHUNK_MAX_BLOCK (64 * 1024)
+
+/* Chunks the first table of a file has room for */
+#define CHUNK_TABLE_MIN 8
+
+static int change_contents(Unix *filesystem, const char arg[],
+			   enum Command command, unsigned long offset,
+			   const char data[], unsigned long len);
+static int print_contents(Unix *filesystem, const char arg[]);
+static int extend(Unix *filesystem, Contents *contents, const char data[],
+		  unsigned long len);
+static int table_add(Unix *filesystem, Contents *contents, Chunk *chunk);
+static unsigned long find_chunk(const Contents *contents,
+				unsigned long offset);
+static Chunk *own_chunk(Unix *filesystem, Contents *contents,
+			unsigned long index);
+static Contents *new_contents(Unix *filesystem);
+static Contents *unshare_contents(Unix *filesystem, Container *file);
+
+
+/*
+ * Writes the len bytes of data into the file at the path arg of the
+ * unix variable sent in, starting offset bytes into it, over what is
+ * there and on past its end. A file that doesn't exist is created, and
+ * a gap between its end and offset reads as zeros.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int write_file(Unix *filesystem, const char arg[], unsigned long offset,
+	       const char data[], unsigned long len) {
+  return change_contents(filesystem, arg, C_WRITE, offset, data, len);
+}
+
+
+/*
+ * Adds the len bytes of data to the end of the file at the path arg of
+ * the unix variable sent in, which is created if it doesn't exist
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int append_file(Unix *filesystem, const char arg[], const char data[],
+		unsigned long len) {
+  return change_contents(filesystem, arg, C_APPEND, 0, data, len);
+}
+
+
+/*
+ * Prints the contents of the file at the path arg of the unix variable
+ * sent in, as they are, with nothing after them
+ *
+ * Returns 1 if successful, 0 if there is no file at the path
+ */
+int cat(Unix *filesystem, const char arg[]) {
+
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || arg == NULL)
+    return 0;
+
+  enter_tree(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  /* A mapped image is read in place */
+  if (filesystem->tree->image != NULL)
+    result = image_cat(filesystem, arg);
+  else
+    result = print_contents(filesystem, arg);
+
+  sink_flush(&filesystem->out);
+
+  result = STATS_END(filesystem, C_CAT, start, result);
+  leave_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Writes the len bytes of data into file, which the caller has locked,
+ * starting offset bytes into it. Only its contents change: the totals
+ * of the directories above it are left to the caller.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+int contents_write(Unix *filesystem, Container *file, unsigned long offset,
+		   const char data[], unsigned long len) {
+
+  Contents *contents = file->contents;
+  Chunk *chunk;
+  unsigned long index, skip, count;
+
+  if (contents == NULL) {
+
+    contents = new_contents(filesystem);
+
+    if (contents == NULL)
+      return 0;
+
+    file->contents = contents;
+  }
+
+  /* Copies of the file go on with the chunks as they were */
+  if (atomic_load(&contents->refs) > 1) {
+
+    contents = unshare_contents(filesystem, file);
+
+    if (contents == NULL)
+      return 0;
+  }
+
+  /* Overwrite the chunks the bytes fall in, and only those */
+  if (offset < contents->len) {
+
+    index = find_chunk(contents, offset);
+    skip = offset - CONTENTS_CHUNK(contents, index)->start;
+
+    for (; len > 0 && index < contents->chunks; index++) {
+
+      chunk = own_chunk(filesystem, contents, index);
+
+      if (chunk == NULL)
+	return 0;
+
+      count = chunk->len - skip < len ? chunk->len - skip : len;
+      memcpy(chunk->data + skip, data, count);
+
+      data += count;
+      len -= count;
+      offset += count;
+      skip = 0;
+    }
+  }
+
+  if (offset > contents->len
+      && !extend(filesystem, contents, NULL, offset - contents->len))
+    return 0;
+
+  return extend(filesystem, contents, data, len);
+}
+
+
+/*
+ * Lets go of contents, which a file that is being deleted had
+ *
+ * Returns 1 if no other file shares them, so they can be freed, 0
+ * otherwise
+ */
+int contents_unref(Contents *contents) {
+  return atomic_fetch_sub(&contents->refs, 1) == 1;
+}
+
+
+/*
+ * Frees contents and their table once contents_unref() has found
+ * nothing else uses them, and the chunks no other contents share
+ */
+void contents_free(Unix *filesystem, Contents *contents) {
+
+  Chunk *chunk;
+  unsigned long index;
+
+  for (index = 0; index < contents->chunks; index++) {
+
+    chunk = CONTENTS_CHUNK(contents, index);
+
+    if (chunk_unref(chunk))
+      tree_free(filesystem, chunk, CHUNK_BYTES(chunk));
+  }
+
+  if (contents->table != NULL)
+    tree_free(filesystem, contents->table,
+	      contents->table_size * sizeof(Chunk *));
+
+  tree_free(filesystem, contents, sizeof(Contents));
+}
+
+
+/*
+ * Lets go of chunk, which contents that are being freed had
+ *
+ * Returns 1 if no other contents share it, so it can be freed, 0
+ * otherwise
+ */
+int chunk_unref(Chunk *chunk) {
+  return atomic_fetch_sub(&chunk->refs, 1) == 1;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Writes the len bytes of data into the file at the path arg of the
+ * unix variable sent in, for write_file() at offset and for
+ * append_file() at its end. The contents are changed under the lock of
+ * the directory of the file, which rm takes to unlink it, so a file
+ * that has been removed meanwhile is left alone and the journal gets
+ * the records of both in the order they happened.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int change_contents(Unix *filesystem, const char arg[],
+			   enum Command command, unsigned long offset,
+			   const char data[], unsigned long len) {
+
+  Container *parent, *file = NULL, *dir;
+  const char *name;
+  unsigned long long start;
+  unsigned long name_len, before;
+  int result;
+
+  if (filesystem == NULL || arg == NULL || (int)strlen(arg) == 0
+      || (data == NULL && len > 0))
+    return 0;
+
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (result) {
+
+    file = resolve_change(filesystem, arg, &parent, &name, &name_len);
+
+    if (file == NULL && add_path(filesystem, arg, U_FILE))
+      file = resolve_change(filesystem, arg, &parent, &name, &name_len);
+
+    result = file != NULL && file->type == U_FILE;
+  }
+
+  /* Copies of its directory go on without the change */
+  if (result)
+    result = unshare(filesystem, file->parent, file->name, file->name_len);
+
+  if (result) {
+
+    dir = file->parent;
+    lock_dir(filesystem, dir);
+
+    result = !file->removed;
+
+    if (result) {
+
+      before = file->contents != NULL ? file->contents->len : 0;
+
+      if (command == C_APPEND)
+	offset = before;
+
+      result = contents_write(filesystem, file, offset, data, len);
+
+      add_totals(filesystem, file, 0, 0,
+		 (long) (file->contents != NULL ? file->contents->len : 0)
+		 - (long) before);
+
+      if (result)
+	JOURNAL_CONTENTS(filesystem, command, arg, offset, data, len,
+			 file);
+    }
+
+    unlock_dir(filesystem, dir);
+  }
+
+  result = STATS_END(filesystem, command, start, result);
+  result = end_change(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Prints the contents of the file at the path arg of the unix variable
+ * sent in, handing SINK_IOV chunks at a time to its output. The
+ * contents are shared for as long as they are printed, the way a copy
+ * of the file shares them, so the lock of the directory isn't held
+ * while they are written out: a write meanwhile gets contents of its
+ * own.
+ *
+ * Returns 1 if successful, 0 if there is no file at the path
+ */
+static int print_contents(Unix *filesystem, const char arg[]) {
+
+  Container *parent, *file, *dir;
+  Contents *contents;
+  const char *name;
+  struct iovec iov[SINK_IOV];
+  unsigned long len, index, visited = 0;
+  Chunk *chunk;
+  int count = 0;
+
+  file = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  if (file == NULL || file->type != U_FILE)
+    return 0;
+
+  dir = file->parent;
+  lock_dir_shared(filesystem, dir);
+
+  contents = file->contents;
+  if (contents != NULL)
+    atomic_fetch_add(&contents->refs, 1);
+
+  unlock_dir(filesystem, dir);
+
+  for (index = 0; contents != NULL && index < contents->chunks; index++) {
+
+    chunk = CONTENTS_CHUNK(contents, index);
+    iov[count].iov_base = chunk->data;
+    iov[count++].iov_len = chunk->len;
+    visited++;
+
+    if (count == SINK_IOV) {
+      sink_writev(&filesystem->out, iov, count);
+      count = 0;
+    }
+  }
+
+  sink_writev(&filesystem->out, iov, count);
+
+  /* The file may have been written to or removed meanwhile */
+  if (contents != NULL && contents_unref(contents))
+    contents_free(filesystem, contents);
+
+  STATS_ADD(filesystem, visited, visited);
+
+  return 1;
+}
+
+
+/*
+ * Adds the len bytes of data to the end of contents, or len zeros if
+ * data is NULL, filling the last chunk before adding more. A last chunk
+ * other contents share is copied first.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int extend(Unix *filesystem, Contents *contents, const char data[],
+		  unsigned long len) {
+
+  Chunk *chunk = NULL;
+  unsigned long block, count;
+
+  if (len > 0 && contents->chunks > 0) {
+
+    chunk = CONTENTS_CHUNK(contents, contents->chunks - 1);
+
+    if (chunk->len < chunk->size) {
+
+      chunk = own_chunk(filesystem, contents, contents->chunks - 1);
+
+      if (chunk == NULL)
+	return 0;
+    }
+  }
+
+  while (len > 0) {
+
+    if (chunk == NULL || chunk->len == chunk->size) {
+
+      /* Big enough for the rest, and at least twice the last chunk */
+      block = CHUNK_MIN_BLOCK;
+      while (block < CHUNK_MAX_BLOCK
+	     && (block < offsetof(Chunk, data) + len
+		 || (chunk != NULL && block < 2 * CHUNK_BYTES(chunk))))
+	block *= 2;
+
+      chunk = tree_alloc(filesystem, block);
+
+      if (chunk == NULL) {
+	print_error(filesystem, NO_MEMORY);
+	return 0;
+      }
+
+      atomic_init(&chunk->refs, 1);
+      chunk->start = contents->len;
+      chunk->len = 0;
+      chunk->size = block - offsetof(Chunk, data);
+
+      if (!table_add(filesystem, contents, chunk)) {
+	print_error(filesystem, NO_MEMORY);
+	tree_free(filesystem, chunk, block);
+	return 0;
+      }
+
+      if (contents->first == NULL)
+	contents->first = chunk;
+
+      contents->chunks++;
+    }
+
+    count = chunk->size - chunk->len < len ? chunk->size - chunk->len : len;
+
+    if (data != NULL) {
+      memcpy(chunk->data + chunk->len, data, count);
+      data += count;
+    } else
+      memset(chunk->data + chunk->len, 0, count);
+
+    chunk->len += count;
+    contents->len += count;
+    len -= count;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Adds chunk, about to go after the last chunk of contents, to the
+ * table of its chunks, growing the table when it is full. A lone chunk
+ * has no table.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int table_add(Unix *filesystem, Contents *contents, Chunk *chunk) {
+
+  Chunk **table;
+  unsigned long size;
+
+  if (contents->first == NULL)
+    return 1;
+
+  if (contents->chunks >= contents->table_size) {
+
+    size = contents->table_size > 0
+      ? 2 * contents->table_size : CHUNK_TABLE_MIN;
+    table = tree_alloc(filesystem, size * sizeof(Chunk *));
+
+    if (table == NULL)
+      return 0;
+
+    if (contents->table != NULL) {
+      memcpy(table, contents->table, contents->chunks * sizeof(Chunk *));
+      tree_free(filesystem, contents->table,
+		contents->table_size * sizeof(Chunk *));
+    } else
+      table[0] = contents->first;
+
+    contents->table = table;
+    contents->table_size = size;
+  }
+
+  contents->table[contents->chunks] = chunk;
+
+  return 1;
+}
+
+
+/*
+ * Returns the index of the chunk of contents holding the byte offset
+ * bytes into it, which is less than their length, found by bisecting
+ * its table
+ */
+static unsigned long find_chunk(const Contents *contents,
+				unsigned long offset) {
+
+  unsigned long low = 0, high = contents->chunks - 1, middle;
+
+  if (contents->table == NULL)
+    return 0;
+
+  /* The last chunk starting at or before offset */
+  while (low < high) {
+
+    middle = low + (high - low + 1) / 2;
+
+    if (contents->table[middle]->start <= offset)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+
+  return low;
+}
+
+
+/*
+ * Returns the chunk of contents at index, about to be written to, after
+ * giving contents a copy of their own if other contents share it
+ *
+ * Returns the chunk, or NULL if memory couldn't be allocated
+ */
+static Chunk *own_chunk(Unix *filesystem, Contents *contents,
+			unsigned long index) {
+
+  Chunk *shared = CONTENTS_CHUNK(contents, index), *chunk;
+
+  if (atomic_load(&shared->refs) == 1)
+    return shared;
+
+  chunk = tree_alloc(filesystem, CHUNK_BYTES(shared));
+
+  if (chunk == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
+  }
+
+  atomic_init(&chunk->refs, 1);
+  chunk->start = shared->start;
+  chunk->len = shared->len;
+  chunk->size = shared->size;
+  memcpy(chunk->data, shared->data, shared->len);
+
+  if (contents->table != NULL)
+    contents->table[index] = chunk;
+  if (index == 0)
+    contents->first = chunk;
+
+  /* The other contents may have been freed meanwhile */
+  if (chunk_unref(shared))
+    tree_free(filesystem, shared, CHUNK_BYTES(shared));
+
+  return chunk;
+}
+
+
+/*
+ * Allocates empty contents for one file
+ *
+ * Returns the contents, or NULL if memory couldn't be allocated
+ */
+static Contents *new_contents(Unix *filesystem) {
+
+  Contents *contents = tree_alloc(filesystem, sizeof(Contents));
+
+  if (contents == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
+  }
+
+  contents->first = NULL;
+  contents->table = NULL;
+  contents->table_size = 0;
+  contents->len = 0;
+  contents->chunks = 0;
+  atomic_init(&contents->refs, 1);
+
+  return contents;
+}
+
+
+/*
+ * Gives file, whose contents copies of it or a cat share, contents of
+ * its own that share the same chunks, and lets go of the shared ones.
+ * Only the table of the chunks is copied: a chunk is copied when it is
+ * written to.
+ *
+ * Returns the new contents, or NULL if memory couldn't be allocated
+ */
+static Contents *unshare_contents(Unix *filesystem, Container *file) {
+
+  Contents *shared = file->contents, *contents;
+  unsigned long index;
+
+  contents = new_contents(filesystem);
+
+  if (contents == NULL)
+    return NULL;
+
+  if (shared->table != NULL) {
+
+    contents->table = tree_alloc(filesystem,
+				 shared->table_size * sizeof(Chunk *));
+
+    if (contents->table == NULL) {
+      print_error(filesystem, NO_MEMORY);
+      tree_free(filesystem, contents, sizeof(Contents));
+      return NULL;
+    }
+
+    memcpy(contents->table, shared->table,
+	   shared->chunks * sizeof(Chunk *));
+    contents->table_size = shared->table_size;
+  }
+
+  contents->first = shared->first;
+  contents->len = shared->len;
+  contents->chunks = shared->chunks;
+
+  for (index = 0; index < contents->chunks; index++)
+    atomic_fetch_add(&CONTENTS_CHUNK(contents, index)->refs, 1);
+
+  file->contents = contents;
+
+  /* The last of the copies may have been written to meanwhile */
+  if (contents_unref(shared))
+    contents_free(filesystem, shared);
+
+  return contents;
+}
@@ -0,0 +1,31 @@
+/*
+ * unix-file.h
+ *
+ * Header file for the contents of the files of a Unix filesystem.
+ *
+ * The contents of a file are a list of chunks, each a block of the
+ * arena. Writing over part of a file changes the chunks that part lies
+ * in, and appending fills the last chunk and adds new ones after it, so
+ * neither copies the rest of the file. A new chunk is twice the size of
+ * the one before it, up to 64 KB, so a file grown a little at a time
+ * doesn't end up in many small chunks and a big one has few of them.
+ * Once a file has more than one chunk, a table of them in order is kept
+ * as well, and the chunk an offset falls in is found by bisecting it on
+ * the offset each chunk starts at. cat hands the chunks to the output
+ * as they are, sharing the contents while it does rather than holding
+ * the lock of the directory of the file.
+ *
+ * A file cp copies shares the contents of the file it was copied from.
+ * Whichever of them is written to first, or a file written to while a
+ * cat prints it, gets contents of its own that share the chunks, which
+ * costs a copy of the table, and the chunks the write touches are
+ * copied as it reaches them. The rest stay shared.
+ */
+
+#include "unix-datastructure.h"
+
+int contents_write(Unix *filesystem, Container *file, unsigned long offset,
+		   const char data[], unsigned long len);
+int contents_unref(Contents *contents);
+int chunk_unref(Chunk *chunk);
+void contents_free(Unix *filesystem, Contents *contents);
@@ -0,0 +1,186 @@
+/*
+ * unix-glob.c
+ *
+ * This file contains the matching of the names in a simulated Unix
+ * filesystem against the patterns of ls and rm.
+ */
+
+
+#include "unix-glob.h"
+
+static int match_one(const char pattern[], unsigned long len,
+		     unsigned long *at, char c);
+static int match_class(const char pattern[], unsigned long len,
+		       unsigned long *at, char c);
+
+
+/*
+ * Checks if the name sent in, of length len, holds a special character
+ * or an escaped one, which makes it a pattern rather than a name
+ *
+ * Returns 1 if it is a pattern, 0 otherwise
+ */
+int is_pattern(const char pattern[], unsigned long len) {
+
+  unsigned long i, at;
+
+  for (i = 0; i < len; i++) {
+
+    if (pattern[i] == '*' || pattern[i] == '?'
+	|| (pattern[i] == '\\' && i + 1 < len))
+      return 1;
+    else if (pattern[i] == '[') {
+
+      /* A bracket that is never closed is just a bracket */
+      at = i;
+      if (match_class(pattern, len, &at, '\0') >= 0)
+	return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * Returns the length of the literal prefix of pattern, of length len:
+ * the characters before the first one that is special or escaped,
+ * which every name it matches starts with
+ */
+unsigned long pattern_prefix(const char pattern[], unsigned long len) {
+
+  unsigned long i;
+
+  for (i = 0; i < len; i++)
+    if (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '['
+	|| pattern[i] == '\\')
+      break;
+
+  return i;
+}
+
+
+/*
+ * Matches name, of length name_len, against pattern, of length len.
+ * After a mismatch the last "*" seen takes one more character and the
+ * rest of the pattern is tried again from there. Going back no further
+ * than that is enough, and keeps a match within len times name_len
+ * steps.
+ *
+ * Returns 1 if name matches, 0 otherwise
+ */
+int match_pattern(const char pattern[], unsigned long len,
+		  const char name[], unsigned long name_len) {
+
+  unsigned long at = 0, i = 0, star = 0, star_i = 0, next;
+  int starred = 0;
+
+  while (i < name_len) {
+
+    if (at < len && pattern[at] == '*') {
+      star = ++at;
+      star_i = i;
+      starred = 1;
+      continue;
+    }
+
+    next = at;
+    if (at < len && match_one(pattern, len, &next, name[i])) {
+      at = next;
+      i++;
+      continue;
+    }
+
+    /* Nothing to go back to */
+    if (!starred)
+      return 0;
+
+    at = star;
+    i = ++star_i;
+  }
+
+  while (at < len && pattern[at] == '*')
+    at++;
+
+  return at == len;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Matches the character c against the part of pattern, of length len,
+ * that starts at at, and moves at past that part
+ *
+ * Returns 1 if c matches, 0 otherwise
+ */
+static int match_one(const char pattern[], unsigned long len,
+		     unsigned long *at, char c) {
+
+  int result;
+
+  if (pattern[*at] == '?') {
+    (*at)++;
+    return 1;
+  }
+
+  if (pattern[*at] == '[') {
+    result = match_class(pattern, len, at, c);
+    if (result >= 0)
+      return result;
+  }
+
+  if (pattern[*at] == '\\' && *at + 1 < len)
+    (*at)++;
+
+  return pattern[(*at)++] == c;
+}
+
+
+/*
+ * Matches the character c against the bracket expression of pattern,
+ * of length len, that starts at at. A "]" right after the opening
+ * bracket, or after the "!" or "^" that negates it, is one of its
+ * characters rather than its end.
+ *
+ * Returns 1 if c matches and moves at past the closing bracket, 0 if it
+ * doesn't, or -1 if the bracket is never closed
+ */
+static int match_class(const char pattern[], unsigned long len,
+		       unsigned long *at, char c) {
+
+  unsigned long i = *at + 1, first;
+  unsigned char low, high;
+  int negate = 0, found = 0;
+
+  if (i < len && (pattern[i] == '!' || pattern[i] == '^')) {
+    negate = 1;
+    i++;
+  }
+
+  for (first = i; i < len && (pattern[i] != ']' || i == first); ) {
+
+    if (pattern[i] == '\\' && i + 1 < len)
+      i++;
+    low = high = pattern[i++];
+
+    if (i + 1 < len && pattern[i] == '-' && pattern[i + 1] != ']') {
+      if (pattern[++i] == '\\' && i + 1 < len)
+	i++;
+      high = pattern[i++];
+    }
+
+    if (low <= (unsigned char) c && (unsigned char) c <= high)
+      found = 1;
+  }
+
+  if (i >= len)
+    return -1;
+
+  *at = i + 1;
+
+  return found != negate;
+}
@@ -0,0 +1,18 @@
+/*
+ * unix-glob.h
+ *
+ * Header file for the patterns ls and rm accept in the last component
+ * of a path: "*" matches any run of characters, "?" any one character
+ * and "[...]" any one of the characters in the brackets, which may
+ * hold ranges like "a-z" and start with "!" or "^" to match those not
+ * in them. A "\" takes the character after it literally.
+ *
+ * The entries of a directory are sorted, so those that can match a
+ * pattern all start with its literal prefix, the part before its first
+ * special character, and sit next to each other.
+ */
+
+int is_pattern(const char pattern[], unsigned long len);
+unsigned long pattern_prefix(const char pattern[], unsigned long len);
+int match_pattern(const char pattern[], unsigned long len,
+		  const char name[], unsigned long name_len);
@@ -0,0 +1,1293 @@
+/*
+ * unix-image.c
+ *
+ * This file contains the save and load commands, which write the tree
+ * of a simulated Unix filesystem to a binary image and build it back
+ * from one, and the reading of an image mapped into memory in place of
+ * the tree.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "unix.h"
+#include "unix-copy.h"
+#include "unix-file.h"
+#include "unix-glob.h"
+#include "unix-image.h"
+#include "unix-lock.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+
+#define ROOT "/"
+
+/* Returned by the lookups in a mapped image for a missing node */
+#define NO_NODE ((uint64_t) -1)
+
+/* A growing array the sections of an image are collected in */
+typedef struct buffer {
+  char * data;
+  unsigned long used;		/* bytes filled in */
+  unsigned long size;		/* bytes allocated */
+} Buffer;
+
+/* A directory collect_nodes() is inside of: the index of its node and
+   the view of what it shows, read up to the next entry to save */
+typedef struct frame {
+  uint64_t index;
+  View view;
+} Frame;
+
+static int collect_image(Unix *filesystem, Container *top,
+			 ImageHeader *header, Buffer sections[]);
+static int collect_nodes(Unix *filesystem, Container *root, Buffer *nodes,
+			 Buffer *children, Buffer *names, Buffer *contents);
+static int add_node(Buffer *nodes, Buffer *children, Buffer *names,
+		    Buffer *contents, Container *container, uint64_t parent);
+static int buffer_reserve(Buffer *buffer, unsigned long len);
+static int write_image(Unix *filesystem, const char file[],
+		       const char *parts[], const unsigned long lens[],
+		       int count);
+static int build_tree(Unix *filesystem, const char image[]);
+static int build_nodes(Unix *filesystem, const char image[],
+		       Container *containers[]);
+static char *read_file(Unix *filesystem, const char file[],
+		       unsigned long *size);
+static int check_header(const char image[], unsigned long size);
+static int check_image(const char image[], unsigned long size);
+static const ImageNode *image_node(Unix *filesystem, uint64_t index);
+static const char *image_name(Unix *filesystem, const ImageNode *node);
+static const char *image_contents(Unix *filesystem, const ImageNode *node);
+static uint64_t image_entry(Unix *filesystem, uint64_t dir, uint64_t at);
+static uint64_t image_lookup(Unix *filesystem, uint64_t dir,
+			     const char name[], unsigned long len,
+			     uint64_t *at);
+static uint64_t image_resolve(Unix *filesystem, const char path[],
+			      uint64_t *parent, const char **name,
+			      unsigned long *len);
+static unsigned long image_matches(Unix *filesystem, uint64_t dir,
+				   const char pattern[], unsigned long len,
+				   int prefix_only);
+static int compare_names(const char first[], unsigned long first_len,
+			 const char second[], unsigned long second_len);
+
+
+/*
+ * Writes every container of the unix variable sent in to the image
+ * file called file, replacing it only once the whole image is written.
+ * The snapshots, if there are any, go in as an image of their own
+ * between the child table and the name blob.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int save(Unix *filesystem, const char file[]) {
+
+  Buffer sections[8] = {{0}};
+  ImageHeader header, nested;
+  Container *snapshots;
+  const char *parts[10];
+  unsigned long lens[10];
+  int result = 0, count = 0, i;
+
+  if (filesystem == NULL || file == NULL || (int)strlen(file) == 0)
+    return 0;
+
+  lock_tree(filesystem);
+
+  snapshots = filesystem->tree->snapshots;
+
+  if (snapshots != NULL && LINK(snapshots->sub_dir) == NULL)
+    snapshots = NULL;
+
+  /* A mapped image already is the tree, apart from its generation */
+  if (filesystem->tree->image != NULL) {
+    memcpy(&header, filesystem->tree->image, sizeof(header));
+    header.generation = filesystem->tree->journal != NULL
+      ? filesystem->tree->journal->generation : 0;
+
+    parts[0] = (const char *) &header;
+    lens[0] = sizeof(header);
+    parts[1] = filesystem->tree->image + sizeof(header);
+    lens[1] = filesystem->tree->image_size - sizeof(header);
+    result = write_image(filesystem, file, parts, lens, 2);
+  } else if (!collect_image(filesystem, filesystem->tree->root, &header,
+			    sections)
+	     || (snapshots != NULL
+		 && !collect_image(filesystem, snapshots, &nested,
+				   sections + 4)))
+    print_error(filesystem, NO_MEMORY);
+  else {
+
+    parts[count] = (const char *) &header;
+    lens[count++] = sizeof(header);
+
+    for (i = 0; i < 2; i++) {
+      parts[count] = sections[i].data;
+      lens[count++] = sections[i].used;
+    }
+
+    if (snapshots != NULL) {
+
+      parts[count] = (const char *) &nested;
+      lens[count++] = sizeof(nested);
+      header.snapshots_size = sizeof(nested);
+
+      for (i = 4; i < 8; i++) {
+	parts[count] = sections[i].data;
+	lens[count++] = sections[i].used;
+	header.snapshots_size += sections[i].used;
+      }
+    }
+
+    for (i = 2; i < 4; i++) {
+      parts[count] = sections[i].data;
+      lens[count++] = sections[i].used;
+    }
+
+    result = write_image(filesystem, file, parts, lens, count);
+  }
+
+  unlock_tree(filesystem);
+
+  for (i = 0; i < 8; i++)
+    free(sections[i].data);
+
+  return result;
+}
+
+
+/*
+ * Replaces every container of the unix variable sent in with the tree
+ * in the image file called file. The root becomes the current
+ * directory. The tree is left as it is if the file isn't a valid
+ * image. A journal, if there is one, is checkpointed from the new tree.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int load(Unix *filesystem, const char file[]) {
+
+  unsigned long size;
+  char *image;
+  int result;
+
+  if (filesystem == NULL || file == NULL)
+    return 0;
+
+  image = read_file(filesystem, file, &size);
+
+  if (image == NULL || !check_image(image, size)) {
+    free(image);
+    return 0;
+  }
+
+  lock_tree(filesystem);
+
+  unmap_image(filesystem);
+  result = build_tree(filesystem, image);
+
+  if (!result)
+    print_error(filesystem, NO_MEMORY);
+
+  /* The journal starts over from the loaded tree, which isn't durable
+     until it does */
+  if (result && filesystem->tree->journal != NULL)
+    result = checkpoint(filesystem);
+
+  unlock_tree(filesystem);
+
+  free(image);
+
+  return result;
+}
+
+
+/*
+ * Maps the image file called file into memory in place of the tree of
+ * the unix variable sent in, with the root as the current directory of
+ * every session on it.
+ * Only the header is checked, the rest of the image is checked as it
+ * is read. The tree is left as it is if the file can't be mapped. A
+ * journal, if there is one, is checkpointed from the mapped tree.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int map_image(Unix *filesystem, const char file[]) {
+
+  void *image = MAP_FAILED;
+  off_t size;
+  int fd, result;
+
+  if (filesystem == NULL || file == NULL)
+    return 0;
+
+  fd = open(file, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+
+  size = lseek(fd, 0, SEEK_END);
+
+  if (size > 0)
+    image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+  /* The mapping stays valid without the descriptor */
+  close(fd);
+
+  if (image == MAP_FAILED)
+    return 0;
+
+  if (!check_header(image, size)) {
+    munmap(image, size);
+    return 0;
+  }
+
+  lock_tree(filesystem);
+
+  if (!reset_tree(filesystem)) {
+    unlock_tree(filesystem);
+    munmap(image, size);
+    return 0;
+  }
+
+  unmap_image(filesystem);
+
+  filesystem->tree->image = image;
+  filesystem->tree->image_size = size;
+
+  /* The journal starts over from the mapped tree, which isn't durable
+     until it does */
+  result = filesystem->tree->journal == NULL || checkpoint(filesystem);
+
+  unlock_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Unmaps the image of the unix variable sent in, if it has one
+ */
+void unmap_image(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+  Unix *session;
+
+  if (tree->image == NULL)
+    return;
+
+  munmap((void *) tree->image, tree->image_size);
+  tree->image = NULL;
+  tree->image_size = 0;
+
+  for (session = tree->sessions; session != NULL;
+       session = session->next_session)
+    session->image_dir = 0;
+}
+
+
+/*
+ * Builds the tree of the mapped image of the unix variable sent in in
+ * memory and unmaps it, keeping the current directory of every session
+ * on it. The image stays mapped if it isn't valid or memory runs out.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int image_materialize(Unix *filesystem) {
+
+  if (!check_image(filesystem->tree->image, filesystem->tree->image_size))
+    return 0;
+
+  if (!build_tree(filesystem, filesystem->tree->image)) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  unmap_image(filesystem);
+
+  return 1;
+}
+
+
+/*
+ * Makes the directory at path in the mapped image of the unix variable
+ * sent in the current directory, the way cd() does for the tree
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int image_cd(Unix *filesystem, const char path[]) {
+
+  const char *name;
+  unsigned long len;
+  uint64_t parent, node = image_resolve(filesystem, path, &parent, &name,
+					&len);
+
+  if (node == NO_NODE || image_node(filesystem, node)->type == U_FILE)
+    return 0;
+
+  filesystem->image_dir = node;
+
+  return 1;
+}
+
+
+/*
+ * Prints the entries of the directory at path in the mapped image of
+ * the unix variable sent in, or its name if it is a file, or the
+ * entries that match the pattern its last component is, the way ls()
+ * does for the tree
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int image_ls(Unix *filesystem, const char path[]) {
+
+  const ImageNode *node, *entry;
+  const char *name;
+  unsigned long len;
+  uint64_t parent, child, i;
+  uint64_t index = image_resolve(filesystem, path, &parent, &name, &len);
+  Sink *out = &filesystem->out;
+
+  if (index == NO_NODE)
+    return parent != NO_NODE && is_pattern(name, len)
+      && image_matches(filesystem, parent, name, len, 0) > 0;
+
+  node = image_node(filesystem, index);
+
+  if (node->type == U_FILE) {
+    sink_write(out, image_name(filesystem, node), node->name_len);
+    sink_write(out, "\n", 1);
+    return 1;
+  }
+
+  STATS_ADD(filesystem, visited, node->entries);
+
+  for (i = 0; i < node->entries; i++) {
+
+    child = image_entry(filesystem, index, i);
+
+    /* A damaged image is listed up to the damage */
+    if (child == NO_NODE)
+      break;
+
+    entry = image_node(filesystem, child);
+    name = image_name(filesystem, entry);
+
+    if (name == NULL)
+      break;
+
+    sink_write(out, name, entry->name_len);
+
+    if (entry->type == U_DIR)
+      sink_write(out, "/\n", 2);
+    else
+      sink_write(out, "\n", 1);
+  }
+
+  return 1;
+}
+
+
+/*
+ * Prints the entries of a directory in the mapped image of the unix
+ * variable sent in that start with the last component of path, the
+ * way complete() does for the tree
+ *
+ * Returns 1 if successful, 0 if the directory doesn't exist
+ */
+int image_complete(Unix *filesystem, const char path[]) {
+
+  const ImageNode *node;
+  const char *name;
+  unsigned long len, path_len = strlen(path);
+  uint64_t parent;
+  uint64_t index = image_resolve(filesystem, path, &parent, &name, &len);
+
+  /* Nothing to complete, so the path is the directory */
+  if (path_len == 0 || path[path_len - 1] == ROOT[0]
+      || (len == 1 && name[0] == '.')
+      || (len == 2 && name[0] == '.' && name[1] == '.')) {
+    parent = index;
+    len = 0;
+  }
+
+  node = parent != NO_NODE ? image_node(filesystem, parent) : NULL;
+
+  if (node == NULL || node->type == U_FILE)
+    return 0;
+
+  image_matches(filesystem, parent, name, len, 1);
+
+  return 1;
+}
+
+
+/*
+ * Prints the contents of the file at path in the mapped image of the
+ * unix variable sent in, the way cat() does for the tree
+ *
+ * Returns 1 if successful, 0 if there is no file at the path
+ */
+int image_cat(Unix *filesystem, const char path[]) {
+
+  const ImageNode *node;
+  const char *name, *contents;
+  unsigned long len;
+  uint64_t parent;
+  uint64_t index = image_resolve(filesystem, path, &parent, &name, &len);
+
+  node = index != NO_NODE ? image_node(filesystem, index) : NULL;
+
+  if (node == NULL || node->type != U_FILE)
+    return 0;
+
+  contents = image_contents(filesystem, node);
+
+  if (contents == NULL)
+    return 0;
+
+  sink_write(&filesystem->out, contents, node->contents_len);
+
+  return 1;
+}
+
+
+/*
+ * Rebuilds the path of the current directory of the unix variable
+ * sent in from the parents of its node in the mapped image. The path
+ * stays invalid if the image is damaged or memory runs out.
+ */
+void image_path(Unix *filesystem) {
+
+  const ImageNode *node;
+  uint64_t index;
+  unsigned long len = 0;
+  char *end;
+
+  /* Parents come before their entries, so the walk always ends */
+  for (index = filesystem->image_dir; index != 0; index = node->parent) {
+
+    node = image_node(filesystem, index);
+
+    if (node == NULL || node->parent >= index
+	|| image_name(filesystem, node) == NULL)
+      return;
+
+    len += node->name_len + 1;
+  }
+
+  if (!path_reserve(filesystem, len > 0 ? len : 1))
+    return;
+
+  filesystem->path[0] = ROOT[0];
+  filesystem->path_len = len > 0 ? len : 1;
+  filesystem->path_valid = 1;
+
+  end = filesystem->path + len;
+
+  for (index = filesystem->image_dir; index != 0; index = node->parent) {
+    node = image_node(filesystem, index);
+    end -= node->name_len;
+    memcpy(end, image_name(filesystem, node), node->name_len);
+    *--end = ROOT[0];
+  }
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Collects the node table, child table, name blob and contents blob of
+ * an image of the tree below top, which is a root, into the four
+ * sections and fills in the header that goes in front of them
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int collect_image(Unix *filesystem, Container *top,
+			 ImageHeader *header, Buffer sections[]) {
+
+  if (!collect_nodes(filesystem, top, &sections[0], &sections[1], &sections[2],
+		     &sections[3]))
+    return 0;
+
+  memcpy(header->magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN);
+  header->nodes = sections[0].used / sizeof(ImageNode);
+  header->names_size = sections[2].used;
+  header->contents_size = sections[3].used;
+  header->snapshots_size = 0;
+  header->generation = filesystem->tree->journal != NULL
+    ? filesystem->tree->journal->generation : 0;
+
+  return 1;
+}
+
+
+/*
+ * Fills in the node table, child table, name blob and contents blob of
+ * an image of the tree below root. The tree is walked in pre-order
+ * with the directories above the current one kept on a stack instead
+ * of recursing. A copy is saved with what it shows, entries of its
+ * layers among them, whose parents are elsewhere, so each directory on
+ * the stack keeps a view of its entries in sorted order.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int collect_nodes(Unix *filesystem, Container *root, Buffer *nodes,
+			 Buffer *children, Buffer *names, Buffer *contents) {
+
+  Buffer stack = {0};
+  Container *curr;
+  Frame *top;
+  uint64_t index;
+  int result = add_node(nodes, children, names, contents, root, 0)
+    && buffer_reserve(&stack, sizeof(Frame));
+
+  if (result) {
+    top = (Frame *) stack.data;
+    top->index = 0;
+    result = view_open(filesystem, &top->view, root, NULL, 0);
+    stack.used = result ? sizeof(Frame) : 0;
+  }
+
+  while (result && stack.used > 0) {
+
+    top = (Frame *) (stack.data + stack.used) - 1;
+    curr = view_next(&top->view);
+
+    /* Go back up once a directory is done */
+    if (curr == NULL) {
+      view_close(&top->view);
+      stack.used -= sizeof(Frame);
+      continue;
+    }
+
+    index = nodes->used / sizeof(ImageNode);
+    result = add_node(nodes, children, names, contents, curr, top->index);
+
+    if (!result || !has_entries(curr))
+      continue;
+
+    result = buffer_reserve(&stack, stack.used + sizeof(Frame));
+
+    if (result) {
+      top = (Frame *) (stack.data + stack.used);
+      top->index = index;
+      result = view_open(filesystem, &top->view, curr, NULL, 0);
+      if (result)
+	stack.used += sizeof(Frame);
+    }
+  }
+
+  /* Views left open by a failure */
+  for (; stack.used > 0; stack.used -= sizeof(Frame))
+    view_close(&((Frame *) (stack.data + stack.used) - 1)->view);
+
+  free(stack.data);
+
+  return result;
+}
+
+
+/*
+ * Appends the node of container, whose parent has index parent, to the
+ * node table, its name to the name blob and its contents to the
+ * contents blob. Room for its entries is set aside in the child table,
+ * and it takes the next free place among the entries of its parent.
+ * The root is added with itself as the parent.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int add_node(Buffer *nodes, Buffer *children, Buffer *names,
+		    Buffer *contents, Container *container, uint64_t parent) {
+
+  ImageNode *node, *parent_node;
+  uint64_t index = nodes->used / sizeof(ImageNode);
+  unsigned long slots = children->used / sizeof(uint64_t);
+  unsigned long entries = container->directory != NULL
+    ? container->directory->shown : 0;
+  unsigned long len = container->contents != NULL
+    ? container->contents->len : 0;
+  Chunk *chunk;
+  unsigned long i;
+
+  if (!buffer_reserve(nodes, nodes->used + sizeof(ImageNode))
+      || !buffer_reserve(names, names->used + container->name_len)
+      || !buffer_reserve(children, children->used
+			 + entries * sizeof(uint64_t))
+      || !buffer_reserve(contents, contents->used + len))
+    return 0;
+
+  node = (ImageNode *) (nodes->data + nodes->used);
+  node->name = names->used;
+  node->parent = parent;
+  node->children = slots;
+  node->entries = 0;
+  node->name_len = container->name_len;
+  node->type = container->type;
+  node->contents = contents->used;
+  node->contents_len = len;
+
+  nodes->used += sizeof(ImageNode);
+  children->used += entries * sizeof(uint64_t);
+
+  memcpy(names->data + names->used, container->name, container->name_len);
+  names->used += container->name_len;
+
+  for (i = 0; len > 0 && i < container->contents->chunks; i++) {
+    chunk = CONTENTS_CHUNK(container->contents, i);
+    memcpy(contents->data + contents->used, chunk->data, chunk->len);
+    contents->used += chunk->len;
+  }
+
+  if (index > 0) {
+    parent_node = (ImageNode *) nodes->data + parent;
+    ((uint64_t *) children->data)[parent_node->children
+				  + parent_node->entries++] = index;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Writes the count parts of an image, of lengths lens, to the file
+ * called file. They are written next to it first and moved over it at
+ * the end, so a failed write leaves the old file in place. Running
+ * out of memory is told to the unix variable sent in.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int write_image(Unix *filesystem, const char file[],
+		       const char *parts[], const unsigned long lens[],
+		       int count) {
+
+  char *temp = malloc(strlen(file) + sizeof(".tmp"));
+  FILE *out;
+  int result = 1, i;
+
+  if (temp == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  sprintf(temp, "%s.tmp", file);
+  out = fopen(temp, "wb");
+
+  if (out == NULL) {
+    free(temp);
+    return 0;
+  }
+
+  /* An empty section may have no buffer at all */
+  for (i = 0; i < count && result; i++)
+    result = lens[i] == 0 || fwrite(parts[i], 1, lens[i], out) == lens[i];
+
+  /* The image has to be on disk before it replaces the old one */
+  result = result && fflush(out) == 0 && fsync(fileno(out)) == 0;
+  result = fclose(out) == 0 && result && rename(temp, file) == 0;
+
+  if (!result)
+    remove(temp);
+
+  free(temp);
+
+  return result;
+}
+
+
+/*
+ * Makes sure buffer has room for len bytes
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int buffer_reserve(Buffer *buffer, unsigned long len) {
+
+  unsigned long size = buffer->size > 0 ? buffer->size : 4096;
+  char *data;
+
+  if (len <= buffer->size)
+    return 1;
+
+  while (size < len)
+    size *= 2;
+
+  data = realloc(buffer->data, size);
+
+  if (data == NULL)
+    return 0;
+
+  buffer->data = data;
+  buffer->size = size;
+
+  return 1;
+}
+
+
+/*
+ * Replaces the tree of the unix variable sent in with the one in image,
+ * which has been checked, and its snapshots with the ones saved with
+ * it. Every session on the tree moves to the container built for the
+ * node of its current directory in a mapped image, or to the root.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int build_tree(Unix *filesystem, const char image[]) {
+
+  const ImageHeader *header = (const ImageHeader *) image, *nested;
+  const ImageNode *table = (const ImageNode *) (header + 1);
+  Container **containers, **snapshots = NULL;
+  Unix *session;
+  int result;
+
+  nested = (const ImageHeader *) ((const uint64_t *) (table + header->nodes)
+				  + header->nodes - 1);
+  containers = malloc(header->nodes * sizeof(Container *));
+
+  if (header->snapshots_size > 0 && containers != NULL)
+    snapshots = malloc(nested->nodes * sizeof(Container *));
+
+  if (containers == NULL
+      || (header->snapshots_size > 0 && snapshots == NULL)
+      || !reset_tree(filesystem)) {
+    free(containers);
+    free(snapshots);
+    return 0;
+  }
+
+  containers[0] = filesystem->tree->root;
+  result = build_nodes(filesystem, image, containers);
+
+  if (result && snapshots != NULL) {
+    filesystem->tree->snapshots = new_root(filesystem);
+    snapshots[0] = filesystem->tree->snapshots;
+    result = snapshots[0] != NULL
+      && build_nodes(filesystem, (const char *) nested, snapshots);
+  }
+
+  for (session = filesystem->tree->sessions; session != NULL && result;
+       session = session->next_session)
+    move_session(session, containers[session->image_dir]);
+
+  free(containers);
+  free(snapshots);
+
+  return result;
+}
+
+
+/*
+ * Adds the containers of the checked image to the tree of the unix
+ * variable sent in below containers[0], which stands for its root, in
+ * one pass over its node table that also fills in the contents of the
+ * files and one back over it for the totals. The container built for
+ * each node is stored in containers at its index.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int build_nodes(Unix *filesystem, const char image[],
+		       Container *containers[]) {
+
+  const ImageHeader *header = (const ImageHeader *) image;
+  const ImageNode *table = (const ImageNode *) (header + 1), *node;
+  const uint64_t *children = (const uint64_t *) (table + header->nodes);
+  const char *names = (const char *) (children + header->nodes - 1)
+    + header->snapshots_size;
+  const char *contents = names + header->names_size;
+  Container *tail[SKIP_MAX_LEVEL];
+  unsigned long i, j;
+  uint64_t child;
+
+  /* The entries of a node always come after it in pre-order, so every
+     directory exists by the time its entries are added, in the sorted
+     order they were saved in */
+  for (i = 0; i < header->nodes; i++) {
+
+    node = &table[i];
+
+    for (j = 0; j < SKIP_MAX_LEVEL && node->entries > 0; j++)
+      tail[j] = NULL;
+
+    for (j = 0; j < node->entries; j++) {
+
+      child = children[node->children + j];
+      containers[child] = append_entry(filesystem, containers[i],
+				       names + table[child].name,
+				       table[child].name_len,
+				       (enum Type) table[child].type, tail);
+
+      if (containers[child] == NULL
+	  || (table[child].contents_len > 0
+	      && !contents_write(filesystem, containers[child], 0,
+				 contents + table[child].contents,
+				 table[child].contents_len)))
+	return 0;
+
+      containers[child]->bytes = table[child].contents_len;
+    }
+  }
+
+  /* Every entry comes after its directory, so going backwards the
+     totals of a container are complete before they are added to the
+     directory holding it */
+  for (i = header->nodes - 1; i > 0; i--) {
+
+    Container *container = containers[i], *dir = container->parent;
+
+    dir->directory->files += FILES_BELOW(container)
+      + (container->type == U_FILE);
+    dir->directory->dirs += DIRS_BELOW(container)
+      + (container->type == U_DIR);
+    dir->bytes += container->bytes;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Reads the whole of the file called file into memory and stores its
+ * length in size. Running out of memory is told to the unix variable
+ * sent in.
+ *
+ * Returns the contents, to be freed by the caller, or NULL if the file
+ * couldn't be read
+ */
+static char *read_file(Unix *filesystem, const char file[],
+		       unsigned long *size) {
+
+  FILE *in = fopen(file, "rb");
+  char *data = NULL;
+  long len;
+
+  if (in == NULL)
+    return NULL;
+
+  if (fseek(in, 0, SEEK_END) == 0 && (len = ftell(in)) > 0
+      && fseek(in, 0, SEEK_SET) == 0) {
+
+    data = malloc(len);
+
+    if (data == NULL)
+      print_error(filesystem, NO_MEMORY);
+    else if (fread(data, 1, len, in) != (unsigned long) len) {
+      free(data);
+      data = NULL;
+    }
+
+    *size = len;
+  }
+
+  fclose(in);
+
+  return data;
+}
+
+
+/*
+ * Checks that the size bytes of image start with the header of an
+ * image whose sections fill the rest of it exactly
+ *
+ * Returns 1 if the header is valid, 0 otherwise
+ */
+static int check_header(const char image[], unsigned long size) {
+
+  const ImageHeader *header = (const ImageHeader *) image;
+  uint64_t nodes, rest;
+
+  if (size < sizeof(*header)
+      || memcmp(header->magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN) != 0)
+    return 0;
+
+  nodes = header->nodes;
+  rest = size - sizeof(*header);
+
+  if (nodes == 0 || nodes > (rest + sizeof(uint64_t))
+      / (sizeof(ImageNode) + sizeof(uint64_t)))
+    return 0;
+
+  rest -= nodes * sizeof(ImageNode) + (nodes - 1) * sizeof(uint64_t);
+
+  if (header->snapshots_size > rest)
+    return 0;
+
+  rest -= header->snapshots_size;
+
+  return header->names_size <= rest
+    && header->contents_size == rest - header->names_size;
+}
+
+
+/*
+ * Checks that the size bytes of image hold a tree that can be loaded:
+ * every offset stays inside its section, every entry comes after its
+ * directory in the node table and names it as its parent, the entries
+ * of each directory are sorted without repeats, every node but the root
+ * is the entry of exactly one directory, and only files have contents.
+ * The image of the snapshots, if there is one, is checked the same way
+ * and can't hold snapshots of its own.
+ *
+ * Returns 1 if the image is valid, 0 otherwise
+ */
+static int check_image(const char image[], unsigned long size) {
+
+  const ImageHeader *header = (const ImageHeader *) image, *nested;
+  const ImageNode *table, *node, *child, *previous;
+  const uint64_t *children;
+  const char *names;
+  uint64_t nodes = header->nodes, entries = 0, i, j, c;
+
+  if (!check_header(image, size))
+    return 0;
+
+  table = (const ImageNode *) (header + 1);
+  children = (const uint64_t *) (table + nodes);
+  names = (const char *) (children + nodes - 1) + header->snapshots_size;
+
+  /* Check every node on its own before following the links between
+     them */
+  for (i = 0; i < nodes; i++) {
+
+    node = &table[i];
+
+    if (i == 0 ? node->type != U_ROOT
+	: node->type != U_FILE && node->type != U_DIR)
+      return 0;
+
+    if (i > 0 && (node->name_len == 0
+		  || node->name > header->names_size
+		  || node->name_len > header->names_size - node->name
+		  || memchr(names + node->name, '/', node->name_len) != NULL
+		  || (node->name_len <= 2
+		      && memcmp(names + node->name, "..",
+				node->name_len) == 0)))
+      return 0;
+
+    if (node->children > nodes - 1
+	|| node->entries > nodes - 1 - node->children
+	|| (node->type == U_FILE && node->entries > 0))
+      return 0;
+
+    if (node->type == U_FILE
+	? node->contents > header->contents_size
+	|| node->contents_len > header->contents_size - node->contents
+	: node->contents_len > 0)
+      return 0;
+
+    entries += node->entries;
+  }
+
+  if (entries != nodes - 1)
+    return 0;
+
+  for (i = 0; i < nodes; i++) {
+
+    node = &table[i];
+    previous = NULL;
+
+    for (j = 0; j < node->entries; j++) {
+
+      c = children[node->children + j];
+
+      if (c <= i || c >= nodes || table[c].parent != i)
+	return 0;
+
+      child = &table[c];
+
+      if (previous != NULL
+	  && compare_names(names + previous->name, previous->name_len,
+			   names + child->name, child->name_len) >= 0)
+	return 0;
+
+      previous = child;
+    }
+  }
+
+  nested = (const ImageHeader *) (children + nodes - 1);
+
+  return header->snapshots_size == 0
+    || (check_image((const char *) nested, header->snapshots_size)
+	&& nested->snapshots_size == 0);
+}
+
+
+/*
+ * Compares two names the way the entries of a directory are sorted
+ *
+ * Returns a negative number, zero or a positive number when first sorts
+ * before, with or after second
+ */
+static int compare_names(const char first[], unsigned long first_len,
+			 const char second[], unsigned long second_len) {
+
+  unsigned long shorter = first_len < second_len ? first_len : second_len;
+  int result = memcmp(first, second, shorter);
+
+  if (result != 0 || first_len == second_len)
+    return result;
+
+  return first_len < second_len ? -1 : 1;
+}
+
+
+/*
+ * Returns the node with the given index in the mapped image of the unix
+ * variable sent in, or NULL if there is no such node
+ */
+static const ImageNode *image_node(Unix *filesystem, uint64_t index) {
+
+  const ImageHeader *header = (const ImageHeader *) filesystem->tree->image;
+
+  if (index >= header->nodes)
+    return NULL;
+
+  return (const ImageNode *) (header + 1) + index;
+}
+
+
+/*
+ * Returns the name of node in the mapped image of the unix variable
+ * sent in, or NULL if it lies outside the name blob
+ */
+static const char *image_name(Unix *filesystem, const ImageNode *node) {
+
+  const ImageHeader *header = (const ImageHeader *) filesystem->tree->image;
+
+  if (node->name > header->names_size
+      || node->name_len > header->names_size - node->name)
+    return NULL;
+
+  return filesystem->tree->image + filesystem->tree->image_size
+    - header->contents_size - header->names_size + node->name;
+}
+
+
+/*
+ * Returns the contents of node in the mapped image of the unix variable
+ * sent in, or NULL if they lie outside the contents blob
+ */
+static const char *image_contents(Unix *filesystem, const ImageNode *node) {
+
+  const ImageHeader *header = (const ImageHeader *) filesystem->tree->image;
+
+  if (node->contents > header->contents_size
+      || node->contents_len > header->contents_size - node->contents)
+    return NULL;
+
+  return filesystem->tree->image + filesystem->tree->image_size
+    - header->contents_size + node->contents;
+}
+
+
+/*
+ * Returns the index of entry number at of the node with index dir in
+ * the mapped image of the unix variable sent in, or NO_NODE if there is
+ * no such entry or it doesn't name dir as its parent
+ */
+static uint64_t image_entry(Unix *filesystem, uint64_t dir, uint64_t at) {
+
+  const ImageHeader *header = (const ImageHeader *) filesystem->tree->image;
+  const ImageNode *node = image_node(filesystem, dir), *entry;
+  const uint64_t *children;
+  uint64_t child;
+
+  if (at >= node->entries || node->children > header->nodes - 1
+      || at >= header->nodes - 1 - node->children)
+    return NO_NODE;
+
+  children = (const uint64_t *) ((const ImageNode *) (header + 1)
+				 + header->nodes);
+  child = children[node->children + at];
+  entry = image_node(filesystem, child);
+
+  if (entry == NULL || child <= dir || entry->parent != dir)
+    return NO_NODE;
+
+  return child;
+}
+
+
+/*
+ * Searches the sorted entries of the node with index dir in the mapped
+ * image of the unix variable sent in for name, of length len, by
+ * bisection. at, unless it is NULL, receives the position among them
+ * of the first entry that doesn't sort before name.
+ *
+ * Returns the index of the entry, or NO_NODE if there is none
+ */
+static uint64_t image_lookup(Unix *filesystem, uint64_t dir,
+			     const char name[], unsigned long len,
+			     uint64_t *at) {
+
+  const ImageNode *entry;
+  const char *entry_name;
+  uint64_t low = 0, high = image_node(filesystem, dir)->entries, middle;
+  uint64_t child = NO_NODE;
+  unsigned long compared = 0;
+  int result = 1;
+
+  while (low < high) {
+
+    middle = low + (high - low) / 2;
+    child = image_entry(filesystem, dir, middle);
+
+    if (child == NO_NODE)
+      break;
+
+    entry = image_node(filesystem, child);
+    entry_name = image_name(filesystem, entry);
+
+    if (entry_name == NULL)
+      break;
+
+    compared++;
+    result = compare_names(entry_name, entry->name_len, name, len);
+
+    if (result == 0)
+      break;
+
+    if (result < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (at != NULL)
+    *at = result == 0 ? middle : low;
+
+  STATS_ADD(filesystem, comparisons, compared);
+  STATS_ADD(filesystem, visited, compared);
+
+  return result == 0 ? child : NO_NODE;
+}
+
+
+/*
+ * Resolves path in the mapped image of the unix variable sent in the
+ * way paths are resolved in the tree: from the root if it starts with
+ * a "/" and from the current directory otherwise, one component at a
+ * time. parent receives the index of the directory the last component
+ * was looked up in, or NO_NODE if a directory leading up to it doesn't
+ * exist, and name and len receive the last component.
+ *
+ * Returns the index of the node the path leads to, or NO_NODE
+ */
+static uint64_t image_resolve(Unix *filesystem, const char path[],
+			      uint64_t *parent, const char **name,
+			      unsigned long *len) {
+
+  const ImageNode *node;
+  uint64_t position;
+  const char *end;
+
+  position = path[0] == ROOT[0] ? 0 : filesystem->image_dir;
+  *parent = NO_NODE;
+  *name = path;
+  *len = 0;
+
+  while (*path != '\0') {
+
+    if (*path == ROOT[0]) {
+      path++;
+      continue;
+    }
+
+    for (end = path; *end != '\0' && *end != ROOT[0]; end++)
+      ;
+
+    /* Only a directory can have more components after it */
+    node = position != NO_NODE ? image_node(filesystem, position) : NULL;
+
+    if (node == NULL || node->type == U_FILE) {
+      *parent = NO_NODE;
+      return NO_NODE;
+    }
+
+    *parent = position;
+    *name = path;
+    *len = end - path;
+
+    if (end - path == 1 && path[0] == '.')
+      ;
+    else if (end - path == 2 && path[0] == '.' && path[1] == '.')
+      position = position == 0 ? 0
+	: node->parent < position ? node->parent : NO_NODE;
+    else
+      position = image_lookup(filesystem, position, path, end - path, NULL);
+
+    path = end;
+  }
+
+  return position != NO_NODE && image_node(filesystem, position) != NULL
+    ? position : NO_NODE;
+}
+
+
+/*
+ * Prints the entries of the node with index dir in the mapped image of
+ * the unix variable sent in that match pattern, of length len, or just
+ * start with it if prefix_only is set. Bisection finds the first entry
+ * that starts with the literal prefix of the pattern.
+ *
+ * Returns the number of entries printed
+ */
+static unsigned long image_matches(Unix *filesystem, uint64_t dir,
+				   const char pattern[], unsigned long len,
+				   int prefix_only) {
+
+  const ImageNode *node = image_node(filesystem, dir), *entry;
+  const char *name;
+  unsigned long prefix = prefix_only ? len : pattern_prefix(pattern, len);
+  unsigned long visited = 0, found = 0;
+  uint64_t child, i;
+  Sink *out = &filesystem->out;
+
+  image_lookup(filesystem, dir, pattern, prefix, &i);
+
+  for (; i < node->entries; i++) {
+
+    child = image_entry(filesystem, dir, i);
+
+    /* A damaged image is listed up to the damage */
+    if (child == NO_NODE)
+      break;
+
+    entry = image_node(filesystem, child);
+    name = image_name(filesystem, entry);
+
+    if (name == NULL || entry->name_len < prefix
+	|| memcmp(name, pattern, prefix) != 0)
+      break;
+
+    visited++;
+
+    if (!prefix_only
+	&& !match_pattern(pattern, len, name, entry->name_len))
+      continue;
+
+    sink_write(out, name, entry->name_len);
+
+    if (entry->type == U_DIR)
+      sink_write(out, "/\n", 2);
+    else
+      sink_write(out, "\n", 1);
+
+    found++;
+  }
+
+  STATS_ADD(filesystem, visited, visited);
+
+  return found;
+}
@@ -0,0 +1,60 @@
+/*
+ * unix-image.h
+ *
+ * Header file for the binary image a Unix filesystem is saved to.
+ *
+ * An image is a header followed by five sections:
+ *
+ *   the node table, one ImageNode per container in pre-order, the
+ *     root first
+ *   the child table, the indexes of the entries of each directory in
+ *     sorted order, every directory's entries next to each other
+ *   the snapshots, an image of their own whose root holds them, or
+ *     nothing if there are none
+ *   the name blob, every name one after the other
+ *   the contents blob, the contents of every file one after the other
+ *
+ * Nodes refer to each other, to their names and to their contents by
+ * index and offset, never by address, so an image reads the same
+ * wherever it is in memory.
+ * Numbers are stored in the byte order of the machine that wrote them.
+ *
+ * That lets map_image() use an image straight from the page cache: ls,
+ * cd, pwd, complete and cat read the mapped sections in place, and the
+ * first command that changes the tree builds it in memory from them.
+ */
+
+#include <stdint.h>
+#include "unix-datastructure.h"
+
+/* First bytes of every image */
+#define IMAGE_MAGIC "UNIXIMG3"
+#define IMAGE_MAGIC_LEN 8
+
+typedef struct image_header {
+  char magic[IMAGE_MAGIC_LEN];
+  uint64_t nodes;		/* entries of the node table */
+  uint64_t names_size;		/* bytes of the name blob */
+  uint64_t generation;		/* journal checkpoint it was saved at */
+  uint64_t contents_size;	/* bytes of the contents blob */
+  uint64_t snapshots_size;	/* bytes of the image of the snapshots */
+} ImageHeader;
+
+typedef struct image_node {
+  uint64_t name;		/* offset of the name in the name blob */
+  uint64_t parent;		/* index of the parent, 0 for the root */
+  uint64_t children;		/* offset of the entries in the child table */
+  uint64_t entries;		/* number of entries */
+  uint64_t contents;		/* offset of the contents of a file */
+  uint64_t contents_len;	/* length of those contents */
+  uint32_t name_len;		/* length of the name */
+  uint32_t type;		/* an enum Type */
+} ImageNode;
+
+void unmap_image(Unix *filesystem);
+int image_materialize(Unix *filesystem);
+int image_cd(Unix *filesystem, const char path[]);
+int image_ls(Unix *filesystem, const char path[]);
+int image_complete(Unix *filesystem, const char path[]);
+int image_cat(Unix *filesystem, const char path[]);
+void image_path(Unix *filesystem);
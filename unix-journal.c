@@ -0,0 +1,849 @@
+/*
+ * unix-journal.c
+ *
+ * This file contains the journal of a simulated Unix filesystem: the
+ * log of the commands that changed it since its last checkpoint, synced
+ * to disk before each of them returns, and the replay of that log on
+ * top of the checkpointed image when the filesystem is opened again.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "unix.h"
+#include "unix-image.h"
+#include "unix-journal.h"
+#include "unix-lock.h"
+#include "unix-sink.h"
+#include "unix-tree.h"
+
+/* Records after which the tree is checkpointed and the journal
+   started over */
+#define JOURNAL_CHECKPOINT 100000
+
+static int image_generation(const char file[], uint64_t *generation);
+static int replay(Unix *filesystem, Journal *journal);
+static int run_record(Unix *filesystem, const JournalRecord *record,
+		      const char path[]);
+static int reset_journal(Journal *journal);
+static int flush_journal(Unix *filesystem, Journal *journal,
+			 unsigned long long records);
+static void append_record(Unix *filesystem, enum Command command,
+			  Container *container, const char dir[],
+			  unsigned long dir_len, const char arg[],
+			  unsigned long len, const char extra[],
+			  unsigned long extra_len, const char data[],
+			  unsigned long data_len);
+static int unlinked_above(Unix *filesystem, const Container *container);
+static uint32_t record_check(uint32_t command, const char path[],
+			     uint32_t len);
+static uint32_t check_bytes(uint32_t hash, const char bytes[],
+			    unsigned long len);
+
+
+/*
+ * Rebuilds the tree of the unix variable sent in from the image file
+ * called image and the journal file called file, and starts journaling
+ * its changes to them. A missing image is an empty tree and a missing
+ * journal is an empty journal. A record torn by a crash, and anything
+ * after it, is dropped from the journal.
+ *
+ * A command that changes the tree returns once its record is on disk,
+ * so every change a command reported is durable. Commands that finish
+ * at the same time share a sync: the first to get to the file writes
+ * out the records of all of them.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int open_journal(Unix *filesystem, const char image[], const char file[]) {
+
+  Journal *journal;
+  uint64_t generation = 0;
+  int fd, found, result;
+
+  if (filesystem == NULL || image == NULL || file == NULL)
+    return 0;
+
+  lock_tree(filesystem);
+
+  found = filesystem->tree->journal != NULL
+    ? -1 : image_generation(image, &generation);
+
+  if (found < 0) {
+    unlock_tree(filesystem);
+    return 0;
+  }
+
+  if (!found)
+    unmap_image(filesystem);
+
+  result = found ? load(filesystem, image) : reset_tree(filesystem);
+  fd = result ? open(file, O_RDWR | O_CREAT | O_APPEND, 0644) : -1;
+
+  if (fd < 0) {
+    unlock_tree(filesystem);
+    return 0;
+  }
+
+  journal = malloc(sizeof(Journal));
+
+  if (journal == NULL
+      || (journal->image = malloc(strlen(image) + 1)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    free(journal);
+    close(fd);
+    unlock_tree(filesystem);
+    return 0;
+  }
+
+  strcpy(journal->image, image);
+  sink_init(&journal->batch, -1);
+  sink_init(&journal->out, fd);
+  journal->generation = generation;
+  journal->appended = 0;
+  journal->synced = 0;
+  journal->records = 0;
+  journal->failed = 0;
+  journal->removal = 0;
+
+  result = replay(filesystem, journal);
+
+  if (result)
+    filesystem->tree->journal = journal;
+  else {
+    sink_release(&journal->batch);
+    sink_release(&journal->out);
+    close(fd);
+    free(journal->image);
+    free(journal);
+  }
+
+  unlock_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Writes out the records waiting in the journal of the unix variable
+ * sent in and waits for them to reach the disk
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int sync_journal(Unix *filesystem) {
+
+  int result = 0;
+
+  if (filesystem == NULL)
+    return 0;
+
+  enter_tree(filesystem);
+
+  if (filesystem->tree->journal != NULL)
+    result = flush_journal(filesystem, filesystem->tree->journal, 0);
+
+  leave_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Saves the tree of the unix variable sent in to the image file of its
+ * journal and starts the journal over, empty. This also happens on its
+ * own every JOURNAL_CHECKPOINT records, and after the journal has lost
+ * records it couldn't write, since the image then saves them.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int checkpoint(Unix *filesystem) {
+
+  Journal *journal;
+  int result = 0;
+
+  if (filesystem == NULL)
+    return 0;
+
+  lock_tree(filesystem);
+
+  journal = filesystem->tree->journal;
+
+  /* Flushed first, so the records stay durable if the image can't be
+     saved. Ones the journal has lost are saved by the image. */
+  if (journal != NULL) {
+
+    (void) flush_journal(filesystem, journal, 0);
+
+    journal->generation++;
+
+    /* From here on a crash leaves a journal older than the image,
+       which is dropped when it is opened */
+    if (save(filesystem, journal->image))
+      result = reset_journal(journal);
+    else
+      journal->generation--;
+  }
+
+  unlock_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Syncs and closes the journal of the unix variable sent in. The tree
+ * stays as it is.
+ *
+ * Returns 1 if every record reached the disk, 0 otherwise
+ */
+int close_journal(Unix *filesystem) {
+
+  Journal *journal;
+  int result = 0;
+
+  if (filesystem == NULL)
+    return 0;
+
+  lock_tree(filesystem);
+
+  journal = filesystem->tree->journal;
+
+  if (journal != NULL) {
+    result = flush_journal(filesystem, journal, 0);
+    sink_release(&journal->batch);
+    sink_release(&journal->out);
+    close(journal->out.fd);
+    free(journal->image);
+    free(journal);
+
+    filesystem->tree->journal = NULL;
+  }
+
+  unlock_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Appends a record of command having succeeded with the path arg, which
+ * added or removed container, to the journal of the unix variable sent
+ * in, to be synced by journal_commit() once the command has let go of
+ * its locks. A relative path is recorded after the path of the current
+ * directory of the session that ran the command. Nothing is recorded
+ * below a directory whose rm is recorded already, and a directory rm
+ * removes is marked so.
+ */
+void journal_record(Unix *filesystem, enum Command command,
+		    const char arg[], Container *container) {
+
+  const char *dir = "";
+  unsigned long dir_len = 0;
+
+  if (arg[0] != '/') {
+
+    dir = current_path(filesystem, &dir_len);
+
+    if (dir == NULL)
+      return;
+  }
+
+  append_record(filesystem, command, container, dir, dir_len, arg,
+		strlen(arg), "", 0, "", 0);
+}
+
+
+/*
+ * Appends a record of a write or append having succeeded with the path
+ * arg to the journal of the unix variable sent in, the way
+ * journal_record() does for file. The record carries the len bytes of
+ * data and the offset they were written at.
+ */
+void journal_contents(Unix *filesystem, enum Command command,
+		      const char arg[], uint64_t offset, const char data[],
+		      unsigned long len, Container *file) {
+
+  const char *dir = "";
+  unsigned long dir_len = 0;
+  char head[1 + sizeof(uint64_t)];
+
+  if (arg[0] != '/') {
+
+    dir = current_path(filesystem, &dir_len);
+
+    if (dir == NULL)
+      return;
+  }
+
+  head[0] = '\0';
+  memcpy(head + 1, &offset, sizeof(offset));
+
+  append_record(filesystem, command, file, dir, dir_len, arg, strlen(arg),
+		head, sizeof(head), data, len);
+}
+
+
+/*
+ * Appends a record of command having succeeded with the paths arg and
+ * dest to the journal of the unix variable sent in, the way
+ * journal_record() does. The path dest follows the end of arg, and
+ * either is recorded after the path of the current directory when it
+ * is relative.
+ */
+void journal_paths(Unix *filesystem, enum Command command,
+		   const char arg[], const char dest[]) {
+
+  const char *dir = "";
+  unsigned long dir_len = 0, extra_len = 1;
+  char *extra;
+
+  if (arg[0] != '/' || dest[0] != '/') {
+
+    dir = current_path(filesystem, &dir_len);
+
+    if (dir == NULL)
+      return;
+  }
+
+  extra = malloc(dir_len + 2);
+
+  if (extra == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return;
+  }
+
+  /* The directory in front of dest, after the end of arg */
+  extra[0] = '\0';
+  if (dest[0] != '/') {
+    memcpy(extra + 1, dir, dir_len);
+    extra_len += dir_len;
+    if (dir[dir_len - 1] != '/')
+      extra[extra_len++] = '/';
+  }
+
+  append_record(filesystem, command, NULL, arg[0] != '/' ? dir : "",
+		arg[0] != '/' ? dir_len : 0, arg, strlen(arg), extra,
+		extra_len, dest, strlen(dest));
+
+  free(extra);
+}
+
+
+/*
+ * Appends a record of command having succeeded with the name arg to the
+ * journal of the unix variable sent in, the way journal_record() does
+ * for a path. The name is recorded as it is.
+ */
+void journal_name(Unix *filesystem, enum Command command, const char arg[]) {
+  append_record(filesystem, command, NULL, "", 0, arg, strlen(arg), "", 0,
+		"", 0);
+}
+
+
+/*
+ * Waits for the records the running command of the unix variable sent
+ * in added to its journal to reach the disk. A command calls this once
+ * it has let go of the tree and of every directory, so that nothing
+ * waits on its sync but itself. Should another thread be syncing, this
+ * one waits for it to finish, and finds its records either synced
+ * along with that batch or in the next one, which it syncs for every
+ * command that added to it meanwhile. A batch that can't be written
+ * leaves the journal failed, for journal_full() to report.
+ *
+ * Returns 1 if the records are on disk or there were none, 0 otherwise
+ */
+int journal_commit(Unix *filesystem) {
+
+  int result = 1;
+
+  if (filesystem->journaled == 0)
+    return 1;
+
+  enter_tree(filesystem);
+
+  /* A journal closed meanwhile synced them */
+  if (filesystem->tree->journal != NULL)
+    result = flush_journal(filesystem, filesystem->tree->journal,
+			   filesystem->journaled);
+
+  leave_tree(filesystem);
+
+  filesystem->journaled = 0;
+
+  return result;
+}
+
+
+/*
+ * Checks if the journal of the unix variable sent in is long enough to
+ * be checkpointed, or has lost records that only a checkpoint can
+ * save. Commands take the checkpoint after they have let go of the
+ * tree, since it needs the tree to itself.
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+int journal_full(Unix *filesystem) {
+
+  Journal *journal = filesystem->tree->journal;
+  int full;
+
+  if (journal == NULL)
+    return 0;
+
+  LOCK(filesystem, journal);
+  full = journal->records >= JOURNAL_CHECKPOINT || journal->failed;
+  UNLOCK(filesystem, journal);
+
+  return full;
+}
+
+
+/*
+ * Checks if the journal of the unix variable sent in has lost records
+ * since its last checkpoint, so the changes they made won't survive a
+ * crash. Commands that find it so after trying to checkpoint report
+ * that they failed.
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+int journal_failed(Unix *filesystem) {
+
+  Journal *journal = filesystem->tree->journal;
+  int failed;
+
+  if (journal == NULL)
+    return 0;
+
+  LOCK(filesystem, journal);
+  failed = journal->failed;
+  UNLOCK(filesystem, journal);
+
+  return failed;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Reads the generation of the image file called file into generation
+ *
+ * Returns 1 if it was read, 0 if there is no such file and -1 if the
+ * file isn't an image
+ */
+static int image_generation(const char file[], uint64_t *generation) {
+
+  ImageHeader header;
+  FILE *in = fopen(file, "rb");
+  int found;
+
+  if (in == NULL)
+    return 0;
+
+  found = fread(&header, sizeof(header), 1, in) == 1
+    && memcmp(header.magic, IMAGE_MAGIC, IMAGE_MAGIC_LEN) == 0;
+  fclose(in);
+
+  if (!found)
+    return -1;
+
+  *generation = header.generation;
+
+  return 1;
+}
+
+
+/*
+ * Runs the records of journal on the tree of the unix variable sent in,
+ * which has just been loaded from the image of the same generation,
+ * and cuts the journal file after the last whole record. A journal
+ * older than the image was left by an unfinished checkpoint and is
+ * started over instead.
+ *
+ * Returns 1 if successful, 0 if the file isn't a journal, is newer than
+ * the image, or couldn't be read
+ */
+static int replay(Unix *filesystem, Journal *journal) {
+
+  JournalHeader header;
+  JournalRecord record;
+  off_t size = lseek(journal->out.fd, 0, SEEK_END), offset;
+  char *data, *path = NULL, *grown;
+  unsigned long path_size = 0;
+  int result = 1;
+
+  if (size < 0)
+    return 0;
+
+  /* A new journal, or one whose header was never finished */
+  if ((unsigned long) size < sizeof(header))
+    return reset_journal(journal);
+
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal->out.fd, 0);
+
+  if (data == MAP_FAILED)
+    return 0;
+
+  if (memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+    munmap(data, size);
+    return 0;
+  }
+
+  memcpy(&header, data, sizeof(header));
+
+  if (header.generation != journal->generation) {
+    munmap(data, size);
+    return header.generation < journal->generation
+      && reset_journal(journal);
+  }
+
+  for (offset = sizeof(header);
+       (unsigned long) (size - offset) >= sizeof(record); ) {
+
+    memcpy(&record, data + offset, sizeof(record));
+
+    /* A torn or damaged record ends the journal */
+    if (record.len > size - offset - sizeof(record)
+	|| record.check != record_check(record.command,
+					data + offset + sizeof(record),
+					record.len))
+      break;
+
+    /* Commands take their paths as strings */
+    if (record.len + 1 > path_size) {
+
+      grown = realloc(path, record.len + 1);
+
+      if (grown == NULL) {
+	print_error(filesystem, NO_MEMORY);
+	result = 0;
+	break;
+      }
+
+      path = grown;
+      path_size = record.len + 1;
+    }
+
+    memcpy(path, data + offset + sizeof(record), record.len);
+    path[record.len] = '\0';
+
+    if (!run_record(filesystem, &record, path))
+      break;
+
+    offset += sizeof(record) + record.len;
+    journal->records++;
+  }
+
+  munmap(data, size);
+  free(path);
+
+  if (result && offset < size && ftruncate(journal->out.fd, offset) != 0)
+    result = 0;
+
+  return result;
+}
+
+
+/*
+ * Runs the command of record with the string path on the tree of the
+ * unix variable sent in. What the command returns doesn't matter, it
+ * does the same as when it was recorded. The bytes of a write or append
+ * come after the end of its path, and so does the destination of a cp
+ * or mv.
+ *
+ * Returns 1 if the record holds a command, 0 otherwise
+ */
+static int run_record(Unix *filesystem, const JournalRecord *record,
+		      const char path[]) {
+
+  unsigned long len = strlen(path);
+  uint64_t offset;
+  const char *data;
+
+  switch (record->command) {
+
+  case C_WRITE:
+  case C_APPEND:
+    if (len + 1 + sizeof(offset) > record->len)
+      return 0;
+
+    memcpy(&offset, path + len + 1, sizeof(offset));
+    data = path + len + 1 + sizeof(offset);
+
+    if (record->command == C_WRITE)
+      write_file(filesystem, path, offset, data,
+		 record->len - (data - path));
+    else
+      append_file(filesystem, path, data, record->len - (data - path));
+    return 1;
+
+  case C_CP:
+    if (len + 1 > record->len)
+      return 0;
+
+    cp(filesystem, path, path + len + 1);
+    return 1;
+
+  case C_MV:
+    if (len + 1 > record->len)
+      return 0;
+
+    mv(filesystem, path, path + len + 1);
+    return 1;
+
+  case C_SNAPSHOT:
+    snapshot(filesystem, path);
+    return 1;
+
+  case C_RESTORE:
+    restore(filesystem, path);
+    return 1;
+
+  case C_TOUCH:
+    touch(filesystem, path);
+    return 1;
+
+  case C_MKDIR:
+    mkdir(filesystem, path);
+    return 1;
+
+  case C_RM:
+    rm(filesystem, path);
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+
+/*
+ * Empties the journal file of journal and starts it with a header of its
+ * generation, synced to disk. Records waiting to be written are dropped,
+ * the tree they changed has been saved, and so are the ones it lost.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int reset_journal(Journal *journal) {
+
+  JournalHeader header;
+
+  journal->batch.used = 0;
+  journal->out.used = 0;
+  journal->out.failed = 0;
+  journal->synced = journal->appended;
+  journal->records = 0;
+  journal->failed = 1;
+
+  if (ftruncate(journal->out.fd, 0) != 0)
+    return 0;
+
+  memcpy(header.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+  header.generation = journal->generation;
+
+  sink_write(&journal->out, (const char *) &header, sizeof(header));
+
+  journal->failed = !sink_flush(&journal->out)
+    || fsync(journal->out.fd) != 0;
+
+  return !journal->failed;
+}
+
+
+/*
+ * Writes out the records waiting in journal, of the unix variable sent
+ * in, and waits for them to reach the disk, unless the first records of
+ * them ever added are on disk already, which a flush another thread
+ * did while this one waited for it may have seen to. records is 0 to
+ * always flush. The batch is taken over under the lock of the journal
+ * and written under a lock of its own, so commands go on adding records
+ * to the next batch meanwhile, and the batches reach the file in the
+ * order they were taken. Once a write or sync has failed, records may
+ * be missing from the file, so the journal stays failed until it is
+ * reset.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int flush_journal(Unix *filesystem, Journal *journal,
+			 unsigned long long records) {
+
+  Sink *batch = &journal->batch, *out = &journal->out;
+  unsigned long long appended;
+  char *buffer;
+  unsigned long size;
+  int result;
+
+  LOCK(filesystem, syncing);
+  LOCK(filesystem, journal);
+
+  if (records > 0 && journal->synced >= records) {
+    result = !journal->failed;
+    UNLOCK(filesystem, journal);
+    UNLOCK(filesystem, syncing);
+    return result;
+  }
+
+  /* out was emptied by the flush before this one, and is the next
+     batch */
+  appended = journal->appended;
+  buffer = out->buffer;
+  size = out->size;
+  out->buffer = batch->buffer;
+  out->size = batch->size;
+  out->used = batch->used;
+  batch->buffer = buffer;
+  batch->size = size;
+  batch->used = 0;
+  UNLOCK(filesystem, journal);
+
+  result = sink_flush(out) && fsync(out->fd) == 0;
+
+  LOCK(filesystem, journal);
+  if (!result)
+    journal->failed = 1;
+  else
+    journal->synced = appended;
+  result = !journal->failed;
+  UNLOCK(filesystem, journal);
+
+  UNLOCK(filesystem, syncing);
+
+  return result;
+}
+
+
+/*
+ * Appends a record of command to the records waiting in the journal of
+ * the unix variable sent in, and notes in it how many records the
+ * journal has with it, for journal_commit(). Its path is arg, of length
+ * len, after the directory path dir, of length dir_len, with a slash
+ * between them if dir doesn't end in one. The extra_len bytes of extra
+ * and the data_len bytes of data follow it. When container isn't NULL
+ * nothing is recorded below a directory whose rm is recorded already,
+ * and a directory rm removes is marked so. The record is checked before
+ * the lock of the journal is taken, so only adding the record is done
+ * under it. Commands record themselves under the lock of the directory
+ * they change, so nothing is written to the file here.
+ */
+static void append_record(Unix *filesystem, enum Command command,
+			  Container *container, const char dir[],
+			  unsigned long dir_len, const char arg[],
+			  unsigned long len, const char extra[],
+			  unsigned long extra_len, const char data[],
+			  unsigned long data_len) {
+
+  Journal *journal = filesystem->tree->journal;
+  JournalRecord record;
+  unsigned long slash = dir_len > 0 && dir[dir_len - 1] != '/';
+
+  record.command = command;
+  record.len = dir_len + slash + len + extra_len + data_len;
+  record.check = record_check(command, NULL, record.len);
+  record.check = check_bytes(record.check, dir, dir_len);
+  record.check = check_bytes(record.check, "/", slash);
+  record.check = check_bytes(record.check, arg, len);
+  record.check = check_bytes(record.check, extra, extra_len);
+  record.check = check_bytes(record.check, data, data_len);
+
+  LOCK(filesystem, journal);
+
+  if (container == NULL || !unlinked_above(filesystem, container)) {
+
+    sink_write(&journal->batch, (const char *) &record, sizeof(record));
+    sink_write(&journal->batch, dir, dir_len);
+    sink_write(&journal->batch, "/", slash);
+    sink_write(&journal->batch, arg, len);
+    sink_write(&journal->batch, extra, extra_len);
+    sink_write(&journal->batch, data, data_len);
+    journal->records++;
+
+    if (command == C_RM && container != NULL
+	&& container->directory != NULL) {
+      container->directory->unlinked = 1;
+
+      if (filesystem->tree->locks != NULL)
+	journal->removal = new_epoch(filesystem);
+    }
+
+    filesystem->journaled = ++journal->appended;
+  }
+
+  UNLOCK(filesystem, journal);
+}
+
+
+/*
+ * Returns 1 if a directory container is inside, up to the root, has had
+ * its rm recorded in the journal of the unix variable sent in, 0
+ * otherwise. Only a command that was already running when the last such
+ * rm was recorded can have looked its path up through one, so any other
+ * command is answered at once, and one thread running alone never is.
+ * The caller holds the lock of the journal, which the marks are set
+ * under.
+ */
+static int unlinked_above(Unix *filesystem, const Container *container) {
+
+  if (filesystem->tree->locks == NULL
+      || atomic_load_explicit(&filesystem->epoch, memory_order_relaxed)
+	 > filesystem->tree->journal->removal)
+    return 0;
+
+  for (container = container->parent; container != NULL;
+       container = container->parent) {
+
+    if (container->directory->unlinked)
+      return 1;
+
+    if (container->type == U_ROOT)
+      break;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Returns the 32-bit FNV-1a hash a record of command with the path of
+ * length len is checked by. A NULL path leaves the hash of its bytes
+ * to be added by check_bytes().
+ */
+static uint32_t record_check(uint32_t command, const char path[],
+			     uint32_t len) {
+
+  uint32_t hash = 2166136261u;
+
+  hash = (hash ^ command) * 16777619u;
+  hash = (hash ^ len) * 16777619u;
+
+  if (path != NULL)
+    hash = check_bytes(hash, path, len);
+
+  return hash;
+}
+
+
+/*
+ * Returns the FNV-1a hash hash carried on over the len bytes of bytes
+ */
+static uint32_t check_bytes(uint32_t hash, const char bytes[],
+			    unsigned long len) {
+
+  unsigned long i;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) bytes[i]) * 16777619u;
+
+  return hash;
+}
@@ -0,0 +1,104 @@
+/*
+ * unix-journal.h
+ *
+ * Header file for the journal of a Unix filesystem.
+ *
+ * A journal file is a header followed by one record for every touch,
+ * mkdir, rm, write and append that succeeded since the image of the
+ * tree was last saved. Each record holds the command and the absolute
+ * path it acted on, so running the records again from the image
+ * rebuilds the tree whichever session ran them and wherever it was.
+ * The path of a write or append is followed by a NUL byte, the offset
+ * it wrote at and the bytes it wrote. A record is checked
+ * by a hash of its contents, so one torn by a crash ends the journal.
+ *
+ * A command that changed the tree returns only once its records are
+ * on disk, so a change a command reported survives a crash, and a
+ * crash loses at most the changes of commands that hadn't returned.
+ * The records are added to a batch in memory under the locks the
+ * command holds, and written and synced by journal_commit() after it
+ * has let go of them. Commands that finish at the same time share one
+ * sync, as the first of them to get to the file writes the whole batch.
+ *
+ * Commands that change one directory while other threads run record
+ * themselves under its lock, so the records of one directory are in
+ * the order its changes happened. rm records a directory as it unlinks
+ * it from its parent, though, while a command that looked up a path
+ * inside it earlier may still be changing something below it. The
+ * directories rm recorded are marked under the lock of the journal, and
+ * a change below one of them is left out of the journal, so replaying
+ * it never makes that change in whatever later takes the place of the
+ * directory. The epoch the last such rm was recorded in is kept, and
+ * only a command that entered the tree before it walks up the
+ * directories above its change to check; every other command checks
+ * in O(1).
+ *
+ * The header holds the generation of the journal, the number of
+ * checkpoints taken. The image written by a checkpoint carries the
+ * generation it starts, so a journal left behind by a checkpoint that
+ * didn't finish is recognised as older than its image.
+ */
+
+#include <stdint.h>
+#include "unix-datastructure.h"
+
+/* First bytes of every journal */
+#define JOURNAL_MAGIC "UNIXJRN1"
+#define JOURNAL_MAGIC_LEN 8
+
+typedef struct journal_header {
+  char magic[JOURNAL_MAGIC_LEN];
+  uint64_t generation;		/* checkpoints taken before this journal */
+} JournalHeader;
+
+/* Followed by the len bytes of the path */
+typedef struct journal_record {
+  uint32_t command;		/* an enum Command */
+  uint32_t len;			/* length of the path and what follows it */
+  uint32_t check;		/* hash of the command and those bytes */
+} JournalRecord;
+
+/* Records a command that succeeded with the path arg, adding or
+   removing container, when the tree has a journal */
+#define JOURNAL(fs, command, arg, container)			\
+  do {								\
+    if ((fs)->tree->journal != NULL)				\
+      journal_record(fs, command, arg, container);		\
+  } while (0)
+
+/* Records a write or append that succeeded with the path arg, writing
+   the len bytes of data at offset into file, when the tree has a
+   journal */
+#define JOURNAL_CONTENTS(fs, command, arg, offset, data, len, file)	\
+  do {									\
+    if ((fs)->tree->journal != NULL)					\
+      journal_contents(fs, command, arg, offset, data, len, file);	\
+  } while (0)
+
+/* Records a command that succeeded with the paths arg and dest, when
+   the tree has a journal */
+#define JOURNAL_PATHS(fs, command, arg, dest)			\
+  do {								\
+    if ((fs)->tree->journal != NULL)				\
+      journal_paths(fs, command, arg, dest);			\
+  } while (0)
+
+/* Records a command that succeeded with the name arg, which isn't a
+   path, when the tree has a journal */
+#define JOURNAL_NAME(fs, command, arg)				\
+  do {								\
+    if ((fs)->tree->journal != NULL)				\
+      journal_name(fs, command, arg);				\
+  } while (0)
+
+void journal_record(Unix *filesystem, enum Command command,
+		    const char arg[], Container *container);
+void journal_contents(Unix *filesystem, enum Command command,
+		      const char arg[], uint64_t offset, const char data[],
+		      unsigned long len, Container *file);
+void journal_paths(Unix *filesystem, enum Command command,
+		   const char arg[], const char dest[]);
+void journal_name(Unix *filesystem, enum Command command, const char arg[]);
+int journal_commit(Unix *filesystem);
+int journal_full(Unix *filesystem);
+int journal_failed(Unix *filesystem);
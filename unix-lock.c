@@ -0,0 +1,385 @@
+/*
+ * unix-lock.c
+ *
+ * This file contains the locks of a simulated Unix filesystem that lets
+ * several threads work on one tree: the epochs commands enter the tree
+ * in, a lock for the whole tree, one for each directory and mutexes for
+ * the state all commands share.
+ */
+
+/* Writer-preferring reader-writer locks are a glibc extension */
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "unix.h"
+#include "unix-arena.h"
+#include "unix-lock.h"
+#include "unix-tree.h"
+
+/* The tree the running thread holds the tree lock of, and how many
+   times it has taken it since */
+static _Thread_local Tree *held_tree;
+static _Thread_local unsigned long held_depth;
+
+/* The bits of the lock of a directory: held by a writer, a writer
+   waiting for it, and one reader holding it */
+#define DIR_WRITER 1UL
+#define DIR_WAITING 2UL
+#define DIR_READER 4UL
+
+static void init_rwlock(pthread_rwlock_t *lock);
+
+
+/*
+ * Lets threads run commands on the tree of the unix variable sent in at
+ * the same time if enable is non-zero, each through a session of its
+ * own made with mksession(), and goes back to one thread at a time
+ * otherwise. Nothing else may run on the tree while this does.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int enable_threads(Unix *filesystem, int enable) {
+
+  Tree *tree = filesystem->tree;
+  Locks *locks;
+  Unix *session;
+
+  if (!enable) {
+
+    if (tree->locks != NULL) {
+
+      /* Free what is still retired, and let every session pick up
+	 where rm last moved it and give back the blocks it kept */
+      reclaim(filesystem, 1);
+
+      for (session = tree->sessions; session != NULL;
+	   session = session->next_session) {
+	if (session->curr_dir != session->shared_dir) {
+	  session->curr_dir = session->shared_dir;
+	  session->path_valid = 0;
+	}
+
+	cache_empty(&session->cache, &tree->arena);
+      }
+
+      free_locks(tree);
+    }
+
+    return 1;
+  }
+
+  if (tree->locks != NULL)
+    return 1;
+
+  locks = malloc(sizeof(Locks));
+
+  if (locks == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  init_rwlock(&locks->tree);
+  pthread_mutex_init(&locks->alloc, NULL);
+  init_rwlock(&locks->order);
+  pthread_mutex_init(&locks->journal, NULL);
+  pthread_mutex_init(&locks->syncing, NULL);
+  pthread_mutex_init(&locks->clones, NULL);
+  atomic_init(&locks->busy, 0);
+  atomic_init(&locks->epoch, 1);
+  atomic_init(&locks->retired, NULL);
+
+  tree->locks = locks;
+
+  return 1;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Enters the tree of the unix variable sent in for a command, which
+ * then runs without locks until leave_tree(), waiting first while
+ * another thread holds the tree lock. The current directory of the
+ * session is picked up where rm last moved it, and stays put for the
+ * command.
+ */
+void enter_tree(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+  Locks *locks = tree->locks;
+  Container *dir;
+
+  if (locks == NULL)
+    return;
+
+  while (held_tree != tree) {
+
+    atomic_store_explicit(&filesystem->epoch,
+			  atomic_load_explicit(&locks->epoch,
+					       memory_order_acquire),
+			  memory_order_relaxed);
+
+    /* Pairs with the fences of lock_tree() and oldest_epoch(): either
+       they see the epoch, or this command sees everything done before
+       them */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!atomic_load_explicit(&locks->busy, memory_order_acquire))
+      break;
+
+    atomic_store_explicit(&filesystem->epoch, 0, memory_order_release);
+
+    /* Wait for the tree lock to be released */
+    pthread_rwlock_rdlock(&locks->tree);
+    pthread_rwlock_unlock(&locks->tree);
+  }
+
+  dir = atomic_load_explicit(&filesystem->shared_dir, memory_order_acquire);
+
+  if (dir != filesystem->curr_dir) {
+    filesystem->curr_dir = dir;
+    filesystem->path_valid = 0;
+  }
+}
+
+
+/*
+ * Leaves the tree of the unix variable sent in at the end of a command
+ */
+void leave_tree(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+
+  if (tree->locks == NULL || held_tree == tree)
+    return;
+
+  atomic_store_explicit(&filesystem->epoch, 0, memory_order_release);
+}
+
+
+/*
+ * Takes the tree lock of the unix variable sent in, once every command
+ * inside the tree has left. A thread that holds it already, such as one
+ * replaying a journal, takes it again without waiting.
+ */
+void lock_tree(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+  Locks *locks = tree->locks;
+  Unix *session;
+
+  if (locks == NULL)
+    return;
+
+  if (held_tree == tree) {
+    held_depth++;
+    return;
+  }
+
+  pthread_rwlock_wrlock(&locks->tree);
+  held_tree = tree;
+  held_depth = 1;
+
+  atomic_store_explicit(&locks->busy, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  for (session = tree->sessions; session != NULL;
+       session = session->next_session) {
+    while (atomic_load_explicit(&session->epoch, memory_order_acquire) != 0)
+      sched_yield();
+  }
+}
+
+
+/*
+ * Releases the tree lock of the unix variable sent in, once for every
+ * time lock_tree() took it
+ */
+void unlock_tree(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+
+  if (tree->locks == NULL || --held_depth > 0)
+    return;
+
+  held_tree = NULL;
+  atomic_store_explicit(&tree->locks->busy, 0, memory_order_release);
+  pthread_rwlock_unlock(&tree->locks->tree);
+}
+
+
+/*
+ * Takes the lock of the directory dir of the unix variable sent in, to
+ * add an entry to it, unlink one or write to one of its files. Nothing
+ * is needed while the thread holds the tree lock.
+ */
+void lock_dir(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  _Atomic unsigned long *lock;
+  unsigned long state;
+
+  if (tree->locks == NULL || held_tree == tree)
+    return;
+
+  lock = &dir->directory->lock;
+
+  while (1) {
+
+    state = atomic_load_explicit(lock, memory_order_relaxed);
+
+    if ((state & ~DIR_WAITING) == 0) {
+      if (atomic_compare_exchange_weak_explicit(lock, &state, DIR_WRITER,
+						memory_order_acquire,
+						memory_order_relaxed))
+	return;
+    } else if (!(state & DIR_WAITING))
+      atomic_fetch_or_explicit(lock, DIR_WAITING, memory_order_relaxed);
+    else
+      sched_yield();
+  }
+}
+
+
+/*
+ * Takes the lock of the directory dir of the unix variable sent in
+ * shared with other readers, to read what changes under the lock
+ */
+void lock_dir_shared(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  _Atomic unsigned long *lock;
+  unsigned long state;
+
+  if (tree->locks == NULL || held_tree == tree)
+    return;
+
+  lock = &dir->directory->lock;
+
+  while (1) {
+
+    state = atomic_load_explicit(lock, memory_order_relaxed);
+
+    /* A writer waiting goes ahead of new readers */
+    if (state & (DIR_WRITER | DIR_WAITING))
+      sched_yield();
+    else if (atomic_compare_exchange_weak_explicit(lock, &state,
+						   state + DIR_READER,
+						   memory_order_acquire,
+						   memory_order_relaxed))
+      return;
+  }
+}
+
+
+/*
+ * Releases the lock of the directory dir of the unix variable sent in,
+ * taken by lock_dir() or lock_dir_shared()
+ */
+void unlock_dir(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  _Atomic unsigned long *lock;
+
+  if (tree->locks == NULL || held_tree == tree)
+    return;
+
+  lock = &dir->directory->lock;
+
+  /* No reader gets in while a writer holds it */
+  if (atomic_load_explicit(lock, memory_order_relaxed) & DIR_WRITER)
+    atomic_fetch_and_explicit(lock, ~DIR_WRITER, memory_order_release);
+  else
+    atomic_fetch_sub_explicit(lock, DIR_READER, memory_order_release);
+}
+
+
+/*
+ * Starts a new epoch on the tree of the unix variable sent in, after
+ * something was unlinked from it. Commands that enter from now on can't
+ * reach it.
+ *
+ * Returns the new epoch
+ */
+unsigned long new_epoch(Unix *filesystem) {
+  return atomic_fetch_add(&filesystem->tree->locks->epoch, 1) + 1;
+}
+
+
+/*
+ * Returns the earliest epoch that a command still inside the tree of
+ * the unix variable sent in entered in, or ULONG_MAX if there is none.
+ * Whatever was retired in that epoch or an earlier one is no longer
+ * used by any command.
+ */
+unsigned long oldest_epoch(Unix *filesystem) {
+
+  unsigned long oldest = ULONG_MAX, epoch;
+  Unix *session;
+
+  atomic_thread_fence(memory_order_seq_cst);
+
+  for (session = filesystem->tree->sessions; session != NULL;
+       session = session->next_session) {
+
+    epoch = atomic_load_explicit(&session->epoch, memory_order_acquire);
+
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+
+  return oldest;
+}
+
+
+/*
+ * Frees the locks of tree, which no thread may hold, and leaves it with
+ * none
+ */
+void free_locks(Tree *tree) {
+
+  Locks *locks = tree->locks;
+
+  if (locks == NULL)
+    return;
+
+  pthread_rwlock_destroy(&locks->tree);
+  pthread_mutex_destroy(&locks->alloc);
+  pthread_rwlock_destroy(&locks->order);
+  pthread_mutex_destroy(&locks->journal);
+  pthread_mutex_destroy(&locks->syncing);
+  pthread_mutex_destroy(&locks->clones);
+
+  free(locks);
+  tree->locks = NULL;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Initializes lock to let a waiting writer in ahead of new readers, so
+ * a command on the whole tree isn't held off by the commands waiting
+ * out the one before it
+ */
+static void init_rwlock(pthread_rwlock_t *lock) {
+
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np(&attr,
+				PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
@@ -0,0 +1,113 @@
+/*
+ * unix-lock.h
+ *
+ * Header file for the locks that let several threads run commands on
+ * the tree of a Unix filesystem at once, each through a session of its
+ * own.
+ *
+ * Lookups and listings take no locks at all. A command enters the tree
+ * by announcing the epoch it started in, and the links it follows are
+ * loaded atomically. Every directory has a reader-writer lock of its
+ * own, a word in the directory itself. Commands that change the tree
+ * hold the lock of the directory they add an entry to or unlink one
+ * from, or whose file they write to, so commands in different
+ * directories never wait on each other, and no command holds more than
+ * one directory lock at a time. What changes under it, such as the
+ * contents of a file cat shares or the levels a completion searches, is
+ * read with the lock shared, so readers of a directory don't wait on
+ * each other. A thread waiting for a directory lock yields the processor
+ * and tries again rather than sleeping, which costs little since no
+ * lock is held for more than one change, but threads all writing to one
+ * directory take turns at it. The commands that work on the whole
+ * tree (save, load, map_image, the journal, ...) hold the tree lock,
+ * which waits for every command inside the tree to leave and keeps new
+ * ones out until it is released.
+ *
+ * Nothing unlinked while commands run is freed on the spot. It is
+ * retired with the epoch it was unlinked in and freed once every
+ * command that entered before then has left, so a container found
+ * inside the tree stays valid until the command leaves.
+ *
+ * Until enable_threads() is called the tree has no locks and the macros
+ * and functions cost a single test.
+ */
+
+#ifndef UNIX_LOCK_H
+#define UNIX_LOCK_H
+
+#include <pthread.h>
+#include "unix-datastructure.h"
+
+/* Memory taken out of the tree while commands may still be using it */
+typedef struct retired {
+  struct retired * next;
+  unsigned long epoch;		/* epoch it was retired in */
+  Container * container;	/* a removed container, or NULL */
+  int moved;			/* sessions inside it were moved out again */
+  void * block;			/* otherwise a block of size bytes */
+  unsigned long size;
+} Retired;
+
+typedef struct locks {
+  pthread_rwlock_t tree;	/* held by commands on the whole tree */
+  pthread_mutex_t alloc;	/* the arena, container ids and level seed */
+  pthread_rwlock_t order;	/* the order of the directories */
+  pthread_mutex_t journal;	/* the records waiting to be synced */
+  pthread_mutex_t syncing;	/* the journal file while a batch is
+				   written to it */
+  pthread_mutex_t clones;	/* the layers of copies and what is frozen
+				   into them */
+  _Atomic int busy;		/* set while the tree lock is held */
+  _Atomic unsigned long epoch;	/* advanced whenever memory is retired */
+  _Atomic(Retired *) retired;	/* memory waiting to be freed */
+} Locks;
+
+/* Locks the mutex called name of the tree of fs, when it has locks */
+#define LOCK(fs, name)						\
+  do {								\
+    if ((fs)->tree->locks != NULL)				\
+      pthread_mutex_lock(&(fs)->tree->locks->name);		\
+  } while (0)
+
+/* Unlocks the mutex called name of the tree of fs */
+#define UNLOCK(fs, name)					\
+  do {								\
+    if ((fs)->tree->locks != NULL)				\
+      pthread_mutex_unlock(&(fs)->tree->locks->name);		\
+  } while (0)
+
+/* Locks the reader-writer lock called name of the tree of fs for
+   reading, when it has locks */
+#define LOCK_SHARED(fs, name)					\
+  do {								\
+    if ((fs)->tree->locks != NULL)				\
+      pthread_rwlock_rdlock(&(fs)->tree->locks->name);		\
+  } while (0)
+
+/* Locks the reader-writer lock called name of the tree of fs for
+   writing, when it has locks */
+#define LOCK_EXCLUSIVE(fs, name)				\
+  do {								\
+    if ((fs)->tree->locks != NULL)				\
+      pthread_rwlock_wrlock(&(fs)->tree->locks->name);		\
+  } while (0)
+
+/* Unlocks the reader-writer lock called name of the tree of fs */
+#define UNLOCK_RW(fs, name)					\
+  do {								\
+    if ((fs)->tree->locks != NULL)				\
+      pthread_rwlock_unlock(&(fs)->tree->locks->name);		\
+  } while (0)
+
+void enter_tree(Unix *filesystem);
+void leave_tree(Unix *filesystem);
+void lock_tree(Unix *filesystem);
+void unlock_tree(Unix *filesystem);
+void lock_dir(Unix *filesystem, Container *dir);
+void lock_dir_shared(Unix *filesystem, Container *dir);
+void unlock_dir(Unix *filesystem, Container *dir);
+unsigned long new_epoch(Unix *filesystem);
+unsigned long oldest_epoch(Unix *filesystem);
+void free_locks(Tree *tree);
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * unix-order.c
+ *
+ * This file contains the order the directories of a simulated Unix
+ * filesystem are kept in, which tells whether one directory is inside
+ * another in O(log n) expected time without walking up from it, and
+ * moves a directory with everything inside it in the same time. It has
+ * a reader-writer lock of its own, so telling whether one directory is
+ * inside another waits only on commands changing the order, not on
+ * other readers or on allocation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "unix-order.h"
+#include "unix-lock.h"
+
+/* Marks below mark in the balanced tree, and mark itself */
+#define SIZE(mark) ((mark) != NULL ? (mark)->size : 0)
+
+static void insert_before(Tree *tree, Mark *next, Mark *mark);
+static void remove_mark(Tree *tree, Mark *mark);
+static void rotate_up(Tree *tree, Mark *mark);
+static void insert_at(Tree *tree, unsigned long position, Mark *marks);
+static Mark *detach(Mark *top);
+static unsigned long position_of(const Mark *mark);
+static const Mark *top_of(const Mark *mark);
+static Mark *merge(Mark *first, Mark *second);
+static void split(Mark *top, unsigned long count, Mark **first,
+		  Mark **second);
+static void update(Mark *mark);
+static unsigned long priority(const Mark *mark);
+
+
+/*
+ * Empties the order of the directories of tree
+ */
+void order_init(Tree *tree) {
+  tree->order = NULL;
+}
+
+
+/*
+ * Puts the marks of dir, a new directory whose parent is set, just
+ * before the end of the parent, before dir can be reached, which is in
+ * the piece the parent was cut into once it is removed. The marks of a
+ * root go first in the order, apart from every other root. A file has
+ * none.
+ */
+void order_insert(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  Mark *next;
+
+  if (dir->directory == NULL)
+    return;
+
+  LOCK_EXCLUSIVE(filesystem, order);
+
+  if (dir->type != U_ROOT)
+    next = &dir->parent->directory->marks[1];
+  else
+    for (next = tree->order; next != NULL && next->left != NULL;
+	 next = next->left)
+      ;
+
+  /* The end first, since next is NULL while the order is empty */
+  insert_before(tree, next, &dir->directory->marks[1]);
+  insert_before(tree, &dir->directory->marks[1], &dir->directory->marks[0]);
+
+  UNLOCK_RW(filesystem, order);
+}
+
+
+/*
+ * Moves the marks of dir, a directory just linked into a new parent,
+ * and every mark between them, to just before the end of the parent.
+ * They are cut out of the order and put back in as one piece, so the
+ * directories below dir are never looked at.
+ */
+void order_move(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  Mark *before, *marks, *after, *rest;
+  unsigned long first, last;
+
+  if (dir->directory == NULL)
+    return;
+
+  LOCK_EXCLUSIVE(filesystem, order);
+
+  first = position_of(&dir->directory->marks[0]);
+  last = position_of(&dir->directory->marks[1]);
+
+  split(tree->order, first, &before, &rest);
+  split(detach(rest), last - first + 1, &marks, &after);
+  tree->order = detach(merge(detach(before), detach(after)));
+
+  insert_at(tree, position_of(&dir->parent->directory->marks[1]),
+	    detach(marks));
+
+  UNLOCK_RW(filesystem, order);
+}
+
+
+/*
+ * Takes the marks of dir, a directory about to be freed, out of the
+ * order of the unix variable sent in, or out of the piece it was cut
+ * into
+ */
+void order_remove(Unix *filesystem, Container *dir) {
+
+  if (dir->directory == NULL)
+    return;
+
+  LOCK_EXCLUSIVE(filesystem, order);
+  order_unlink(filesystem->tree, dir);
+  UNLOCK_RW(filesystem, order);
+}
+
+
+/*
+ * Cuts the marks of dir, a directory just removed, and every mark
+ * between them out of the order of the unix variable sent in at once,
+ * into a piece of their own, so nothing inside dir is looked at. A
+ * directory already cut out with a piece is left in it.
+ */
+void order_cut(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  Mark *before, *marks, *after, *rest;
+  unsigned long first, last;
+
+  if (dir->directory == NULL || dir->directory->marks[0].size == 0)
+    return;
+
+  LOCK_EXCLUSIVE(filesystem, order);
+
+  if (top_of(&dir->directory->marks[0]) == tree->order) {
+
+    first = position_of(&dir->directory->marks[0]);
+    last = position_of(&dir->directory->marks[1]);
+
+    split(tree->order, first, &before, &rest);
+    split(detach(rest), last - first + 1, &marks, &after);
+    tree->order = detach(merge(detach(before), detach(after)));
+    detach(marks);
+  }
+
+  UNLOCK_RW(filesystem, order);
+}
+
+
+/*
+ * Checks if dir, a directory cut out of the order, has the piece it was
+ * cut into to itself: nothing outside it was cut out with it, or is
+ * still kept in it. A file has no marks to share.
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+int order_alone(Unix *filesystem, Container *dir) {
+
+  const Mark *marks;
+  int result;
+
+  if (dir->directory == NULL || dir->directory->marks[0].size == 0)
+    return 1;
+
+  marks = dir->directory->marks;
+
+  LOCK_SHARED(filesystem, order);
+  result = top_of(&marks[0]) != filesystem->tree->order
+    && position_of(&marks[0]) == 0
+    && position_of(&marks[1]) == top_of(&marks[1])->size - 1;
+  UNLOCK_RW(filesystem, order);
+
+  return result;
+}
+
+
+/*
+ * Takes the marks of dir out of the order of tree, or out of the piece
+ * it was cut into, for a caller that holds the lock on the order. Marks
+ * that were never put in the order are left alone.
+ */
+void order_unlink(Tree *tree, Container *dir) {
+
+  if (dir->directory == NULL || dir->directory->marks[0].size == 0)
+    return;
+
+  remove_mark(tree, &dir->directory->marks[0]);
+  remove_mark(tree, &dir->directory->marks[1]);
+}
+
+
+/*
+ * Checks if ancestor is dir or one of the directories above it, from
+ * the places of their marks in the order. A file only contains itself,
+ * and a directory cut out of the order only what was cut out with it.
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+int is_ancestor(Unix *filesystem, Container *ancestor, Container *dir) {
+
+  Mark *outer, *inner;
+  int result;
+
+  if (ancestor->directory == NULL || dir->directory == NULL)
+    return ancestor == dir;
+
+  outer = ancestor->directory->marks;
+  inner = dir->directory->marks;
+
+  LOCK_SHARED(filesystem, order);
+  result = top_of(&outer[0]) == top_of(&inner[0])
+    && position_of(&outer[0]) <= position_of(&inner[0])
+    && position_of(&inner[1]) <= position_of(&outer[1]);
+  UNLOCK_RW(filesystem, order);
+
+  return result;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Puts mark, which isn't in the order of tree, just before next, or
+ * alone in the order when next is NULL. It goes in at the bottom of the
+ * tree, counted by every mark above it, and is turned up past the marks
+ * of lower priority.
+ */
+static void insert_before(Tree *tree, Mark *next, Mark *mark) {
+
+  Mark *at;
+
+  mark->left = NULL;
+  mark->right = NULL;
+  mark->size = 1;
+
+  if (next == NULL) {
+    mark->parent = NULL;
+    tree->order = mark;
+    return;
+  }
+
+  /* Right after the last mark before next, below next */
+  if (next->left == NULL) {
+    next->left = mark;
+    mark->parent = next;
+  } else {
+
+    for (at = next->left; at->right != NULL; at = at->right)
+      ;
+
+    at->right = mark;
+    mark->parent = at;
+  }
+
+  for (at = mark->parent; at != NULL; at = at->parent)
+    at->size++;
+
+  while (mark->parent != NULL && priority(mark) > priority(mark->parent))
+    rotate_up(tree, mark);
+}
+
+
+/*
+ * Takes mark out of the order of tree, or out of the piece it is in. It
+ * is turned down below the marks of higher priority until it has one
+ * mark below it at most, which takes its place, and is no longer
+ * counted above it.
+ */
+static void remove_mark(Tree *tree, Mark *mark) {
+
+  Mark *child, *at;
+
+  while (mark->left != NULL && mark->right != NULL)
+    rotate_up(tree, priority(mark->left) > priority(mark->right)
+	      ? mark->left : mark->right);
+
+  child = mark->left != NULL ? mark->left : mark->right;
+
+  if (child != NULL)
+    child->parent = mark->parent;
+
+  if (mark->parent == NULL) {
+    if (tree->order == mark)
+      tree->order = child;
+  } else if (mark->parent->left == mark)
+    mark->parent->left = child;
+  else
+    mark->parent->right = child;
+
+  for (at = mark->parent; at != NULL; at = at->parent)
+    at->size--;
+
+  mark->parent = NULL;
+  mark->left = NULL;
+  mark->right = NULL;
+  mark->size = 0;
+}
+
+
+/*
+ * Turns mark up above its parent in the order of tree, or in the piece
+ * it is in, keeping the order of the marks. Only the top of the order
+ * itself is kept track of.
+ */
+static void rotate_up(Tree *tree, Mark *mark) {
+
+  Mark *parent = mark->parent, *above = parent->parent;
+
+  if (mark == parent->left) {
+    parent->left = mark->right;
+    mark->right = parent;
+  } else {
+    parent->right = mark->left;
+    mark->left = parent;
+  }
+
+  mark->parent = above;
+
+  if (above == NULL) {
+    if (tree->order == parent)
+      tree->order = mark;
+  } else if (above->left == parent)
+    above->left = mark;
+  else
+    above->right = mark;
+
+  update(parent);
+  update(mark);
+}
+
+
+/*
+ * Puts marks, the top of a piece of the order of tree that isn't in it,
+ * in the order with position marks before them
+ */
+static void insert_at(Tree *tree, unsigned long position, Mark *marks) {
+
+  Mark *before, *after;
+
+  split(tree->order, position, &before, &after);
+  tree->order = detach(merge(merge(detach(before), marks), detach(after)));
+}
+
+
+/*
+ * Leaves top, the top of a piece of the order split off from the rest,
+ * with nothing above it
+ *
+ * Returns top
+ */
+static Mark *detach(Mark *top) {
+
+  if (top != NULL)
+    top->parent = NULL;
+
+  return top;
+}
+
+
+/*
+ * Returns the number of marks before mark in its order, found on the
+ * way up to the top of the balanced tree
+ */
+static unsigned long position_of(const Mark *mark) {
+
+  unsigned long position = SIZE(mark->left);
+
+  for (; mark->parent != NULL; mark = mark->parent)
+    if (mark == mark->parent->right)
+      position += SIZE(mark->parent->left) + 1;
+
+  return position;
+}
+
+
+/*
+ * Returns the top of the order, or of the piece, mark is in
+ */
+static const Mark *top_of(const Mark *mark) {
+
+  while (mark->parent != NULL)
+    mark = mark->parent;
+
+  return mark;
+}
+
+
+/*
+ * Joins the pieces of the order with tops first and second, all of
+ * first going before second. The top with the higher priority stays on
+ * top, which keeps the tree balanced whatever order the marks come in.
+ *
+ * Returns the top of the joined order
+ */
+static Mark *merge(Mark *first, Mark *second) {
+
+  if (first == NULL)
+    return second;
+
+  if (second == NULL)
+    return first;
+
+  if (priority(first) > priority(second)) {
+    first->right = merge(first->right, second);
+    update(first);
+    return first;
+  }
+
+  second->left = merge(first, second->left);
+  update(second);
+
+  return second;
+}
+
+
+/*
+ * Splits the piece of the order with top into the first count marks,
+ * whose top is stored to first, and the rest, whose top is stored to
+ * second. The parents of the new tops are left to the caller.
+ */
+static void split(Mark *top, unsigned long count, Mark **first,
+		  Mark **second) {
+
+  if (top == NULL) {
+    *first = NULL;
+    *second = NULL;
+    return;
+  }
+
+  if (SIZE(top->left) < count) {
+    split(top->right, count - SIZE(top->left) - 1, &top->right, second);
+    update(top);
+    *first = top;
+  } else {
+    split(top->left, count, first, &top->left);
+    update(top);
+    *second = top;
+  }
+}
+
+
+/*
+ * Sets the size of mark and the parent of the marks right below it,
+ * after they changed
+ */
+static void update(Mark *mark) {
+
+  mark->size = 1 + SIZE(mark->left) + SIZE(mark->right);
+
+  if (mark->left != NULL)
+    mark->left->parent = mark;
+
+  if (mark->right != NULL)
+    mark->right->parent = mark;
+}
+
+
+/*
+ * Returns the priority of mark in the balanced tree, a hash of where it
+ * is in memory, which is as good as a random number for keeping the
+ * tree balanced and costs nothing to store
+ */
+static unsigned long priority(const Mark *mark) {
+
+  uint64_t hash = (uintptr_t) mark;
+
+  /* The finalizer of splitmix64 */
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+
+  return hash ^ (hash >> 31);
+}
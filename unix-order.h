@@ -0,0 +1,56 @@
+/*
+ * unix-order.h
+ *
+ * Header file for the order the directories of a Unix filesystem are
+ * kept in, so whether one is inside another is found without walking
+ * up from it.
+ *
+ * Every directory, and every root, has two marks in the order: one
+ * where it starts and one where it ends, with everything inside it
+ * between them. One directory is inside another when its marks are
+ * between those of the other.
+ *
+ * The marks are the nodes of a balanced binary tree, a treap, kept in
+ * the order of the marks rather than sorted on a key. Each mark knows
+ * how many marks are below it, so its place in the order is counted on
+ * the way up from it to the top, and each has a priority, a hash of its
+ * address, with a mark always above the marks of lower priority. That
+ * keeps the tree O(log n) high whatever order marks come and go in.
+ * Splitting the tree at a place and joining two pieces end to end each
+ * follow one path down it.
+ *
+ * So putting the marks of a new directory just before the end of its
+ * parent, taking the marks of a freed directory out, telling whether
+ * one directory is inside another and moving a directory are each
+ * O(log n) expected. A moved directory has the piece of the order from
+ * its start to its end split off and joined back in before the end of
+ * its new parent, however much is below it: nothing inside it is
+ * looked at.
+ *
+ * Telling whether one directory is inside another is O(log n), not
+ * O(1): it counts the places of four marks on the way up the tree,
+ * rather than comparing four labels. Labels that stay comparable in
+ * O(1) would have to be rewritten for everything below a moved
+ * directory, making mv as slow as the subtree is big. The order has a
+ * reader-writer lock of its own, held shared by the check, so checks
+ * wait on nothing but the mkdir, rm and mv changing the order.
+ *
+ * A removed directory has the piece from its start to its end cut out
+ * of the order at once, rather than every directory inside it taking
+ * its marks out one at a time. The piece stays a balanced tree of its
+ * own while anything in it may still be kept for copies or have a
+ * directory added by a command that started before the removal, and
+ * marks in it are taken out, or put in, without touching the order.
+ * A directory in a piece is inside no directory of the order.
+ */
+
+#include "unix-datastructure.h"
+
+void order_init(Tree *tree);
+void order_insert(Unix *filesystem, Container *dir);
+void order_move(Unix *filesystem, Container *dir);
+void order_remove(Unix *filesystem, Container *dir);
+void order_cut(Unix *filesystem, Container *dir);
+int order_alone(Unix *filesystem, Container *dir);
+void order_unlink(Tree *tree, Container *dir);
+int is_ancestor(Unix *filesystem, Container *ancestor, Container *dir);
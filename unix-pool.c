@@ -0,0 +1,426 @@
+/*
+ * unix-pool.c
+ *
+ * This file contains the work-stealing task pool of a simulated Unix
+ * filesystem, which runs the recursive commands on several threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "unix-pool.h"
+
+/* Slots a deque starts out with */
+#define DEQUE_MIN_SIZE 64
+
+/* Tasks that have to wait in a deque before sleeping workers are woken
+   to steal them */
+#define WAKE_TASKS 2
+
+/* Times in a row a worker thread finds nothing to take before it goes
+   back to sleep */
+#define SPIN_ROUNDS 64
+
+static void *work(void *arg);
+static void help(Worker *worker, int rounds);
+static int take(Worker *worker, Task *task);
+static void execute(Worker *worker, Task *task);
+static int deque_init(Deque *deque);
+static void deque_release(Deque *deque);
+static unsigned long deque_push(Deque *deque, const Task *task);
+static int deque_pop(Deque *deque, Task *task);
+static int deque_steal(Deque *deque, Task *task);
+
+
+/*
+ * Creates a pool of the given number of workers, counting the thread
+ * that runs a job, and starts a thread for each of the others
+ *
+ * Returns the pool, or NULL if it couldn't be created
+ */
+Pool *pool_create(int workers) {
+
+  Pool *pool = malloc(sizeof(Pool));
+
+  if (pool == NULL)
+    return NULL;
+
+  pool->worker = calloc(workers, sizeof(Worker));
+
+  if (pool->worker == NULL) {
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->busy, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->wakeups = 0;
+  pool->stop = 0;
+  atomic_init(&pool->idle, 0);
+  atomic_init(&pool->pending, 0);
+
+  for (pool->workers = 0; pool->workers < workers; pool->workers++) {
+
+    Worker *worker = &pool->worker[pool->workers];
+
+    worker->pool = pool;
+    worker->job = NULL;
+    worker->seed = 88172645463325252UL + pool->workers;
+
+    if (!deque_init(&worker->deque))
+      break;
+
+    /* The first worker is whoever runs a job */
+    if (pool->workers > 0
+	&& pthread_create(&worker->thread, NULL, work, worker) != 0) {
+      deque_release(&worker->deque);
+      break;
+    }
+  }
+
+  if (pool->workers < workers) {
+    pool_destroy(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+
+/*
+ * Stops the threads of pool, which isn't running a job, and frees it
+ */
+void pool_destroy(Pool *pool) {
+
+  int i;
+
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 1; i < pool->workers; i++)
+    pthread_join(pool->worker[i].thread, NULL);
+
+  for (i = 0; i < pool->workers; i++)
+    deque_release(&pool->worker[i].deque);
+
+  pthread_mutex_destroy(&pool->busy);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  free(pool->worker);
+  free(pool);
+}
+
+
+/*
+ * Runs the task run(arg), and every task it spawns, as a job with the
+ * state job, returning once all of them have finished. Without a pool,
+ * or while another thread runs a job on it, the calling thread runs
+ * them all by itself.
+ */
+void pool_run(Pool *pool, TaskFunction run, void *arg, void *job) {
+
+  Worker alone, *worker = &alone;
+  Task task;
+
+  if (pool != NULL && pthread_mutex_trylock(&pool->busy) == 0)
+    worker = &pool->worker[0];
+  else {
+    alone.pool = NULL;
+
+    /* With no room for a deque, every task runs as it is spawned */
+    if (!deque_init(&alone.deque))
+      alone.deque.tasks = NULL;
+  }
+
+  worker->job = job;
+  pool_spawn(worker, run, arg);
+
+  if (worker == &alone) {
+
+    while (alone.deque.tasks != NULL && deque_pop(&alone.deque, &task))
+      execute(&alone, &task);
+
+    deque_release(&alone.deque);
+    return;
+  }
+
+  help(worker, 0);
+  pthread_mutex_unlock(&pool->busy);
+}
+
+
+/*
+ * Spawns the task run(arg), in the job of the task the worker sent in
+ * is running
+ */
+void pool_spawn(Worker *worker, TaskFunction run, void *arg) {
+
+  Pool *pool = worker->pool;
+  Task task;
+  unsigned long waiting;
+
+  task.run = run;
+  task.arg = arg;
+  task.job = worker->job;
+
+  if (pool != NULL)
+    atomic_fetch_add(&pool->pending, 1);
+
+  waiting = worker->deque.tasks != NULL
+    ? deque_push(&worker->deque, &task) : 0;
+
+  if (waiting == 0) {
+    execute(worker, &task);
+    return;
+  }
+
+  if (pool == NULL || waiting < WAKE_TASKS
+      || atomic_load_explicit(&pool->idle, memory_order_relaxed) == 0)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->wakeups++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Runs a worker thread of the pool: it sleeps until it is woken, helps
+ * with the job running until it runs out of tasks to take, then sleeps
+ * again
+ */
+static void *work(void *arg) {
+
+  Worker *worker = arg;
+  Pool *pool = worker->pool;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (!pool->stop) {
+
+    if (pool->wakeups == seen) {
+      atomic_fetch_add(&pool->idle, 1);
+      pthread_cond_wait(&pool->wake, &pool->lock);
+      atomic_fetch_sub(&pool->idle, 1);
+      continue;
+    }
+
+    seen = pool->wakeups;
+    pthread_mutex_unlock(&pool->lock);
+
+    help(worker, SPIN_ROUNDS);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+
+/*
+ * Runs tasks of the job in the pool of the worker sent in until none
+ * is left, or until it has found nothing to take the given number of
+ * times in a row if that isn't 0. Its own deque is empty by then.
+ */
+static void help(Worker *worker, int rounds) {
+
+  Pool *pool = worker->pool;
+  Task task;
+  int missed = 0;
+
+  while (atomic_load(&pool->pending) > 0) {
+
+    if (take(worker, &task)) {
+      execute(worker, &task);
+      missed = 0;
+    } else if (rounds > 0 && ++missed == rounds)
+      return;
+    else
+      sched_yield();
+  }
+}
+
+
+/*
+ * Takes the next task for the worker sent in: the last one it spawned,
+ * or else the first one waiting at another worker, trying them in turn
+ * from one picked at random
+ *
+ * Returns 1 if successful, 0 if no task is waiting
+ */
+static int take(Worker *worker, Task *task) {
+
+  Pool *pool = worker->pool;
+  int i, victim;
+
+  if (deque_pop(&worker->deque, task))
+    return 1;
+
+  /* xorshift step on the worker's seed */
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 7;
+  worker->seed ^= worker->seed << 17;
+  victim = worker->seed % pool->workers;
+
+  for (i = 0; i < pool->workers; i++) {
+
+    if (&pool->worker[victim] != worker
+	&& deque_steal(&pool->worker[victim].deque, task))
+      return 1;
+
+    victim = (victim + 1) % pool->workers;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Runs task on the worker sent in and counts it as finished
+ */
+static void execute(Worker *worker, Task *task) {
+
+  void *job = worker->job;
+
+  worker->job = task->job;
+  task->run(worker, task->arg);
+  worker->job = job;
+
+  if (worker->pool != NULL)
+    atomic_fetch_sub(&worker->pool->pending, 1);
+}
+
+
+/*
+ * Initializes deque to be empty
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int deque_init(Deque *deque) {
+
+  deque->tasks = malloc(DEQUE_MIN_SIZE * sizeof(Task));
+
+  if (deque->tasks == NULL)
+    return 0;
+
+  pthread_mutex_init(&deque->lock, NULL);
+  deque->head = 0;
+  deque->tail = 0;
+  deque->size = DEQUE_MIN_SIZE;
+
+  return 1;
+}
+
+
+/*
+ * Frees the slots of deque
+ */
+static void deque_release(Deque *deque) {
+
+  if (deque->tasks == NULL)
+    return;
+
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->tasks);
+  deque->tasks = NULL;
+}
+
+
+/*
+ * Adds task at the tail of deque, doubling its slots when they are all
+ * taken
+ *
+ * Returns the number of tasks in deque, or 0 if memory couldn't be
+ * allocated
+ */
+static unsigned long deque_push(Deque *deque, const Task *task) {
+
+  Task *tasks;
+  unsigned long i, waiting;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->tail - deque->head == deque->size) {
+
+    tasks = malloc(2 * deque->size * sizeof(Task));
+
+    /* The task is run where it was spawned instead */
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      return 0;
+    }
+
+    for (i = deque->head; i != deque->tail; i++)
+      tasks[i & (2 * deque->size - 1)] = deque->tasks[i & (deque->size - 1)];
+
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->size *= 2;
+  }
+
+  deque->tasks[deque->tail++ & (deque->size - 1)] = *task;
+  waiting = deque->tail - deque->head;
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return waiting;
+}
+
+
+/*
+ * Takes the task at the tail of deque
+ *
+ * Returns 1 if successful, 0 if deque is empty
+ */
+static int deque_pop(Deque *deque, Task *task) {
+
+  int found;
+
+  pthread_mutex_lock(&deque->lock);
+
+  found = deque->head != deque->tail;
+  if (found)
+    *task = deque->tasks[--deque->tail & (deque->size - 1)];
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+
+/*
+ * Takes the task at the head of deque
+ *
+ * Returns 1 if successful, 0 if deque is empty
+ */
+static int deque_steal(Deque *deque, Task *task) {
+
+  int found;
+
+  pthread_mutex_lock(&deque->lock);
+
+  found = deque->head != deque->tail;
+  if (found)
+    *task = deque->tasks[deque->head++ & (deque->size - 1)];
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
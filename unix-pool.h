@@ -0,0 +1,70 @@
+/*
+ * unix-pool.h
+ *
+ * Header file for the work-stealing task pool that the recursive
+ * commands of a Unix filesystem spread their work over.
+ *
+ * Every worker keeps a deque of tasks. A task may spawn more, which go
+ * on the bottom of the deque of the worker running it, and a worker
+ * takes its next task from the bottom of its own deque, so it goes
+ * depth first the way a recursive walk would. A worker with nothing
+ * left steals from the top of another deque, where the biggest pieces
+ * of work wait.
+ *
+ * The thread that runs a job is a worker too, and the other workers
+ * sleep between jobs. They are only woken once a deque holds more than
+ * a task, so a small job runs on its own thread alone.
+ */
+
+#ifndef UNIX_POOL_H
+#define UNIX_POOL_H
+
+#include <pthread.h>
+
+struct worker;
+
+/* What a task runs: arg is its own, and the job it belongs to is in
+   worker->job */
+typedef void (*TaskFunction)(struct worker *worker, void *arg);
+
+typedef struct task {
+  TaskFunction run;
+  void * arg;
+  void * job;			/* state shared by the tasks of a job */
+} Task;
+
+/* Tasks waiting, from head (stolen first) to tail (run first) */
+typedef struct deque {
+  pthread_mutex_t lock;
+  Task * tasks;			/* ring of size slots */
+  unsigned long head;
+  unsigned long tail;
+  unsigned long size;		/* always a power of two */
+} Deque;
+
+typedef struct worker {
+  struct pool * pool;		/* NULL when running a job alone */
+  Deque deque;
+  void * job;			/* job of the task being run */
+  unsigned long seed;		/* state for picking whom to steal from */
+  pthread_t thread;
+} Worker;
+
+typedef struct pool {
+  int workers;			/* counting the thread running a job */
+  Worker * worker;		/* worker[0] is the thread running a job */
+  pthread_mutex_t busy;		/* held while a job runs */
+  pthread_mutex_t lock;		/* wakeups and stop */
+  pthread_cond_t wake;
+  unsigned long wakeups;	/* times sleeping workers were woken */
+  int stop;			/* set when the pool is destroyed */
+  _Atomic int idle;		/* workers asleep */
+  _Atomic unsigned long pending; /* tasks spawned and not finished */
+} Pool;
+
+Pool *pool_create(int workers);
+void pool_destroy(Pool *pool);
+void pool_run(Pool *pool, TaskFunction run, void *arg, void *job);
+void pool_spawn(Worker *worker, TaskFunction run, void *arg);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * unix-sink.c
+ *
+ * This file contains the buffered output of a simulated Unix
+ * filesystem. Commands append their output to a sink, which hands it
+ * to the operating system in large writes, or keeps it in memory for
+ * a caller to read back.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unix-sink.h"
+
+/* Bytes a sink buffers before writing them out */
+#define SINK_SIZE (64 * 1024)
+
+static int write_all(int fd, struct iovec iov[], int count);
+
+
+/*
+ * Initializes sink to write to the file descriptor fd, or to keep
+ * everything written to it in memory if fd is -1
+ */
+void sink_init(Sink *sink, int fd) {
+
+  sink->fd = fd;
+  sink->failed = 0;
+  sink->used = 0;
+  sink->buffer = malloc(SINK_SIZE);
+  sink->size = sink->buffer == NULL ? 0 : SINK_SIZE;
+}
+
+
+/*
+ * Appends len bytes of data to the sink. When they don't fit in the
+ * buffer, a sink with a file descriptor writes out the buffer and the
+ * data together in one call, and a sink kept in memory grows its
+ * buffer. A write that fails is remembered until sink_flush().
+ */
+void sink_write(Sink *sink, const char data[], unsigned long len) {
+
+  struct iovec iov[2];
+  unsigned long size;
+  char *buffer;
+
+  if (sink->used + len <= sink->size) {
+    memcpy(sink->buffer + sink->used, data, len);
+    sink->used += len;
+    return;
+  }
+
+  if (sink->fd < 0) {
+
+    for (size = sink->size > 0 ? sink->size : SINK_SIZE;
+         size < sink->used + len; size *= 2)
+      ;
+
+    buffer = realloc(sink->buffer, size);
+
+    /* Output that can't be kept is dropped */
+    if (buffer == NULL)
+      return;
+
+    sink->buffer = buffer;
+    sink->size = size;
+    memcpy(sink->buffer + sink->used, data, len);
+    sink->used += len;
+    return;
+  }
+
+  iov[0].iov_base = sink->buffer;
+  iov[0].iov_len = sink->used;
+  iov[1].iov_base = (void *) data;
+  iov[1].iov_len = len;
+
+  if (!write_all(sink->fd, iov, 2))
+    sink->failed = 1;
+  sink->used = 0;
+}
+
+
+/*
+ * Appends the count buffers of iov, at most SINK_IOV, to the sink.
+ * When they don't fit in the buffer, a sink with a file descriptor
+ * hands the buffer and all of them to the operating system in one
+ * call, so they are never copied.
+ */
+void sink_writev(Sink *sink, const struct iovec iov[], int count) {
+
+  struct iovec all[1 + SINK_IOV];
+  unsigned long len = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    len += iov[i].iov_len;
+
+  if (sink->used + len <= sink->size || sink->fd < 0) {
+    for (i = 0; i < count; i++)
+      sink_write(sink, iov[i].iov_base, iov[i].iov_len);
+    return;
+  }
+
+  all[0].iov_base = sink->buffer;
+  all[0].iov_len = sink->used;
+  memcpy(all + 1, iov, count * sizeof(struct iovec));
+
+  if (!write_all(sink->fd, all, count + 1))
+    sink->failed = 1;
+  sink->used = 0;
+}
+
+
+/*
+ * Writes out everything waiting in the buffer of a sink with a file
+ * descriptor. Output kept in memory stays where it is.
+ *
+ * Returns 1 if everything written to the sink since it was last flushed
+ * reached its file descriptor, 0 otherwise
+ */
+int sink_flush(Sink *sink) {
+
+  struct iovec iov;
+  int result;
+
+  if (sink->fd >= 0 && sink->used > 0) {
+
+    iov.iov_base = sink->buffer;
+    iov.iov_len = sink->used;
+
+    if (!write_all(sink->fd, &iov, 1))
+      sink->failed = 1;
+    sink->used = 0;
+  }
+
+  result = !sink->failed;
+  sink->failed = 0;
+
+  return result;
+}
+
+
+/*
+ * Flushes the sink and frees its buffer
+ */
+void sink_release(Sink *sink) {
+
+  sink_flush(sink);
+
+  free(sink->buffer);
+  sink->buffer = NULL;
+  sink->used = 0;
+  sink->size = 0;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Writes the count buffers of iov to fd, carrying on after partial
+ * writes and interrupted calls. Output that can't be written is
+ * dropped.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int write_all(int fd, struct iovec iov[], int count) {
+
+  ssize_t written;
+
+  while (count > 0) {
+
+    /* Skip buffers that are done */
+    if (iov->iov_len == 0) {
+      iov++;
+      count--;
+      continue;
+    }
+
+    written = writev(fd, iov, count);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    while (count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 1;
+}
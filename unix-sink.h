@@ -0,0 +1,17 @@
+/*
+ * unix-sink.h
+ *
+ * Header file for the buffered output of a Unix filesystem
+ */
+
+#include <sys/uio.h>
+#include "unix-datastructure.h"
+
+/* Most buffers sink_writev() takes at once */
+#define SINK_IOV 64
+
+void sink_init(Sink *sink, int fd);
+void sink_write(Sink *sink, const char data[], unsigned long len);
+void sink_writev(Sink *sink, const struct iovec iov[], int count);
+int sink_flush(Sink *sink);
+void sink_release(Sink *sink);
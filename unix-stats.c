@@ -0,0 +1,177 @@
+/*
+ * unix-stats.c
+ *
+ * This file contains the counters a simulated Unix filesystem keeps of
+ * the commands it runs and the work they do, and the stats command that
+ * prints them.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "unix.h"
+#include "unix-lock.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+
+/* Names the commands are printed with */
+static const char *command_names[C_COMMANDS] = {
+  "touch", "mkdir", "cd", "ls", "rm", "pwd", "du", "find", "tree",
+  "count", "complete", "write", "append", "cat", "cp", "snapshot",
+  "restore", "snapshots", "mv"
+};
+
+static void print_counter(Sink *out, const char name[], const char label[],
+			  unsigned long value);
+
+/* Reads a counter threads may be adding to */
+#define COUNTER(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+
+/*
+ * Starts counting the commands of the unix variable sent in from zero
+ * if enable is non-zero, and stops counting otherwise
+ */
+void enable_stats(Unix *filesystem, int enable) {
+
+  lock_tree(filesystem);
+
+  free(filesystem->tree->stats);
+  filesystem->tree->stats = NULL;
+
+  if (enable) {
+
+    filesystem->tree->stats = calloc(1, sizeof(Stats));
+
+    if (filesystem->tree->stats == NULL)
+      print_error(filesystem, NO_MEMORY);
+  }
+
+  unlock_tree(filesystem);
+}
+
+
+/*
+ * Returns the counters of the unix variable sent in, or NULL if
+ * counting is disabled
+ */
+const Stats *get_stats(Unix *filesystem) {
+  return filesystem->tree->stats;
+}
+
+
+/*
+ * Prints the counters of the unix variable sent in, one per line as a
+ * name and a value: the calls of each command and their latencies by
+ * bucket, the names compared and containers visited, the entries
+ * copies were given, and the memory held by the filesystem
+ */
+void stats(Unix *filesystem) {
+
+  Stats *stats;
+  Sink *out = &filesystem->out;
+  unsigned long in_use, reserved, calls;
+  char label[32];
+  int command, bucket;
+
+  /* Threads may be counting while the counters are read, each on its
+     own, and the tree keeps them until it is left */
+  enter_tree(filesystem);
+
+  LOCK(filesystem, alloc);
+  in_use = filesystem->tree->arena.in_use;
+  reserved = filesystem->tree->arena.reserved;
+  UNLOCK(filesystem, alloc);
+
+  stats = filesystem->tree->stats;
+
+  print_counter(out, "memory", "in_use", in_use);
+  print_counter(out, "memory", "reserved", reserved);
+
+  if (stats != NULL) {
+
+    print_counter(out, "lookup", "comparisons", COUNTER(stats->comparisons));
+    print_counter(out, "lookup", "visited", COUNTER(stats->visited));
+    print_counter(out, "copy", "copied", COUNTER(stats->copied));
+
+    for (command = 0; command < C_COMMANDS; command++) {
+
+      print_counter(out, command_names[command], "calls",
+		    COUNTER(stats->calls[command]));
+
+      for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+
+	calls = COUNTER(stats->latency[command][bucket]);
+
+	if (calls == 0)
+	  continue;
+
+	sprintf(label, "under_%luns", 2UL << bucket);
+	print_counter(out, command_names[command], label, calls);
+      }
+    }
+  }
+
+  leave_tree(filesystem);
+
+  sink_flush(out);
+}
+
+
+/*
+ * Returns a monotonic timestamp in nanoseconds
+ */
+unsigned long long stats_clock(void) {
+
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (unsigned long long) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+
+/*
+ * Counts a call of command that started at start in the counters of the
+ * unix variable sent in, and adds its latency to the bucket for it
+ *
+ * Returns result
+ */
+int stats_end(Unix *filesystem, enum Command command,
+	      unsigned long long start, int result) {
+
+  Stats *stats = filesystem->tree->stats;
+  unsigned long long elapsed = stats_clock() - start;
+  int bucket = 0;
+
+  while (bucket < STATS_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0)
+    bucket++;
+
+  atomic_fetch_add_explicit(&stats->calls[command], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->latency[command][bucket], 1,
+			    memory_order_relaxed);
+
+  return result;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Prints one counter as "name.label value"
+ */
+static void print_counter(Sink *out, const char name[], const char label[],
+			  unsigned long value) {
+
+  char line[96];
+  int len = sprintf(line, "%s.%s %lu\n", name, label, value);
+
+  sink_write(out, line, len);
+}
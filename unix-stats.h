@@ -0,0 +1,32 @@
+/*
+ * unix-stats.h
+ *
+ * Header file for the counters a Unix filesystem keeps of its own work.
+ * The macros cost a single test while counting is disabled. With
+ * threads enabled, the counters are added to atomically and without
+ * locks, so counting stays off the lock-free paths of lookups.
+ */
+
+#include "unix-datastructure.h"
+
+/* Adds n to a counter of the filesystem. Nothing is ordered by it, so
+   the add is relaxed */
+#define STATS_ADD(fs, counter, n)					\
+  do {									\
+    if ((fs)->tree->stats != NULL)					\
+      atomic_fetch_add_explicit(&(fs)->tree->stats->counter, (n),	\
+				memory_order_relaxed);			\
+  } while (0)
+
+/* Returns the time a command starts at, or 0 when not counting */
+#define STATS_BEGIN(fs) ((fs)->tree->stats != NULL ? stats_clock() : 0)
+
+/* Counts a call of command that started at start, and evaluates to
+   result so a command can return through it */
+#define STATS_END(fs, command, start, result)				\
+  ((fs)->tree->stats != NULL						\
+   ? stats_end(fs, command, start, result) : (result))
+
+unsigned long long stats_clock(void);
+int stats_end(Unix *filesystem, enum Command command,
+	      unsigned long long start, int result);
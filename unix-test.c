@@ -0,0 +1,2027 @@
+/*
+ * unix-test.c
+ *
+ * Behavioural tests for the simulated Unix filesystem. Each test builds
+ * a tree through the functions in unix.h, keeps the output of the
+ * commands in memory and checks it against what they should print.
+ *
+ * Build and run it with make test. Every failed check is reported on
+ * the standard error, and the exit status is 1 if any failed.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unix.h"
+
+/* Names made in the directory the index test looks up */
+#define INDEX_ENTRIES 5000
+
+/* Names the order test makes out of order, and the step it makes them
+   in, which has no factor in common with their number */
+#define ORDER_ENTRIES 1000
+#define ORDER_STEP 7919
+
+/* Entries the arena test makes and removes in each of its rounds */
+#define CHURN_ENTRIES 1000
+#define CHURN_ROUNDS 20
+
+/* Longest name the names test makes, longer than the biggest block the
+   arena carves out of its slabs */
+#define LONG_NAME 3000
+
+/* Levels of the chain of directories and entries of the directory the
+   delete test removes. Every change adds to the totals of each
+   directory above it, so the chain is made in time quadratic in its
+   levels. */
+#define DEEP_LEVELS 5000
+#define WIDE_ENTRIES 100000
+
+/* Threads of the lookup test, and the rounds each makes, finds and
+   removes its names in */
+#define LOOKUP_THREADS 8
+#define LOOKUP_ROUNDS 5000
+
+/* Entries of the directory the output test lists, more than fill the
+   buffer of the output */
+#define OUTPUT_ENTRIES 20000
+
+/* Bytes cut off the end of the journal to tear its last record */
+#define TORN_BYTES 3
+
+/* Rounds of changes each thread of the locking test makes */
+#define LOCKING_ROUNDS 2000
+
+/* Directories of the tree the pool test walks, the entries of each,
+   enough to be split between workers, and the workers */
+#define POOL_DIRS 8
+#define POOL_ENTRIES 3000
+#define POOL_WORKERS 4
+
+/* Files of the directory the glob test seeks in */
+#define GLOB_ENTRIES 4096
+
+/* Pieces the contents test appends to a file, each of PIECE bytes */
+#define CONTENTS_PIECES 1000
+#define PIECE "0123456789"
+
+/* Entries of the directory the mv test moves */
+#define MOVED_ENTRIES 10000
+
+/* Names the mv test renames a directory to, longer than its first */
+#define LONG_DIR "a_long_name_for_a_directory_which_doesnt_fit_where_a_was"
+#define LONGER_DIR "another_name_which_is_longer_still_and_so_doesnt_fit_either_" \
+  "of_the_blocks_the_names_before_it_had"
+
+/* Levels of the chain and directories made beside it in the ancestors
+   test */
+#define ANCESTOR_LEVELS 50
+#define ANCESTOR_SIBLINGS 2000
+
+/* Threads writing below the directory the race test removes, and the
+   rounds of removing it */
+#define RACE_WRITERS 4
+#define RACE_ROUNDS 200
+
+/* One thread of the race test */
+typedef struct writer {
+  Unix * filesystem;		/* tree the thread starts a session on */
+  int id;
+  int remover;			/* removes the directory instead */
+  pthread_t thread;
+} Writer;
+
+/* One thread of the tests that run sessions at the same time */
+typedef struct looker {
+  Unix session;			/* made before the thread starts */
+  int id;
+  int wrong;			/* lookups that found what wasn't there */
+  pthread_t thread;
+} Looker;
+
+static unsigned long checks = 0, failures = 0;
+
+static void test_index(void);
+static void test_order(void);
+static void test_arena(void);
+static void test_names(void);
+static void test_delete(void);
+static void test_paths(void);
+static void test_lookups(void);
+static void *lookup_thread(void *arg);
+static void test_output(void);
+static void test_pwd(void);
+static void test_stats(void);
+static unsigned long latencies(Unix *filesystem, enum Command command);
+static void test_image(void);
+static void test_map(void);
+static void test_journal(void);
+static void test_locking(void);
+static void *locking_thread(void *arg);
+static void test_race(void);
+static void *race_thread(void *arg);
+static void test_pool(void);
+static void test_totals(void);
+static void test_glob(void);
+static void test_contents(void);
+static void test_copies(void);
+static void test_snapshots(void);
+static void test_mv(void);
+static void test_ancestors(void);
+static void start(Unix *filesystem);
+static int shows(Unix *filesystem, const char expected[]);
+static char *output(Unix *filesystem);
+static unsigned long memory(Unix *filesystem, const char counter[]);
+static unsigned long visited(Unix *filesystem);
+static void temp_file(char file[], unsigned long size, const char name[]);
+static int cut_file(const char file[], off_t bytes);
+static int same_files(const char file[], const char other[]);
+static int copy_file(const char file[], const char copy[]);
+
+/* Counts a check and reports it on the standard error if it fails */
+#define CHECK(test)							\
+  do {									\
+    checks++;								\
+    if (!(test)) {							\
+      failures++;							\
+      fprintf(stderr, "unix-test: %s:%d: %s\n", __FILE__, __LINE__,	\
+	      #test);							\
+    }									\
+  } while (0)
+
+
+int main(void) {
+
+  test_index();
+  test_order();
+  test_arena();
+  test_names();
+  test_delete();
+  test_paths();
+  test_lookups();
+  test_output();
+  test_pwd();
+  test_stats();
+  test_image();
+  test_map();
+  test_journal();
+  test_locking();
+  test_race();
+  test_pool();
+  test_totals();
+  test_glob();
+  test_contents();
+  test_copies();
+  test_snapshots();
+  test_mv();
+  test_ancestors();
+
+  printf("unix-test: %lu checks, %lu failed\n", checks, failures);
+
+  return failures > 0;
+}
+
+
+/*
+ * The index of a directory: while it grows, every name made in it is
+ * found and no other is, a name removed isn't found until it is made
+ * again, and a name is made only once
+ */
+static void test_index(void) {
+
+  Unix filesystem;
+  char path[32];
+  int i, found;
+
+  start(&filesystem);
+  mkdir(&filesystem, "/h");
+
+  found = 0;
+  for (i = 0; i < INDEX_ENTRIES; i++) {
+    sprintf(path, "/h/e%d", i);
+    touch(&filesystem, path);
+    found += ls(&filesystem, path);
+  }
+  CHECK(found == INDEX_ENTRIES);
+
+  found = 0;
+  for (i = 0; i < INDEX_ENTRIES; i++) {
+    sprintf(path, "/h/e%d", INDEX_ENTRIES + i);
+    found += ls(&filesystem, path);
+  }
+  CHECK(found == 0);
+  clear_output(&filesystem);
+
+  CHECK(!ls(&filesystem, "/h/e"));
+  CHECK(!ls(&filesystem, "/h/e00"));
+  ls(&filesystem, "/h/e4999");
+  CHECK(shows(&filesystem, "e4999\n"));
+
+  /* Every other name removed, then made again as directories */
+  found = 0;
+  for (i = 0; i < INDEX_ENTRIES; i += 2) {
+    sprintf(path, "/h/e%d", i);
+    found += rm(&filesystem, path);
+  }
+  CHECK(found == INDEX_ENTRIES / 2);
+
+  found = 0;
+  for (i = 0; i < INDEX_ENTRIES; i++) {
+    sprintf(path, "/h/e%d", i);
+    found += ls(&filesystem, path);
+  }
+  CHECK(found == INDEX_ENTRIES / 2);
+  clear_output(&filesystem);
+
+  found = 0;
+  for (i = 0; i < INDEX_ENTRIES; i += 2) {
+    sprintf(path, "/h/e%d", i);
+    found += mkdir(&filesystem, path);
+    found += mkdir(&filesystem, path);
+  }
+  CHECK(found == INDEX_ENTRIES / 2);
+
+  ls(&filesystem, "/h/e4998");
+  CHECK(shows(&filesystem, ""));
+  ls(&filesystem, "/h/e4999");
+  CHECK(shows(&filesystem, "e4999\n"));
+  CHECK(!mkdir(&filesystem, "/h/e4999"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The order of a directory: ls lists the names in it sorted by their
+ * bytes, whatever order they were made and removed in
+ */
+static void test_order(void) {
+
+  Unix filesystem;
+  char path[32], expected[ORDER_ENTRIES * 6 + 1], *next;
+  char removed[ORDER_ENTRIES];
+  int i, name;
+
+  start(&filesystem);
+
+  touch(&filesystem, "b");
+  touch(&filesystem, "ab");
+  mkdir(&filesystem, "B");
+  touch(&filesystem, "a");
+  touch(&filesystem, "a0");
+  mkdir(&filesystem, "-");
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "-/\nB/\na\na0\nab\nb\n"));
+  rm(&filesystem, "a");
+  rm(&filesystem, "b");
+  touch(&filesystem, "aa");
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "-/\nB/\na0\naa\nab\n"));
+
+  /* Made in a scrambled order, and the odd ones of every third made
+     removed in the reverse of it */
+  mkdir(&filesystem, "/o");
+  for (i = 0; i < ORDER_ENTRIES; i++) {
+    name = i * ORDER_STEP % ORDER_ENTRIES;
+    sprintf(path, "/o/n%04d", name);
+    touch(&filesystem, path);
+    removed[name] = i % 3 == 0 && name % 2 == 1;
+  }
+  for (i = ORDER_ENTRIES - 1; i >= 0; i--) {
+    name = i * ORDER_STEP % ORDER_ENTRIES;
+    sprintf(path, "/o/n%04d", name);
+    if (removed[name])
+      rm(&filesystem, path);
+  }
+
+  next = expected;
+  *next = '\0';
+  for (name = 0; name < ORDER_ENTRIES; name++)
+    if (!removed[name])
+      next += sprintf(next, "n%04d\n", name);
+  ls(&filesystem, "/o");
+  CHECK(shows(&filesystem, expected));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The arena: the blocks of the entries removed are used again by those
+ * made after them, so once the free lists of the arena hold blocks of
+ * every size the entries take, making and removing them over and over
+ * takes no more memory
+ */
+static void test_arena(void) {
+
+  Unix filesystem;
+  unsigned long in_use, reserved;
+  char path[64];
+  int round, i;
+
+  start(&filesystem);
+  in_use = reserved = 0;
+
+  for (round = 0; round <= CHURN_ROUNDS; round++) {
+
+    mkdir(&filesystem, "/c");
+    for (i = 0; i < CHURN_ENTRIES; i++) {
+      sprintf(path, "/c/%0*d", 1 + i % 40, i);
+      if (i % 4 == 0)
+	mkdir(&filesystem, path);
+      else
+	touch(&filesystem, path);
+    }
+    rm(&filesystem, "/c");
+
+    if (round == CHURN_ROUNDS / 2) {
+      in_use = memory(&filesystem, "in_use");
+      reserved = memory(&filesystem, "reserved");
+    }
+  }
+
+  CHECK(memory(&filesystem, "reserved") == reserved);
+  CHECK(memory(&filesystem, "in_use") == in_use);
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, ""));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Names kept with their entries: names of every length up to one
+ * bigger than any block of the arena are listed, found and removed as
+ * they were made, and names that only differ in their last byte are
+ * told apart
+ */
+static void test_names(void) {
+
+  Unix filesystem;
+  char name[LONG_NAME + 2], path[LONG_NAME + 8], *listed;
+  int len, made = 0, found = 0, shown = 0;
+
+  start(&filesystem);
+  mkdir(&filesystem, "/n");
+
+  for (len = 1; len <= LONG_NAME; len += len < 64 ? 1 : 61) {
+
+    made++;
+    memset(name, 'a' + len % 26, len);
+    name[len] = '\0';
+    sprintf(path, "/n/%s", name);
+    touch(&filesystem, path);
+    path[len + 2] = 'Z';
+    mkdir(&filesystem, path);
+
+    path[len + 2] = name[len - 1];
+    found += ls(&filesystem, path);
+    listed = output(&filesystem);
+    shown += strlen(listed) == (unsigned long)len + 1
+      && memcmp(listed, name, len) == 0;
+    free(listed);
+
+    path[len + 2] = 'Z';
+    found += cd(&filesystem, path);
+    pwd(&filesystem);
+    listed = output(&filesystem);
+    shown += strcmp(listed + 3 + len - 1, "Z\n") == 0
+      && memcmp(listed + 3, name, len - 1) == 0;
+    free(listed);
+    cd(&filesystem, "/");
+
+    path[len + 2] = name[len - 1];
+    found += rm(&filesystem, path);
+    found += !ls(&filesystem, path);
+  }
+  clear_output(&filesystem);
+  CHECK(found == 4 * made);
+  CHECK(shown == 2 * made);
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * rm and rmfs of a deep chain of directories, and of a directory with
+ * many entries
+ */
+static void test_delete(void) {
+
+  Unix filesystem;
+  char path[32], *dir;
+  int i, made = 0;
+
+  start(&filesystem);
+
+  for (i = 0; i < DEEP_LEVELS; i++) {
+    made += mkdir(&filesystem, "d");
+    made += cd(&filesystem, "d");
+    if (i % 100 == 0)
+      touch(&filesystem, "f");
+  }
+  CHECK(made == 2 * DEEP_LEVELS);
+  CHECK(cd(&filesystem, "/"));
+  CHECK(rm(&filesystem, "/d"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, ""));
+
+  mkdir(&filesystem, "/w");
+  for (i = 0; i < WIDE_ENTRIES; i++) {
+    sprintf(path, "/w/%d", i);
+    if (i % 2 == 0)
+      touch(&filesystem, path);
+    else
+      mkdir(&filesystem, path);
+  }
+  touch(&filesystem, "/w/1/f");
+  CHECK(rm(&filesystem, "/w"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, ""));
+
+  /* Left for rmfs */
+  for (i = 0; i < DEEP_LEVELS; i++) {
+    mkdir(&filesystem, "d");
+    cd(&filesystem, "d");
+  }
+  pwd(&filesystem);
+  dir = output(&filesystem);
+  CHECK(strlen(dir) == 2 * DEEP_LEVELS + 1);
+  free(dir);
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Paths of many components, absolute or relative, through . and ..,
+ * with empty components, and with a trailing slash, which only a
+ * directory can have
+ */
+static void test_paths(void) {
+
+  Unix filesystem;
+
+  start(&filesystem);
+
+  CHECK(mkdir(&filesystem, "//p//"));
+  CHECK(mkdir(&filesystem, "p/q"));
+  CHECK(mkdir(&filesystem, "/p/q/r"));
+  CHECK(cd(&filesystem, "p/./q/r/.."));
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/p/q\n"));
+
+  CHECK(touch(&filesystem, "r/../../f"));
+  CHECK(ls(&filesystem, ".."));
+  CHECK(shows(&filesystem, "f\nq/\n"));
+  CHECK(ls(&filesystem, ""));
+  CHECK(shows(&filesystem, "r/\n"));
+  CHECK(cd(&filesystem, "/.."));
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/\n"));
+  CHECK(mkdir(&filesystem, "../../p/s"));
+  CHECK(ls(&filesystem, "p/q/../"));
+  CHECK(shows(&filesystem, "f\nq/\ns/\n"));
+
+  /* Names that are there already or have nothing to go in */
+  CHECK(!mkdir(&filesystem, "."));
+  CHECK(!mkdir(&filesystem, "/p/q/."));
+  CHECK(!mkdir(&filesystem, "/"));
+  CHECK(!rm(&filesystem, "/"));
+  CHECK(!touch(&filesystem, "/nope/x"));
+  CHECK(!cd(&filesystem, "/p/nope/.."));
+
+  /* A file is no directory, with a trailing slash or anything after
+     it */
+  CHECK(!cd(&filesystem, "/p/f"));
+  CHECK(!mkdir(&filesystem, "/p/f/x"));
+  CHECK(!touch(&filesystem, "/p/f/"));
+  CHECK(!ls(&filesystem, "/p/f/"));
+  CHECK(!rm(&filesystem, "/p/f/"));
+  CHECK(!ls(&filesystem, "/p/f/."));
+  CHECK(ls(&filesystem, "/p/f"));
+  CHECK(shows(&filesystem, "f\n"));
+  CHECK(ls(&filesystem, "/p/q/"));
+  CHECK(shows(&filesystem, "r/\n"));
+  CHECK(rm(&filesystem, "/p/q/"));
+  CHECK(rm(&filesystem, "/p/f"));
+  CHECK(ls(&filesystem, "/p"));
+  CHECK(shows(&filesystem, "s/\n"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The lookup cache: a name looked up and not found is found once it is
+ * made, and one found isn't once it is removed or moved, or the
+ * directory it is in is, nor when a copy or a restore replaces it,
+ * also while threads look up and change names in the same directory
+ */
+static void test_lookups(void) {
+
+  Unix filesystem;
+  Looker lookers[LOOKUP_THREADS];
+  int i, wrong = 0;
+
+  start(&filesystem);
+
+  CHECK(!ls(&filesystem, "/x"));
+  touch(&filesystem, "/x");
+  CHECK(ls(&filesystem, "/x"));
+  rm(&filesystem, "/x");
+  CHECK(!ls(&filesystem, "/x"));
+  mkdir(&filesystem, "/x");
+  CHECK(cd(&filesystem, "/x"));
+  cd(&filesystem, "/");
+
+  mkdir(&filesystem, "/a");
+  mkdir(&filesystem, "/a/b");
+  touch(&filesystem, "/a/b/f");
+  CHECK(ls(&filesystem, "/a/b/f"));
+  CHECK(!ls(&filesystem, "/z/b/f"));
+  mv(&filesystem, "/a", "/z");
+  CHECK(!ls(&filesystem, "/a/b/f"));
+  CHECK(ls(&filesystem, "/z/b/f"));
+  mkdir(&filesystem, "/a");
+  CHECK(!ls(&filesystem, "/a/b"));
+  mv(&filesystem, "/z/b/f", "/z/b/g");
+  CHECK(!ls(&filesystem, "/z/b/f"));
+  CHECK(ls(&filesystem, "/z/b/g"));
+  rm(&filesystem, "/z");
+  mkdir(&filesystem, "/z");
+  CHECK(!ls(&filesystem, "/z/b"));
+
+  CHECK(!ls(&filesystem, "/c/f"));
+  touch(&filesystem, "/a/f");
+  cp(&filesystem, "/a", "/c");
+  CHECK(ls(&filesystem, "/c/f"));
+  snapshot(&filesystem, "before");
+  rm(&filesystem, "/c/f");
+  CHECK(!ls(&filesystem, "/c/f"));
+  restore(&filesystem, "before");
+  CHECK(ls(&filesystem, "/c/f"));
+  clear_output(&filesystem);
+
+  mkdir(&filesystem, "/l");
+  enable_threads(&filesystem, 1);
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    mksession(&lookers[i].session, &filesystem);
+    set_output(&lookers[i].session, -1);
+    lookers[i].id = i;
+    lookers[i].wrong = 0;
+  }
+
+  for (i = 0; i < LOOKUP_THREADS; i++)
+    pthread_create(&lookers[i].thread, NULL, lookup_thread, &lookers[i]);
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    pthread_join(lookers[i].thread, NULL);
+    wrong += lookers[i].wrong;
+    rmfs(&lookers[i].session);
+  }
+  CHECK(wrong == 0);
+
+  enable_threads(&filesystem, 0);
+  ls(&filesystem, "/l");
+  CHECK(shows(&filesystem, ""));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Runs one thread of the lookup test: makes, looks up and removes
+ * names of its own in /l, among those of the other threads, and counts
+ * the lookups that don't find what it made or find what it removed
+ */
+static void *lookup_thread(void *arg) {
+
+  Looker *looker = arg;
+  char path[32];
+  int i;
+
+  for (i = 0; i < LOOKUP_ROUNDS; i++) {
+
+    sprintf(path, "/l/t%d_%d", looker->id, i % 8);
+
+    looker->wrong += !touch(&looker->session, path);
+    looker->wrong += !ls(&looker->session, path);
+    looker->wrong += !rm(&looker->session, path);
+    looker->wrong += ls(&looker->session, path);
+    clear_output(&looker->session);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * The output: what the commands print comes out whole and in the order
+ * they ran, kept in memory or written to a file, however much of it
+ * there is
+ */
+static void test_output(void) {
+
+  Unix filesystem;
+  char path[32], *expected, *next, *text;
+  unsigned long len;
+  FILE *file;
+  int i;
+
+  start(&filesystem);
+
+  mkdir(&filesystem, "/o");
+  touch(&filesystem, "/o/f");
+  pwd(&filesystem);
+  ls(&filesystem, "/");
+  cd(&filesystem, "/o");
+  pwd(&filesystem);
+  ls(&filesystem, "/o");
+  CHECK(shows(&filesystem, "/\no/\n/o\nf\n"));
+  pwd(&filesystem);
+  clear_output(&filesystem);
+  CHECK(shows(&filesystem, ""));
+  rm(&filesystem, "/o/f");
+
+  expected = malloc(OUTPUT_ENTRIES * 7 + 8);
+  text = malloc(OUTPUT_ENTRIES * 7 + 8);
+  if (expected == NULL || text == NULL) {
+    fprintf(stderr, "unix-test: not enough memory\n");
+    exit(1);
+  }
+
+  next = expected + sprintf(expected, "/o\n");
+  for (i = 0; i < OUTPUT_ENTRIES; i++) {
+    sprintf(path, "/o/e%05d", i);
+    touch(&filesystem, path);
+    next += sprintf(next, "e%05d\n", i);
+  }
+  sprintf(next, "/o\n");
+
+  pwd(&filesystem);
+  ls(&filesystem, "/o");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, expected));
+
+  /* Written to a file, then kept in memory again */
+  file = tmpfile();
+  CHECK(file != NULL);
+  if (file != NULL) {
+    set_output(&filesystem, fileno(file));
+    pwd(&filesystem);
+    ls(&filesystem, "/o");
+    pwd(&filesystem);
+    get_output(&filesystem, &len);
+    CHECK(len == 0);
+    set_output(&filesystem, -1);
+
+    rewind(file);
+    len = fread(text, 1, OUTPUT_ENTRIES * 7 + 8, file);
+    CHECK(len == strlen(expected) && memcmp(text, expected, len) == 0);
+    fclose(file);
+  }
+
+  CHECK(shows(&filesystem, ""));
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/o\n"));
+
+  free(expected);
+  free(text);
+  rmfs(&filesystem);
+}
+
+
+/*
+ * pwd prints where a session is after cd, after a directory above it
+ * is renamed or moved by it or another session, and after the
+ * directory it is in goes away
+ */
+static void test_pwd(void) {
+
+  Unix filesystem, other;
+
+  start(&filesystem);
+  mksession(&other, &filesystem);
+  set_output(&other, -1);
+
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/\n"));
+  mkdir(&filesystem, "/a");
+  mkdir(&filesystem, "/a/b");
+  mkdir(&filesystem, "/a/b/c");
+  cd(&filesystem, "/a/b/c");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/a/b/c\n"));
+  cd(&filesystem, "..");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/a/b\n"));
+  cd(&filesystem, "c");
+  cd(&other, "/a/b");
+
+  mv(&filesystem, "/a", "/x");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/x/b/c\n"));
+  pwd(&other);
+  CHECK(shows(&other, "/x/b\n"));
+
+  mkdir(&other, "/y");
+  mv(&other, "/x/b", "/y/renamed");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/y/renamed/c\n"));
+  mv(&filesystem, "/y/renamed/c", "/c");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/c\n"));
+  pwd(&other);
+  CHECK(shows(&other, "/y/renamed\n"));
+
+  /* The directory a session is in removed, or gone after a restore */
+  rm(&filesystem, "/y");
+  pwd(&other);
+  CHECK(shows(&other, "/\n"));
+  snapshot(&filesystem, "before");
+  mkdir(&filesystem, "/c/d");
+  cd(&filesystem, "d");
+  restore(&other, "before");
+  pwd(&filesystem);
+  CHECK(shows(&filesystem, "/\n"));
+
+  rmfs(&other);
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The counters: every call of a command is counted once, failed or
+ * not, in its calls and in one latency bucket, also by threads at the
+ * same time, lookups count the names they compare, counting starts
+ * from zero when enabled and stops when disabled
+ */
+static void test_stats(void) {
+
+  Unix filesystem;
+  Looker lookers[LOOKUP_THREADS];
+  const Stats *counters;
+  char *printed;
+  int i;
+
+  start(&filesystem);
+  CHECK(get_stats(&filesystem) == NULL);
+  touch(&filesystem, "/uncounted");
+
+  enable_stats(&filesystem, 1);
+  counters = get_stats(&filesystem);
+  CHECK(counters != NULL);
+  if (counters == NULL) {
+    rmfs(&filesystem);
+    return;
+  }
+  CHECK(counters->calls[C_TOUCH] == 0);
+
+  mkdir(&filesystem, "/s");
+  mkdir(&filesystem, "/s");
+  touch(&filesystem, "/s/f");
+  touch(&filesystem, "/s/g");
+  touch(&filesystem, "/nope/f");
+  ls(&filesystem, "/s");
+  pwd(&filesystem);
+  clear_output(&filesystem);
+
+  CHECK(counters->calls[C_MKDIR] == 2);
+  CHECK(counters->calls[C_TOUCH] == 3);
+  CHECK(counters->calls[C_LS] == 1);
+  CHECK(counters->calls[C_PWD] == 1);
+  CHECK(counters->calls[C_RM] == 0);
+  CHECK(latencies(&filesystem, C_TOUCH) == 3);
+  CHECK(latencies(&filesystem, C_RM) == 0);
+  CHECK(counters->comparisons > 0);
+
+  stats(&filesystem);
+  printed = output(&filesystem);
+  CHECK(strstr(printed, "\ntouch.calls 3\n") != NULL);
+  CHECK(strstr(printed, "\nmkdir.calls 2\n") != NULL);
+  free(printed);
+
+  /* Counted by threads at the same time */
+  mkdir(&filesystem, "/l");
+  enable_threads(&filesystem, 1);
+  enable_stats(&filesystem, 1);
+  counters = get_stats(&filesystem);
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    mksession(&lookers[i].session, &filesystem);
+    set_output(&lookers[i].session, -1);
+    lookers[i].id = i;
+    lookers[i].wrong = 0;
+  }
+
+  for (i = 0; i < LOOKUP_THREADS; i++)
+    pthread_create(&lookers[i].thread, NULL, lookup_thread, &lookers[i]);
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    pthread_join(lookers[i].thread, NULL);
+    rmfs(&lookers[i].session);
+  }
+
+  enable_threads(&filesystem, 0);
+  CHECK(counters->calls[C_MKDIR] == 0);
+  CHECK(counters->calls[C_TOUCH] == LOOKUP_THREADS * LOOKUP_ROUNDS);
+  CHECK(counters->calls[C_LS] == 2 * LOOKUP_THREADS * LOOKUP_ROUNDS);
+  CHECK(counters->calls[C_RM] == LOOKUP_THREADS * LOOKUP_ROUNDS);
+  CHECK(latencies(&filesystem, C_LS) == 2 * LOOKUP_THREADS * LOOKUP_ROUNDS);
+
+  enable_stats(&filesystem, 0);
+  CHECK(get_stats(&filesystem) == NULL);
+  touch(&filesystem, "/uncounted");
+  stats(&filesystem);
+  printed = output(&filesystem);
+  CHECK(strstr(printed, "calls") == NULL);
+  free(printed);
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * save and load: an image keeps what each version of the format added
+ * to it, the tree (UNIXIMG1), the contents of its files (UNIXIMG2) and
+ * its snapshots (UNIXIMG3), copies saved with what they show, and
+ * saving what was loaded writes the same image again
+ */
+static void test_image(void) {
+
+  Unix filesystem;
+  char image[64], again[64], magic[8], *tree;
+  FILE *file;
+  int i;
+
+  temp_file(image, sizeof(image), "image.img");
+  temp_file(again, sizeof(again), "again.img");
+
+  start(&filesystem);
+  mkdir(&filesystem, "/i");
+  mkdir(&filesystem, "/i/j");
+  touch(&filesystem, "/i/j/f");
+  append_file(&filesystem, "/i/j/f", "contents", 8);
+  touch(&filesystem, "/i/empty");
+  snapshot(&filesystem, "old");
+  cp(&filesystem, "/i", "/copy");
+  rm(&filesystem, "/copy/empty");
+  touch(&filesystem, "/copy/j/g");
+  print_tree(&filesystem, "/");
+  tree = output(&filesystem);
+  CHECK(save(&filesystem, image));
+  rmfs(&filesystem);
+
+  file = fopen(image, "rb");
+  CHECK(file != NULL && fread(magic, 1, 8, file) == 8
+	&& memcmp(magic, "UNIXIMG3", 8) == 0);
+  if (file != NULL)
+    fclose(file);
+
+  start(&filesystem);
+  CHECK(load(&filesystem, image));
+  print_tree(&filesystem, "/");
+  CHECK(shows(&filesystem, tree));
+  cat(&filesystem, "/copy/j/f");
+  CHECK(shows(&filesystem, "contents"));
+  snapshots(&filesystem);
+  CHECK(shows(&filesystem, "old\n"));
+  CHECK(save(&filesystem, again));
+  CHECK(restore(&filesystem, "old"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "i/\n"));
+  rmfs(&filesystem);
+
+  CHECK(same_files(image, again));
+
+  /* A file that isn't a whole image of this version is refused */
+  for (i = 0; i < 2; i++) {
+    file = fopen(again, "r+b");
+    if (file != NULL) {
+      fwrite(i == 0 ? "UNIXIMG2" : "UNIXIMG3", 1, 8, file);
+      fclose(file);
+    }
+    if (i == 1)
+      CHECK(cut_file(again, 1));
+
+    start(&filesystem);
+    touch(&filesystem, "/stays");
+    CHECK(!load(&filesystem, again));
+    ls(&filesystem, "/");
+    CHECK(shows(&filesystem, "stays\n"));
+    rmfs(&filesystem);
+  }
+
+  free(tree);
+  unlink(image);
+  unlink(again);
+}
+
+
+/*
+ * map_image: an image read in place shows the tree, the contents and
+ * the snapshots it was saved with, the first change builds the tree in
+ * memory and leaves the image as it was, and a file that isn't an
+ * image is refused
+ */
+static void test_map(void) {
+
+  Unix filesystem;
+  char image[64], saved[64], *tree;
+
+  temp_file(image, sizeof(image), "map.img");
+  temp_file(saved, sizeof(saved), "saved.img");
+
+  start(&filesystem);
+  mkdir(&filesystem, "/m");
+  mkdir(&filesystem, "/m/n");
+  touch(&filesystem, "/m/n/f");
+  append_file(&filesystem, "/m/n/f", "mapped", 6);
+  snapshot(&filesystem, "old");
+  cp(&filesystem, "/m", "/copy");
+  touch(&filesystem, "/copy/g");
+  print_tree(&filesystem, "/");
+  tree = output(&filesystem);
+  CHECK(save(&filesystem, image));
+  CHECK(save(&filesystem, saved));
+  rmfs(&filesystem);
+
+  start(&filesystem);
+  CHECK(map_image(&filesystem, image));
+  print_tree(&filesystem, "/");
+  CHECK(shows(&filesystem, tree));
+  ls(&filesystem, "/copy");
+  CHECK(shows(&filesystem, "g\nn/\n"));
+  cat(&filesystem, "/copy/n/f");
+  CHECK(shows(&filesystem, "mapped"));
+  snapshots(&filesystem);
+  CHECK(shows(&filesystem, "old\n"));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 3\ndirs 4\nbytes 12\n"));
+
+  /* Built in memory by the first change */
+  touch(&filesystem, "/m/new");
+  write_file(&filesystem, "/m/n/f", 0, "M", 1);
+  ls(&filesystem, "/m");
+  CHECK(shows(&filesystem, "n/\nnew\n"));
+  cat(&filesystem, "/m/n/f");
+  CHECK(shows(&filesystem, "Mapped"));
+  cat(&filesystem, "/copy/n/f");
+  CHECK(shows(&filesystem, "mapped"));
+  CHECK(restore(&filesystem, "old"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "m/\n"));
+  rmfs(&filesystem);
+
+  CHECK(same_files(image, saved));
+
+  start(&filesystem);
+  CHECK(map_image(&filesystem, image));
+  ls(&filesystem, "/m");
+  CHECK(shows(&filesystem, "n/\n"));
+  rmfs(&filesystem);
+
+  /* Not a whole image */
+  CHECK(cut_file(image, 1));
+  start(&filesystem);
+  touch(&filesystem, "/stays");
+  CHECK(!map_image(&filesystem, image));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "stays\n"));
+  rmfs(&filesystem);
+
+  free(tree);
+  unlink(image);
+  unlink(saved);
+}
+
+
+/*
+ * The journal: a change is in it once its command returns, a tree
+ * opened again from it is the one that was closed, a record torn by a
+ * crash is dropped with nothing before it, and the records after the
+ * tear are kept once it was cut off
+ */
+static void test_journal(void) {
+
+  Unix filesystem, crashed;
+  char image[64], journal[64], copy[64], *tree;
+
+  temp_file(image, sizeof(image), "journal.img");
+  temp_file(journal, sizeof(journal), "journal.jrn");
+  temp_file(copy, sizeof(copy), "copy.jrn");
+
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  mkdir(&filesystem, "/j");
+
+  /* Copied as a crash right after the command would leave it */
+  CHECK(copy_file(journal, copy));
+  start(&crashed);
+  CHECK(open_journal(&crashed, image, copy));
+  ls(&crashed, "/");
+  CHECK(shows(&crashed, "j/\n"));
+  CHECK(close_journal(&crashed));
+  rmfs(&crashed);
+
+  mkdir(&filesystem, "/j/k");
+  touch(&filesystem, "/j/k/f");
+  append_file(&filesystem, "/j/k/f", "abc", 3);
+  write_file(&filesystem, "/j/k/f", 1, "XY", 2);
+  touch(&filesystem, "/j/gone");
+  rm(&filesystem, "/j/gone");
+  touch(&filesystem, "/j/last");
+  print_tree(&filesystem, "/");
+  tree = output(&filesystem);
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  /* Replayed as it was */
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  print_tree(&filesystem, "/");
+  CHECK(shows(&filesystem, tree));
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  /* Torn in the middle of the last record */
+  CHECK(cut_file(journal, TORN_BYTES));
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  ls(&filesystem, "/j");
+  CHECK(shows(&filesystem, "k/\n"));
+  cat(&filesystem, "/j/k/f");
+  CHECK(shows(&filesystem, "aXY"));
+
+  /* Written after the tear, and replayed with what came before it */
+  touch(&filesystem, "/j/after");
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  ls(&filesystem, "/j");
+  CHECK(shows(&filesystem, "after\nk/\n"));
+
+  /* A checkpoint starts the journal over on top of the image */
+  CHECK(checkpoint(&filesystem));
+  touch(&filesystem, "/j/k/g");
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  print_tree(&filesystem, "/j");
+  CHECK(shows(&filesystem, "after\nk/\n  f\n  g\n"));
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  free(tree);
+  unlink(image);
+  unlink(journal);
+  unlink(copy);
+}
+
+
+/*
+ * Sessions changing and reading one tree from threads at the same
+ * time: what each makes, writes and moves is all there once they are
+ * done, with totals to match, and what each moved was found where it
+ * went right after
+ */
+static void test_locking(void) {
+
+  Unix filesystem;
+  Looker lookers[LOOKUP_THREADS];
+  char expected[64];
+  int i, wrong = 0;
+
+  start(&filesystem);
+  mkdir(&filesystem, "/k");
+  mkdir(&filesystem, "/k/all");
+  CHECK(enable_threads(&filesystem, 1));
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    mksession(&lookers[i].session, &filesystem);
+    set_output(&lookers[i].session, -1);
+    lookers[i].id = i;
+    lookers[i].wrong = 0;
+  }
+
+  for (i = 0; i < LOOKUP_THREADS; i++)
+    pthread_create(&lookers[i].thread, NULL, locking_thread, &lookers[i]);
+
+  for (i = 0; i < LOOKUP_THREADS; i++) {
+    pthread_join(lookers[i].thread, NULL);
+    wrong += lookers[i].wrong;
+    rmfs(&lookers[i].session);
+  }
+  CHECK(wrong == 0);
+
+  count(&filesystem, "/k/all");
+  sprintf(expected, "entries %d\ntotal %d\n", LOOKUP_THREADS * LOCKING_ROUNDS,
+	  LOOKUP_THREADS * LOCKING_ROUNDS);
+  CHECK(shows(&filesystem, expected));
+  du(&filesystem, "/k");
+  sprintf(expected, "files %d\ndirs %d\nbytes %d\n",
+	  LOOKUP_THREADS * LOCKING_ROUNDS, LOOKUP_THREADS + 1,
+	  4 * LOOKUP_THREADS * LOCKING_ROUNDS);
+  CHECK(shows(&filesystem, expected));
+  ls(&filesystem, "/k/all/t0_0");
+  CHECK(shows(&filesystem, "t0_0\n"));
+
+  enable_threads(&filesystem, 0);
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Runs one thread of the locking test: makes and writes files in
+ * /k/t<id>, moves each to /k/all and looks for it there, while
+ * reading the directories the other threads change
+ */
+static void *locking_thread(void *arg) {
+
+  Looker *looker = arg;
+  char dir[32], path[64], moved[64];
+  int i;
+
+  sprintf(dir, "/k/t%d", looker->id);
+  looker->wrong += !mkdir(&looker->session, dir);
+  looker->wrong += !cd(&looker->session, dir);
+
+  for (i = 0; i < LOCKING_ROUNDS; i++) {
+
+    sprintf(path, "f%d", i);
+    sprintf(moved, "/k/all/t%d_%d", looker->id, i);
+
+    looker->wrong += !touch(&looker->session, path);
+    looker->wrong += !append_file(&looker->session, path, "data", 4);
+    looker->wrong += !mv(&looker->session, path, moved);
+    looker->wrong += !ls(&looker->session, moved);
+    looker->wrong += ls(&looker->session, path);
+    ls(&looker->session, "/k");
+    du(&looker->session, "/k/all");
+    clear_output(&looker->session);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * rm of a directory while other threads keep making, writing and
+ * reading files below it: the totals stay those of the tree, and the
+ * journal replays to the same tree, with none of the changes made in a
+ * removed directory showing up in the one made after it
+ */
+static void test_race(void) {
+
+  Unix filesystem;
+  Writer writers[RACE_WRITERS + 1];
+  char image[64], journal[64], counted[64], *tree, *totals, *line;
+  unsigned long files = 0, dirs = 0;
+  int i;
+
+  temp_file(image, sizeof(image), "race.img");
+  temp_file(journal, sizeof(journal), "race.jrn");
+
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  CHECK(enable_threads(&filesystem, 1));
+  mkdir(&filesystem, "/r");
+  mkdir(&filesystem, "/r/x");
+
+  for (i = 0; i <= RACE_WRITERS; i++) {
+    writers[i].filesystem = &filesystem;
+    writers[i].id = i;
+    writers[i].remover = i == RACE_WRITERS;
+    pthread_create(&writers[i].thread, NULL, race_thread, &writers[i]);
+  }
+
+  for (i = 0; i <= RACE_WRITERS; i++)
+    pthread_join(writers[i].thread, NULL);
+
+  print_tree(&filesystem, "/");
+  tree = output(&filesystem);
+  du(&filesystem, "/");
+  totals = output(&filesystem);
+  CHECK(close_journal(&filesystem));
+
+  for (line = tree; *line != '\0'; line = strchr(line, '\n') + 1)
+    if (strchr(line, '\n')[-1] == '/')
+      dirs++;
+    else
+      files++;
+  sprintf(counted, "files %lu\ndirs %lu\n", files, dirs);
+
+  enable_threads(&filesystem, 0);
+  rmfs(&filesystem);
+
+  start(&filesystem);
+  CHECK(open_journal(&filesystem, image, journal));
+  print_tree(&filesystem, "/");
+  CHECK(shows(&filesystem, tree));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, totals));
+  CHECK(close_journal(&filesystem));
+  rmfs(&filesystem);
+
+  /* The totals are those of what the tree holds */
+  CHECK(strncmp(totals, counted, strlen(counted)) == 0);
+
+  free(tree);
+  free(totals);
+  unlink(image);
+  unlink(journal);
+}
+
+
+/*
+ * Runs one thread of the race test through a session of its own: a
+ * writer makes, writes and reads files in /r/x/w<id>, which it makes
+ * again whenever it is gone, and the remover removes /r and makes /r/x
+ * again
+ */
+static void *race_thread(void *arg) {
+
+  Writer *writer = arg;
+  Unix session;
+  char dir[32], path[64];
+  int i;
+
+  mksession(&session, writer->filesystem);
+  set_output(&session, -1);
+  sprintf(dir, "/r/x/w%d", writer->id);
+
+  for (i = 0; i < RACE_ROUNDS; i++) {
+
+    if (writer->remover) {
+      rm(&session, "/r");
+      mkdir(&session, "/r");
+      mkdir(&session, "/r/x");
+      continue;
+    }
+
+    mkdir(&session, dir);
+    sprintf(path, "%s/f%d", dir, i % 8);
+    touch(&session, path);
+    append_file(&session, path, "data", 4);
+    write_file(&session, path, 1, "AT", 2);
+    cat(&session, path);
+    ls(&session, "/r/x");
+    clear_output(&session);
+    sprintf(path, "%s/d%d", dir, i % 4);
+    mkdir(&session, path);
+  }
+
+  rmfs(&session);
+
+  return NULL;
+}
+
+
+/*
+ * Recursive commands spread over workers: find, print_tree and du
+ * print what they print on one thread, in the same order, and rm
+ * removes the whole tree, copies in it too
+ */
+static void test_pool(void) {
+
+  Unix filesystem;
+  char path[32], *found, *tree, *totals;
+  int workers, i, j;
+
+  start(&filesystem);
+
+  mkdir(&filesystem, "/p");
+  for (i = 0; i < POOL_DIRS; i++) {
+    sprintf(path, "/p/d%d", i);
+    mkdir(&filesystem, path);
+    for (j = 0; j < POOL_ENTRIES; j++) {
+      sprintf(path, "/p/d%d/%c%d", i, j % 3 == 0 ? 'd' : 'f', j);
+      if (j % 3 == 0)
+	mkdir(&filesystem, path);
+      else
+	touch(&filesystem, path);
+    }
+    sprintf(path, "/p/d%d/d0/f7", i);
+    touch(&filesystem, path);
+    append_file(&filesystem, path, "seven", 5);
+  }
+  cp(&filesystem, "/p/d0", "/p/copy");
+  touch(&filesystem, "/p/copy/d3/f7");
+
+  find(&filesystem, "/", "f7");
+  found = output(&filesystem);
+  print_tree(&filesystem, "/p");
+  tree = output(&filesystem);
+  du(&filesystem, "/p");
+  totals = output(&filesystem);
+  CHECK(strstr(found, "/p/copy/d0/f7\n/p/copy/d3/f7\n/p/copy/f7\n") != NULL);
+
+  for (workers = 2; workers <= POOL_WORKERS; workers++) {
+    CHECK(set_workers(&filesystem, workers));
+    find(&filesystem, "/", "f7");
+    CHECK(shows(&filesystem, found));
+    print_tree(&filesystem, "/p");
+    CHECK(shows(&filesystem, tree));
+    du(&filesystem, "/p");
+    CHECK(shows(&filesystem, totals));
+  }
+
+  CHECK(rm(&filesystem, "/p"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, ""));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 0\ndirs 0\nbytes 0\n"));
+  CHECK(set_workers(&filesystem, 1));
+  CHECK(!set_workers(&filesystem, 0));
+
+  free(found);
+  free(tree);
+  free(totals);
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The totals of du and count after touch, write, rm and mv, which
+ * change those of every directory above them
+ */
+static void test_totals(void) {
+
+  Unix filesystem;
+
+  start(&filesystem);
+
+  mkdir(&filesystem, "/t");
+  mkdir(&filesystem, "/t/u");
+  mkdir(&filesystem, "/t/u/v");
+  touch(&filesystem, "/t/u/v/f");
+  touch(&filesystem, "/t/u/g");
+  append_file(&filesystem, "/t/u/v/f", "12345", 5);
+  write_file(&filesystem, "/t/u/g", 2, "ab", 2);
+  mkdir(&filesystem, "/w");
+
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 2\ndirs 4\nbytes 9\n"));
+  du(&filesystem, "/t/u");
+  CHECK(shows(&filesystem, "files 2\ndirs 1\nbytes 9\n"));
+
+  mv(&filesystem, "/t/u/v", "/w");
+  du(&filesystem, "/t");
+  CHECK(shows(&filesystem, "files 1\ndirs 1\nbytes 4\n"));
+  du(&filesystem, "/w");
+  CHECK(shows(&filesystem, "files 1\ndirs 1\nbytes 5\n"));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 2\ndirs 4\nbytes 9\n"));
+
+  rm(&filesystem, "/w/v/f");
+  du(&filesystem, "/w");
+  CHECK(shows(&filesystem, "files 0\ndirs 1\nbytes 0\n"));
+
+  /* A copy counts what it shows */
+  cp(&filesystem, "/t", "/w/t");
+  du(&filesystem, "/w");
+  CHECK(shows(&filesystem, "files 1\ndirs 3\nbytes 4\n"));
+  rm(&filesystem, "/t/u/g");
+  du(&filesystem, "/w/t");
+  CHECK(shows(&filesystem, "files 1\ndirs 1\nbytes 4\n"));
+  rm(&filesystem, "/w/t/u");
+  du(&filesystem, "/w");
+  CHECK(shows(&filesystem, "files 0\ndirs 2\nbytes 0\n"));
+
+  rm(&filesystem, "/t");
+  count(&filesystem, "/");
+  CHECK(shows(&filesystem, "entries 1\ntotal 3\n"));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 0\ndirs 3\nbytes 0\n"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Patterns: ls and rm find the entries that start with the literal
+ * prefix of a pattern by seeking to the first of them, in a directory
+ * and in a copy of it, so a narrow pattern looks at few entries
+ */
+static void test_glob(void) {
+
+  Unix filesystem;
+  unsigned long before;
+  char path[32];
+  int i;
+
+  start(&filesystem);
+  enable_stats(&filesystem, 1);
+
+  mkdir(&filesystem, "/g");
+  for (i = 0; i < GLOB_ENTRIES; i++) {
+    sprintf(path, "/g/f%04d", i);
+    touch(&filesystem, path);
+  }
+
+  before = visited(&filesystem);
+  ls(&filesystem, "/g/f204*");
+  CHECK(shows(&filesystem, "f2040\nf2041\nf2042\nf2043\nf2044\nf2045\n"
+	      "f2046\nf2047\nf2048\nf2049\n"));
+  CHECK(visited(&filesystem) - before < GLOB_ENTRIES / 16);
+
+  ls(&filesystem, "/g/f40?5");
+  CHECK(shows(&filesystem, "f4005\nf4015\nf4025\nf4035\nf4045\nf4055\n"
+	      "f4065\nf4075\nf4085\nf4095\n"));
+  ls(&filesystem, "/g/f9*");
+  CHECK(shows(&filesystem, ""));
+  complete(&filesystem, "/g/f409");
+  CHECK(shows(&filesystem, "f4090\nf4091\nf4092\nf4093\nf4094\nf4095\n"));
+
+  /* The same in a copy, with entries of its own and removed ones */
+  cp(&filesystem, "/g", "/h");
+  rm(&filesystem, "/h/f2043");
+  touch(&filesystem, "/h/f2043x");
+  rm(&filesystem, "/h/f204[5-9]");
+  before = visited(&filesystem);
+  ls(&filesystem, "/h/f204*");
+  CHECK(shows(&filesystem, "f2040\nf2041\nf2042\nf2043x\nf2044\n"));
+  CHECK(visited(&filesystem) - before < GLOB_ENTRIES / 16);
+  ls(&filesystem, "/g/f204[3-5]");
+  CHECK(shows(&filesystem, "f2043\nf2044\nf2045\n"));
+
+  rm(&filesystem, "/g/f1*");
+  count(&filesystem, "/g");
+  CHECK(shows(&filesystem, "entries 3096\ntotal 3096\n"));
+  count(&filesystem, "/h");
+  CHECK(shows(&filesystem, "entries 4091\ntotal 4091\n"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * The contents of files: cat prints what was appended and written in
+ * any number of pieces, a write in the middle changes only the bytes
+ * it covers, a write past the end leaves zeros before it, a write to
+ * a file that isn't there makes it, and only a file has contents
+ */
+static void test_contents(void) {
+
+  Unix filesystem;
+  char expected[CONTENTS_PIECES * 10 + 3], *text;
+  unsigned long len;
+  int i, written = 0;
+
+  start(&filesystem);
+
+  mkdir(&filesystem, "/c");
+  touch(&filesystem, "/c/f");
+  CHECK(cat(&filesystem, "/c/f"));
+  CHECK(shows(&filesystem, ""));
+
+  for (i = 0; i < CONTENTS_PIECES; i++) {
+    written += append_file(&filesystem, "/c/f", PIECE, 10);
+    memcpy(expected + 10 * i, PIECE, 10);
+  }
+  expected[10 * CONTENTS_PIECES] = '\0';
+  CHECK(written == CONTENTS_PIECES);
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, expected));
+
+  /* Across the pieces, and over the end */
+  CHECK(write_file(&filesystem, "/c/f", 5, "abcdefghijklmnopqrstuvwxyz", 26));
+  memcpy(expected + 5, "abcdefghijklmnopqrstuvwxyz", 26);
+  CHECK(write_file(&filesystem, "/c/f", 10 * CONTENTS_PIECES - 2, "END!", 4));
+  strcpy(expected + 10 * CONTENTS_PIECES - 2, "END!");
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, expected));
+  du(&filesystem, "/c");
+  sprintf(expected, "files 1\ndirs 0\nbytes %d\n", 10 * CONTENTS_PIECES + 2);
+  CHECK(shows(&filesystem, expected));
+
+  /* Past the end of a file made by the write */
+  CHECK(write_file(&filesystem, "/c/g", 4, "xy", 2));
+  CHECK(append_file(&filesystem, "/c/g", "z", 1));
+  cat(&filesystem, "/c/g");
+  text = (char *)get_output(&filesystem, &len);
+  CHECK(len == 7 && memcmp(text, "\0\0\0\0xyz", 7) == 0);
+  clear_output(&filesystem);
+
+  /* Only files have contents */
+  CHECK(!cat(&filesystem, "/c"));
+  CHECK(!append_file(&filesystem, "/c", "x", 1));
+  CHECK(!write_file(&filesystem, "/c", 0, "x", 1));
+  CHECK(!cat(&filesystem, "/c/nope"));
+  CHECK(!append_file(&filesystem, "/nope/f", "x", 1));
+  CHECK(shows(&filesystem, ""));
+
+  /* Made again empty */
+  rm(&filesystem, "/c/f");
+  touch(&filesystem, "/c/f");
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, ""));
+  du(&filesystem, "/");
+  CHECK(shows(&filesystem, "files 2\ndirs 1\nbytes 7\n"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * cp and mv: a change to a copy, at any depth and whichever way it is
+ * made, isn't seen in what it was copied from, nor the other way round,
+ * and mv moves an entry out of one side only
+ */
+static void test_copies(void) {
+
+  Unix filesystem;
+
+  start(&filesystem);
+
+  mkdir(&filesystem, "/a");
+  mkdir(&filesystem, "/a/b");
+  touch(&filesystem, "/a/f");
+  touch(&filesystem, "/a/b/g");
+  append_file(&filesystem, "/a/f", "one", 3);
+
+  CHECK(cp(&filesystem, "/a", "/c"));
+  ls(&filesystem, "/c");
+  CHECK(shows(&filesystem, "b/\nf\n"));
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, "one"));
+
+  /* Changes to the copy */
+  touch(&filesystem, "/c/new");
+  rm(&filesystem, "/c/b/g");
+  write_file(&filesystem, "/c/f", 0, "two", 3);
+  ls(&filesystem, "/a");
+  CHECK(shows(&filesystem, "b/\nf\n"));
+  ls(&filesystem, "/a/b");
+  CHECK(shows(&filesystem, "g\n"));
+  cat(&filesystem, "/a/f");
+  CHECK(shows(&filesystem, "one"));
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, "two"));
+
+  /* Changes to what it was copied from */
+  touch(&filesystem, "/a/b/h");
+  append_file(&filesystem, "/a/f", "!", 1);
+  ls(&filesystem, "/c/b");
+  CHECK(shows(&filesystem, ""));
+  cat(&filesystem, "/c/f");
+  CHECK(shows(&filesystem, "two"));
+  print_tree(&filesystem, "/c");
+  CHECK(shows(&filesystem, "b/\nf\nnew\n"));
+
+  /* A copy of a copy, then a change to the copy in between */
+  CHECK(cp(&filesystem, "/c", "/d"));
+  rm(&filesystem, "/c/new");
+  mkdir(&filesystem, "/c/b/deep");
+  ls(&filesystem, "/d");
+  CHECK(shows(&filesystem, "b/\nf\nnew\n"));
+  ls(&filesystem, "/d/b");
+  CHECK(shows(&filesystem, ""));
+
+  /* mv out of a copy, within one and into one */
+  CHECK(mv(&filesystem, "/d/new", "/moved"));
+  CHECK(mv(&filesystem, "/a/b/g", "/a/g2"));
+  CHECK(mv(&filesystem, "/a/f", "/c/b"));
+  ls(&filesystem, "/d");
+  CHECK(shows(&filesystem, "b/\nf\n"));
+  ls(&filesystem, "/c");
+  CHECK(shows(&filesystem, "b/\nf\n"));
+  ls(&filesystem, "/c/b");
+  CHECK(shows(&filesystem, "deep/\nf\n"));
+  cat(&filesystem, "/c/b/f");
+  CHECK(shows(&filesystem, "one!"));
+  ls(&filesystem, "/a");
+  CHECK(shows(&filesystem, "b/\ng2\n"));
+  ls(&filesystem, "/a/b");
+  CHECK(shows(&filesystem, "h\n"));
+  find(&filesystem, "/", "f");
+  CHECK(shows(&filesystem, "/c/b/f\n/c/f\n/d/f\n"));
+
+  /* A directory can't go into itself, through a copy or not */
+  CHECK(!cp(&filesystem, "/c", "/c/b"));
+  CHECK(!mv(&filesystem, "/c", "/c/b/deep"));
+
+  rm(&filesystem, "/a");
+  rm(&filesystem, "/c");
+  ls(&filesystem, "/d/b");
+  CHECK(shows(&filesystem, ""));
+  cat(&filesystem, "/d/f");
+  CHECK(shows(&filesystem, "two"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * snapshot and restore: a snapshot keeps the tree as it was, the first
+ * change after it copies only the entries on the way down, and a
+ * restore brings the tree back without changing the snapshot
+ */
+static void test_snapshots(void) {
+
+  Unix filesystem;
+  unsigned long before;
+  char path[32];
+  int i;
+
+  start(&filesystem);
+  enable_stats(&filesystem, 1);
+
+  mkdir(&filesystem, "/s");
+  mkdir(&filesystem, "/s/d");
+  for (i = 0; i < 100; i++) {
+    sprintf(path, "/s/d/f%02d", i);
+    touch(&filesystem, path);
+  }
+  append_file(&filesystem, "/s/d/f00", "kept", 4);
+
+  CHECK(snapshot(&filesystem, "first"));
+
+  before = get_stats(&filesystem)->copied;
+  touch(&filesystem, "/s/d/new");
+  CHECK(get_stats(&filesystem)->copied - before == 2);
+
+  before = get_stats(&filesystem)->copied;
+  write_file(&filesystem, "/s/d/f00", 0, "lost", 4);
+  rm(&filesystem, "/s/d/f01");
+  CHECK(get_stats(&filesystem)->copied - before == 2);
+
+  CHECK(snapshot(&filesystem, "second"));
+  rm(&filesystem, "/s");
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, ""));
+
+  CHECK(restore(&filesystem, "first"));
+  ls(&filesystem, "/s/d/f0*");
+  CHECK(shows(&filesystem, "f00\nf01\nf02\nf03\nf04\nf05\nf06\nf07\nf08\n"
+	      "f09\n"));
+  cat(&filesystem, "/s/d/f00");
+  CHECK(shows(&filesystem, "kept"));
+
+  /* Changing the restored tree leaves the snapshot as it was */
+  rm(&filesystem, "/s/d/f02");
+  CHECK(restore(&filesystem, "first"));
+  ls(&filesystem, "/s/d/f02");
+  CHECK(shows(&filesystem, "f02\n"));
+
+  CHECK(restore(&filesystem, "second"));
+  ls(&filesystem, "/s/d/f0[0-2]");
+  CHECK(shows(&filesystem, "f00\nf02\n"));
+  cat(&filesystem, "/s/d/f00");
+  CHECK(shows(&filesystem, "lost"));
+  count(&filesystem, "/s/d");
+  CHECK(shows(&filesystem, "entries 100\ntotal 100\n"));
+
+  snapshots(&filesystem);
+  CHECK(shows(&filesystem, "first\nsecond\n"));
+  CHECK(!restore(&filesystem, "third"));
+
+  rmfs(&filesystem);
+}
+
+
+/*
+ * mv: a directory is moved or renamed whole, with what is in it, to a
+ * name of any length, without looking at its entries, and stays the
+ * directory a session in it is in, and a move onto a name that is
+ * there, or into a directory that isn't or already has its name, is
+ * refused
+ */
+static void test_mv(void) {
+
+  Unix filesystem, other;
+  char path[32], image[64];
+  unsigned long before;
+  int i;
+
+  temp_file(image, sizeof(image), "mv.img");
+
+  start(&filesystem);
+  enable_stats(&filesystem, 1);
+  mksession(&other, &filesystem);
+  set_output(&other, -1);
+
+  mkdir(&filesystem, "/a");
+  touch(&filesystem, "/a/x");
+  mkdir(&filesystem, "/a/y");
+  touch(&filesystem, "/a/y/z");
+  mkdir(&filesystem, "/a/many");
+  for (i = 0; i < MOVED_ENTRIES; i++) {
+    sprintf(path, "/a/many/%d", i);
+    touch(&filesystem, path);
+  }
+  cd(&other, "/a/y");
+  cp(&filesystem, "/a", "/c");
+
+  before = visited(&filesystem);
+  CHECK(mv(&filesystem, "/a", "/" LONG_DIR));
+  CHECK(visited(&filesystem) - before < MOVED_ENTRIES / 100);
+  ls(&filesystem, "/" LONG_DIR);
+  CHECK(shows(&filesystem, "many/\nx\ny/\n"));
+  pwd(&other);
+  CHECK(shows(&other, "/" LONG_DIR "/y\n"));
+
+  CHECK(mv(&filesystem, "/" LONG_DIR, "/" LONGER_DIR));
+  CHECK(mv(&filesystem, "/" LONGER_DIR, "/q"));
+  ls(&filesystem, "/");
+  CHECK(shows(&filesystem, "c/\nq/\n"));
+  touch(&other, "w");
+  ls(&filesystem, "/q/y");
+  CHECK(shows(&filesystem, "w\nz\n"));
+  ls(&filesystem, "/c/y");
+  CHECK(shows(&filesystem, "z\n"));
+  count(&filesystem, "/q");
+  CHECK(shows(&filesystem, "entries 3\ntotal 10005\n"));
+
+  /* Into a directory, and a file renamed */
+  CHECK(!mv(&filesystem, "/q/y", "/c"));
+  mkdir(&filesystem, "/d");
+  CHECK(mv(&filesystem, "/q/y", "/d"));
+  pwd(&other);
+  CHECK(shows(&other, "/d/y\n"));
+  ls(&filesystem, "/d/y");
+  CHECK(shows(&filesystem, "w\nz\n"));
+  CHECK(mv(&filesystem, "/d/y/z", "/d/y/" LONGER_DIR));
+  CHECK(save(&filesystem, image));
+  CHECK(load(&filesystem, image));
+  ls(&filesystem, "/d/y");
+  CHECK(shows(&filesystem, LONGER_DIR "\nw\n"));
+
+  /* Refused */
+  CHECK(!mv(&filesystem, "/q/x", "/c/x"));
+  CHECK(!mv(&filesystem, "/q/x", "/nope/x"));
+  CHECK(!mv(&filesystem, "/q/nope", "/q/x2"));
+  CHECK(!mv(&filesystem, "/", "/q/root"));
+  ls(&filesystem, "/q");
+  CHECK(shows(&filesystem, "many/\nx\n"));
+
+  rmfs(&other);
+  rmfs(&filesystem);
+  unlink(image);
+}
+
+
+/*
+ * Which directory is above which: mv and cp refuse to put a directory
+ * anywhere below itself and allow it everywhere else, also after
+ * directories are made, moved and copied around it, and rm of a
+ * directory moves the sessions below it, and no other, out of it
+ */
+static void test_ancestors(void) {
+
+  Unix filesystem, below, beside;
+  char path[ANCESTOR_LEVELS * 2 + 16];
+  int i, j, refused = 0;
+
+  start(&filesystem);
+  mksession(&below, &filesystem);
+  set_output(&below, -1);
+  mksession(&beside, &filesystem);
+  set_output(&beside, -1);
+
+  mkdir(&filesystem, "/a");
+  cd(&filesystem, "/a");
+  for (i = 0; i < ANCESTOR_LEVELS; i++) {
+    mkdir(&filesystem, "d");
+    cd(&filesystem, "d");
+  }
+  cd(&filesystem, "/");
+  mkdir(&filesystem, "/ab");
+
+  /* Made between the others, so they are labeled again: s<i> is i
+     levels down the chain */
+  for (i = 0; i < ANCESTOR_SIBLINGS; i++) {
+    strcpy(path, "/a");
+    for (j = 0; j < i % ANCESTOR_LEVELS; j++)
+      strcat(path, "/d");
+    sprintf(path + strlen(path), "/s%d", i);
+    mkdir(&filesystem, path);
+  }
+
+  for (strcpy(path, "/a"); strlen(path) < 3 + 2 * ANCESTOR_LEVELS;
+       strcat(path, "/d")) {
+    refused += !mv(&filesystem, "/a", path);
+    refused += !cp(&filesystem, "/a", path);
+  }
+  CHECK(refused == 2 * (ANCESTOR_LEVELS + 1));
+  CHECK(!mv(&filesystem, "/a/d", "/a/d/d/d"));
+  CHECK(mv(&filesystem, "/a/d/d", "/a/d/s1"));
+  CHECK(!mv(&filesystem, "/a/d/s1", "/a/d/s1/d/d"));
+
+  /* Beside it, and into what was below it */
+  CHECK(mv(&filesystem, "/a", "/ab"));
+  CHECK(cp(&filesystem, "/ab/a/d/s1", "/ab/a/copy"));
+  CHECK(!cp(&filesystem, "/ab/a/copy", "/ab/a/copy/d/d"));
+  CHECK(mv(&filesystem, "/ab/a/d/s1/d", "/"));
+  CHECK(mv(&filesystem, "/ab", "/d/d/d"));
+  CHECK(!mv(&filesystem, "/d", "/d/d/d/ab/a/d"));
+  CHECK(!cp(&filesystem, "/d/d", "/d/d/d/ab/a/copy"));
+  ls(&filesystem, "/d/d/d/ab/a/[a-r]*");
+  CHECK(shows(&filesystem, "copy/\nd/\n"));
+
+  /* Sessions below a removed directory, and beside it */
+  CHECK(cd(&below, "/d/d/d/ab/a/copy/d"));
+  CHECK(cd(&beside, "/d/d/d/ab/a/d"));
+  CHECK(rm(&filesystem, "/d/d/d/ab/a/copy"));
+  pwd(&below);
+  CHECK(shows(&below, "/d/d/d/ab/a\n"));
+  pwd(&beside);
+  CHECK(shows(&beside, "/d/d/d/ab/a/d\n"));
+  CHECK(rm(&filesystem, "/d"));
+  pwd(&beside);
+  CHECK(shows(&beside, "/\n"));
+
+  rmfs(&below);
+  rmfs(&beside);
+  rmfs(&filesystem);
+}
+
+
+/*
+ * Makes filesystem an empty filesystem that keeps its output in memory
+ */
+static void start(Unix *filesystem) {
+  mkfs(filesystem);
+  set_output(filesystem, -1);
+}
+
+
+/*
+ * Checks if the output of filesystem since it was last cleared is
+ * expected, and clears it
+ *
+ * Returns 1 if it is, 0 otherwise
+ */
+static int shows(Unix *filesystem, const char expected[]) {
+
+  unsigned long len;
+  const char *text = get_output(filesystem, &len);
+  int result = len == strlen(expected) && memcmp(text, expected, len) == 0;
+
+  if (!result)
+    fprintf(stderr, "unix-test: printed \"%.*s\", not \"%s\"\n", (int)len,
+	    text, expected);
+
+  clear_output(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Returns the output of filesystem since it was last cleared as a
+ * string the caller frees, and clears it
+ */
+static char *output(Unix *filesystem) {
+
+  unsigned long len;
+  const char *text = get_output(filesystem, &len);
+  char *copy = malloc(len + 1);
+
+  if (copy == NULL) {
+    fprintf(stderr, "unix-test: not enough memory\n");
+    exit(1);
+  }
+
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  clear_output(filesystem);
+
+  return copy;
+}
+
+
+/*
+ * Returns a memory counter of filesystem, "in_use" or "reserved", as
+ * stats prints it
+ */
+static unsigned long memory(Unix *filesystem, const char counter[]) {
+
+  char *text, *line, label[32];
+  unsigned long value = 0;
+
+  clear_output(filesystem);
+  stats(filesystem);
+  text = output(filesystem);
+
+  sprintf(label, "memory.%s ", counter);
+  line = strstr(text, label);
+  if (line != NULL)
+    value = strtoul(line + strlen(label), NULL, 10);
+
+  free(text);
+
+  return value;
+}
+
+
+/*
+ * Returns the calls of command counted in the latency buckets of
+ * filesystem
+ */
+static unsigned long latencies(Unix *filesystem, enum Command command) {
+
+  unsigned long calls = 0;
+  int bucket;
+
+  for (bucket = 0; bucket < STATS_BUCKETS; bucket++)
+    calls += get_stats(filesystem)->latency[command][bucket];
+
+  return calls;
+}
+
+
+/*
+ * Returns the containers and index slots the filesystem looked at so
+ * far
+ */
+static unsigned long visited(Unix *filesystem) {
+  return get_stats(filesystem)->visited;
+}
+
+
+/*
+ * Writes the name of a file for a test, in the temporary directory and
+ * of this process only, to file, which holds size bytes, and removes
+ * what is left of it
+ */
+static void temp_file(char file[], unsigned long size, const char name[]) {
+  snprintf(file, size, "/tmp/unix-test-%ld-%s", (long)getpid(), name);
+  unlink(file);
+}
+
+
+/*
+ * Cuts the last bytes off the end of file, as a crash in the middle of
+ * writing them would
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int cut_file(const char file[], off_t bytes) {
+
+  int fd = open(file, O_RDWR);
+  off_t size = fd >= 0 ? lseek(fd, 0, SEEK_END) : -1;
+  int result = size >= bytes && ftruncate(fd, size - bytes) == 0;
+
+  if (fd >= 0)
+    close(fd);
+
+  return result;
+}
+
+
+/*
+ * Checks if file and other hold the same bytes
+ *
+ * Returns 1 if they do, 0 otherwise
+ */
+static int same_files(const char file[], const char other[]) {
+
+  FILE *one = fopen(file, "rb"), *two = fopen(other, "rb");
+  int result = one != NULL && two != NULL, c;
+
+  while (result && (c = getc(one)) != EOF)
+    result = getc(two) == c;
+
+  result = result && getc(two) == EOF;
+
+  if (one != NULL)
+    fclose(one);
+  if (two != NULL)
+    fclose(two);
+
+  return result;
+}
+
+
+/*
+ * Copies the bytes of file to copy
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int copy_file(const char file[], const char copy[]) {
+
+  FILE *from = fopen(file, "rb"), *to = fopen(copy, "wb");
+  int result = from != NULL && to != NULL, c;
+
+  while (result && (c = getc(from)) != EOF)
+    result = putc(c, to) != EOF;
+
+  if (from != NULL)
+    fclose(from);
+  if (to != NULL)
+    result = fclose(to) == 0 && result;
+
+  return result;
+}
@@ -0,0 +1,83 @@
+/*
+ * unix-tree.h
+ *
+ * Header file for the functions of unix.c that other parts of a Unix
+ * filesystem build trees with
+ */
+
+#include <stddef.h>
+#include "unix-datastructure.h"
+
+/* Most skip-list levels an entry can be linked on. Each level holds
+   about a quarter of the entries of the one below */
+#define SKIP_MAX_LEVEL 16
+
+/* Loads a link that other threads may be following without locks */
+#define LINK(link) atomic_load_explicit(&(link), memory_order_acquire)
+
+/* Stores a link, after everything the container it leads to was set */
+#define SET_LINK(link, value)					\
+  atomic_store_explicit(&(link), (value), memory_order_release)
+
+/* Most blocks a container is allocated in, apart from its contents */
+#define CONTAINER_BLOCKS 6
+
+/* Files and directories anywhere below container, none for a file */
+#define FILES_BELOW(container)						\
+  ((container)->directory != NULL ? (container)->directory->files : 0)
+#define DIRS_BELOW(container)						\
+  ((container)->directory != NULL ? (container)->directory->dirs : 0)
+
+/* What a command says when memory runs out */
+#define NO_MEMORY "Not enough memory for allocation.\n"
+
+/* Bytes a chunk was allocated with */
+#define CHUNK_BYTES(chunk) (offsetof(Chunk, data) + (chunk)->size)
+
+/* The chunk of contents at index in their order */
+#define CONTENTS_CHUNK(contents, index)					\
+  ((contents)->table != NULL ? (contents)->table[index] : (contents)->first)
+
+int reset_tree(Unix *filesystem);
+int begin_change(Unix *filesystem);
+int end_change(Unix *filesystem);
+Container *resolve_path(Unix *filesystem, const char path[],
+			Container **parent, const char **name,
+			unsigned long *len);
+Container *resolve_change(Unix *filesystem, const char path[],
+			  Container **parent, const char **name,
+			  unsigned long *len);
+unsigned long container_size(Container *container);
+Link *skip_link(Container *dir, Container *entry, int level);
+int container_blocks(Container *container, void *blocks[],
+		     unsigned long sizes[]);
+int add_path(Unix *filesystem, const char arg[], enum Type type);
+void add_totals(Unix *filesystem, Container *dir, long files, long dirs,
+		long bytes);
+void *tree_alloc(Unix *filesystem, unsigned long size);
+void tree_free(Unix *filesystem, void *block, unsigned long size);
+Container *new_root(Unix *filesystem);
+void replace_root(Unix *filesystem, Container *root);
+void unlink_entry(Unix *filesystem, Container *dir, Container *entry);
+void move_session(Unix *session, Container *dir);
+void reclaim(Unix *filesystem, int all);
+int path_reserve(Unix *filesystem, unsigned long len);
+const char *current_path(Unix *filesystem, unsigned long *len);
+char *absolute_path(Unix *filesystem, const char path[], unsigned long *len);
+Container *append_entry(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len, enum Type type, Container *tail[]);
+Container *add_container_to_filesystem(Unix *filesystem, Container *dir,
+				       const char name[], unsigned long len,
+				       enum Type type);
+Container *new_entry(Unix *filesystem, const char name[], unsigned long len,
+		     enum Type type);
+void place_entry(Unix *filesystem, Container *dir, Container *entry);
+void add_entry(Unix *filesystem, Container *dir, Container *entry);
+Container *index_lookup(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len);
+void free_container(Unix *filesystem, Container *container);
+Container *skip_seek(Unix *filesystem, Container *dir, const char prefix[],
+		     unsigned long len);
+int make_room(Unix *filesystem, Container *dir, int level);
+void remove_container(Unix *filesystem, Container *container);
+void print_error(Unix *filesystem, const char message[]);
@@ -0,0 +1,857 @@
+/*
+ * unix-walk.c
+ *
+ * This file contains the recursive commands of a simulated Unix
+ * filesystem: find and print_tree, and the removal of a whole subtree
+ * for rm, which spread their work over the task pool set up by
+ * set_workers().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unix.h"
+#include "unix-arena.h"
+#include "unix-copy.h"
+#include "unix-file.h"
+#include "unix-lock.h"
+#include "unix-order.h"
+#include "unix-pool.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+#include "unix-walk.h"
+
+/* Ranges split off on a skip-list level below this are walked one
+   entry at a time by a single task. One on level 3 holds about 64
+   entries */
+#define PART_LEVEL 4
+
+/* Bytes of output a piece is allocated with at least */
+#define PIECE_SIZE 4000
+
+/* Blocks a removal gives back to the arena at a time */
+#define FREE_BATCH 64
+
+/* What a walk does with the containers it finds */
+enum Walk {W_DELETE, W_FIND, W_TREE};
+
+struct part;
+
+/* A piece of the output of a part: text, or the place where the output
+   of a part it split off goes */
+typedef struct piece {
+  struct piece * next;
+  struct part * part;		/* the part split off, or NULL for text */
+  char * text;
+  unsigned long len;		/* bytes of text */
+  unsigned long size;		/* bytes text can hold */
+} Piece;
+
+/* A range of the entries of a directory, walked by one task. A copy
+   shows entries of its layers, whose parent links lead there, so paths
+   go through the part a directory was found in instead */
+typedef struct part {
+  Piece link;			/* its place in the output of its parent */
+  Container * dir;		/* whose entries are walked */
+  Container * shown;		/* the directory they are shown in */
+  struct part * outer;		/* the part shown was found in, or NULL */
+  Container * from;		/* first entry, or NULL for the first of dir */
+  Container * to;		/* entry after the range, or NULL */
+  int level;			/* skip-list level it was split off on */
+  int depth;			/* of dir, 0 for the directory walked */
+  Piece * first;		/* its output */
+  Piece * last;
+  struct part * up;		/* where the output goes on after it */
+  Piece * resume;
+} Part;
+
+/* The state shared by the tasks of a walk */
+typedef struct walk {
+  Unix * filesystem;
+  enum Walk op;
+  int concurrent;		/* other threads may be changing the tree */
+  const char * name;		/* what find looks for */
+  unsigned long name_len;
+  char * prefix;		/* absolute path of the directory walked,
+				   for find */
+  unsigned long prefix_len;
+  pthread_mutex_t * alloc;	/* held while giving blocks back */
+  pthread_mutex_t own_alloc;	/* that lock when the tree has none */
+  pthread_rwlock_t * order;	/* held while taking marks out */
+  pthread_rwlock_t own_order;	/* that lock when the tree has none */
+  _Atomic unsigned long visited; /* containers walked */
+  _Atomic int failed;		/* memory ran out */
+  Container * deferred;		/* left to delete() by a removal */
+  int cut;			/* the marks of a removal go with its
+				   memory, not taken out one by one */
+} Walk;
+
+/* Blocks of removed containers waiting to go back to the arena */
+typedef struct batch {
+  int count;
+  void * blocks[FREE_BATCH];
+  unsigned long sizes[FREE_BATCH];
+} Batch;
+
+static int walk_path(Unix *filesystem, const char arg[], Walk *walk,
+		     enum Command command);
+static void walk_init(Walk *walk, Unix *filesystem, enum Walk op);
+static int walk_subtree(Walk *walk, Container *top);
+static void walk_part(Worker *worker, void *arg);
+static void split_part(Worker *worker, Walk *walk, Part *part);
+static void walk_entries(Worker *worker, Walk *walk, Part *part);
+static void visit(Worker *worker, Walk *walk, Part *part, Container *entry);
+static void spawn_dir(Worker *worker, Walk *walk, Part *part,
+		      Container *dir);
+static void gather(Walk *walk, Part *top);
+static Part *new_part(Walk *walk, Part *outer, Container *dir,
+		      Container *shown, Container *from, Container *to,
+		      int level, int depth);
+static int top_level(Container *dir);
+static int reached(Walk *walk, Container *entry, Container *end);
+static void append_piece(Part *part, Piece *piece);
+static char *part_text(Walk *walk, Part *part, unsigned long len);
+static void write_path(Walk *walk, Part *part, Container *entry);
+static Container *up(Part **at);
+static void walk_failed(Walk *walk);
+static void batch_add(Walk *walk, Batch *batch, Container *container);
+static void batch_flush(Walk *walk, Batch *batch);
+static void defer(Walk *walk, Container *container);
+
+
+/*
+ * Prints the absolute path of every container below the path arg of the
+ * unix variable sent in that is called name, in the order ls would
+ * reach them
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ */
+int find(Unix *filesystem, const char arg[], const char name[]) {
+
+  Walk walk;
+
+  if (filesystem == NULL || arg == NULL || name == NULL)
+    return 0;
+
+  walk_init(&walk, filesystem, W_FIND);
+  walk.name = name;
+  walk.name_len = strlen(name);
+
+  return walk_path(filesystem, arg, &walk, C_FIND);
+}
+
+
+/*
+ * Prints every container below the path arg of the unix variable sent
+ * in, each directory followed by what it holds indented by two more
+ * spaces, with the same names ls prints
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ */
+int print_tree(Unix *filesystem, const char arg[]) {
+
+  Walk walk;
+
+  if (filesystem == NULL || arg == NULL)
+    return 0;
+
+  walk_init(&walk, filesystem, W_TREE);
+
+  return walk_path(filesystem, arg, &walk, C_TREE);
+}
+
+
+/*
+ * Lets the recursive commands of the unix variable sent in spread their
+ * work over the given number of workers, counting the thread that runs
+ * the command. With 1, the default, they run on that thread alone.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int set_workers(Unix *filesystem, int workers) {
+
+  Pool *pool = NULL, *old;
+
+  if (filesystem == NULL || workers < 1)
+    return 0;
+
+  if (workers > 1 && (pool = pool_create(workers)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  /* No command runs a job while this holds the tree lock */
+  lock_tree(filesystem);
+  old = filesystem->tree->pool;
+  filesystem->tree->pool = pool;
+  unlock_tree(filesystem);
+
+  pool_destroy(old);
+
+  return 1;
+}
+
+
+/*
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Frees dir, a directory with entries that rm has unlinked from the
+ * tree of the unix variable sent in, and everything in it, on the
+ * workers of the tree. What shares anything with copies is left on the
+ * list of containers for delete() to delete. With cut set, nothing in it
+ * is kept for copies, so its marks go with the memory.
+ *
+ * Returns 1 if successful, 0 if the walk couldn't be started
+ */
+int walk_delete(Unix *filesystem, Container *dir, int cut) {
+
+  Walk walk;
+  Part *part;
+  Container *next;
+
+  walk_init(&walk, filesystem, W_DELETE);
+  walk.cut = cut;
+
+  if (filesystem->tree->locks != NULL) {
+    walk.alloc = &filesystem->tree->locks->alloc;
+    walk.order = &filesystem->tree->locks->order;
+  } else {
+    pthread_mutex_init(&walk.own_alloc, NULL);
+    pthread_rwlock_init(&walk.own_order, NULL);
+    walk.alloc = &walk.own_alloc;
+    walk.order = &walk.own_order;
+  }
+
+  part = new_part(&walk, NULL, dir, dir, NULL, NULL, top_level(dir) + 1, 0);
+
+  if (part != NULL)
+    pool_run(filesystem->tree->pool, walk_part, part, &walk);
+
+  /* Handed over once no task can be reading them */
+  LOCK(filesystem, clones);
+  while (walk.deferred != NULL) {
+    next = walk.deferred->prev;
+    walk.deferred->prev = filesystem->tree->orphans;
+    filesystem->tree->orphans = walk.deferred;
+    walk.deferred = next;
+  }
+  UNLOCK(filesystem, clones);
+
+  if (walk.alloc == &walk.own_alloc) {
+    pthread_mutex_destroy(&walk.own_alloc);
+    pthread_rwlock_destroy(&walk.own_order);
+  }
+
+  return part != NULL;
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Runs walk over what is below the path arg of the unix variable sent
+ * in, for command, and prints what it found. A mapped image is built in
+ * memory first.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int walk_path(Unix *filesystem, const char arg[], Walk *walk,
+		     enum Command command) {
+
+  Container *parent, *position = NULL;
+  const char *name;
+  unsigned long long start;
+  unsigned long len;
+  int result;
+
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (result)
+    position = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  /* The directory may be in the origin of a copy, whose parent links
+     lead elsewhere, so its path is made from arg */
+  if (position != NULL && walk->op == W_FIND
+      && (walk->prefix = absolute_path(filesystem, arg, &walk->prefix_len))
+      == NULL)
+    position = NULL;
+
+  result = position != NULL && walk_subtree(walk, position);
+
+  free(walk->prefix);
+
+  sink_flush(&filesystem->out);
+
+  result = STATS_END(filesystem, command, start, result);
+  end_change(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Initializes walk to do op on the tree of the unix variable sent in
+ */
+static void walk_init(Walk *walk, Unix *filesystem, enum Walk op) {
+
+  walk->filesystem = filesystem;
+  walk->op = op;
+
+  /* A removed subtree is out of reach of every other thread */
+  walk->concurrent = filesystem->tree->locks != NULL && op != W_DELETE;
+
+  walk->name = NULL;
+  walk->name_len = 0;
+  walk->prefix = NULL;
+  walk->prefix_len = 0;
+  walk->alloc = NULL;
+  walk->order = NULL;
+  atomic_init(&walk->visited, 0);
+  atomic_init(&walk->failed, 0);
+  walk->deferred = NULL;
+  walk->cut = 0;
+}
+
+
+/*
+ * Runs walk over everything below top on the workers of the tree and
+ * gathers what it found
+ *
+ * Returns 1 if successful, 0 if memory ran out
+ */
+static int walk_subtree(Walk *walk, Container *top) {
+
+  Unix *filesystem = walk->filesystem;
+  Part *part;
+
+  if (!has_entries(top))
+    return 1;
+
+  part = new_part(walk, NULL, top, top, NULL, NULL, top_level(top) + 1, 0);
+
+  if (part != NULL) {
+    pool_run(filesystem->tree->pool, walk_part, part, walk);
+    gather(walk, part);
+
+    STATS_ADD(filesystem, visited, atomic_load(&walk->visited));
+  }
+
+  if (atomic_load(&walk->failed)) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Walks the part sent in, a task of the walk that worker->job is. What
+ * a copy shows is merged from its layers, so it is walked as one part.
+ */
+static void walk_part(Worker *worker, void *arg) {
+
+  Walk *walk = worker->job;
+  Part *part = arg;
+
+  if (part->level >= PART_LEVEL
+      && (walk->op == W_DELETE || LINK(part->dir->directory->origin) == NULL))
+    split_part(worker, walk, part);
+  else
+    walk_entries(worker, walk, part);
+
+  /* Nothing is gathered from a removal */
+  if (walk->op == W_DELETE)
+    free(part);
+}
+
+
+/*
+ * Splits part into the ranges between its entries on the skip-list
+ * level below its own, spawning a part for each. The link out of an
+ * entry is read before the part starting at it is spawned, since a
+ * removal frees the entry there.
+ */
+static void split_part(Worker *worker, Walk *walk, Part *part) {
+
+  Container *from = part->from, *to;
+  Part *range;
+  int level = part->level - 1;
+
+  do {
+
+    to = LINK(*skip_link(part->dir, from, level));
+
+    /* An entry removed meanwhile may be skipped over */
+    if (reached(walk, to, part->to))
+      to = part->to;
+
+    range = new_part(walk, part->outer, part->dir, part->shown, from, to,
+		     level, part->depth);
+
+    if (range == NULL)
+      return;
+
+    if (walk->op != W_DELETE)
+      append_piece(part, &range->link);
+
+    pool_spawn(worker, walk_part, range);
+    from = to;
+
+  } while (from != part->to);
+}
+
+
+/*
+ * Walks the entries of part one at a time, spawning a part for every
+ * directory among them that has entries to show, or, for a copy, what
+ * it shows in sorted order. The range that starts a directory is the
+ * last to read it, so a removal frees the directory there. A removal
+ * leaves the containers layers are made of, and copies, to delete(),
+ * which sees to what they share.
+ */
+static void walk_entries(Worker *worker, Walk *walk, Part *part) {
+
+  Container *curr, *next;
+  unsigned long visited = 0;
+  Batch batch;
+  View view;
+
+  batch.count = 0;
+
+  if (walk->op != W_DELETE && LINK(part->dir->directory->origin) != NULL) {
+
+    if (!view_open(walk->filesystem, &view, part->dir, NULL, 0)) {
+      walk_failed(walk);
+      return;
+    }
+
+    for (; (curr = view_next(&view)) != NULL; visited++)
+      visit(worker, walk, part, curr);
+
+    view_close(&view);
+    atomic_fetch_add_explicit(&walk->visited, visited, memory_order_relaxed);
+    return;
+  }
+
+  curr = part->from != NULL ? part->from : LINK(part->dir->sub_dir);
+
+  for (; !reached(walk, curr, part->to); curr = next) {
+
+    next = LINK(curr->next);
+    visited++;
+
+    if (walk->op != W_DELETE)
+      visit(worker, walk, part, curr);
+    else if (curr->directory != NULL
+	     && (LINK(curr->directory->share) != NULL
+		 || LINK(curr->directory->origin) != NULL))
+      defer(walk, curr);
+    else if (LINK(curr->sub_dir) != NULL)
+      spawn_dir(worker, walk, part, curr);
+    else
+      batch_add(walk, &batch, curr);
+  }
+
+  if (walk->op == W_DELETE) {
+    if (part->from == NULL)
+      batch_add(walk, &batch, part->dir);
+    batch_flush(walk, &batch);
+  }
+
+  atomic_fetch_add_explicit(&walk->visited, visited, memory_order_relaxed);
+}
+
+
+/*
+ * Finds entry, an entry of part, for a walk that prints, and spawns a
+ * part for what it shows if it is a directory
+ */
+static void visit(Worker *worker, Walk *walk, Part *part, Container *entry) {
+
+  unsigned long len;
+  char *text;
+
+  if (walk->op == W_FIND && entry->name_len == walk->name_len
+      && memcmp(entry->name, walk->name, walk->name_len) == 0)
+    write_path(walk, part, entry);
+
+  if (walk->op == W_TREE) {
+
+    len = 2 * part->depth + entry->name_len + (entry->type == U_DIR) + 1;
+    text = part_text(walk, part, len);
+
+    if (text != NULL) {
+      memset(text, ' ', 2 * part->depth);
+      memcpy(text + 2 * part->depth, entry->name, entry->name_len);
+      if (entry->type == U_DIR)
+	text[len - 2] = '/';
+      text[len - 1] = '\n';
+    }
+  }
+
+  if (has_entries(entry))
+    spawn_dir(worker, walk, part, entry);
+}
+
+
+/*
+ * Spawns the part for all of dir, an entry of part with entries, and
+ * puts its output next in that of part
+ */
+static void spawn_dir(Worker *worker, Walk *walk, Part *part,
+		      Container *dir) {
+
+  Part *child = new_part(walk, part, dir, dir, NULL, NULL,
+			 top_level(dir) + 1, part->depth + 1);
+
+  if (child == NULL)
+    return;
+
+  if (walk->op != W_DELETE)
+    append_piece(part, &child->link);
+
+  pool_spawn(worker, walk_part, child);
+}
+
+
+/*
+ * Writes the output of the walk that ended at top to the output of its
+ * unix variable in order, following the pieces of each part into the
+ * parts split off from it, and frees them
+ */
+static void gather(Walk *walk, Part *top) {
+
+  Sink *out = &walk->filesystem->out;
+  Part *part = top, *up;
+  Piece *piece = top->first, *next;
+
+  top->up = NULL;
+
+  for (;;) {
+
+    /* Go back to where the part was split off from */
+    if (piece == NULL) {
+
+      up = part->up;
+      piece = part->resume;
+      free(part);
+
+      if (up == NULL)
+	return;
+
+      part = up;
+      continue;
+    }
+
+    next = piece->next;
+
+    if (piece->part != NULL) {
+      piece->part->up = part;
+      piece->part->resume = next;
+      part = piece->part;
+      piece = part->first;
+      continue;
+    }
+
+    sink_write(out, piece->text, piece->len);
+    free(piece);
+    piece = next;
+  }
+}
+
+
+/*
+ * Allocates a part of walk for the entries of dir from from up to to,
+ * split off on the given skip-list level. They are shown in the
+ * directory shown, an entry of the part outer, or where the walk
+ * starts when outer is NULL.
+ *
+ * Returns the part, or NULL if memory couldn't be allocated
+ */
+static Part *new_part(Walk *walk, Part *outer, Container *dir,
+		      Container *shown, Container *from, Container *to,
+		      int level, int depth) {
+
+  Part *part = malloc(sizeof(Part));
+
+  if (part == NULL) {
+    walk_failed(walk);
+    return NULL;
+  }
+
+  part->link.next = NULL;
+  part->link.part = part;
+  part->link.text = NULL;
+  part->link.len = 0;
+  part->link.size = 0;
+  part->dir = dir;
+  part->shown = shown;
+  part->outer = outer;
+  part->from = from;
+  part->to = to;
+  part->level = level;
+  part->depth = depth;
+  part->first = NULL;
+  part->last = NULL;
+  part->up = NULL;
+  part->resume = NULL;
+
+  return part;
+}
+
+
+/*
+ * Returns the highest skip-list level the entries of dir are linked on
+ * above the sorted list, or 0 if there is none
+ */
+static int top_level(Container *dir) {
+
+  Link *head = LINK(dir->directory->skip_head);
+  int level = SKIP_MAX_LEVEL - 1;
+
+  if (head == NULL)
+    return 0;
+
+  while (level > 0 && LINK(head[level - 1]) == NULL)
+    level--;
+
+  return level;
+}
+
+
+/*
+ * Checks if entry is where a range ending at end stops: end itself, the
+ * end of the directory, or, while other threads may have removed end,
+ * an entry that sorts after it
+ *
+ * Returns a non-zero value if true, zero otherwise
+ */
+static int reached(Walk *walk, Container *entry, Container *end) {
+
+  unsigned long shorter;
+  int result;
+
+  if (entry == end || entry == NULL)
+    return 1;
+
+  if (end == NULL || !walk->concurrent)
+    return 0;
+
+  shorter = entry->name_len < end->name_len ? entry->name_len : end->name_len;
+  result = memcmp(entry->name, end->name, shorter);
+
+  return result > 0 || (result == 0 && entry->name_len >= end->name_len);
+}
+
+
+/*
+ * Adds piece at the end of the output of part
+ */
+static void append_piece(Part *part, Piece *piece) {
+
+  piece->next = NULL;
+
+  if (part->last == NULL)
+    part->first = piece;
+  else
+    part->last->next = piece;
+
+  part->last = piece;
+}
+
+
+/*
+ * Makes room for len more bytes of text at the end of the output of
+ * part
+ *
+ * Returns where to write them, or NULL if memory couldn't be allocated
+ */
+static char *part_text(Walk *walk, Part *part, unsigned long len) {
+
+  Piece *piece = part->last;
+  unsigned long size;
+
+  if (piece == NULL || piece->part != NULL || piece->size - piece->len < len) {
+
+    size = len > PIECE_SIZE ? len : PIECE_SIZE;
+    piece = malloc(sizeof(Piece) + size);
+
+    if (piece == NULL) {
+      walk_failed(walk);
+      return NULL;
+    }
+
+    piece->part = NULL;
+    piece->text = (char *) (piece + 1);
+    piece->len = 0;
+    piece->size = size;
+    append_piece(part, piece);
+  }
+
+  piece->len += len;
+
+  return piece->text + piece->len - len;
+}
+
+
+/*
+ * Writes the absolute path of entry, an entry of part, and a newline to
+ * the output of part. The parts it was found through lead up to where
+ * the walk started, whose path the walk keeps.
+ */
+static void write_path(Walk *walk, Part *part, Container *entry) {
+
+  Container *curr;
+  Part *at = part;
+  unsigned long len = 0;
+  char *text;
+
+  for (curr = entry; at != NULL; curr = up(&at))
+    len += curr->name_len + 1;
+
+  text = part_text(walk, part, walk->prefix_len + len + 1);
+
+  if (text == NULL)
+    return;
+
+  memcpy(text, walk->prefix, walk->prefix_len);
+
+  /* Fill in the rest from the end, going up */
+  text += walk->prefix_len + len;
+  *text = '\n';
+
+  at = part;
+
+  for (curr = entry; at != NULL; curr = up(&at)) {
+    text -= curr->name_len;
+    memcpy(text, curr->name, curr->name_len);
+    *--text = '/';
+  }
+}
+
+
+/*
+ * Returns the directory the entries of the part at are shown in, and
+ * moves at on to the part that directory was found in
+ */
+static Container *up(Part **at) {
+
+  Container *shown = (*at)->shown;
+
+  *at = (*at)->outer;
+
+  return shown;
+}
+
+
+/*
+ * Notes that memory ran out during walk. The workers share no output,
+ * so walk_subtree() says so once they are done.
+ */
+static void walk_failed(Walk *walk) {
+  atomic_store(&walk->failed, 1);
+}
+
+
+/*
+ * Adds the blocks of container, which a removal is done with, and the
+ * chunks of its contents to batch, giving the batch back to the arena
+ * whenever it is full
+ */
+static void batch_add(Walk *walk, Batch *batch, Container *container) {
+
+  Contents *contents = container->contents;
+  Chunk *chunk;
+  unsigned long index;
+
+  /* Copies of the file may still share its contents, or some chunks */
+  if (contents != NULL && contents_unref(contents)) {
+
+    for (index = 0; index < contents->chunks; index++) {
+
+      chunk = CONTENTS_CHUNK(contents, index);
+
+      if (!chunk_unref(chunk))
+	continue;
+
+      if (batch->count == FREE_BATCH)
+	batch_flush(walk, batch);
+
+      batch->blocks[batch->count] = chunk;
+      batch->sizes[batch->count++] = CHUNK_BYTES(chunk);
+    }
+
+    if (batch->count == FREE_BATCH)
+      batch_flush(walk, batch);
+
+    if (contents->table != NULL) {
+
+      batch->blocks[batch->count] = contents->table;
+      batch->sizes[batch->count++] = contents->table_size * sizeof(Chunk *);
+
+      if (batch->count == FREE_BATCH)
+	batch_flush(walk, batch);
+    }
+
+    batch->blocks[batch->count] = contents;
+    batch->sizes[batch->count++] = sizeof(Contents);
+  }
+
+  if (container->directory != NULL && !walk->cut) {
+    pthread_rwlock_wrlock(walk->order);
+    order_unlink(walk->filesystem->tree, container);
+    pthread_rwlock_unlock(walk->order);
+  }
+
+  if (batch->count + CONTAINER_BLOCKS > FREE_BATCH)
+    batch_flush(walk, batch);
+
+  batch->count += container_blocks(container, batch->blocks + batch->count,
+				   batch->sizes + batch->count);
+}
+
+
+/*
+ * Gives the blocks of batch back to the arena of the tree walk is on
+ * under a single lock, and empties it
+ */
+static void batch_flush(Walk *walk, Batch *batch) {
+
+  Tree *tree = walk->filesystem->tree;
+  int i;
+
+  if (batch->count == 0)
+    return;
+
+  pthread_mutex_lock(walk->alloc);
+  for (i = 0; i < batch->count; i++)
+    arena_free(&tree->arena, batch->blocks[i], batch->sizes[i]);
+  pthread_mutex_unlock(walk->alloc);
+
+  batch->count = 0;
+}
+
+
+/*
+ * Leaves container, which a removal found sharing what it has with
+ * copies, for delete() to delete once the walk is done
+ */
+static void defer(Walk *walk, Container *container) {
+
+  pthread_mutex_lock(walk->alloc);
+  container->prev = walk->deferred;
+  walk->deferred = container;
+  pthread_mutex_unlock(walk->alloc);
+}
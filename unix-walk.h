@@ -0,0 +1,22 @@
+/*
+ * unix-walk.h
+ *
+ * Header file for the recursive commands of a Unix filesystem, which
+ * walk a whole subtree on the workers of its task pool.
+ *
+ * A walk is split into parts, each a range of the entries of one
+ * directory. The part for a whole directory is split on the entries of
+ * its highest skip-list level, and each range again on the level below,
+ * until the ranges are small enough for one task to walk one entry at a
+ * time. Every directory with entries found on the way is a part of its
+ * own, so wide and deep trees both spread over the workers.
+ *
+ * A part writes its output to pieces of its own, with a placeholder
+ * for each part it splits off, and the pieces are gathered in order
+ * once the walk is over. The output comes out the same however the
+ * parts were spread.
+ */
+
+#include "unix-datastructure.h"
+
+int walk_delete(Unix *filesystem, Container *dir, int cut);
@@ -8,24 +8,118 @@
  */
 
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "unix.h"
+#include "unix-arena.h"
+#include "unix-copy.h"
+#include "unix-file.h"
+#include "unix-glob.h"
+#include "unix-lock.h"
+#include "unix-order.h"
+#include "unix-pool.h"
+#include "unix-sink.h"
+#include "unix-stats.h"
+#include "unix-tree.h"
+#include "unix-image.h"
+#include "unix-journal.h"
+#include "unix-walk.h"
 
 #define CD "."
 #define PARENT ".."
 #define ROOT "/"
 
-static int non_error_arg(const char arg[]);
-static int invalid_arg(const char arg[]);
-static Container * name_exists(Unix *fs, const char arg[],
-			       int *exists, int should_assign);
-static int add_container_to_filesystem(Unix *fs, const char arg[],
-				       enum Type type);
-static void print_elements(Container *container, int is_curr_dir);
-static void pwd_helper(Container *dir, Unix *filesystem);
-static void delete(Container *dir, int delete_all);
+/* File descriptor of the standard output */
+#define STDOUT_FD 1
+
+/* Smallest hash index allocated for a directory */
+#define INDEX_MIN_SIZE 8
+
+/* Directories a path is resolved through before room is allocated to
+   remember more of them */
+#define TRAIL_START 32
+
+/* Room an inline name of length len takes after the upper skip-list
+   links, in whole words so that it can hold its own size once a rename
+   gives the name a block of its own */
+#define NAME_ROOM(len) \
+  (((len) + sizeof(Container *)) & ~(sizeof(Container *) - 1))
+
+/* Where the inline name of container is, after its upper links */
+#define INLINE_NAME(container) \
+  ((char *) ((container)->forward + (container)->level - 1))
+
+static int new_tree(Unix *filesystem);
+static void session_init(Unix *session, Tree *tree);
+static int list_path(Unix *filesystem, const char arg[]);
+static int complete_path(Unix *filesystem, const char arg[]);
+static Container * unlink_path(Unix *filesystem, const char arg[]);
+static int remove_matches(Unix *filesystem, const char arg[]);
+static int move_path(Unix *filesystem, const char arg[], const char dest[]);
+static int change_dir(Unix *filesystem, Container *dir, int absolute);
+static void move_sessions(Unix *filesystem, Container *container);
+static void retire(Unix *filesystem, Container *container, void *block,
+		   unsigned long size);
+static Container *resolve(Unix *filesystem, const char path[],
+			  Container **parent, const char **name,
+			  unsigned long *len, int own, int *through);
+static int non_error_arg(const char name[], unsigned long len);
+static void print_elements(Unix *filesystem, Container *dir);
+static unsigned long print_matches(Unix *filesystem, Container *dir,
+				   const char pattern[], unsigned long len,
+				   int prefix_only);
+static int print_totals(Unix *filesystem, const char arg[],
+			enum Command command);
+static void remove_totals(Unix *filesystem, Container *container);
+static void path_update(Unix *filesystem, const char path[]);
+static void path_rebuild(Unix *filesystem);
+static void delete(Unix *filesystem, Container *dir);
+static void delete_subtree(Unix *filesystem, Container *dir);
+static unsigned long hash_name(const char name[], unsigned long len);
+static int compare_name(Container *entry, const char name[],
+			unsigned long len);
+static Container * lookup(Unix *filesystem, Container *dir,
+			  const char name[], unsigned long len);
+static Dentry * dcache_slot(Unix *filesystem, Container *dir,
+			    unsigned long hash);
+static void dcache_forget(Unix *filesystem, Container *dir,
+			  const char name[], unsigned long len);
+static int dcache_matches(Dentry *dentry, Container *dir, unsigned long hash,
+			  const char name[], unsigned long len);
+static void dcache_fill(Dentry *dentry, Container *dir, unsigned long hash,
+			const char name[], unsigned long len,
+			Container *entry);
+static Container * new_container(Unix *filesystem, const char name[],
+				 unsigned long len, enum Type type,
+				 int level);
+static void rename_entry(Unix *filesystem, Container *entry, char *block,
+			 const char name[], unsigned long len);
+static unsigned long index_bytes(unsigned long size);
+static int index_insert(Unix *filesystem, Container *dir, Container *entry);
+static int index_reserve(Unix *filesystem, Container *dir);
+static void index_remove(Container *dir, Container *entry);
+static int index_resize(Unix *filesystem, Container *dir,
+			unsigned long size);
+static int random_level(Unix *filesystem);
+static int has_prefix(Container *entry, const char prefix[],
+		      unsigned long len);
+static Container * skip_search(Unix *filesystem, Container *dir,
+				const char name[], unsigned long len,
+				Container *update[]);
+static void link_entry(Unix *filesystem, Container *dir, Container *entry);
+static void skip_remove(Unix *filesystem, Container *dir,
+			Container *entry);
+
+/* Marks a slot of a hash index whose entry was removed, so probing
+   continues past it */
+static Container deleted_entry;
+#define DELETED (&deleted_entry)
 
 
 /*
@@ -37,493 +131,2960 @@ void mkfs(Unix *filesystem) {
   /* Only perform initialization on non-NULL value */
   if (filesystem != NULL) {
 
-    Container *root = malloc(sizeof(*root));
+    Tree *tree = malloc(sizeof(Tree));
 
     /* Allocate enough memory and verify memmory was allocated */
-    if (root == NULL) {
+    if (tree == NULL) {
       printf("Not enough memory for allocation. Terminating program.\n");
       exit(1);
     }
 
     /* Set the members for this unix variable */
-    filesystem->root = root;
-    filesystem->curr_dir = root;
-
-    /* Initialize the root directory for this unix variable */
-    root->prev = NULL;
-    root->parent = root;
-    root->type = U_ROOT;
-    root->next = NULL;
-    root->name = malloc(sizeof(char) + 1);
-
-    if (root->name == NULL) {
+    tree->seed = 88172645463325252UL;
+    tree->stats = NULL;
+    tree->image = NULL;
+    tree->image_size = 0;
+    tree->journal = NULL;
+    tree->sessions = NULL;
+    tree->locks = NULL;
+    tree->pool = NULL;
+    atomic_init(&tree->layers, 0);
+    atomic_init(&tree->freezes, 0);
+    arena_init(&tree->arena);
+
+    session_init(filesystem, tree);
+
+    if (!new_tree(filesystem)) {
       printf("Not enough memory for allocation. Terminating program.\n");
       exit(1);
     }
-    
-    strcpy(root->name, "/");
   }
 }
 
 
 /*
- * Adds a file with the name arg to the passed in unix variable
+ * Initializes the Unix parameter to be a new session on the same tree
+ * as the unix variable filesystem, with the root as its current
+ * directory and its output going to the standard output. Changes made
+ * through either are seen by both.
  *
- * Returns 1 if file was added successfully, 0 if there was an error
- * or invalid parameter
+ * Returns 1 if successful, 0 otherwise
+ */
+int mksession(Unix *session, Unix *filesystem) {
+
+  if (session == NULL || filesystem == NULL || filesystem->tree == NULL)
+    return 0;
+
+  lock_tree(filesystem);
+
+  session_init(session, filesystem->tree);
+  move_session(session, filesystem->tree->root);
+
+  unlock_tree(filesystem);
+
+  return 1;
+}
+
+
+/*
+ * Adds a file at the path arg to the passed in unix variable
+ *
+ * Returns 1 if file was added successfully or already exists, 0 if
+ * there was an error or invalid parameter
  */
 int touch(Unix *filesystem, const char arg[]) {
 
-  int exists = 0;
+  unsigned long long start;
+  int result;
 
-  if (filesystem == NULL || arg == NULL)
+  if (filesystem == NULL || arg == NULL || (int)strlen(arg) == 0)
     return 0;
-   
-  name_exists(filesystem, arg, &exists, 0);
 
-  if (non_error_arg(arg) || exists) 
-    return 1;
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
 
-  if (invalid_arg(arg))
-    return 0;
-  
-  return add_container_to_filesystem(filesystem, arg, U_FILE);
+  result = result && add_path(filesystem, arg, U_FILE);
+  result = STATS_END(filesystem, C_TOUCH, start, result);
+
+  result = end_change(filesystem) && result;
+
+  return result;
 }
 
 
 /*
- * Adds a directory with the name arg to the passed in unix variable
+ * Adds a directory at the path arg to the passed in unix variable
  *
  * Returns 1 if directory was added successfully, 0 if there was an error
  * or invalid parameter
  */
 int mkdir(Unix *filesystem, const char arg[]) {
 
-  int exists = 0;
+  unsigned long long start;
+  int result;
 
-  if (filesystem == NULL || arg == NULL)
-    return 0;
-   
-  name_exists(filesystem, arg, &exists, 0);
-  
-  if (exists || non_error_arg(arg))
+  if (filesystem == NULL || arg == NULL || (int)strlen(arg) == 0)
     return 0;
 
-  if (invalid_arg(arg))
-    return 0;
-  
-  return add_container_to_filesystem(filesystem, arg, U_DIR);
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  result = result && add_path(filesystem, arg, U_DIR);
+  result = STATS_END(filesystem, C_MKDIR, start, result);
+
+  result = end_change(filesystem) && result;
+
+  return result;
 }
 
 
 
 /*
  * Changes the current directory of the unix variable sent in
- * to the parameter arg
+ * to the path arg
  *
  * Returns 1 if successful, 0 otherwise
  */
 int cd(Unix *filesystem, const char arg[]) {
 
-  Container * position = NULL;
-  int exists = 0;
+  Container *parent, *position;
+  const char *name;
+  unsigned long len;
+  unsigned long long start;
+  int result;
 
   if (filesystem == NULL || arg == NULL)
     return 0;
 
-  /* Case when current directory is the arg sent in */
-  if (strcmp(arg, CD) == 0 || (int)strlen(arg) == 0)
-    return 1;
-
-  /* Changing cd to the parent of the current directory */
-  if (strcmp(arg, PARENT) == 0) {
+  enter_tree(filesystem);
+  start = STATS_BEGIN(filesystem);
 
-    /* Check if this is the root */
-    if (filesystem->curr_dir->type != U_ROOT)
-      filesystem->curr_dir = filesystem->curr_dir->parent;
-    
-    return 1;
-  }
-
-  /* Changing cd to root */
-  if (strcmp(arg, ROOT) == 0) {
-    filesystem->curr_dir = filesystem->root;
-    return 1;
+  /* A mapped image is read in place */
+  if (filesystem->tree->image != NULL)
+    result = image_cd(filesystem, arg);
+  else {
+    position = resolve_change(filesystem, arg, &parent, &name, &len);
+    result = position != NULL && position->type != U_FILE
+      && change_dir(filesystem, position, arg[0] == ROOT[0]);
   }
 
-  /* Changing cd to a different directory other than the ROOT */
-  position = name_exists(filesystem, arg, &exists, 1);
+  if (result)
+    path_update(filesystem, arg);
 
-  if (!exists && non_error_arg(arg) == 0)
-    return 0;
+  result = STATS_END(filesystem, C_CD, start, result);
+  leave_tree(filesystem);
 
-  if (position != NULL) {
-    if (position->type == U_FILE)
-      return 0;
-  }
-  
-  /* Changing cd to valid subdirectory */
-  filesystem->curr_dir = position;
-  
-  return 1;
+  return result;
 }
 
 
 /*
- * Prints depending on arg sent in: the elements in the
- * current directory, elements in the parent directory,
- * elements in the root directory, name of a file in the
- * current directory, or elements of a subdirectory in 
- * the current directory
+ * Prints depending on the path arg sent in: the name of a
+ * file, or the elements of a directory. An empty path
+ * prints the elements of the current directory. A last
+ * component that names nothing but is a pattern prints
+ * the elements of its directory that match it.
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ * or the pattern matches nothing
  */
 int ls(Unix *filesystem, const char arg[]) {
 
-  Container * position = NULL;
-  int exists = 0;
+  unsigned long long start;
+  int result;
 
   if (filesystem == NULL || arg == NULL)
     return 0;
-  
-  position = name_exists(filesystem, arg, &exists, 1);
-
-  /* Printing contents of the current directory */
-  if (strcmp(arg, CD) == 0 || (int)strlen(arg) == 0) {
-    print_elements(filesystem->curr_dir, 1);
-    return 1;
-  }
-
-  /* Argument sent in doesn't exist in the current directroy */
-  if (!exists && non_error_arg(arg) == 0)
-    return 0;
 
-  /* Printing the contents of the parent directory */
-  if (strcmp(arg, PARENT) == 0)
-    print_elements(filesystem->curr_dir->parent, 0);
+  enter_tree(filesystem);
+  start = STATS_BEGIN(filesystem);
 
-  /* Printing the contents of the root directory */
-  if (strcmp(arg, ROOT) == 0)
-    print_elements(filesystem->root, 0);
+  /* A mapped image is read in place */
+  if (filesystem->tree->image != NULL)
+    result = image_ls(filesystem, arg);
+  else
+    result = list_path(filesystem, arg);
 
-  /* Either printing a file or directory */
-  if (position != NULL) {
+  sink_flush(&filesystem->out);
 
-    if (position->type == U_FILE)
-      printf("%s\n", position->name);
-    else /* Printing elements of a subdirectory */
-      print_elements(position->sub_dir, 0);
-  }
+  result = STATS_END(filesystem, C_LS, start, result);
+  leave_tree(filesystem);
 
-  return 1;
+  return result;
 }
 
 
 /*
  * Prints the current directory of the unix variable
- * passed in listing out it's entire path from the 
- * root directory
+ * passed in listing out it's entire path from the
+ * root directory. The path is kept up to date by cd,
+ * so this is a single write.
  */
 void pwd(Unix *filesystem) {
-  pwd_helper(filesystem->curr_dir, filesystem);
+
+  unsigned long long start;
+
+  enter_tree(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (!filesystem->path_valid)
+    path_rebuild(filesystem);
+
+  if (filesystem->path_valid)
+    sink_write(&filesystem->out, filesystem->path, filesystem->path_len);
+
+  sink_write(&filesystem->out, "\n", 1);
+  sink_flush(&filesystem->out);
+
+  (void) STATS_END(filesystem, C_PWD, start, 0);
+  leave_tree(filesystem);
 }
 
 /*
- * Removes all containers created in the Unix filesystem
- * passed in.
+ * Ends the session of the Unix filesystem passed in. Removing the last
+ * session on a tree removes all containers created in it. They all
+ * live in the filesystem's arena, so this releases its slabs rather
+ * than visiting each one.
  */
 void rmfs(Unix *filesystem) {
-  delete(filesystem->root, 1);
+
+  Tree *tree = filesystem->tree;
+  Unix **link;
+  int last;
+
+  lock_tree(filesystem);
+
+  last = tree->sessions == filesystem && filesystem->next_session == NULL;
+
+  if (!last) {
+    for (link = &tree->sessions; *link != filesystem;
+	 link = &(*link)->next_session)
+      ;
+    *link = filesystem->next_session;
+
+    cache_empty(&filesystem->cache, &tree->arena);
+  }
+
+  unlock_tree(filesystem);
+
+  /* The tree goes with its last session */
+  if (last) {
+    close_journal(filesystem);
+    unmap_image(filesystem);
+    free(tree->stats);
+    free_locks(tree);
+    pool_destroy(tree->pool);
+    arena_release(&tree->arena);
+    free(tree);
+  }
+
+  sink_release(&filesystem->out);
+  free(filesystem->path);
+  filesystem->path = NULL;
+  filesystem->tree = NULL;
+  filesystem->curr_dir = NULL;
+  filesystem->shared_dir = NULL;
+  filesystem->next_session = NULL;
 }
 
 
 /*
- * Removes the container named arg from the Unix
- * variable sent in.
+ * Removes the container at the path arg from the Unix
+ * variable sent in. The current directory of every session
+ * inside it moves up to its parent. A last component that
+ * names nothing but is a pattern removes every element of
+ * its directory that matches it.
+ *
+ * It is unlinked from its directory under the lock of that
+ * directory alone. While threads run, commands may still be
+ * looking at it, so it is retired rather than freed. A
+ * command still changing something inside it leaves no record
+ * in the journal after the record of rm, so replaying the
+ * journal doesn't make that change in whatever takes its
+ * place.
  *
  * Returns 1 if successful, 0 if an error was encountered
  */
 int rm(Unix *filesystem, const char arg[]) {
 
-  Container * position = NULL;
-  int exists = 0;
-
-  position = name_exists(filesystem, arg, &exists, 1);
+  Container *position = NULL;
+  unsigned long long start;
+  int result;
 
   if (filesystem == NULL || arg == NULL)
     return 0;
 
-  if (invalid_arg(arg) || non_error_arg(arg) || !exists)
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (result)
+    position = unlink_path(filesystem, arg);
+
+  if (position != NULL)
+    remove_container(filesystem, position);
+  else if (result)
+    result = remove_matches(filesystem, arg);
+
+  result = STATS_END(filesystem, C_RM, start, position != NULL || result);
+  result = end_change(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Moves the file or directory at the path arg of the unix variable
+ * sent in to the path dest, or into the directory at dest under its own
+ * name if there is one. Only the two directories change: it is unlinked
+ * from one and linked into the other, and its marks, with everything
+ * between them, are cut out of the order of the directories and put
+ * back in at once. Nothing below it is looked at: a new name that
+ * doesn't fit in its block gets a block of its own, so it stays where
+ * it is. A directory can't be moved into itself or anywhere below it,
+ * and the root, "." and ".." can't be moved.
+ *
+ * It holds the tree lock, for the moment it takes, so no command is
+ * half way down a path that goes through it.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int mv(Unix *filesystem, const char arg[], const char dest[]) {
+
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || arg == NULL || dest == NULL
+      || (int)strlen(arg) == 0 || (int)strlen(dest) == 0)
     return 0;
 
-  if (position != NULL) {
-    delete(position, 0);
-    return 1;
-  }
+  lock_tree(filesystem);
+  enter_tree(filesystem);
+
+  /* A mapped image is built in memory first */
+  result = filesystem->tree->image == NULL || image_materialize(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  result = result && move_path(filesystem, arg, dest);
+  result = STATS_END(filesystem, C_MV, start, result);
 
-  return 0;
+  if (journal_full(filesystem))
+    checkpoint(filesystem);
+
+  /* Records the checkpoint couldn't save are lost */
+  if (journal_failed(filesystem))
+    result = 0;
+
+  leave_tree(filesystem);
+  unlock_tree(filesystem);
+
+  /* Synced once the tree is let go, so other commands go on meanwhile */
+  result = journal_commit(filesystem) && result;
+
+  return result;
 }
 
 
 /*
- * Private functions
+ * Prints how much is below the path arg of the unix variable sent in:
+ * the number of files and of directories, and the bytes of the
+ * contents of the files. Every directory keeps these up to date, so
+ * nothing is walked.
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ */
+int du(Unix *filesystem, const char arg[]) {
+  return print_totals(filesystem, arg, C_DU);
+}
+
+
+/*
+ * Prints how many entries the directory at the path arg of the unix
+ * variable sent in holds, and how many containers there are below it
+ * in all, without walking it
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
  */
+int count(Unix *filesystem, const char arg[]) {
+  return print_totals(filesystem, arg, C_COUNT);
+}
 
 
 /*
- * Prints out all the entire path of the current directory
- * all the way up to the ROOT directory
+ * Prints the elements of a directory whose names start with the last
+ * component of the path arg, or all of them when arg is empty, ends in
+ * "/" or ends in "." or "..", in which case that is the directory.
+ * Only the matches are visited.
+ *
+ * Returns 1 if successful, 0 if the directory doesn't exist
  */
-static void pwd_helper(Container *dir, Unix *filesystem) {
+int complete(Unix *filesystem, const char arg[]) {
 
-  if (dir->type == U_ROOT) {
-    /* Check if the ROOT is the current directroy */
-    if (dir == filesystem->curr_dir)
-      printf("%s\n", dir->name);
-    else
-      printf("%s", dir->name);
-    
-    return;
-  }
+  unsigned long long start;
+  int result;
+
+  if (filesystem == NULL || arg == NULL)
+    return 0;
 
-  /* Print the parent subdirectory of the current directory recursively */
-  pwd_helper(dir->parent, filesystem);
+  enter_tree(filesystem);
+  start = STATS_BEGIN(filesystem);
 
-  /* Print the name of this directory */
-  if (dir != filesystem->curr_dir)
-    printf("%s/", dir->name);
+  /* A mapped image is read in place */
+  if (filesystem->tree->image != NULL)
+    result = image_complete(filesystem, arg);
   else
-    printf("%s\n", dir->name);
+    result = complete_path(filesystem, arg);
+
+  sink_flush(&filesystem->out);
+
+  result = STATS_END(filesystem, C_COMPLETE, start, result);
+  leave_tree(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Sends the output of the commands of the unix variable
+ * to the file descriptor fd, or keeps it in memory to be
+ * read with get_output() if fd is -1
+ */
+void set_output(Unix *filesystem, int fd) {
+  sink_release(&filesystem->out);
+  sink_init(&filesystem->out, fd);
 }
 
+
 /*
- * Checks if the name parameter is invalid for the filesystem.
- * Returns a non-zero value if invalid, zero otherwise
+ * Returns the output kept in memory since it was last
+ * cleared, which is not NUL-terminated, and sets len to
+ * its length
  */
-static int invalid_arg(const char arg[]) {
-  return ((int)strlen(arg) == 0 || strstr(arg, ROOT) != NULL);
+const char *get_output(Unix *filesystem, unsigned long *len) {
+  *len = filesystem->out.fd < 0 ? filesystem->out.used : 0;
+  return filesystem->out.buffer;
 }
 
+
 /*
- * Checks if the name parameter does not cause an error but cannot
- * be the name of a file or directory
- * Returns a non-zero value is true, zero otherwise
+ * Discards the output kept in memory
  */
-static int non_error_arg(const char arg[]) {
-  return (strcmp(arg, CD) == 0 || strcmp(arg, PARENT) == 0 ||
-	  strcmp(arg, ROOT) == 0);
+void clear_output(Unix *filesystem) {
+  if (filesystem->out.fd < 0)
+    filesystem->out.used = 0;
 }
 
+
 /*
- * Checks if the name parameter exists in the filesystem sent in
- * If should_assign is a non-zero value, this function returns a pointer
- * to the element in the list if was found. Returns NULL otherwise
+ * Functions shared with the rest of the filesystem
+ */
+
+
+/*
+ * Drops every container of the tree of the unix variable sent in and
+ * leaves it with an empty root as the current directory of every
+ * session, as mkfs() does
  *
- * Assigns the value of exists to 1 if the parameter was found, 0 otherwise
+ * Returns 1 if successful, 0 otherwise
  */
-static Container *name_exists(Unix *filesystem, const char arg[],
-			      int *exists, int should_assign) {
+int reset_tree(Unix *filesystem) {
 
-  Container *curr = filesystem->curr_dir;
+  Unix *session;
 
-  /* Check if the current directory is the root or a directory*/
-  if (curr->type == U_ROOT || curr->type == U_DIR) {
-    
-    if (curr->type == U_ROOT)
-      curr = curr->next;
-    else
-      curr = curr->sub_dir;
-  }
-  
-  while (curr != NULL) {
+  arena_release(&filesystem->tree->arena);
 
-    if (strcmp(curr->name, arg) == 0) {
+  /* What the sessions kept went with it */
+  for (session = filesystem->tree->sessions; session != NULL;
+       session = session->next_session)
+    cache_init(&session->cache);
 
-      /* Set the value to be found and return the pointer to the element */
-      *exists = 1;
-      if (should_assign) { 
-	return curr;
+  return new_tree(filesystem);
+}
+
+
+/*
+ * Makes dir the current directory of session, which isn't running a
+ * command, and drops its path to be rebuilt
+ */
+void move_session(Unix *session, Container *dir) {
+
+  session->curr_dir = dir;
+  atomic_store_explicit(&session->shared_dir, dir, memory_order_release);
+  session->path_valid = 0;
+}
+
+
+/*
+ * Frees what was retired from the tree of the unix variable sent in
+ * once every command that entered before it was retired has left, or
+ * all of it if all is non-zero, which is only safe with no command
+ * running. A removed container first has the sessions inside it moved
+ * out once more, in case a command that was running when it was
+ * removed moved one in, and then waits for the commands that entered
+ * before that.
+ */
+void reclaim(Unix *filesystem, int all) {
+
+  Locks *locks = filesystem->tree->locks;
+  Retired *retired, *next, *keep = NULL;
+  unsigned long oldest = all ? ULONG_MAX : oldest_epoch(filesystem);
+
+  /* Other threads only ever add to the list, so this one has what it
+     takes to itself */
+  retired = atomic_exchange(&locks->retired, NULL);
+
+  for (; retired != NULL; retired = next) {
+
+    next = retired->next;
+
+    if (retired->epoch > oldest) {
+      retired->next = keep;
+      keep = retired;
+      continue;
+    }
+
+    if (retired->container != NULL && !retired->moved) {
+
+      move_sessions(filesystem, retired->container);
+      retired->moved = 1;
+
+      if (!all) {
+	retired->epoch = new_epoch(filesystem);
+	retired->next = keep;
+	keep = retired;
+	continue;
       }
-      return NULL;
     }
 
-    /* Name doesn't match, check the next element */
-    curr = curr->next;
+    if (retired->container != NULL)
+      delete(filesystem, retired->container);
+    else
+      tree_free(filesystem, retired->block, retired->size);
+
+    tree_free(filesystem, retired, sizeof(Retired));
   }
 
-  /* Name wasn't found in filesystem */
-  *exists = 0;
-  return NULL;
+  /* Put back what has to wait longer */
+  for (; keep != NULL; keep = next) {
+
+    next = keep->next;
+    keep->next = atomic_load_explicit(&locks->retired, memory_order_relaxed);
+
+    while (!atomic_compare_exchange_weak(&locks->retired, &keep->next, keep))
+      ;
+  }
 }
 
 
 /*
- * Adds a container with the name arg to the unix parameter sent in
- * Sorts the files alphabetically as it adds to make printing 
- * the elements easier.
+ * Makes sure the path of the current directory has room
+ * for len bytes
  *
- * Returns 1 if successful, 0 if there was an error.
+ * Returns 1 if successful, 0 if memory couldn't be allocated
  */
-static int add_container_to_filesystem(Unix *filesystem,
-				       const char arg[], enum Type type) {
+int path_reserve(Unix *filesystem, unsigned long len) {
 
-  Container *curr_dir = filesystem->curr_dir, *curr, *new_container;
-  Container *prev = curr_dir;
-  char *container_name;
-  curr = curr_dir;
+  unsigned long size = filesystem->path_size > 0 ? filesystem->path_size : 64;
+  char *path;
 
-  /* Check if the current directory is a directory other than ROOT */
-  if (curr_dir->type == U_DIR)
-    curr = curr_dir->sub_dir;
+  if (len <= filesystem->path_size)
+    return 1;
 
-  /* Find the right place to insert this container */
-  while (curr != NULL && (curr->type == U_ROOT
-			  || strcmp(curr->name, arg) < 0)) {
-    prev = curr;
-    curr = curr->next;
-  }
-  
+  while (size < len)
+    size *= 2;
 
-  /* Allocate enough space for the new file container and verify success */
-  new_container = malloc(sizeof(*new_container));
+  path = realloc(filesystem->path, size);
 
-  if (new_container == NULL) {
-    printf("Not enough memory for allocation. Terminating program.\n");
+  if (path == NULL)
     return 0;
-  }
 
-  /* Successfully allocated memory, initialize the container
-     with the right data */
-  new_container->parent = curr_dir;
-  new_container->next = curr;
-  new_container->type = type;
-  new_container->prev = prev;
+  filesystem->path = path;
+  filesystem->path_size = size;
+
+  return 1;
+}
+
+
+/*
+ * Returns the absolute path of the current directory of the unix
+ * variable sent in, rebuilding it if needed, and stores its length in
+ * len
+ *
+ * Returns the path, or NULL if memory couldn't be allocated for it
+ */
+const char *current_path(Unix *filesystem, unsigned long *len) {
+
+  if (!filesystem->path_valid)
+    path_rebuild(filesystem);
 
-  /* Switch the previous of curr */
-  if (curr != NULL)
-    curr->prev = new_container;
-  
-  if (type == U_DIR) 
-    new_container->sub_dir = NULL;
+  if (!filesystem->path_valid)
+    return NULL;
 
-  /* Allocate enough memory for the name of a file container */
-  container_name = malloc(strlen(arg) + 1);
+  *len = filesystem->path_len;
 
-  if (container_name == NULL) {
-    printf("Not enough memory for allocation. Terminating program.\n");
+  return filesystem->path;
+}
 
-    free(new_container);
-    new_container = NULL;
-    return 0;
+
+/*
+ * Makes the absolute path that the path sent in names, from the
+ * current directory of the unix variable sent in, by its components
+ * alone: what ".." leaves is the directory the path came through, even
+ * where the parent links lead elsewhere. The root is the empty path.
+ *
+ * Returns the path, which the caller frees, or NULL if memory couldn't
+ * be allocated
+ */
+char *absolute_path(Unix *filesystem, const char path[], unsigned long *len) {
+
+  const char *dir = "", *end;
+  unsigned long dir_len = 0, used, part;
+  char *result;
+
+  if (path[0] != ROOT[0] && (dir = current_path(filesystem, &dir_len))
+      == NULL)
+    return NULL;
+
+  result = malloc(dir_len + strlen(path) + 1);
+
+  if (result == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
   }
-  
-  /* Set the name of this container */
-  strcpy(container_name, arg);
-  new_container->name = container_name;
 
-  /* Check if the current directory is a directory other than ROOT 
-     and if this is the first element added to it */
-  if (curr_dir->type == U_DIR && curr_dir->sub_dir == NULL) {
+  /* Components are added after the path of the root as "/name" */
+  used = dir_len == 1 ? 0 : dir_len;
+  memcpy(result, dir, used);
 
-    curr_dir->sub_dir = new_container;
-    
-  } else {
+  while (*path != '\0') {
 
-    if (prev == curr_dir && prev->type == U_DIR)
-      prev->sub_dir = new_container;
-    else
-      prev->next = new_container;
+    if (*path == ROOT[0]) {
+      path++;
+      continue;
+    }
+
+    for (end = path; *end != '\0' && *end != ROOT[0]; end++)
+      ;
+    part = end - path;
+
+    if (part == 2 && non_error_arg(path, part)) {
+
+      /* Drop the last component */
+      while (used > 0 && result[used - 1] != ROOT[0])
+	used--;
+      if (used > 0)
+	used--;
+
+    } else if (!non_error_arg(path, part)) {
+      result[used++] = ROOT[0];
+      memcpy(result + used, path, part);
+      used += part;
+    }
+
+    path = end;
   }
-  
-  return 1;
+
+  *len = used;
+
+  return result;
 }
-  
 
 
 /*
- * Prints out the elements in the linked list representing the 
- * files and directories in the Unix filesystem
+ * Adds a container called name, of length len, to dir after every
+ * entry it already has, without searching for its sorted position.
+ * Only valid when name sorts after all of them. tail holds the last
+ * entry on each skip-list level and is updated; it starts out as
+ * SKIP_MAX_LEVEL NULL pointers for an empty directory. The totals of
+ * the directories above are left to the caller.
+ *
+ * Returns the new container, or NULL if memory couldn't be allocated
  */
-static void print_elements(Container *container, int is_current_dir) {
+Container *append_entry(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len, enum Type type, Container *tail[]) {
 
-  Container *curr = container;
+  Container *container;
+  Link *head;
+  int level = random_level(filesystem), i;
 
-  if (curr == NULL)
-    return;
+  container = new_container(filesystem, name, len, type, level);
 
-  /* Check if printing root directory with no elements */
-  if (curr->type == U_ROOT && curr->next == NULL)
-    return;
+  if (container == NULL)
+    return NULL;
 
-  if (curr->type == U_ROOT || is_current_dir) {
+  container->parent = dir;
+  order_insert(filesystem, container);
 
-    if (curr->type == U_ROOT)
-      curr = curr->next;
-    else
-      curr = curr->sub_dir;
+  if (level > 1 && dir->directory->skip_head == NULL) {
+    head = tree_alloc(filesystem, (SKIP_MAX_LEVEL - 1) * sizeof(Link));
+    if (head != NULL) {
+      memset(head, 0, (SKIP_MAX_LEVEL - 1) * sizeof(Link));
+      SET_LINK(dir->directory->skip_head, head);
+    }
   }
 
-  if (curr == NULL)
-    return;
-  
-  while (curr->next != NULL) {
+  if ((level > 1 && dir->directory->skip_head == NULL)
+      || !index_insert(filesystem, dir, container)) {
+    order_remove(filesystem, container);
+    free_container(filesystem, container);
+    return NULL;
+  }
 
-    if (curr->type == U_DIR)
-      printf("%s/\n", curr->name);
-    else
-      printf("%s\n", curr->name);;
-    
-    curr = curr->next;
+  dcache_forget(filesystem, dir, name, len);
+
+  /* Nothing follows the container on any of its levels yet */
+  container->prev = tail[0];
+  for (i = 0; i < level; i++) {
+    SET_LINK(*skip_link(dir, container, i), NULL);
+    SET_LINK(*skip_link(dir, tail[i], i), container);
+    tail[i] = container;
   }
 
-  /* Print the last element before returning */
-  if (curr->type == U_DIR)
-    printf("%s/\n", curr->name);
-  else
-    printf("%s\n", curr->name);
+  if (level > dir->directory->skip_levels)
+    dir->directory->skip_levels = level;
+
+  dir->directory->shown++;
+
+  return container;
+}
+
+
+/*
+ * Enters the tree of the unix variable sent in for a command that
+ * changes it or walks all of it. A mapped image is built in memory
+ * first, which needs the tree lock while it is.
+ *
+ * Returns 1 if successful, 0 if the image couldn't be built. The
+ * command is inside the tree either way.
+ */
+int begin_change(Unix *filesystem) {
+
+  int result;
+
+  enter_tree(filesystem);
+
+  while (filesystem->tree->image != NULL) {
+
+    leave_tree(filesystem);
+    lock_tree(filesystem);
+
+    /* Another thread may have built it in the meantime */
+    result = filesystem->tree->image == NULL
+      || image_materialize(filesystem);
+
+    unlock_tree(filesystem);
+    enter_tree(filesystem);
+
+    if (!result)
+      return 0;
+  }
+
+  return 1;
 }
 
 
 /*
- * Deletes the container sent in from the current Unix variable.
- * If the dir is a directory, this function deletes all the contents
- * of dir, otherwise it just deletes the container.
+ * Leaves the tree entered by begin_change(), freeing on the way what
+ * earlier commands retired that nothing uses any longer, then takes
+ * the checkpoint the journal has grown long enough for, or needs to
+ * save records it lost, which needs the tree lock, and waits for the
+ * records of the command to reach the disk. The caller has let go of
+ * every directory, so no other command waits on the sync.
  *
- * If delete_all is non-zero, this function deletes everything in the
- * current unix variable.
+ * Returns 1 if every record of the command is on disk, 0 otherwise
  */
-void delete(Container * dir, int delete_all) {
+int end_change(Unix *filesystem) {
+
+  Locks *locks = filesystem->tree->locks;
+  int full = journal_full(filesystem), result = 1;
 
+  if (locks != NULL
+      && atomic_load_explicit(&locks->retired, memory_order_relaxed) != NULL)
+    reclaim(filesystem, 0);
 
-  /* Check if deleting a non-empty directory */
-  if (dir->type == U_DIR && dir->sub_dir != NULL)
-    delete(dir->sub_dir, 1);
- 
+  leave_tree(filesystem);
 
-  if (delete_all) { /* Delete all connections recursively */
+  if (full) {
 
-   if (dir->next != NULL)
-     delete(dir->next, delete_all);
-  } 
+    lock_tree(filesystem);
 
-  /* Adjust the previous pointer of this container */
-  if (dir->prev != NULL) {
+    /* Another thread may have taken it in the meantime */
+    if (journal_full(filesystem))
+      checkpoint(filesystem);
 
-    /* Case where the previous container is the first container
-       of a subdirectoryy */
-    if ((dir->prev == dir->parent) && dir->prev->type != U_ROOT)
-      dir->parent->sub_dir = dir->next;
-    else 
-      dir->prev->next = dir->next;
+    /* Records the checkpoint couldn't save are lost */
+    result = !journal_failed(filesystem);
+
+    unlock_tree(filesystem);
   }
 
-  /* Container to be removed is between two containers */
-  if (dir->next != NULL)
-    dir->next->prev = dir->prev;
-  
-  /* Free all dynamically allocated memory and clear dangling pointers */
-  free(dir->name);
-  free(dir);
-  dir->name = NULL;
-  dir->parent = NULL;
-  dir->prev = NULL;
-  dir = NULL;
+  result = journal_commit(filesystem) && result;
+
+  return result;
+}
+
+
+/*
+ * Resolves the path sent in, one component at a time, from the root if
+ * it starts with "/" and from the current directory otherwise. Empty
+ * components are skipped, "." stays in the same directory and ".."
+ * moves to its parent.
+ *
+ * parent receives the directory that holds (or would hold) the last
+ * component, or NULL if a directory leading up to it doesn't exist.
+ * name and len receive the last component, with len 0 if the path has
+ * none.
+ *
+ * This is for the commands that only read: a path through a copy goes
+ * on in the layers it shows the entries of, so what is returned may be
+ * in a layer rather than in the copy. Commands that change what they
+ * find use resolve_change().
+ *
+ * Returns the container the path names, or NULL if there is none
+ */
+Container *resolve_path(Unix *filesystem, const char path[],
+			Container **parent, const char **name,
+			unsigned long *len) {
+
+  int through;
+
+  return resolve(filesystem, path, parent, name, len, 0, &through);
+}
+
+
+/*
+ * Resolves the path sent in the way resolve_path() does, for a command
+ * that changes what it names or what is in its parent. Once the parent
+ * is found, and only then, every copy the path leads through is given
+ * an entry of its own for the next component, and nothing else, so
+ * what is returned and parent are in the tree itself rather than in a
+ * layer.
+ *
+ * Returns the container the path names, or NULL if there is none
+ */
+Container *resolve_change(Unix *filesystem, const char path[],
+			  Container **parent, const char **name,
+			  unsigned long *len) {
+
+  Container *position;
+  int through;
+
+  position = resolve(filesystem, path, parent, name, len, 0, &through);
+
+  if (through && *parent != NULL)
+    position = resolve(filesystem, path, parent, name, len, 1, &through);
+
+  return position;
+}
+
+
+/*
+ * Returns the number of bytes the container was allocated with, leaving
+ * out a block of its own that a rename gave its name
+ */
+unsigned long container_size(Container *container) {
+
+  unsigned long links = offsetof(Container, forward)
+    + (container->level - 1) * sizeof(Link);
+
+  /* The room of a name that went out keeps its size */
+  if (container->name != INLINE_NAME(container))
+    return links + *(unsigned long *) INLINE_NAME(container);
+
+  return links + NAME_ROOM(container->name_len);
+}
+
+
+/*
+ * Returns the address of the link on the given skip-list level that
+ * leaves entry, or that leaves the head of dir when entry is NULL.
+ * Level 0 is the sorted list itself.
+ */
+Link *skip_link(Container *dir, Container *entry, int level) {
+
+  if (entry == NULL)
+    return level == 0 ? &dir->sub_dir : &dir->directory->skip_head[level - 1];
+
+  return level == 0 ? &entry->next : &entry->forward[level - 1];
+}
+
+
+/*
+ * Stores the blocks container was allocated in to blocks, with their
+ * sizes in sizes: for a directory its hash index, its skip-list heads
+ * and the record of its copies when it has them, and what only a
+ * directory has, then the container itself and the block a rename gave
+ * its name. Its contents, which copies may share, are left to the
+ * caller.
+ *
+ * Returns the number of blocks, at most CONTAINER_BLOCKS
+ */
+int container_blocks(Container *container, void *blocks[],
+		     unsigned long sizes[]) {
+
+  Directory *directory = container->directory;
+  Index *index;
+  Link *head;
+  Share *share;
+  int count = 0;
+
+  if (directory != NULL) {
+
+    index = LINK(directory->index);
+    head = LINK(directory->skip_head);
+    share = LINK(directory->share);
+
+    if (index != NULL) {
+      blocks[count] = index;
+      sizes[count++] = index_bytes(index->size);
+    }
+
+    if (head != NULL) {
+      blocks[count] = head;
+      sizes[count++] = (SKIP_MAX_LEVEL - 1) * sizeof(Link);
+    }
+
+    if (share != NULL) {
+      blocks[count] = share;
+      sizes[count++] = sizeof(Share);
+    }
+
+    blocks[count] = directory;
+    sizes[count++] = sizeof(Directory);
+  }
+
+  blocks[count] = container;
+  sizes[count++] = container_size(container);
+
+  if (container->name != INLINE_NAME(container)) {
+    blocks[count] = container->name;
+    sizes[count++] = container->name_len + 1;
+  }
+
+  return count;
+}
+
+
+/*
+ * Adds a container of the given type at the path arg to the unix
+ * variable sent in, for touch, mkdir and the commands that write to a
+ * file. A name that is taken already is left as it is, which counts as
+ * success for a file.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+int add_path(Unix *filesystem, const char arg[], enum Type type) {
+
+  Container *parent, *position;
+  const char *name;
+  unsigned long len;
+  int result;
+
+  position = resolve_change(filesystem, arg, &parent, &name, &len);
+
+  if (position != NULL)
+    return type == U_FILE;
+
+  /* A directory leading up to the name doesn't exist */
+  if (parent == NULL || !unshare(filesystem, parent, name, len))
+    return 0;
+
+  lock_dir(filesystem, parent);
+
+  /* Another thread may have added the name since it was looked up */
+  if (filesystem->tree->locks != NULL
+      && view_lookup(filesystem, parent, name, len) != NULL)
+    result = type == U_FILE;
+  else {
+    position = add_container_to_filesystem(filesystem, parent, name, len,
+					   type);
+    result = position != NULL;
+
+    /* Recorded before another thread can find the container, so
+       records of commands inside it come after this one */
+    if (result)
+      JOURNAL(filesystem, type == U_FILE ? C_TOUCH : C_MKDIR, arg,
+	      position);
+  }
+
+  unlock_dir(filesystem, parent);
+
+  return result;
+}
+
+
+/*
+ * Adds files, dirs and bytes, which may be negative, to the totals of
+ * dir and of every directory above it. Each total is added to on its
+ * own, so writers anywhere in the tree never wait on each other. The
+ * counts stop short of a container rm has taken out of the tree, since
+ * what is below it no longer counts above it: a container is only
+ * added to while it is announced as being added to and isn't removed,
+ * which remove_totals() waits out before taking its totals away.
+ */
+void add_totals(Unix *filesystem, Container *dir, long files, long dirs,
+		long bytes) {
+
+  (void) filesystem;
+
+  for (;;) {
+
+    atomic_fetch_add(&dir->adding, 1);
+
+    if (atomic_load(&dir->removed)) {
+      atomic_fetch_sub_explicit(&dir->adding, 1, memory_order_release);
+      break;
+    }
+
+    /* A file only has bytes of its own */
+    if (dir->directory != NULL) {
+      atomic_fetch_add_explicit(&dir->directory->files, files,
+				memory_order_relaxed);
+      atomic_fetch_add_explicit(&dir->directory->dirs, dirs,
+				memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&dir->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&dir->adding, 1, memory_order_release);
+
+    if (dir->type == U_ROOT)
+      break;
+
+    dir = dir->parent;
+  }
+}
+
+
+/*
+ * Allocates a block of size bytes from the arena of the unix variable
+ * sent in. While threads run, a small block comes out of the cache of
+ * the session, and the arena, which threads take turns at, is only
+ * touched to fill the cache again.
+ *
+ * Returns a pointer to the block, or NULL if memory couldn't be
+ * allocated
+ */
+void *tree_alloc(Unix *filesystem, unsigned long size) {
+
+  Tree *tree = filesystem->tree;
+  void *block;
+
+  if (tree->locks == NULL)
+    return arena_alloc(&tree->arena, size);
+
+  block = cache_alloc(&filesystem->cache, size);
+
+  if (block == NULL) {
+    LOCK(filesystem, alloc);
+    block = arena_alloc(&tree->arena, size);
+    cache_fill(&filesystem->cache, &tree->arena, size);
+    UNLOCK(filesystem, alloc);
+  }
+
+  return block;
+}
+
+
+/*
+ * Allocates an empty root for the tree of the unix variable sent in,
+ * which is its own parent, without making it the root of the tree
+ *
+ * Returns the root, or NULL if memory couldn't be allocated
+ */
+Container *new_root(Unix *filesystem) {
+
+  Container *root = new_container(filesystem, ROOT, strlen(ROOT), U_ROOT,
+				  1);
+
+  if (root != NULL) {
+    root->parent = root;
+    order_insert(filesystem, root);
+  }
+
+  return root;
+}
+
+
+/*
+ * Makes root, from new_root(), the root of the tree of the unix variable
+ * sent in and the current directory of every session, and deletes the
+ * old root with everything in it. The caller holds the tree lock, so
+ * no command is inside the tree to be using them.
+ */
+void replace_root(Unix *filesystem, Container *root) {
+
+  Tree *tree = filesystem->tree;
+  Container *old = tree->root;
+  Unix *session;
+
+  tree->root = root;
+
+  for (session = tree->sessions; session != NULL;
+       session = session->next_session)
+    move_session(session, root);
+
+  order_cut(filesystem, old);
+  delete(filesystem, old);
+}
+
+
+/*
+ * Unlinks entry from dir, the directory it is in, under the lock the
+ * caller holds on dir, and takes it out of the totals above it. An
+ * entry that hides a name was never shown or counted.
+ */
+void unlink_entry(Unix *filesystem, Container *dir, Container *entry) {
+
+  index_remove(dir, entry);
+
+  /* Cached lookups in the directories below it are keyed by ids that
+     are never reused, so only the lookup of the container itself has
+     to be forgotten */
+  dcache_forget(filesystem, dir, entry->name, entry->name_len);
+  skip_remove(filesystem, dir, entry);
+
+  if (entry->type != U_HIDDEN) {
+    dir->directory->shown--;
+    remove_totals(filesystem, entry);
+  }
+}
+
+
+/*
+ * Gives a block of size bytes back to the arena of the unix variable
+ * sent in, or, while threads run, to the cache of the session until it
+ * is full
+ */
+void tree_free(Unix *filesystem, void *block, unsigned long size) {
+
+  Tree *tree = filesystem->tree;
+
+  if (tree->locks == NULL) {
+    arena_free(&tree->arena, block, size);
+    return;
+  }
+
+  if (block == NULL || cache_free(&filesystem->cache, block, size))
+    return;
+
+  LOCK(filesystem, alloc);
+  cache_drain(&filesystem->cache, &tree->arena, size);
+  arena_free(&tree->arena, block, size);
+  UNLOCK(filesystem, alloc);
+}
+
+
+/*
+ * Adds a container called name, of length len, to the directory dir
+ * of the unix parameter sent in.
+ * Sorts the files alphabetically as it adds to make printing
+ * the elements easier.
+ *
+ * Returns the new container, or NULL if there was an error.
+ */
+Container *add_container_to_filesystem(Unix *filesystem, Container *dir,
+				       const char name[], unsigned long len,
+				       enum Type type) {
+
+  Container *container;
+  int level;
+
+  /* Pick the skip-list levels of the container, allocate it with room
+     for its links above the sorted list and verify success */
+  level = random_level(filesystem);
+  container = new_container(filesystem, name, len, type, level);
+
+  if (container == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
+  }
+
+  if (!make_room(filesystem, dir, level)) {
+    print_error(filesystem, NO_MEMORY);
+
+    free_container(filesystem, container);
+    return NULL;
+  }
+
+  add_entry(filesystem, dir, container);
+
+  return container;
+}
+
+
+/*
+ * Allocates a container called name, of length len, of the given type
+ * for the unix variable sent in, on as many skip-list levels as a new
+ * entry is, to be linked into a directory by place_entry() or
+ * add_entry() once make_room() has made room for it
+ *
+ * Returns the container, or NULL if memory couldn't be allocated
+ */
+Container *new_entry(Unix *filesystem, const char name[], unsigned long len,
+		     enum Type type) {
+  return new_container(filesystem, name, len, type, random_level(filesystem));
+}
+
+
+/*
+ * Links entry, from new_entry(), into dir, which make_room() has made
+ * room in, and gives it its place in the order of the directories.
+ * Neither what dir shows nor its totals change: entry is an entry a
+ * copy or layer is given in place of one it already shows, or one that
+ * hides a name.
+ */
+void place_entry(Unix *filesystem, Container *dir, Container *entry) {
+
+  entry->parent = dir;
+  order_insert(filesystem, entry);
+  link_entry(filesystem, dir, entry);
+}
+
+
+/*
+ * Adds entry, from new_entry() and with everything below it, to dir,
+ * which make_room() has made room in, under the lock the caller holds
+ * on dir, and to the totals above it. An entry of dir that hides the
+ * name is dropped once entry is linked in after it.
+ */
+void add_entry(Unix *filesystem, Container *dir, Container *entry) {
+
+  Container *hidden = index_lookup(filesystem, dir, entry->name,
+				   entry->name_len);
+
+  place_entry(filesystem, dir, entry);
+
+  if (hidden != NULL) {
+    unlink_entry(filesystem, dir, hidden);
+    remove_container(filesystem, hidden);
+  }
+
+  dir->directory->shown++;
+  add_totals(filesystem, dir, FILES_BELOW(entry) + (entry->type == U_FILE),
+	     DIRS_BELOW(entry) + (entry->type == U_DIR), entry->bytes);
+}
+
+
+/*
+ * Looks up the entry called name, of length len, in the hash index of
+ * the directory sent in. Other threads may be changing the index, so
+ * the slots are loaded atomically.
+ *
+ * Returns a pointer to the entry, or NULL if there is none
+ */
+Container *index_lookup(Unix *filesystem, Container *dir, const char name[],
+			unsigned long len) {
+
+  Index *index = LINK(dir->directory->index);
+  Container *entry;
+  unsigned long mask, slot, hash, probes = 0, compared = 0;
+
+  if (index == NULL)
+    return NULL;
+
+  hash = hash_name(name, len);
+  mask = index->size - 1;
+  slot = hash & mask;
+
+  /* Probe until an empty slot ends the run, only comparing the names
+     of entries whose hash and length match */
+  while ((entry = LINK(index->slots[slot])) != NULL) {
+
+    probes++;
+
+    if (entry != DELETED && entry->hash == hash && entry->name_len == len
+	&& (compared++, memcmp(entry->name, name, len) == 0))
+      break;
+
+    slot = (slot + 1) & mask;
+  }
+
+  STATS_ADD(filesystem, visited, probes + 1);
+  STATS_ADD(filesystem, comparisons, compared);
+
+  return entry;
+}
+
+
+/*
+ * Gives all of the memory of a container, whose marks are out of the
+ * order of the directories, back to the filesystem's arena
+ */
+void free_container(Unix *filesystem, Container *container) {
+
+  void *blocks[CONTAINER_BLOCKS];
+  unsigned long sizes[CONTAINER_BLOCKS];
+  int count = container_blocks(container, blocks, sizes), i;
+
+  /* Copies of the file may still share its contents */
+  if (container->contents != NULL && contents_unref(container->contents))
+    contents_free(filesystem, container->contents);
+
+  for (i = 0; i < count; i++)
+    tree_free(filesystem, blocks[i], sizes[i]);
+}
+
+
+/*
+ * Finds the first entry of dir that doesn't sort before prefix, of
+ * length len, which is the first that starts with it if any does. The
+ * search takes the lock of dir, since the levels in use may change;
+ * the sorted list from there on can be followed without it.
+ *
+ * Returns the entry, or NULL if there is none
+ */
+Container *skip_seek(Unix *filesystem, Container *dir, const char prefix[],
+		     unsigned long len) {
+
+  Container *update[SKIP_MAX_LEVEL], *entry;
+
+  lock_dir_shared(filesystem, dir);
+  entry = skip_search(filesystem, dir, prefix, len, update);
+  unlock_dir(filesystem, dir);
+
+  return entry;
+}
+
+
+/*
+ * Allocates what dir needs before an entry on the given number of
+ * skip-list levels is linked into it: the heads of its upper levels
+ * and room in its hash index. link_entry() can't fail after it.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+int make_room(Unix *filesystem, Container *dir, int level) {
+
+  Link *head;
+
+  if (level > 1 && dir->directory->skip_head == NULL) {
+
+    head = tree_alloc(filesystem, (SKIP_MAX_LEVEL - 1) * sizeof(Link));
+
+    if (head == NULL)
+      return 0;
+
+    memset(head, 0, (SKIP_MAX_LEVEL - 1) * sizeof(Link));
+    SET_LINK(dir->directory->skip_head, head);
+  }
+
+  return index_reserve(filesystem, dir);
+}
+
+
+/*
+ * Frees container, which has just been unlinked from its directory,
+ * and everything inside it, or retires them while threads may still
+ * be looking at them. The sessions inside it move out first, and then
+ * its marks, with those of everything inside it, leave the order of the
+ * directories.
+ */
+void remove_container(Unix *filesystem, Container *container) {
+
+  move_sessions(filesystem, container);
+  order_cut(filesystem, container);
+
+  if (filesystem->tree->locks != NULL)
+    retire(filesystem, container, NULL, 0);
+  else
+    delete(filesystem, container);
+}
+
+
+/*
+ * Writes message, about something a command of the unix variable sent
+ * in couldn't do, to its output and flushes it, so it comes out in
+ * order with what the commands print instead of through stdio, which
+ * buffers apart from it
+ */
+void print_error(Unix *filesystem, const char message[]) {
+  sink_write(&filesystem->out, message, strlen(message));
+  sink_flush(&filesystem->out);
+}
+
+
+/*
+ * Private functions
+ */
+
+
+/*
+ * Resolves the path sent in for resolve_path() and resolve_change().
+ * A name a copy on the way only shows through its origin is found in
+ * its layers, setting through, or the copy is first given an entry of
+ * its own for it if own is non-zero. The directories the path went
+ * down through are kept in order, so ".." goes back up the way the path
+ * came even from an entry of a layer, whose parent is elsewhere. A
+ * path that ends in a slash only names a directory.
+ *
+ * Returns the container the path names, or NULL if there is none
+ */
+static Container *resolve(Unix *filesystem, const char path[],
+			  Container **parent, const char **name,
+			  unsigned long *len, int own, int *through) {
+
+  Container *trail_start[TRAIL_START], **trail = trail_start, **grown;
+  Container *dir, *position, *origin;
+  unsigned long depth = 1, size = TRAIL_START;
+  const char *start = path, *end;
+
+  if (path[0] == ROOT[0])
+    position = filesystem->tree->root;
+  else
+    position = filesystem->curr_dir;
+  trail[0] = position;
+  *parent = position->parent;
+  *name = path;
+  *len = 0;
+  *through = 0;
+
+  while (*path != '\0') {
+
+    /* Skip to the start of the next component */
+    if (*path == ROOT[0]) {
+      path++;
+      continue;
+    }
+
+    for (end = path; *end != '\0' && *end != ROOT[0]; end++)
+      ;
+
+    /* Only a directory can have more components after it */
+    if (position == NULL || position->type == U_FILE) {
+      *parent = position = NULL;
+      break;
+    }
+
+    dir = position;
+
+    if (end - path == 1 && path[0] == '.')
+      ;
+    else if (non_error_arg(path, end - path)) {
+
+      /* Back the way the path came, or above where it started */
+      if (depth > 1)
+	position = trail[--depth - 1];
+      else
+	position = trail[0] = dir->parent;
+    } else {
+
+      position = lookup(filesystem, dir, path, end - path);
+      origin = LINK(dir->directory->origin);
+
+      if (position != NULL && position->type == U_HIDDEN)
+	position = NULL;
+      else if (position == NULL && origin != NULL
+	       && (position = view_lookup(filesystem, origin, path,
+					  end - path)) != NULL) {
+	if (own)
+	  position = own_entry(filesystem, dir, path, end - path);
+	else
+	  *through = 1;
+      }
+
+      if (depth == size && position != NULL) {
+
+	grown = realloc(trail == trail_start ? NULL : trail,
+			2 * size * sizeof(Container *));
+
+	if (grown == NULL) {
+	  print_error(filesystem, NO_MEMORY);
+	  *parent = position = NULL;
+	  break;
+	}
+
+	if (trail == trail_start)
+	  memcpy(grown, trail_start, size * sizeof(Container *));
+	trail = grown;
+	size *= 2;
+      }
+
+      if (position != NULL)
+	trail[depth++] = position;
+    }
+
+    if (!non_error_arg(path, end - path))
+      *parent = dir;
+    else
+      *parent = depth > 1 ? trail[depth - 2] : position->parent;
+    *name = path;
+    *len = end - path;
+    path = end;
+  }
+
+  /* A trailing slash names a directory, so it can't follow a file */
+  if (position != NULL && position->type == U_FILE && path > start
+      && path[-1] == ROOT[0])
+    *parent = position = NULL;
+
+  if (trail != trail_start)
+    free(trail);
+
+  return position;
+}
+
+
+/*
+ * Gives the tree of the unix variable sent in a fresh start in its
+ * arena: an empty root that is the current directory of every session,
+ * and an empty lookup cache
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int new_tree(Unix *filesystem) {
+
+  Tree *tree = filesystem->tree;
+  Container *root;
+  Unix *session;
+
+  atomic_store(&tree->next_id, 1);
+  atomic_store(&tree->layers, 0);
+  atomic_store(&tree->freezes, 0);
+  tree->orphans = NULL;
+  tree->snapshots = NULL;
+  order_init(tree);
+  root = new_root(filesystem);
+  tree->dcache = arena_alloc(&tree->arena, DCACHE_SIZE * sizeof(Dentry));
+
+  if (root == NULL || tree->dcache == NULL)
+    return 0;
+
+  memset(tree->dcache, 0, DCACHE_SIZE * sizeof(Dentry));
+
+  tree->root = root;
+
+  for (session = tree->sessions; session != NULL;
+       session = session->next_session)
+    move_session(session, root);
+
+  /* What was retired lived in the arena too */
+  if (tree->locks != NULL)
+    atomic_store(&tree->locks->retired, NULL);
+
+  return 1;
+}
+
+
+/*
+ * Initializes session to be a session on tree, writing to the standard
+ * output, and adds it to the sessions of the tree
+ */
+static void session_init(Unix *session, Tree *tree) {
+
+  session->tree = tree;
+  session->curr_dir = NULL;
+  atomic_init(&session->shared_dir, NULL);
+  atomic_init(&session->epoch, 0);
+  session->image_dir = 0;
+  session->journaled = 0;
+  cache_init(&session->cache);
+
+  /* Each session picks skip-list levels from a seed of its own */
+  session->seed = tree->seed;
+  tree->seed = tree->seed * 6364136223846793005UL + 1442695040888963407UL;
+
+  sink_init(&session->out, STDOUT_FD);
+
+  session->path = NULL;
+  session->path_len = 0;
+  session->path_size = 0;
+  session->path_valid = 0;
+
+  session->next_session = tree->sessions;
+  tree->sessions = session;
+}
+
+
+/*
+ * Prints the name of the file at the path arg, or the elements of the
+ * directory there, to the output of the unix variable sent in
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ */
+static int list_path(Unix *filesystem, const char arg[]) {
+
+  Container *parent, *position;
+  const char *name;
+  unsigned long len;
+
+  position = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  if (position == NULL)
+    return parent != NULL && is_pattern(name, len)
+      && print_matches(filesystem, parent, name, len, 0) > 0;
+
+  /* Either printing a file or directory */
+  if (position->type == U_FILE) {
+    sink_write(&filesystem->out, position->name, position->name_len);
+    sink_write(&filesystem->out, "\n", 1);
+  } else
+    print_elements(filesystem, position);
+
+  return 1;
+}
+
+
+/*
+ * Prints the elements of the directory named by the path arg of the
+ * unix variable sent in that start with its last component, for
+ * complete()
+ *
+ * Returns 1 if successful, 0 if the directory doesn't exist
+ */
+static int complete_path(Unix *filesystem, const char arg[]) {
+
+  Container *parent, *position;
+  const char *name;
+  unsigned long len, arg_len = strlen(arg);
+
+  position = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  /* Nothing to complete, so the path is the directory */
+  if (arg_len == 0 || arg[arg_len - 1] == ROOT[0]
+      || non_error_arg(name, len)) {
+    parent = position;
+    len = 0;
+  }
+
+  if (parent == NULL || parent->type == U_FILE)
+    return 0;
+
+  print_matches(filesystem, parent, name, len, 1);
+
+  return 1;
+}
+
+
+/*
+ * Unlinks the container at the path arg of the unix variable sent in
+ * from its directory, leaving it to be freed by delete(). The root,
+ * "." and ".." can't be removed. In a copy whose origin shows the name
+ * too, an entry that hides the name takes its place.
+ *
+ * Returns the container, or NULL if there is none to remove
+ */
+static Container *unlink_path(Unix *filesystem, const char arg[]) {
+
+  Container *parent, *position, *origin, *hidden = NULL;
+  const char *name;
+  unsigned long len;
+
+  position = resolve_change(filesystem, arg, &parent, &name, &len);
+
+  if (position == NULL || len == 0 || non_error_arg(name, len)
+      || !unshare(filesystem, parent, name, len))
+    return NULL;
+
+  origin = LINK(parent->directory->origin);
+
+  if (origin != NULL
+      && (hidden = new_entry(filesystem, name, len, U_HIDDEN)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return NULL;
+  }
+
+  lock_dir(filesystem, parent);
+
+  /* Another thread may have removed it since it was looked up */
+  if (filesystem->tree->locks != NULL
+      && index_lookup(filesystem, parent, name, len) != position)
+    position = NULL;
+  else if (hidden != NULL && !make_room(filesystem, parent, hidden->level)) {
+    print_error(filesystem, NO_MEMORY);
+    position = NULL;
+  }
+
+  if (position != NULL) {
+
+    /* Recorded while the path still leads to the container */
+    JOURNAL(filesystem, C_RM, arg, position);
+
+    /* Linked in after the container, which hides it until it goes */
+    if (hidden != NULL && view_lookup(filesystem, origin, name, len) != NULL) {
+      place_entry(filesystem, parent, hidden);
+      hidden = NULL;
+    }
+
+    unlink_entry(filesystem, parent, position);
+  }
+
+  unlock_dir(filesystem, parent);
+
+  if (hidden != NULL)
+    free_container(filesystem, hidden);
+
+  return position;
+}
+
+
+/*
+ * Removes every element that matches the last component of the path
+ * arg of the unix variable sent in from its directory, for rm. The
+ * names are collected first and then removed one path at a time, so
+ * each removal is journaled and locked on its own like any other.
+ *
+ * Returns 1 if something was removed, 0 otherwise
+ */
+static int remove_matches(Unix *filesystem, const char arg[]) {
+
+  Container *parent, *position, *curr;
+  const char *name;
+  char *paths = NULL, *grown, *path;
+  unsigned long len, prefix, dir_len, used = 0, size = 0, need;
+  int removed = 0;
+  View view;
+
+  position = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  if (position != NULL || parent == NULL || !is_pattern(name, len))
+    return 0;
+
+  /* Every match is the directory part of arg followed by its name */
+  dir_len = name - arg;
+  prefix = pattern_prefix(name, len);
+
+  if (!view_open(filesystem, &view, parent, name, prefix)) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  for (curr = view_next(&view); curr != NULL && has_prefix(curr, name, prefix);
+       curr = view_next(&view)) {
+
+    if (!match_pattern(name, len, curr->name, curr->name_len))
+      continue;
+
+    need = dir_len + curr->name_len + 1;
+
+    if (used + need > size) {
+
+      grown = realloc(paths, 2 * (used + need));
+
+      if (grown == NULL) {
+	print_error(filesystem, NO_MEMORY);
+	view_close(&view);
+	free(paths);
+	return 0;
+      }
+
+      paths = grown;
+      size = 2 * (used + need);
+    }
+
+    memcpy(paths + used, arg, dir_len);
+    memcpy(paths + used + dir_len, curr->name, curr->name_len);
+    paths[used + need - 1] = '\0';
+    used += need;
+  }
+
+  view_close(&view);
+
+  for (path = paths; path < paths + used; path += strlen(path) + 1) {
+
+    position = unlink_path(filesystem, path);
+
+    if (position != NULL) {
+      remove_container(filesystem, position);
+      removed = 1;
+    }
+  }
+
+  free(paths);
+
+  return removed;
+}
+
+
+
+/*
+ * Moves the container at the path arg of the unix variable sent in to
+ * the path dest, for mv. The directory it leaves and the one it goes
+ * to are unshared first, so their copies keep showing what they did,
+ * and everything that can run out of memory is done before it is
+ * unlinked. In a copy whose origin shows the name it leaves, an entry
+ * that hides the name takes its place.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int move_path(Unix *filesystem, const char arg[], const char dest[]) {
+
+  Container *parent, *position, *dir, *target, *origin;
+  Container *hidden = NULL, *replaced;
+  char *block = NULL;
+  const char *name;
+  unsigned long len, size;
+  long files, dirs, bytes;
+  Unix *session;
+
+  position = resolve_change(filesystem, arg, &parent, &name, &len);
+
+  if (position == NULL || len == 0 || non_error_arg(name, len))
+    return 0;
+
+  target = resolve_change(filesystem, dest, &dir, &name, &len);
+
+  /* Into a directory that is there already, under its own name */
+  if (target != NULL) {
+
+    if (target->type == U_FILE)
+      return 0;
+
+    dir = target;
+    name = position->name;
+    len = position->name_len;
+  }
+
+  if (dir == NULL
+      || (position->type == U_DIR && is_ancestor(filesystem, position, dir))
+      || view_lookup(filesystem, dir, name, len) != NULL
+      || !unshare(filesystem, parent, position->name, position->name_len)
+      || !unshare(filesystem, dir, name, len))
+    return 0;
+
+  origin = LINK(parent->directory->origin);
+
+  /* A new name that doesn't fit in the block of the container needs a
+     block of its own */
+  size = offsetof(Container, forward) + (position->level - 1) * sizeof(Link)
+    + NAME_ROOM(len);
+
+  if (arena_block_size(size) != arena_block_size(container_size(position))
+      && (block = tree_alloc(filesystem, size = len + 1)) == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  /* Linked in after the container, which hides it until it goes, so
+     that room in dir is made with it there */
+  if (origin != NULL
+      && view_lookup(filesystem, origin, position->name, position->name_len)
+      != NULL) {
+
+    hidden = new_entry(filesystem, position->name, position->name_len,
+		       U_HIDDEN);
+
+    if (hidden == NULL || !make_room(filesystem, parent, hidden->level)) {
+      print_error(filesystem, NO_MEMORY);
+
+      if (hidden != NULL)
+	free_container(filesystem, hidden);
+      if (block != NULL)
+	tree_free(filesystem, block, size);
+      return 0;
+    }
+
+    place_entry(filesystem, parent, hidden);
+  }
+
+  if (!make_room(filesystem, dir, position->level)) {
+    print_error(filesystem, NO_MEMORY);
+
+    if (hidden != NULL) {
+      unlink_entry(filesystem, parent, hidden);
+      free_container(filesystem, hidden);
+    }
+    if (block != NULL)
+      tree_free(filesystem, block, size);
+    return 0;
+  }
+
+  /* Recorded while the paths still lead where they did */
+  JOURNAL_PATHS(filesystem, C_MV, arg, dest);
+
+  files = FILES_BELOW(position) + (position->type == U_FILE);
+  dirs = DIRS_BELOW(position) + (position->type == U_DIR);
+  bytes = position->bytes;
+
+  index_remove(parent, position);
+  dcache_forget(filesystem, parent, position->name, position->name_len);
+  skip_remove(filesystem, parent, position);
+  parent->directory->shown--;
+  add_totals(filesystem, parent, -files, -dirs, -bytes);
+
+  if (len != position->name_len || memcmp(name, position->name, len) != 0)
+    rename_entry(filesystem, position, block, name, len);
+
+  /* An entry of dir that hides the name goes once it is linked in */
+  replaced = index_lookup(filesystem, dir, name, len);
+
+  link_entry(filesystem, dir, position);
+  order_move(filesystem, position);
+  dir->directory->shown++;
+  add_totals(filesystem, dir, files, dirs, bytes);
+
+  if (replaced != NULL) {
+    unlink_entry(filesystem, dir, replaced);
+    remove_container(filesystem, replaced);
+  }
+
+  /* The paths of the sessions inside it have changed */
+  for (session = filesystem->tree->sessions; session != NULL;
+       session = session->next_session)
+    if (is_ancestor(filesystem, position, atomic_load(&session->shared_dir)))
+      session->path_valid = 0;
+
+  return 1;
+}
+
+/*
+ * Makes dir the current directory of the unix variable sent in, for
+ * cd. While threads run, an rm may have moved the session out of a
+ * directory it removed since the command started. An absolute path
+ * leads to dir from anywhere, but a relative one was resolved from a
+ * directory that is gone and fails.
+ *
+ * Returns 1 if successful, 0 otherwise
+ */
+static int change_dir(Unix *filesystem, Container *dir, int absolute) {
+
+  Container *expected = filesystem->curr_dir;
+
+  if (filesystem->tree->locks == NULL)
+    atomic_store_explicit(&filesystem->shared_dir, dir, memory_order_relaxed);
+  else if (!atomic_compare_exchange_strong(&filesystem->shared_dir,
+					   &expected, dir)) {
+
+    filesystem->curr_dir = expected;
+    filesystem->path_valid = 0;
+
+    if (!absolute)
+      return 0;
+
+    atomic_store_explicit(&filesystem->shared_dir, dir, memory_order_release);
+  }
+
+  filesystem->curr_dir = dir;
+
+  return 1;
+}
+
+
+/*
+ * Moves every session whose current directory is the container sent
+ * in, or inside it, up to the directory it was removed from. While
+ * threads run a session may be changing directory at the same time,
+ * so it is only moved from where it was found.
+ */
+static void move_sessions(Unix *filesystem, Container *container) {
+
+  Unix *session;
+  Container *dir;
+
+  for (session = filesystem->tree->sessions; session != NULL;
+       session = session->next_session) {
+
+    if (filesystem->tree->locks == NULL) {
+      if (is_ancestor(filesystem, container, session->curr_dir))
+	move_session(session, container->parent);
+      continue;
+    }
+
+    dir = atomic_load_explicit(&session->shared_dir, memory_order_acquire);
+
+    while (is_ancestor(filesystem, container, dir)
+	   && !atomic_compare_exchange_weak(&session->shared_dir, &dir,
+					    container->parent))
+      ;
+  }
+}
+
+
+/*
+ * Hands what was just unlinked from the tree of the unix variable sent
+ * in over to reclaim(), to be freed once no command can be using it:
+ * either a removed container or a block of size bytes. Should there be
+ * no memory to keep track of it, it is never freed.
+ */
+static void retire(Unix *filesystem, Container *container, void *block,
+		   unsigned long size) {
+
+  Locks *locks = filesystem->tree->locks;
+  Retired *retired = tree_alloc(filesystem, sizeof(Retired));
+
+  if (retired == NULL) {
+    print_error(filesystem, NO_MEMORY);
+    return;
+  }
+
+  retired->container = container;
+  retired->moved = 0;
+  retired->block = block;
+  retired->size = size;
+  retired->epoch = new_epoch(filesystem);
+  retired->next = atomic_load_explicit(&locks->retired, memory_order_relaxed);
+
+  while (!atomic_compare_exchange_weak(&locks->retired, &retired->next,
+				       retired))
+    ;
+}
+
+
+/*
+ * Updates the path of the current directory after a cd
+ * to the path sent in, by applying its components the
+ * same way resolve_path() does. An absolute path starts
+ * over from the root.
+ */
+static void path_update(Unix *filesystem, const char path[]) {
+
+  unsigned long len;
+  const char *end;
+
+  if (path[0] == ROOT[0]) {
+    filesystem->path_len = 0;
+    filesystem->path_valid = 1;
+  }
+
+  if (!filesystem->path_valid) {
+    path_rebuild(filesystem);
+    return;
+  }
+
+  /* Components are added after the path of the root as "/name" */
+  if (filesystem->path_len == 1)
+    filesystem->path_len = 0;
+
+  while (*path != '\0') {
+
+    if (*path == ROOT[0]) {
+      path++;
+      continue;
+    }
+
+    for (end = path; *end != '\0' && *end != ROOT[0]; end++)
+      ;
+    len = end - path;
+
+    if (len == 2 && non_error_arg(path, len)) {
+
+      /* Drop the last component */
+      while (filesystem->path_len > 0
+	     && filesystem->path[filesystem->path_len - 1] != ROOT[0])
+	filesystem->path_len--;
+      if (filesystem->path_len > 0)
+	filesystem->path_len--;
+
+    } else if (!non_error_arg(path, len)) {
+
+      if (!path_reserve(filesystem, filesystem->path_len + len + 1)) {
+	filesystem->path_valid = 0;
+	return;
+      }
+
+      filesystem->path[filesystem->path_len++] = ROOT[0];
+      memcpy(filesystem->path + filesystem->path_len, path, len);
+      filesystem->path_len += len;
+    }
+
+    path = end;
+  }
+
+  /* The root is the one path that ends in a "/" */
+  if (filesystem->path_len == 0) {
+    if (!path_reserve(filesystem, 1)) {
+      filesystem->path_valid = 0;
+      return;
+    }
+    filesystem->path[0] = ROOT[0];
+    filesystem->path_len = 1;
+  }
+}
+
+
+/*
+ * Rebuilds the path of the current directory from its
+ * parent links, filling it in from the end
+ */
+static void path_rebuild(Unix *filesystem) {
+
+  Container *dir;
+  unsigned long len = 0;
+  char *end;
+
+  /* A mapped image has parent links of its own */
+  if (filesystem->tree->image != NULL) {
+    image_path(filesystem);
+    return;
+  }
+
+  for (dir = filesystem->curr_dir; dir->type != U_ROOT; dir = dir->parent)
+    len += dir->name_len + 1;
+
+  if (!path_reserve(filesystem, len > 0 ? len : 1))
+    return;
+
+  if (len == 0) {
+    filesystem->path[0] = ROOT[0];
+    filesystem->path_len = 1;
+    filesystem->path_valid = 1;
+    return;
+  }
+
+  end = filesystem->path + len;
+
+  for (dir = filesystem->curr_dir; dir->type != U_ROOT; dir = dir->parent) {
+    end -= dir->name_len;
+    memcpy(end, dir->name, dir->name_len);
+    *--end = ROOT[0];
+  }
+
+  filesystem->path_len = len;
+  filesystem->path_valid = 1;
+}
+
+/*
+ * Checks if the name parameter of length len does not cause an error
+ * but cannot be the name of a file or directory
+ * Returns a non-zero value is true, zero otherwise
+ */
+static int non_error_arg(const char name[], unsigned long len) {
+  return ((len == 1 && name[0] == '.')
+	  || (len == 2 && name[0] == '.' && name[1] == '.'));
+}
+
+
+/*
+ * Prints out the elements in the linked list representing the
+ * files and directories in the directory sent in, with those a copy
+ * shows through its origin. Entries added or removed by other threads
+ * meanwhile may or may not be seen.
+ */
+static void print_elements(Unix *filesystem, Container *dir) {
+
+  Container *curr;
+  Sink *out = &filesystem->out;
+  unsigned long visited = 0;
+  View view;
+
+  if (!view_open(filesystem, &view, dir, NULL, 0)) {
+    print_error(filesystem, NO_MEMORY);
+    return;
+  }
+
+  while ((curr = view_next(&view)) != NULL) {
+
+    sink_write(out, curr->name, curr->name_len);
+
+    if (curr->type == U_DIR)
+      sink_write(out, "/\n", 2);
+    else
+      sink_write(out, "\n", 1);
+
+    visited++;
+  }
+
+  view_close(&view);
+
+  STATS_ADD(filesystem, visited, visited);
+}
+
+
+/*
+ * Prints the elements of dir that match pattern, of length len, or
+ * just start with it if prefix_only is set. The sorted list is entered
+ * at the first element that starts with the literal prefix of the
+ * pattern and left after the last one.
+ *
+ * Returns the number of elements printed
+ */
+static unsigned long print_matches(Unix *filesystem, Container *dir,
+				   const char pattern[], unsigned long len,
+				   int prefix_only) {
+
+  unsigned long prefix = prefix_only ? len : pattern_prefix(pattern, len);
+  unsigned long visited = 0, found = 0;
+  Container *curr;
+  Sink *out = &filesystem->out;
+  View view;
+
+  if (!view_open(filesystem, &view, dir, pattern, prefix)) {
+    print_error(filesystem, NO_MEMORY);
+    return 0;
+  }
+
+  for (curr = view_next(&view);
+       curr != NULL && has_prefix(curr, pattern, prefix);
+       curr = view_next(&view)) {
+
+    visited++;
+
+    if (!prefix_only
+	&& !match_pattern(pattern, len, curr->name, curr->name_len))
+      continue;
+
+    sink_write(out, curr->name, curr->name_len);
+
+    if (curr->type == U_DIR)
+      sink_write(out, "/\n", 2);
+    else
+      sink_write(out, "\n", 1);
+
+    found++;
+  }
+
+  view_close(&view);
+
+  STATS_ADD(filesystem, visited, visited);
+
+  return found;
+}
+
+
+/*
+ * Prints the totals of the container at the path arg of the unix
+ * variable sent in, for du or count. A mapped image is built in memory
+ * first.
+ *
+ * Returns 1 if successful, 0 if the path doesn't exist
+ */
+static int print_totals(Unix *filesystem, const char arg[],
+			enum Command command) {
+
+  Container *parent, *position = NULL;
+  const char *name;
+  unsigned long long start;
+  unsigned long len, entries = 0, files = 0, dirs = 0, bytes = 0;
+  char line[128];
+  int result;
+
+  if (filesystem == NULL || arg == NULL)
+    return 0;
+
+  result = begin_change(filesystem);
+  start = STATS_BEGIN(filesystem);
+
+  if (result)
+    position = resolve_path(filesystem, arg, &parent, &name, &len);
+
+  if (position != NULL) {
+
+    /* A copy counts the entries it shows through its origin too */
+    if (position->directory != NULL) {
+      lock_dir_shared(filesystem, position);
+      entries = position->directory->shown;
+      unlock_dir(filesystem, position);
+    }
+
+    /* A file counts itself */
+    files = position->type == U_FILE ? 1 : FILES_BELOW(position);
+    dirs = DIRS_BELOW(position);
+    bytes = position->bytes;
+
+    if (command == C_DU)
+      len = sprintf(line, "files %lu\ndirs %lu\nbytes %lu\n", files, dirs,
+		    bytes);
+    else
+      len = sprintf(line, "entries %lu\ntotal %lu\n", entries,
+		    files + dirs);
+
+    sink_write(&filesystem->out, line, len);
+  }
+
+  sink_flush(&filesystem->out);
+
+  result = STATS_END(filesystem, command, start, position != NULL);
+  end_change(filesystem);
+
+  return result;
+}
+
+
+/*
+ * Takes container, which has just been unlinked from its directory,
+ * and everything below it out of the totals of the directories above
+ * it. Anything added below it from now on stops counting short of it.
+ */
+static void remove_totals(Unix *filesystem, Container *container) {
+
+  long files, dirs, bytes;
+
+  /* Pairs with add_totals(): whatever adds to it from now on sees it
+     removed, and what is adding to it already is counted below */
+  atomic_store(&container->removed, 1);
+
+  while (atomic_load(&container->adding) != 0)
+    sched_yield();
+
+  files = FILES_BELOW(container) + (container->type == U_FILE);
+  dirs = DIRS_BELOW(container) + (container->type == U_DIR);
+  bytes = container->bytes;
+
+  add_totals(filesystem, container->parent, -files, -dirs, -bytes);
+}
+
+
+/*
+ * Deletes the container sent in from the current Unix variable once
+ * unlink_path() has taken it out of its directory, and everything
+ * inside it, then the origins of copies that were only kept for those
+ * copies and have none left. The memory goes back to the filesystem's
+ * arena to be reused.
+ */
+static void delete(Unix *filesystem, Container *dir) {
+
+  Tree *tree = filesystem->tree;
+  Container *orphan;
+
+  delete_subtree(filesystem, dir);
+
+  for (;;) {
+
+    LOCK(filesystem, clones);
+    orphan = tree->orphans;
+    if (orphan != NULL)
+      tree->orphans = orphan->prev;
+    UNLOCK(filesystem, clones);
+
+    if (orphan == NULL)
+      break;
+
+    delete_subtree(filesystem, orphan);
+  }
+}
+
+
+/*
+ * Deletes dir and everything inside it for delete(). If the dir is a
+ * directory, this function deletes all the contents of dir, otherwise
+ * it just deletes the container. A directory that still has copies
+ * reading its entries is kept for them, with everything inside it.
+ *
+ * The contents are deleted bottom up by following the first entry of
+ * each directory down and the parent links back up, so neither deep
+ * nor wide directories use any more stack. A tree with workers deletes
+ * a directory with entries on them instead. The marks of dir were cut
+ * out of the order of the directories when it was removed. Without
+ * copies in the tree, nothing inside is kept, so when dir has the piece
+ * to itself they are left to go with the memory; otherwise they are
+ * taken out one directory at a time, so those of what is kept stay in
+ * order.
+ */
+static void delete_subtree(Unix *filesystem, Container *dir) {
+
+  Container *curr = dir, *parent, *next;
+  int cut;
+
+  if (!let_go(filesystem, dir))
+    return;
+
+  cut = atomic_load(&filesystem->tree->layers) == 0
+    && order_alone(filesystem, dir);
+
+  if (filesystem->tree->pool != NULL && LINK(dir->sub_dir) != NULL
+      && walk_delete(filesystem, dir, cut))
+    return;
+
+  while (curr != NULL) {
+
+    /* Descend until reaching a container with no entries left, going
+       past the ones kept for copies */
+    next = LINK(curr->sub_dir);
+
+    if (next != NULL) {
+      if (let_go(filesystem, next))
+	curr = next;
+      else
+	SET_LINK(curr->sub_dir, LINK(next->next));
+      continue;
+    }
+
+    /* The rest of its directory is only ever reached through sub_dir,
+       so dropping the first entry needs no other unlinking */
+    parent = NULL;
+    if (curr != dir) {
+      parent = curr->parent;
+      SET_LINK(parent->sub_dir, LINK(curr->next));
+    }
+
+    if (!cut)
+      order_remove(filesystem, curr);
+
+    free_container(filesystem, curr);
+    curr = parent;
+  }
+}
+
+
+/*
+ * Hashes a container name of length len (FNV-1a)
+ */
+static unsigned long hash_name(const char name[], unsigned long len) {
+
+  unsigned long hash = 2166136261UL;
+
+  while (len-- > 0) {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+
+/*
+ * Compares the name of entry with name, of length len, in the same
+ * order as strcmp()
+ *
+ * Returns a negative value, zero or a positive value if the name of
+ * entry sorts before, equal to or after name
+ */
+static int compare_name(Container *entry, const char name[],
+			unsigned long len) {
+
+  unsigned long shorter = entry->name_len < len ? entry->name_len : len;
+  int result = memcmp(entry->name, name, shorter);
+
+  if (result != 0 || entry->name_len == len)
+    return result;
+
+  return entry->name_len < len ? -1 : 1;
+}
+
+
+/*
+ * Looks up the entry called name, of length len, in the directory dir,
+ * going through the filesystem's lookup cache. Names that don't exist
+ * are cached too, so repeated misses are as cheap as hits. While threads
+ * run, a lookup fills the cache only if nothing was forgotten in its
+ * entry since it began, so what it found in the index can't be stale.
+ *
+ * Returns a pointer to the entry, or NULL if there is none
+ */
+static Container *lookup(Unix *filesystem, Container *dir,
+			 const char name[], unsigned long len) {
+
+  unsigned long hash = hash_name(name, len), seq;
+  Dentry *dentry = dcache_slot(filesystem, dir, hash);
+  Container *entry;
+
+  seq = atomic_load_explicit(&dentry->seq, memory_order_acquire);
+
+  if (seq % 2 == 0 && dcache_matches(dentry, dir, hash, name, len)) {
+
+    entry = atomic_load_explicit(&dentry->container, memory_order_relaxed);
+
+    /* Only good if the entry didn't change while it was read */
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&dentry->seq, memory_order_relaxed) == seq)
+      return entry;
+  }
+
+  entry = index_lookup(filesystem, dir, name, len);
+
+  /* Replace whatever the slot held before */
+  if (seq % 2 == 0 && len <= DCACHE_NAME_MAX
+      && atomic_compare_exchange_strong_explicit(&dentry->seq, &seq, seq + 1,
+						 memory_order_relaxed,
+						 memory_order_relaxed)) {
+    atomic_thread_fence(memory_order_release);
+    dcache_fill(dentry, dir, hash, name, len, entry);
+    atomic_store_explicit(&dentry->seq, seq + 2, memory_order_release);
+  }
+
+  return entry;
+}
+
+
+/*
+ * Returns the slot of the lookup cache that a name with the given hash
+ * in the directory dir is cached in
+ */
+static Dentry *dcache_slot(Unix *filesystem, Container *dir,
+			   unsigned long hash) {
+  return &filesystem->tree->dcache[(hash ^ dir->id * 2654435761UL)
+			     & (DCACHE_SIZE - 1)];
+}
+
+
+/*
+ * Drops the cached lookup of the entry called name, of length len, in
+ * the directory dir, whether it found the entry or not. This is done
+ * after the entry is added to or removed from the index of dir, and
+ * makes every lookup that began before give up filling the cache.
+ */
+static void dcache_forget(Unix *filesystem, Container *dir,
+			  const char name[], unsigned long len) {
+
+  unsigned long hash = hash_name(name, len), seq;
+  Dentry *dentry = dcache_slot(filesystem, dir, hash);
+
+  /* Wait out a lookup filling the entry */
+  seq = atomic_load_explicit(&dentry->seq, memory_order_relaxed);
+  while (seq % 2 != 0
+	 || !atomic_compare_exchange_weak_explicit(&dentry->seq, &seq, seq + 1,
+						   memory_order_acquire,
+						   memory_order_relaxed)) {
+    if (seq % 2 != 0) {
+      sched_yield();
+      seq = atomic_load_explicit(&dentry->seq, memory_order_relaxed);
+    }
+  }
+
+  atomic_thread_fence(memory_order_release);
+  if (dcache_matches(dentry, dir, hash, name, len))
+    atomic_store_explicit(&dentry->dir_id, 0, memory_order_relaxed);
+  atomic_store_explicit(&dentry->seq, seq + 2, memory_order_release);
+}
+
+
+/*
+ * Returns 1 if dentry holds the lookup of name, of length len, in the
+ * directory dir, whose name hashes to hash, and 0 otherwise. The entry
+ * may be changing meanwhile, which the caller checks for.
+ */
+static int dcache_matches(Dentry *dentry, Container *dir, unsigned long hash,
+			  const char name[], unsigned long len) {
+
+  unsigned long words[DCACHE_WORDS] = {0};
+  int i;
+
+  if (atomic_load_explicit(&dentry->dir_id, memory_order_relaxed) != dir->id
+      || atomic_load_explicit(&dentry->hash, memory_order_relaxed) != hash
+      || atomic_load_explicit(&dentry->len, memory_order_relaxed) != len)
+    return 0;
+
+  memcpy(words, name, len);
+
+  for (i = 0; i < DCACHE_WORDS; i++)
+    if (atomic_load_explicit(&dentry->name[i], memory_order_relaxed)
+	!= words[i])
+      return 0;
+
+  return 1;
+}
+
+
+/*
+ * Stores the lookup of name, of length len, in the directory dir, whose
+ * name hashes to hash, in dentry. The caller has made seq of dentry odd.
+ */
+static void dcache_fill(Dentry *dentry, Container *dir, unsigned long hash,
+			const char name[], unsigned long len,
+			Container *entry) {
+
+  unsigned long words[DCACHE_WORDS] = {0};
+  int i;
+
+  memcpy(words, name, len);
+
+  atomic_store_explicit(&dentry->dir_id, dir->id, memory_order_relaxed);
+  atomic_store_explicit(&dentry->hash, hash, memory_order_relaxed);
+  atomic_store_explicit(&dentry->container, entry, memory_order_relaxed);
+  atomic_store_explicit(&dentry->len, len, memory_order_relaxed);
+
+  for (i = 0; i < DCACHE_WORDS; i++)
+    atomic_store_explicit(&dentry->name[i], words[i], memory_order_relaxed);
+}
+
+
+/*
+ * Returns the number of bytes of a hash index with size slots
+ */
+static unsigned long index_bytes(unsigned long size) {
+  return offsetof(Index, slots) + size * sizeof(Link);
+}
+
+
+/*
+ * Adds entry to the hash index of dir, growing the index when it is
+ * three quarters full. The entry must not already be in the index.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int index_insert(Unix *filesystem, Container *dir, Container *entry) {
+
+  Index *index;
+  Container *found;
+  unsigned long mask, slot;
+
+  if (!index_reserve(filesystem, dir))
+    return 0;
+
+  index = LINK(dir->directory->index);
+  mask = index->size - 1;
+  slot = entry->hash & mask;
+
+  while ((found = LINK(index->slots[slot])) != NULL && found != DELETED)
+    slot = (slot + 1) & mask;
+
+  if (found == NULL)
+    dir->directory->index_used++;
+
+  SET_LINK(index->slots[slot], entry);
+  dir->directory->entries++;
+
+  return 1;
+}
+
+
+/*
+ * Grows the hash index of dir, or allocates it, when one more entry
+ * would make it over three quarters full
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int index_reserve(Unix *filesystem, Container *dir) {
+
+  Index *index = LINK(dir->directory->index);
+  unsigned long size;
+
+  if (index != NULL && (dir->directory->index_used + 1) * 4 <= index->size * 3)
+    return 1;
+
+  /* Size for the live entries only, deleted markers are dropped */
+  size = INDEX_MIN_SIZE;
+  while (size * 3 < (dir->directory->entries + 1) * 8)
+    size *= 2;
+
+  return index_resize(filesystem, dir, size);
+}
+
+
+/*
+ * Removes entry from the hash index of dir. Its slot is marked as
+ * deleted rather than emptied so entries further along the probe
+ * run are still found.
+ */
+static void index_remove(Container *dir, Container *entry) {
+
+  Index *index = LINK(dir->directory->index);
+  Container *found;
+  unsigned long mask, slot;
+
+  if (index == NULL)
+    return;
+
+  mask = index->size - 1;
+  slot = entry->hash & mask;
+
+  while ((found = LINK(index->slots[slot])) != NULL) {
+
+    if (found == entry) {
+      SET_LINK(index->slots[slot], DELETED);
+      dir->directory->entries--;
+      return;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+}
+
+
+/*
+ * Rebuilds the hash index of dir with size slots. Lookups running in
+ * other threads may still be probing the old one, so it is retired
+ * rather than freed.
+ *
+ * Returns 1 if successful, 0 if memory couldn't be allocated
+ */
+static int index_resize(Unix *filesystem, Container *dir,
+			unsigned long size) {
+
+  Index *old = LINK(dir->directory->index), *index;
+  Container *entry;
+  unsigned long i, slot;
+
+  index = tree_alloc(filesystem, index_bytes(size));
+
+  if (index == NULL)
+    return 0;
+
+  memset(index, 0, index_bytes(size));
+  index->size = size;
+
+  for (i = 0; old != NULL && i < old->size; i++) {
+
+    entry = LINK(old->slots[i]);
+
+    if (entry == NULL || entry == DELETED)
+      continue;
+
+    slot = entry->hash & (size - 1);
+    while (LINK(index->slots[slot]) != NULL)
+      slot = (slot + 1) & (size - 1);
+
+    SET_LINK(index->slots[slot], entry);
+  }
+
+  SET_LINK(dir->directory->index, index);
+  dir->directory->index_used = dir->directory->entries;
+
+  if (old == NULL)
+    return 1;
+
+  if (filesystem->tree->locks != NULL)
+    retire(filesystem, NULL, old, index_bytes(old->size));
+  else
+    tree_free(filesystem, old, index_bytes(old->size));
+
+  return 1;
+}
+
+
+/*
+ * Allocates a container called name, of length len, from the
+ * filesystem's arena, with its name and its links on the given number
+ * of skip-list levels in the same block, and initializes it to have no
+ * parent or entries.
+ *
+ * Returns a pointer to the container, or NULL if memory couldn't be
+ * allocated
+ */
+static Container *new_container(Unix *filesystem, const char name[],
+				 unsigned long len, enum Type type,
+				 int level) {
+
+  Container *container;
+  Directory *directory = NULL;
+  unsigned long size = offsetof(Container, forward)
+    + (level - 1) * sizeof(Link) + NAME_ROOM(len);
+  int i;
+
+  /* A directory gets what only a directory has too */
+  container = tree_alloc(filesystem, size);
+  if (container != NULL && type != U_FILE && type != U_HIDDEN
+      && (directory = tree_alloc(filesystem, sizeof(Directory))) == NULL) {
+    tree_free(filesystem, container, size);
+    container = NULL;
+  }
+
+  if (container == NULL)
+    return NULL;
+
+  container->id = atomic_fetch_add_explicit(&filesystem->tree->next_id, 1,
+					    memory_order_relaxed);
+
+  if (directory != NULL) {
+
+    atomic_init(&directory->index, NULL);
+    directory->index_used = 0;
+    directory->entries = 0;
+    directory->shown = 0;
+    directory->files = 0;
+    directory->dirs = 0;
+    atomic_init(&directory->origin, NULL);
+    atomic_init(&directory->share, NULL);
+    atomic_init(&directory->skip_head, NULL);
+    directory->skip_levels = 1;
+    directory->unlinked = 0;
+    atomic_init(&directory->lock, 0);
+
+    for (i = 0; i < 2; i++) {
+      directory->marks[i].parent = NULL;
+      directory->marks[i].left = NULL;
+      directory->marks[i].right = NULL;
+      directory->marks[i].size = 0;
+    }
+  }
+
+  container->parent = NULL;
+  container->prev = NULL;
+  atomic_init(&container->next, NULL);
+  container->type = type;
+  container->removed = 0;
+  atomic_init(&container->adding, 0);
+  atomic_init(&container->sub_dir, NULL);
+  container->bytes = 0;
+  container->contents = NULL;
+  container->directory = directory;
+  container->level = level;
+  container->hash = hash_name(name, len);
+  container->name_len = len;
+
+  /* The name follows the upper links */
+  container->name = INLINE_NAME(container);
+  memcpy(container->name, name, len);
+  container->name[len] = '\0';
+
+  return container;
+}
+
+
+
+/*
+ * Renames entry, which is unlinked from its directory, to name, of
+ * length len. The name is written over the old one unless block is
+ * given, a block of len + 1 bytes that the new name then has of its
+ * own, so the container stays where it is and nothing that points to
+ * it, its entries, copies or the sessions in it, has to change.
+ */
+static void rename_entry(Unix *filesystem, Container *entry, char *block,
+			 const char name[], unsigned long len) {
+
+  char *room = INLINE_NAME(entry);
+  unsigned long size = container_size(entry);
+
+  /* Commands that still have the entry may be reading the old name */
+  if (entry->name != room) {
+    if (filesystem->tree->locks != NULL)
+      retire(filesystem, NULL, entry->name, entry->name_len + 1);
+    else
+      tree_free(filesystem, entry->name, entry->name_len + 1);
+  }
+
+  /* The room that is left keeps its size for container_size() */
+  if (block != NULL) {
+    if (entry->name == room)
+      *(unsigned long *) room = size - offsetof(Container, forward)
+	- (entry->level - 1) * sizeof(Link);
+    entry->name = block;
+  } else
+    entry->name = room;
+
+  entry->hash = hash_name(name, len);
+  entry->name_len = len;
+  memcpy(entry->name, name, len);
+  entry->name[len] = '\0';
+}
+
+
+/*
+ * Picks how many skip-list levels a new entry is linked on: one, plus
+ * one more with probability 1/4 each time, up to SKIP_MAX_LEVEL
+ */
+static int random_level(Unix *filesystem) {
+
+  unsigned long bits;
+  int level = 1;
+
+  /* xorshift step on the session's seed */
+  filesystem->seed ^= filesystem->seed << 13;
+  filesystem->seed ^= filesystem->seed >> 7;
+  filesystem->seed ^= filesystem->seed << 17;
+  bits = filesystem->seed;
+
+  while (level < SKIP_MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+
+  return level;
+}
+
+
+/*
+ * Searches the entries of dir for the sorted position of name, of
+ * length len. On every level in use, update receives the last entry
+ * that sorts before name, or NULL when there is none.
+ *
+ * Returns the first entry that doesn't sort before name, or NULL
+ */
+static Container *skip_search(Unix *filesystem, Container *dir,
+			       const char name[], unsigned long len,
+			       Container *update[]) {
+
+  Container *curr = NULL, *next;
+  unsigned long compared = 0;
+  int level;
+
+  for (level = dir->directory->skip_levels - 1; level >= 0; level--) {
+
+    while ((next = LINK(*skip_link(dir, curr, level))) != NULL
+	   && (compared++, compare_name(next, name, len) < 0))
+      curr = next;
+
+    update[level] = curr;
+  }
+
+  STATS_ADD(filesystem, comparisons, compared);
+  STATS_ADD(filesystem, visited, compared);
+
+  return LINK(*skip_link(dir, curr, 0));
+}
+
+
+/*
+ * Checks if the name of entry starts with prefix, of length len
+ *
+ * Returns 1 if it does, 0 otherwise
+ */
+static int has_prefix(Container *entry, const char prefix[],
+		      unsigned long len) {
+  return entry->name_len >= len && memcmp(entry->name, prefix, len) == 0;
+}
+
+
+/*
+ * Links entry into dir, which make_room() has made room in, on every
+ * skip-list level it was allocated with, in the sorted place of its
+ * name, and makes dir its directory. An entry it replaces, which is
+ * unlinked next, keeps its place ahead of it, so listings show that one
+ * until it goes.
+ */
+static void link_entry(Unix *filesystem, Container *dir, Container *entry) {
+
+  Container *update[SKIP_MAX_LEVEL], *next;
+  int i;
+
+  entry->parent = dir;
+
+  /* Make the entry reachable by name before linking it in */
+  index_insert(filesystem, dir, entry);
+
+  /* A cached lookup may say the name doesn't exist */
+  dcache_forget(filesystem, dir, entry->name, entry->name_len);
+
+  /* Find the right place to insert this entry on every level */
+  skip_search(filesystem, dir, entry->name, entry->name_len, update);
+
+  for (i = 0; i < dir->directory->skip_levels; i++)
+    while ((next = LINK(*skip_link(dir, update[i], i))) != NULL
+	   && compare_name(next, entry->name, entry->name_len) == 0)
+      update[i] = next;
+
+  for (i = dir->directory->skip_levels; i < entry->level; i++)
+    update[i] = NULL;
+
+  if (entry->level > dir->directory->skip_levels)
+    dir->directory->skip_levels = entry->level;
+
+  /* Linking it in on the sorted list makes it visible to listings */
+  for (i = 0; i < entry->level; i++) {
+    SET_LINK(*skip_link(dir, entry, i), LINK(*skip_link(dir, update[i], i)));
+    SET_LINK(*skip_link(dir, update[i], i), entry);
+  }
+
+  /* Switch the previous of the entry that follows */
+  entry->prev = update[0];
+  next = LINK(entry->next);
+  if (next != NULL)
+    next->prev = entry;
+}
+
+
+/*
+ * Unlinks entry from every skip-list level of dir
+ */
+static void skip_remove(Unix *filesystem, Container *dir,
+			Container *entry) {
+
+  Directory *directory = dir->directory;
+  Container *update[SKIP_MAX_LEVEL], *next;
+  int level;
+
+  skip_search(filesystem, dir, entry->name, entry->name_len, update);
+
+  /* The links of entry are left as they are, so a listing that has
+     reached it carries on through the rest of the directory. While
+     one entry replaces another, the one with the same name before it
+     is gone past. */
+  for (level = 0; level < entry->level; level++) {
+
+    while ((next = LINK(*skip_link(dir, update[level], level))) != NULL
+	   && next != entry
+	   && compare_name(next, entry->name, entry->name_len) == 0)
+      update[level] = next;
+
+    if (LINK(*skip_link(dir, update[level], level)) == entry)
+      SET_LINK(*skip_link(dir, update[level], level),
+	       LINK(*skip_link(dir, entry, level)));
+  }
+
+  next = LINK(entry->next);
+  if (next != NULL)
+    next->prev = entry->prev;
+
+  /* Drop levels nothing is linked on anymore */
+  while (directory->skip_levels > 1
+	 && LINK(directory->skip_head[directory->skip_levels - 2]) == NULL)
+    directory->skip_levels--;
 }
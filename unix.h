@@ -6,3 +6,36 @@ int mkdir(Unix *filesystem, const char arg[]);
 int cd(Unix *filesystem, const char arg[]);
 int ls(Unix *filesystem, const char arg[]);
 void pwd(Unix *filesystem);
+void rmfs(Unix *filesystem);
+int rm(Unix *filesystem, const char arg[]);
+int mv(Unix *filesystem, const char arg[], const char dest[]);
+void set_output(Unix *filesystem, int fd);
+const char *get_output(Unix *filesystem, unsigned long *len);
+void clear_output(Unix *filesystem);
+void enable_stats(Unix *filesystem, int enable);
+const Stats *get_stats(Unix *filesystem);
+void stats(Unix *filesystem);
+int save(Unix *filesystem, const char file[]);
+int load(Unix *filesystem, const char file[]);
+int map_image(Unix *filesystem, const char file[]);
+int open_journal(Unix *filesystem, const char image[], const char file[]);
+int sync_journal(Unix *filesystem);
+int checkpoint(Unix *filesystem);
+int close_journal(Unix *filesystem);
+int mksession(Unix *session, Unix *filesystem);
+int enable_threads(Unix *filesystem, int enable);
+int du(Unix *filesystem, const char arg[]);
+int find(Unix *filesystem, const char arg[], const char name[]);
+int print_tree(Unix *filesystem, const char arg[]);
+int count(Unix *filesystem, const char arg[]);
+int complete(Unix *filesystem, const char arg[]);
+int write_file(Unix *filesystem, const char arg[], unsigned long offset,
+	       const char data[], unsigned long len);
+int append_file(Unix *filesystem, const char arg[], const char data[],
+		unsigned long len);
+int cat(Unix *filesystem, const char arg[]);
+int cp(Unix *filesystem, const char arg[], const char dest[]);
+int snapshot(Unix *filesystem, const char name[]);
+int restore(Unix *filesystem, const char name[]);
+int snapshots(Unix *filesystem);
+int set_workers(Unix *filesystem, int workers);